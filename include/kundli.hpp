@@ -2,14 +2,20 @@
 
 #include <atomic>
 #include <condition_variable>
+#include <coroutine>
 #include <cstdint>
 #include <functional>
+#include <iosfwd>
 #include <future>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <queue>
+#include <span>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 // Memory mapping support for large files
@@ -30,12 +36,22 @@ using s32 = std::int32_t;
 using s64 = std::int64_t;
 
 constexpr const char *ARCHIVE_MAGIC = "KNDL";
-constexpr u8 ARCHIVE_VERSION = 1;
+constexpr const char *FOOTER_MAGIC = "KNDT";
+constexpr u8 ARCHIVE_VERSION = 11;
+constexpr u8 MIN_ARCHIVE_VERSION = 5; // Oldest one that can still be read
 
 enum class ArchiveFlag : u8 {
     None = 1 << 0,
     Compressed = 1 << 1,
     Encrypted = 1 << 2,
+    Deduplicated = 1 << 3,
+    Streamed = 1 << 4, // Written front to back, see Archive::compress_stream
+};
+
+enum class ArchiveCodec : u8 {
+    Store = 0, // Stored as-is
+    Lz,        // Fast LZ77 codec
+    Lzma,      // High-ratio LZMA2 codec (only if built with liblzma)
 };
 
 struct ArchiveHeader {
@@ -43,54 +59,298 @@ struct ArchiveHeader {
     u8 version{};  // Version of the archive format
     u8 flags{};    // Bitmask of ArchiveFlag
     u64 timestamp{}; // Timestamp of the archive creation
-    u32 crc32{};     // CRC32 checksum
+    u32 crc32{};     // CRC32C of the decoded data section
+} __attribute__((packed));
+
+// Last bytes of the archive. The file table comes after the data, so adding
+// files only has to write the new data, a new table and a new footer.
+struct ArchiveFooter {
+    u64 data_size{};    // Stored size of the data section
+    u64 table_offset{}; // Where the file table starts
+    u8 magic[4]{};      // KNDT
 } __attribute__((packed));
 
 struct ArchiveFile {
-    u64 offset{};        // Offset in the archive data where the file starts
-    u64 size{};          // Size of the file data in bytes
+    u64 offset{};      // Offset in the archive data where the file starts
+    u64 data_length{}; // Length of the file data (for Regular files) or symlink
+                       // target
+    std::string_view path{}; // File path relative to the archive root, owned
+                             // by the archive's path pool
+    // Last modification (nanoseconds since the epoch) and inode when the
+    // file was added, 0 if unknown. Incremental archives reuse the data of
+    // files where these and the size still match, see Archive::set_previous.
+    s64 mtime{};
+    u64 inode{};
+    u32 crc32c{}; // CRC32C of the file data, filled in when the archive is
+                  // written and checked whenever a lazy read touches the file
+    // Sparse files only store their data, data_length leaves the holes out.
+    // These pick the file's holes out of the archive's list, see
+    // Archive::file_holes.
+    u32 first_hole{};
+    u32 hole_count{};
     u8 permissions[3]{}; // Permissions for owner, group, and others (3 bytes)
     enum class FileType : u8 {
         Regular = 0,
         Directory,
         Symlink
-    } type{};          // Type of the file (Regular, Directory, Symlink)
-    u64 path_length{}; // Length of the file path
-    u64 data_length{}; // Length of the file data (for Regular files) or symlink
-                       // target
-    std::string path{}; // File path relative to the archive root
+    } type{}; // Type of the file (Regular, Directory, Symlink)
 
     ArchiveFile() = default;
 };
 
+// Archives with millions of files keep all of these in memory, so they're
+// kept to a cache line each
+static_assert(sizeof(ArchiveFile) <= 64);
+
+// A run of zeros a sparse file doesn't store. The offset is into the file as
+// extracted, holes are sorted and don't touch each other.
+struct ArchiveHole {
+    u64 offset{};
+    u64 length{};
+};
+
+// Compressed archives split the data section into fixed-size blocks that are
+// encoded independently. The block index follows the data section.
+struct ArchiveBlock {
+    u64 offset{};         // Offset of the encoded block in the data section
+    u32 stored_size{};    // Size of the encoded block
+    u32 raw_size{};       // Size of the block once decoded
+    ArchiveCodec codec{}; // Codec the block was encoded with
+    u32 crc32c{};         // CRC32C of the decoded block
+} __attribute__((packed));
+
+// Deduplicated archives store every distinct chunk once. File offsets stay
+// logical, as if each file's data was there in full, and the extent map
+// after the block index says where those bytes are stored.
+struct ArchiveExtent {
+    u64 offset{};        // Logical offset
+    u64 stored_offset{}; // Where the bytes are in the decoded data section
+    u64 length{};
+} __attribute__((packed));
+
+// Counters of the scratch buffer pool every archive draws from
+struct BufferPoolStats {
+    u64 hits{};       // Served from the thread's own cache
+    u64 depot_hits{}; // Served from buffers other threads handed back
+    u64 misses{};     // Had to allocate
+    u64 unpooled{};   // Too big to pool, allocated and freed directly
+    u64 dropped{};    // Freed because every cache was full
+
+    double hit_rate() const {
+        const u64 requests = hits + depot_hits + misses + unpooled;
+        return requests == 0
+                   ? 0.0
+                   : static_cast<double>(hits + depot_hits) /
+                         static_cast<double>(requests);
+    }
+};
+
+// Counters of an archive's decoded data cache, see Archive::set_cache_size
+struct CacheStats {
+    u64 hits{};
+    u64 misses{};
+    u64 inserts{};
+    u64 evictions{}; // Dropped to make room
+    u64 bytes{};     // Memory the entries take up right now
+    u64 capacity{};
+
+    double hit_rate() const {
+        const u64 requests = hits + misses;
+        return requests == 0 ? 0.0
+                             : static_cast<double>(hits) /
+                                   static_cast<double>(requests);
+    }
+};
+
+// Where an archive job's time went, see Archive::set_stats_enabled
+// Times are nanoseconds summed over every thread that did the work, so they
+// can add up to more than the wall time.
+struct ArchiveStats {
+    u64 scan_ns{};        // Walking the input trees
+    u64 read_ns{};        // Reading input files and archive data
+    u64 crc_ns{};         // CRC32C over data and blocks
+    u64 encode_ns{};      // Compressing blocks
+    u64 decode_ns{};      // Decompressing blocks
+    u64 table_ns{};       // Serializing and parsing the file table
+    u64 write_ns{};       // Writing the archive, extracted files, directories
+    u64 permissions_ns{}; // Restoring permissions after extraction
+    u64 queue_wait_ns{};  // Thread pool tasks waiting for a worker
+    u64 dedup_ns{};       // Chunking and hashing for deduplication
+    u64 bytes_read{};
+    u64 bytes_written{};
+    u64 syscalls{}; // File system calls made directly, roughly
+    u64 tasks{};    // Thread pool tasks run
+    std::vector<u64> worker_busy_ns; // Time each pool worker spent in tasks
+};
+
+class BlockCache;
+class Buffer;
+class ReadRing;
+
+// Threads: a loaded archive can be read from any number of threads at once,
+// as long as none of them modifies it. find_file, get_file_data,
+// get_file_view, open_member, list_files, print_info and verify only look at
+// the file table and the archive file or its mapping, and every read brings
+// its own file handle and scratch buffers. Adding, removing, extending or
+// extracting needs the archive to itself. So does the first write, extract,
+// list_files, verify or print_info after a remove, it drops the removed
+// entries. The thread pool is shared by all archives and can be used and
+// resized from any thread.
 class Archive {
   public:
     static std::unique_ptr<Archive> create();
-    static std::unique_ptr<Archive> load(const std::string &path);
-    static std::unique_ptr<Archive> load_full(const std::string &path);
+    // An archive written in volumes is loaded by its path without the
+    // suffix, from next to it or from `volume_dirs` if it was spread over
+    // directories, see set_volumes
+    static std::unique_ptr<Archive>
+    load(const std::string &path,
+         std::span<const std::string> volume_dirs = {});
+    static std::unique_ptr<Archive>
+    load_full(const std::string &path,
+              std::span<const std::string> volume_dirs = {});
     ~Archive();
 
     ArchiveFile *add_file(const std::string &path);
     ArchiveFile *add_directory(const std::string &path);
+    // Same result as add_file, but the tree is walked and read on the pool
+    ArchiveFile *add_file_parallel(const std::string &path,
+                                   size_t num_threads = 0);
 
+    // O(1), the entry is dropped from the table by the next write, extract,
+    // list or verify
     void remove_file(const std::string &path);
 
+    // O(1) lookup by archive path, nullptr if there's no such entry
+    ArchiveFile *find_file(const std::string &path);
+    const ArchiveFile *find_file(const std::string &path) const;
+
     void compress(const std::string &output_path) const;
+    // Writes what was added since loading back into the loaded archive,
+    // touching only the new data, the table and the footer. Falls back to a
+    // full rewrite if the codec or block size changed.
+    bool append(size_t num_threads = 0);
     void compress_parallel(const std::string &output_path,
                            size_t num_threads = 0) const;
+    // Splits what compress and compress_parallel write into volumes of
+    // `size` bytes, path.000, path.001 and so on. With `directories` volume
+    // i goes to directories[i % directories.size()] instead of next to the
+    // path, so a big archive can be spread over several devices. Sizes are
+    // rounded up to a whole MIN_VOLUME_SIZE, 0 writes a single file again.
+    // Loaded archives keep the size of their first volume. Volumes aren't
+    // appended to in place, append rewrites them.
+    static constexpr u64 MIN_VOLUME_SIZE = 1024UL * 1024UL; // 1MB
+    void set_volumes(u64 size, std::vector<std::string> directories = {});
+    // How many members extraction reads ahead of writing them, on a thread
+    // of its own for each thread that writes, so the archive is read while
+    // the last member is still being written. Bounded in bytes too. 0 reads
+    // every member right before it's written.
+    static constexpr size_t DEFAULT_EXTRACT_READAHEAD = 8;
+    void set_extract_readahead(size_t members) {
+        extract_readahead = members;
+    }
     void decompress();
     void decompress_parallel(size_t num_threads = 0);
     void decompress_file(const std::string &file_path,
                          const std::string &output_path);
+    // Extracts the entries matching any of the `include` globs (everything
+    // if there are none) and none of `exclude`. `*`, `?` and `[...]` don't
+    // match a `/`, `**` does, and an entry matches if its path or that of a
+    // directory it's in does. Selected members are read in data order with
+    // neighbours merged into one read, spread over `num_threads` workers.
+    // Returns false if an include pattern matched nothing or anything failed.
+    bool decompress_matching(std::span<const std::string> include,
+                             std::span<const std::string> exclude = {},
+                             size_t num_threads = 0);
+
+    // Pipes and sockets: writes the archive to `fd` front to back without
+    // ever seeking. A streamed archive has a copy of the file table up front
+    // and frames every block, so it can be extracted as it comes in, and it
+    // still loads like any other once it's in a file. Deduplicated archives
+    // can't be streamed. Returns false if anything couldn't be written.
+    bool compress_stream(int fd, size_t num_threads = 0) const;
+    // Reads a streamed archive from `fd` up to where its data starts, the
+    // file table can be looked at from then on. decompress_stream extracts
+    // the rest while it's read and checks every file against the CRC32C at
+    // the end of the stream.
+    static std::unique_ptr<Archive> load_stream(int fd);
+    bool decompress_stream(size_t num_threads = 0);
 
     void list_files() const;
+    // Checks every member against its CRC32C, members are spread over the
+    // workers. Returns false if anything is corrupted or unreadable.
+    bool verify(size_t num_threads = 0) const;
     void print_info() const;
 
     void set_verbose(bool verbose) { this->verbose = verbose; }
 
-    // Lazy loading methods
+    // Block compression, returns false if the codec isn't available
+    bool set_codec(ArchiveCodec codec);
+    bool set_codec(const std::string &name);
+    void set_block_size(u32 size) {
+        block_size = size > 0 ? size : DEFAULT_BLOCK_SIZE;
+    }
+    bool is_compressed() const {
+        return (header.flags & static_cast<u8>(ArchiveFlag::Compressed)) != 0;
+    }
+
+    // Stores repeated content once, see Deduplicator. Loaded archives keep
+    // the setting they were written with.
+    void set_dedup(bool dedup) { this->dedup = dedup; }
+    bool is_deduplicated() const {
+        return (header.flags & static_cast<u8>(ArchiveFlag::Deduplicated)) !=
+               0;
+    }
+    bool is_streamed() const {
+        return (header.flags & static_cast<u8>(ArchiveFlag::Streamed)) != 0;
+    }
+
+    // Streaming writes: add_file only records where the data lives and
+    // compress reads it from disk in bounded chunks while writing
+    void set_streaming(bool streaming) { this->streaming = streaming; }
+
+    // Incremental archives: regular files whose size, mtime and inode match
+    // their entry in `previous` aren't read again, their data is copied out
+    // of `previous` instead (checked against its CRCs on the way). Set before
+    // adding files, `previous` is only read from and can be the archive
+    // that's about to be replaced.
+    void set_previous(std::shared_ptr<const Archive> previous) {
+        this->previous = std::move(previous);
+    }
+
+    // Read-only view of a file's data without copying it out of the archive.
+    // Points into the in-memory data (valid until the archive is modified or
+    // destroyed) or into the mapping, which it keeps alive. Anything else,
+    // such as compressed data, is decoded into a buffer the view owns.
+    class FileView {
+      public:
+        FileView() = default;
+
+        std::span<const u8> bytes() const { return view; }
+        const u8 *data() const { return view.data(); }
+        size_t size() const { return view.size(); }
+        bool empty() const { return view.empty(); }
+
+      private:
+        friend class Archive;
+        FileView(std::span<const u8> view, std::shared_ptr<const void> owner)
+            : view(view), owner(std::move(owner)) {}
+
+        std::span<const u8> view;
+        std::shared_ptr<const void> owner;
+    };
+
+    // Size once extracted, data_length plus the holes of a sparse file
+    u64 file_size(const ArchiveFile &file) const;
+    std::span<const ArchiveHole> file_holes(const ArchiveFile &file) const {
+        return {holes.data() + file.first_hole, file.hole_count};
+    }
+
+    // Lazy loading methods. Sparse files come back with their holes filled
+    // in with zeros.
     const std::vector<u8> get_file_data(const ArchiveFile &file) const;
     const std::vector<u8> get_file_data(const std::string &file_path) const;
+    FileView get_file_view(const ArchiveFile &file) const;
+    FileView get_file_view(const std::string &file_path) const;
     bool is_loaded() const { return lazy_loaded; }
 
     // Memory mapping for large files
@@ -98,10 +358,25 @@ class Archive {
       public:
         MappedFile() = default;
         ~MappedFile();
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
 
         bool map_file(const std::string &path);
+        // Volumes back to back as if they were one file. All but the last
+        // have to be the same whole number of pages.
+        bool map_volumes(const std::vector<std::string> &paths);
         void unmap();
 
+        // Access pattern hints for the kernel's readahead
+        enum class Access : u8 {
+            Normal,
+            Sequential, // Whole archive in offset order (extraction)
+            Random,     // Scattered member reads
+            WillNeed,   // Prefetch the range now
+        };
+        void advise(Access access) const;
+        void advise(size_t offset, size_t length, Access access) const;
+
         const u8 *data() const { return mapped_data; }
         size_t size() const { return file_size; }
         bool is_mapped() const { return mapped_data != nullptr; }
@@ -114,62 +389,347 @@ class Archive {
         size_t file_size = 0;
     };
 
+    // Only applies to archives big enough to be memory mapped
+    void set_access_pattern(MappedFile::Access access) const {
+        mapped_archive->advise(access);
+    }
+
+    // Random access to one member without reading all of it, e.g. a header
+    // out of a huge entry or assets served straight from the archive. Reads
+    // go to the archive file with pread, or to the mapping. Compressed
+    // members decode only the blocks a read touches. read() streams from the
+    // current position through a readahead window and checks the member's
+    // CRC32C when it gets to the end, pread() doesn't check anything beyond
+    // the block CRCs. The archive has to outlive its readers unmodified, and a
+    // reader isn't meant to be shared between threads.
+    class MemberReader {
+      public:
+        ~MemberReader();
+        MemberReader(const MemberReader &) = delete;
+        MemberReader &operator=(const MemberReader &) = delete;
+
+        static constexpr size_t DEFAULT_READAHEAD = 256UL * 1024UL; // 256KB
+
+        const ArchiveFile &file() const { return entry; }
+        u64 size() const { return length; }
+
+        // `length` bytes at `offset` of the member, false if the range goes
+        // past the end or can't be read
+        bool pread(u64 offset, size_t length, u8 *out);
+
+        // Up to `length` bytes from the current position, 0 at the end or
+        // once something failed
+        size_t read(u8 *out, size_t length);
+        void seek(u64 offset) { position = offset; }
+        u64 tell() const { return position; }
+        bool failed() const { return error; }
+        void set_readahead(size_t bytes) { readahead = bytes; }
+
+      private:
+        friend class Archive;
+        MemberReader(const Archive &archive, const ArchiveFile &entry);
+
+        bool read_member(u64 offset, size_t length, u8 *out);
+        bool read_at(u64 offset, size_t length, u8 *out);
+        bool read_piece(u64 offset, size_t length, u8 *out);
+        bool read_stored(u64 offset, size_t length, u8 *out);
+        bool load_block(u64 index);
+
+        const Archive &archive;
+        ArchiveFile entry;
+        u64 length{0}; // with holes
+        std::shared_ptr<MappedFile> mapping; // null unless mapped
+#ifdef __unix__
+        int fd = -1;
+#endif
+        u64 position{0};
+        size_t readahead{DEFAULT_READAHEAD};
+        bool error{false};
+
+        // Sequential reads of stored data are served from here
+        std::vector<u8> window;
+        u64 window_offset{0}; // into the member
+        // The last decoded block of a compressed archive, maybe shared with
+        // the archive's cache
+        std::shared_ptr<const Buffer> block;
+        std::vector<u8> stored;
+        u64 block_index{UINT64_MAX};
+        // Running CRC of everything read() returned from the start on
+        u32 crc{0};
+        u64 checked{0};
+    };
+
+    // nullptr if there's no such member or it's a directory
+    std::unique_ptr<MemberReader> open_member(const std::string &path) const;
+
+    // Reads for services that can't block, from any coroutine:
+    //
+    //     std::optional<std::vector<u8>> bytes =
+    //         co_await archive.read_member("assets/logo.png", &ring);
+    //
+    // nullopt if there's no such member, it's a directory or it didn't read
+    // back intact, the CRC32C is checked as with get_file_data. With a
+    // ReadRing the coroutine resumes on the ring's thread, see ReadRing.
+    // Without one the read runs on the thread pool and the coroutine resumes
+    // on that worker, which it shouldn't block. Members already in memory
+    // don't suspend at all. The archive has to stay unmodified until the read
+    // is done.
+    class ReadMember {
+      public:
+        ReadMember(const ReadMember &) = delete;
+        ReadMember &operator=(const ReadMember &) = delete;
+
+        bool await_ready() const noexcept { return ready; }
+        void await_suspend(std::coroutine_handle<> handle);
+        std::optional<std::vector<u8>> await_resume() {
+            return std::move(result);
+        }
+
+      private:
+        friend class Archive;
+        friend class ReadRing;
+        ReadMember(const Archive &archive, const ArchiveFile *file,
+                   ReadRing *ring);
+
+        const Archive &archive;
+        const ArchiveFile *file;
+        ReadRing *ring;
+        std::coroutine_handle<> waiter;
+        std::optional<std::vector<u8>> result;
+        bool ready{false};
+    };
+
+    ReadMember read_member(const std::string &path,
+                           ReadRing *ring = nullptr) const;
+    ReadMember read_member(const ArchiveFile &file,
+                           ReadRing *ring = nullptr) const;
+
+    // Keeps up to `bytes` of decoded data for repeated reads, 0 turns it off
+    // (the default). Compressed archives cache decoded blocks, stored ones
+    // cache whole members up to MAX_CACHED_MEMBER that have been read from
+    // the file and checked, so a hit costs neither I/O, decoding nor a CRC.
+    // Mapped and in-memory members are read in place and aren't cached. Set
+    // before sharing the archive between threads, the cache itself is safe
+    // to hit from any number of them.
+    static constexpr size_t MAX_CACHED_MEMBER = 1024UL * 1024UL; // 1MB
+    void set_cache_size(size_t bytes);
+    CacheStats cache_stats() const;
+
     // Threading configuration
     void set_thread_count(size_t count) { thread_count = count; }
     size_t get_thread_count() const { return thread_count; }
 
+    static BufferPoolStats buffer_stats();
+    // Instrumentation shared by all archives, off until enabled
+    static void set_stats_enabled(bool enabled);
+    static ArchiveStats stats();
+    static void reset_stats();
+    // CRC32C of a buffer, big ones are split over the thread pool
+    static u32 checksum_parallel(const u8 *data, size_t length);
+    // Kernels picked for this CPU at runtime, for version output
+    static const char *simd_level();
+    static const char *checksum_kernel();
+
   private:
+    friend class ReadRing;
     Archive() = default;
 
+    // What adding an input path needs to know, gathered before adding it
+    struct ScannedPath {
+        std::string path; // normalized once it's known to exist
+        bool exists{false};
+        bool is_directory{false};
+        bool readable{true};
+        ArchiveFile::FileType type{ArchiveFile::FileType::Regular};
+        u8 permissions[3]{};
+        u64 data_length{0};
+        s64 mtime{0};
+        u64 inode{0};
+        // Same as in the previous archive, whose copy is used
+        const ArchiveFile *unchanged{nullptr};
+        std::string target;                // Symlink target
+        std::vector<u8> contents;          // Buffered (non streaming) data
+        std::vector<ArchiveHole> holes;    // Of a sparse file
+        std::vector<ScannedPath> children; // Directory entries, listing order
+        std::string list_error;
+    };
+    static void scan_path(ScannedPath &scanned, bool read_contents,
+                          const Archive *previous);
+    static void scan_children(ScannedPath &directory);
+    void scan_tree(ScannedPath &root, size_t num_threads) const;
+    ArchiveFile *add_scanned(ScannedPath &scanned);
+    ArchiveFile *add_scanned_directory(ScannedPath &scanned);
     void add_parent_directories(const std::string &path);
-    std::string normalize_path(const std::string &path);
+    ArchiveFile *push_file(ArchiveFile entry);
+    void rebuild_path_index();
+    void compact_files() const;
+    static std::string normalize_path(const std::string &path);
     void load_file_data_if_needed();
 
+    std::unique_ptr<std::istream>
+    open_archive(const std::string &path,
+                 std::span<const std::string> directories, u64 &archive_size);
+    bool read_head(std::istream &in, u64 archive_size,
+                   const std::string &path);
+    std::unique_ptr<std::istream> reopen_archive() const;
+    bool write_archive(const std::string &output_path,
+                       size_t num_threads) const;
+    bool write_sections(std::ostream &out, size_t num_threads,
+                        int out_fd) const;
+    size_t volume_of(u64 offset) const;
+    int open_copy_target(const std::string &path) const;
+    static void close_copy_fd(int fd);
+    void write_file_table(std::ostream &out, std::span<const u32> crcs) const;
+    // Takes `length` bytes of an input file at `offset` off the stream to
+    // copy them itself, returns how many the file had. The rest it fills
+    // in with zeros.
+    using CopySink = std::function<u64(int fd, u64 offset, u64 length)>;
+    void stream_data(const std::function<void(const u8 *, size_t)> &sink,
+                     size_t num_threads = 1, u64 from = 0,
+                     const CopySink &copy = {}) const;
+    u64 write_data_section(std::ostream &out, size_t num_threads, u32 &crc,
+                           std::vector<ArchiveBlock> &index,
+                           std::vector<ArchiveExtent> &extent_map,
+                           std::vector<u32> &file_crcs, u64 from = 0,
+                           u64 stored_from = 0, int out_fd = -1,
+                           bool framed = false) const;
+    void write_trailer(std::ostream &out, u64 data_size,
+                       std::span<const u32> crcs) const;
+    bool read_trailer(std::istream &in, u64 archive_size);
+    u64 data_end() const { return base_size + data.size() + stream_size; }
+    bool decode_blocks(const std::vector<u8> &stored,
+                       std::vector<u8> &out) const;
+    bool decode_block(const ArchiveBlock &block, const u8 *stored,
+                      u8 *out) const;
+    bool read_compressed_range(u64 offset, u64 length, u8 *out) const;
+    const u8 *read_stored_blocks(u64 first, u64 last, Buffer &stored) const;
+    bool read_cached_range(u64 offset, u64 length, u8 *out) const;
+    std::shared_ptr<const Buffer> decode_shared(u64 index,
+                                                const u8 *stored) const;
+    bool member_cacheable(const ArchiveFile &file) const;
+    std::shared_ptr<const Buffer> cached_member(const ArchiveFile &file) const;
+    bool read_range(u64 offset, u64 length, u8 *out) const;
+    bool read_stored_range(u64 offset, u64 length, u8 *out) const;
+    const ArchiveExtent *find_extent(u64 offset) const;
+    bool expand_extents(std::vector<u8> &stored) const;
+    void write_extent_map(std::ostream &out,
+                          const std::vector<ArchiveExtent> &map) const;
+    bool read_extent_map(std::istream &in, u64 stored_size, u64 end);
+    bool view_range(u64 offset, u64 length, FileView &view) const;
+    FileView member_view(const ArchiveFile &file) const;
+    u64 file_offset(const ArchiveFile &file) const;
+    u64 copy_offset(const ArchiveFile &file) const;
+    int ring_source() const;
+    std::optional<std::vector<u8>> read_member_data(
+        const ArchiveFile &file) const;
+    bool finish_ring_read(const ArchiveFile &file,
+                          std::vector<u8> &bytes) const;
+    std::vector<u8> expand_member(const ArchiveFile &file,
+                                  const u8 *stored) const;
+    int open_copy_source();
+    bool verify_member(const ArchiveFile &file, const u8 *bytes) const;
+    void write_block_index(std::ostream &out,
+                           const std::vector<ArchiveBlock> &index) const;
+    bool read_block_index(std::istream &in, u64 data_size);
+    bool read_file_table(std::istream &in, u64 archive_size);
+    bool read_file_columns(std::istream &in, u64 archive_size);
+    bool read_file_records(std::istream &in, u64 archive_size); // before 10
+    bool read_holes(std::istream &in, u64 archive_size);
+    bool read_file_stats(std::istream &in, u64 archive_size);
+    void read_run(std::span<const size_t> run,
+                  const std::function<void(size_t, FileView)> &member) const;
+    u64 run_gap() const;
+    size_t readahead_depth(size_t readers) const;
+    bool match_members(std::span<const std::string> include,
+                       std::span<const std::string> exclude,
+                       std::vector<size_t> &selected) const;
+    u64 stream_member(const ArchiveFile &file,
+                      const std::function<void(const u8 *, size_t)> &sink,
+                      std::unique_ptr<MemberReader> &reader) const;
+
     ArchiveHeader header{};
-    std::vector<ArchiveFile> files;
+    // Removes only take the path out of the index and note the entry, the
+    // first call that walks the table drops them all at once
+    mutable std::vector<ArchiveFile> files;
+    mutable std::unordered_map<std::string_view, size_t> path_index;
+    mutable std::vector<size_t> removed_files; // not in path_index anymore
+
+    // Backing storage for ArchiveFile::path. Chunks never move, so the views
+    // handed out stay valid as the pool grows. A loaded file table is adopted
+    // whole, so loading doesn't allocate per path.
+    class PathPool {
+      public:
+        std::string_view add(std::string_view path);
+        void adopt(std::unique_ptr<char[]> chunk);
+
+      private:
+        static constexpr size_t CHUNK_SIZE = 64UL * 1024UL;
+        std::vector<std::unique_ptr<char[]>> chunks;
+        char *cursor{nullptr};
+        size_t remaining{0};
+    };
+    PathPool path_pool;
+    // Holes of every sparse file, in no particular order. Replaced or
+    // removed files leave theirs behind until the table is read again.
+    std::vector<ArchiveHole> holes;
     std::vector<u8> data;
     bool verbose{false};
 
     // Lazy loading support
     std::string archive_file_path;
-    u64 data_section_offset{0};
+    u64 data_section_offset{sizeof(ArchiveHeader)};
+    u64 stored_data_size{0}; // Data section size in the loaded archive
+    u64 loaded_size{0};      // Decoded data size when loaded, no CRCs needed
+                             // below this offset
+    u64 base_size{0};        // Leading data that's only in the archive file,
+                             // `data` logically follows it
     bool lazy_loaded{false};
+    // Opened on the first ReadRing read, shared by all of them
+    mutable std::once_flag ring_source_once;
+    mutable int ring_source_fd{-1};
+    int input_fd{-1};     // Streamed archive being read, see load_stream
+    u64 input_length{0};  // and its decoded data size
+    bool from_stream{false}; // Loaded by load_stream, only the table is here
+
+    // Volumes, see set_volumes. A loaded archive split in volumes has them
+    // all in the mapping.
+    u64 volume_size{0};
+    std::vector<std::string> volume_dirs;
+    size_t loaded_volumes{0}; // 0 if it was a single file
+
+    // Block compression
+    static constexpr u32 DEFAULT_BLOCK_SIZE = 1024U * 1024U; // 1MB
+    ArchiveCodec codec{ArchiveCodec::Store};
+    u32 block_size{DEFAULT_BLOCK_SIZE};
+    std::vector<ArchiveBlock> blocks; // block index of a loaded archive
+    std::shared_ptr<BlockCache> cache; // null unless set_cache_size
+    bool dedup{false};
+    std::vector<ArchiveExtent> extents; // extent map of a loaded archive
+
+    // Streaming writes, the streamed data logically follows `data`
+    struct StreamSource {
+        u64 length{};
+        std::string path;   // Regular files are read from here while writing
+        std::string target; // Symlink targets are tiny, keep them in memory
+        u32 first_hole{};   // Parts of the file that aren't read, as in
+        u32 hole_count{};   // ArchiveFile
+        // Copied out of the previous archive rather than read from `path`
+        const ArchiveFile *unchanged{nullptr};
+    };
+    std::vector<StreamSource> stream_sources;
+    u64 stream_size{0};
+    bool streaming{false};
+    std::shared_ptr<const Archive> previous; // see set_previous
+    size_t extract_readahead{DEFAULT_EXTRACT_READAHEAD};
 
     // Memory mapping for very large archives (>100MB)
-    mutable MappedFile mapped_archive;
+    // Shared so file views can keep the mapping alive
+    std::shared_ptr<MappedFile> mapped_archive{std::make_shared<MappedFile>()};
     static constexpr size_t MMAP_THRESHOLD = 100UL * 1024UL * 1024UL; // 100MB
 
     // Threading support
     size_t thread_count{0}; // 0 means auto-detect
 
-    // Memory pool for better allocation performance
-    struct MemoryPool {
-        std::vector<std::vector<u8>> buffers;
-        std::mutex pool_mutex;
-
-        std::vector<u8> get_buffer(size_t size) {
-            std::lock_guard<std::mutex> lock(pool_mutex);
-            for (auto it = buffers.begin(); it != buffers.end(); ++it) {
-                if (it->size() >= size && it->capacity() <= size * 2) {
-                    auto result = std::move(*it);
-                    buffers.erase(it);
-                    return result;
-                }
-            }
-            return std::vector<u8>(size);
-        }
-
-        void return_buffer(std::vector<u8> buffer) {
-            std::lock_guard<std::mutex> lock(pool_mutex);
-            if (buffers.size() < 10) { // Limit pool size
-                buffer.clear();
-                buffers.push_back(std::move(buffer));
-            }
-        }
-    };
-
-    static MemoryPool memory_pool;
-
     // Thread pool for better parallel processing
     class ThreadPool {
       public:
@@ -190,23 +750,76 @@ class Archive {
                 if (stop) {
                     throw std::runtime_error("enqueue on stopped ThreadPool");
                 }
-                tasks.emplace([task]() { (*task)(); });
+                tasks.push({[task]() { (*task)(); }, queue_stamp()});
             }
             condition.notify_one();
             return res;
         }
 
+        // Safe while other threads use the pool. Extra workers leave after
+        // their current task, queued tasks stay queued.
         void resize(size_t new_size);
-        size_t size() const { return workers.size(); }
+        size_t size() const { return worker_count.load(); }
 
       private:
-        std::vector<std::thread> workers;
-        std::queue<std::function<void()>> tasks;
+        struct Task {
+            std::function<void()> run;
+            u64 queued_at{}; // 0 unless stats are on
+        };
+
+        static u64 queue_stamp();
+        void work(size_t worker);
+
+        std::vector<std::thread> workers; // guarded by resize_mutex
+        std::queue<Task> tasks;
+        size_t active{0}; // workers at or past this index leave
 
         std::mutex queue_mutex;
+        std::mutex resize_mutex;
         std::condition_variable condition;
         std::atomic<bool> stop;
+        std::atomic<size_t> worker_count{0};
     };
 
     static ThreadPool thread_pool;
 };
+
+// Where the reads of one event loop thread complete, see
+// Archive::read_member. Members stored in one piece in the archive file are
+// read with io_uring straight into their buffers, so thousands can be in
+// flight without a thread each. Compressed members, and every read where
+// io_uring isn't there, run on the thread pool and come back through the same
+// queue. Waiting coroutines only resume inside poll() and wait(), on the
+// thread calling them, so a ring belongs to one thread.
+//
+// Reads started from outside poll() go to the kernel right away, reads
+// started by the coroutines it resumes go in one batch when it returns.
+class ReadRing {
+  public:
+    static constexpr unsigned DEFAULT_DEPTH = 256; // io_uring reads in flight
+
+    explicit ReadRing(unsigned depth = DEFAULT_DEPTH);
+    ~ReadRing(); // Finishes everything in flight, resuming as poll() would
+    ReadRing(const ReadRing &) = delete;
+    ReadRing &operator=(const ReadRing &) = delete;
+
+    // Readable whenever poll() has something to resume, for epoll and
+    // friends. -1 where there are no eventfds, wait() still works.
+    int event_fd() const;
+    // Resumes the coroutines whose reads are done, returns how many. Never
+    // blocks.
+    size_t poll();
+    // Blocks until at least one read is done and resumes as poll() does, 0
+    // right away if none are in flight
+    size_t wait();
+    // Reads started and not resumed yet
+    size_t pending() const;
+    bool batched() const; // io_uring in use
+
+  private:
+    friend class Archive;
+    class Impl;
+    std::unique_ptr<Impl> impl;
+
+    void submit(Archive::ReadMember &read);
+};
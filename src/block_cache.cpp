@@ -0,0 +1,81 @@
+#include "block_cache.hpp"
+#include <algorithm>
+
+BlockCache::BlockCache(size_t capacity)
+    : capacity(capacity),
+      shard_count(std::clamp<size_t>(capacity / MIN_SHARD_SIZE, 1,
+                                     MAX_SHARDS)),
+      shard_capacity(capacity / shard_count),
+      shards(std::make_unique<Shard[]>(shard_count)) {}
+
+BlockCache::Shard &BlockCache::shard_for(u64 key) {
+    // Neighbouring blocks are read together, spread them out
+    return shards[(key * 0x9E3779B97F4A7C15ULL >> 32) % shard_count];
+}
+
+BlockCache::Entry BlockCache::find(u64 key) {
+    Shard &shard = shard_for(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto found = shard.index.find(key);
+    if (found == shard.index.end()) {
+        ++shard.misses;
+        return nullptr;
+    }
+    ++shard.hits;
+    shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+    return found->second->second;
+}
+
+size_t BlockCache::charge(const Entry &entry) {
+    return entry->capacity() + ENTRY_OVERHEAD;
+}
+
+void BlockCache::insert(u64 key, Entry entry) {
+    const size_t size = charge(entry);
+    if (size > shard_capacity) {
+        return;
+    }
+
+    Shard &shard = shard_for(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto found = shard.index.find(key);
+    if (found != shard.index.end()) {
+        // Two readers missed at once, keep the one that's there
+        return;
+    }
+    while (shard.bytes + size > shard_capacity) {
+        auto &coldest = shard.lru.back();
+        shard.bytes -= charge(coldest.second);
+        shard.index.erase(coldest.first);
+        shard.lru.pop_back();
+        ++shard.evictions;
+    }
+    shard.lru.emplace_front(key, std::move(entry));
+    shard.index.emplace(key, shard.lru.begin());
+    shard.bytes += size;
+    ++shard.inserts;
+}
+
+void BlockCache::clear() {
+    for (size_t i = 0; i < shard_count; ++i) {
+        std::lock_guard<std::mutex> lock(shards[i].mutex);
+        shards[i].lru.clear();
+        shards[i].index.clear();
+        shards[i].bytes = 0;
+    }
+}
+
+CacheStats BlockCache::stats() const {
+    CacheStats stats;
+    stats.capacity = capacity;
+    for (size_t i = 0; i < shard_count; ++i) {
+        const Shard &shard = shards[i];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        stats.hits += shard.hits;
+        stats.misses += shard.misses;
+        stats.inserts += shard.inserts;
+        stats.evictions += shard.evictions;
+        stats.bytes += shard.bytes;
+    }
+    return stats;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "buffer_pool.hpp"
+#include "kundli.hpp"
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+// Decoded data kept for repeated reads, see Archive::set_cache_size
+// Entries are immutable and shared with their readers, so an evicted entry
+// lives on until the last view of it is gone. The budget is split over
+// shards, each with its own lock and LRU list, so readers on different
+// threads rarely meet. An entry bigger than a shard's share isn't cached.
+// Entries are charged what they allocate, pooled buffers are rounded up to
+// their size class, so the budget bounds memory and not just the bytes held.
+class BlockCache {
+  public:
+    using Entry = std::shared_ptr<const Buffer>;
+
+    explicit BlockCache(size_t capacity);
+
+    // What an entry holds, a decoded block or a whole stored member
+    static u64 block_key(u64 index) { return index << 1; }
+    static u64 member_key(u64 offset) { return (offset << 1) | 1; }
+
+    // nullptr on a miss, a hit becomes the most recently used entry
+    Entry find(u64 key);
+    // Keeps what `key` has if it's there already, otherwise evicts from the
+    // cold end to make room
+    void insert(u64 key, Entry entry);
+    void clear();
+
+    CacheStats stats() const;
+
+  private:
+    // Smaller budgets get fewer shards so a block still fits in one
+    static constexpr size_t MAX_SHARDS = 16;
+    static constexpr size_t MIN_SHARD_SIZE = 8UL * 1024UL * 1024UL; // 8MB
+
+    struct Shard {
+        mutable std::mutex mutex;
+        std::list<std::pair<u64, Entry>> lru; // most recent first
+        std::unordered_map<u64, std::list<std::pair<u64, Entry>>::iterator>
+            index;
+        size_t bytes{0};
+        u64 hits{0};
+        u64 misses{0};
+        u64 inserts{0};
+        u64 evictions{0};
+    };
+
+    // List and index nodes and the shared_ptr's control block, roughly
+    static constexpr size_t ENTRY_OVERHEAD = 128;
+
+    Shard &shard_for(u64 key);
+    static size_t charge(const Entry &entry);
+
+    size_t capacity;
+    size_t shard_count;
+    size_t shard_capacity;
+    std::unique_ptr<Shard[]> shards;
+};
@@ -0,0 +1,207 @@
+#include "buffer_pool.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstring>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace {
+
+constexpr size_t MIN_CLASS_SHIFT = 12; // 4 KB
+constexpr size_t CLASS_COUNT = 15;     // up to 64 MB
+constexpr size_t MAX_POOLED = size_t(1) << (MIN_CLASS_SHIFT + CLASS_COUNT - 1);
+
+// A thread keeps about this much per class, up to 64 buffers. Extraction has
+// up to 64 small files in flight per writer.
+constexpr size_t CACHE_BYTES = 8UL * 1024UL * 1024UL;
+constexpr size_t MAX_CACHED = 64;
+// The depot holds a few threads' worth
+constexpr size_t DEPOT_FACTOR = 4;
+
+size_t class_of(size_t capacity) {
+    return static_cast<size_t>(std::countr_zero(capacity)) - MIN_CLASS_SHIFT;
+}
+
+size_t class_bytes(size_t size_class) {
+    return size_t(1) << (MIN_CLASS_SHIFT + size_class);
+}
+
+// Classes bigger than CACHE_BYTES aren't kept by threads at all, or every
+// thread that once read a 16 MB range would hold on to it for good
+size_t cache_limit(size_t size_class) {
+    return std::min(CACHE_BYTES / class_bytes(size_class), MAX_CACHED);
+}
+
+// Those only go through the depot, which keeps DEPOT_FACTOR * CACHE_BYTES of
+// them but at least one
+size_t depot_limit(size_t size_class) {
+    const size_t limit = cache_limit(size_class);
+    if (limit > 0) {
+        return DEPOT_FACTOR * limit;
+    }
+    const size_t depot_bytes = DEPOT_FACTOR * CACHE_BYTES;
+    return std::max<size_t>(depot_bytes / class_bytes(size_class), 1);
+}
+
+using FreeList = std::vector<std::unique_ptr<u8[]>>;
+
+struct Counters {
+    std::atomic<u64> hits{0};
+    std::atomic<u64> depot_hits{0};
+    std::atomic<u64> misses{0};
+    std::atomic<u64> unpooled{0};
+    std::atomic<u64> dropped{0};
+} counters;
+
+void count(std::atomic<u64> &counter) {
+    counter.fetch_add(1, std::memory_order_relaxed);
+}
+
+struct Depot {
+    std::mutex mutex;
+    FreeList buffers;
+};
+
+// Never destroyed, buffers in static objects can still come back at exit
+std::array<Depot, CLASS_COUNT> &depots() {
+    static auto *instance = new std::array<Depot, CLASS_COUNT>();
+    return *instance;
+}
+
+bool give_to_depot(size_t size_class, std::unique_ptr<u8[]> &bytes) {
+    Depot &depot = depots()[size_class];
+    std::lock_guard<std::mutex> lock(depot.mutex);
+    if (depot.buffers.size() >= depot_limit(size_class)) {
+        return false;
+    }
+    depot.buffers.push_back(std::move(bytes));
+    return true;
+}
+
+std::unique_ptr<u8[]> take_from_depot(size_t size_class) {
+    Depot &depot = depots()[size_class];
+    std::lock_guard<std::mutex> lock(depot.mutex);
+    if (depot.buffers.empty()) {
+        return nullptr;
+    }
+    auto bytes = std::move(depot.buffers.back());
+    depot.buffers.pop_back();
+    return bytes;
+}
+
+thread_local bool cache_destroyed = false;
+
+struct ThreadCache {
+    std::array<FreeList, CLASS_COUNT> free;
+
+    // A finished thread's buffers are still good for everyone else
+    ~ThreadCache() {
+        cache_destroyed = true;
+        for (size_t c = 0; c < CLASS_COUNT; ++c) {
+            for (auto &bytes : free[c]) {
+                if (!give_to_depot(c, bytes)) {
+                    count(counters.dropped);
+                }
+            }
+        }
+    }
+};
+
+// nullptr while the thread is exiting, those buffers skip the thread cache
+ThreadCache *thread_cache() {
+    if (cache_destroyed) {
+        return nullptr;
+    }
+    thread_local ThreadCache cache;
+    return &cache;
+}
+
+} // namespace
+
+Buffer::Buffer(size_t size) : length(size) {
+    if (size > MAX_POOLED) {
+        count(counters.unpooled);
+        bytes.reset(new u8[size]);
+        allocated = size;
+        return;
+    }
+
+    allocated = std::max(std::bit_ceil(size), size_t(1) << MIN_CLASS_SHIFT);
+    const size_t size_class = class_of(allocated);
+
+    if (ThreadCache *cache = thread_cache();
+        cache != nullptr && !cache->free[size_class].empty()) {
+        bytes = std::move(cache->free[size_class].back());
+        cache->free[size_class].pop_back();
+        count(counters.hits);
+        return;
+    }
+    bytes = take_from_depot(size_class);
+    if (bytes != nullptr) {
+        count(counters.depot_hits);
+        return;
+    }
+    count(counters.misses);
+    bytes.reset(new u8[allocated]);
+}
+
+Buffer::Buffer(Buffer &&other) noexcept
+    : bytes(std::move(other.bytes)), length(std::exchange(other.length, 0)),
+      allocated(std::exchange(other.allocated, 0)) {}
+
+Buffer &Buffer::operator=(Buffer &&other) noexcept {
+    if (this != &other) {
+        release();
+        bytes = std::move(other.bytes);
+        length = std::exchange(other.length, 0);
+        allocated = std::exchange(other.allocated, 0);
+    }
+    return *this;
+}
+
+void Buffer::resize(size_t size) {
+    if (size <= allocated) {
+        length = size;
+        return;
+    }
+    Buffer bigger(size);
+    if (length > 0) {
+        std::memcpy(bigger.data(), data(), length);
+    }
+    *this = std::move(bigger);
+}
+
+void Buffer::release() {
+    length = 0;
+    if (bytes == nullptr || allocated > MAX_POOLED) {
+        bytes.reset();
+        allocated = 0;
+        return;
+    }
+
+    const size_t size_class = class_of(allocated);
+    allocated = 0;
+    if (ThreadCache *cache = thread_cache();
+        cache != nullptr &&
+        cache->free[size_class].size() < cache_limit(size_class)) {
+        cache->free[size_class].push_back(std::move(bytes));
+        return;
+    }
+    if (!give_to_depot(size_class, bytes)) {
+        count(counters.dropped);
+        bytes.reset();
+    }
+}
+
+BufferPoolStats buffer_pool_stats() {
+    BufferPoolStats stats;
+    stats.hits = counters.hits.load(std::memory_order_relaxed);
+    stats.depot_hits = counters.depot_hits.load(std::memory_order_relaxed);
+    stats.misses = counters.misses.load(std::memory_order_relaxed);
+    stats.unpooled = counters.unpooled.load(std::memory_order_relaxed);
+    stats.dropped = counters.dropped.load(std::memory_order_relaxed);
+    return stats;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "kundli.hpp"
+#include <cstddef>
+#include <memory>
+
+// Scratch buffers for reads, block coding and extraction
+// Sizes round up to a power of two from 4 KB to 64 MB. Every thread keeps a
+// few free buffers of each size class up to 8 MB, so taking one and handing
+// it back doesn't lock anything. What a thread can't keep goes to a shared
+// depot per class, which is how blocks freed by the workers make it back to
+// the writer. The bigger classes only have the depot, and requests over
+// 64 MB aren't pooled.
+class Buffer {
+  public:
+    Buffer() = default;
+    explicit Buffer(size_t size); // Contents are uninitialized
+    ~Buffer() { release(); }
+    Buffer(Buffer &&other) noexcept;
+    Buffer &operator=(Buffer &&other) noexcept;
+
+    u8 *data() { return bytes.get(); }
+    const u8 *data() const { return bytes.get(); }
+    size_t size() const { return length; }
+    size_t capacity() const { return allocated; }
+    bool empty() const { return length == 0; }
+
+    // Free within capacity(), beyond it the contents move to a bigger buffer
+    void resize(size_t size);
+
+  private:
+    void release();
+
+    std::unique_ptr<u8[]> bytes;
+    size_t length{};
+    size_t allocated{};
+};
+
+BufferPoolStats buffer_pool_stats();
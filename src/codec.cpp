@@ -0,0 +1,394 @@
+#include "codec.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#ifdef KUNDLI_HAVE_LZMA
+#include <lzma.h>
+#endif
+
+namespace {
+
+class StoreCodec final : public Codec {
+  public:
+    ArchiveCodec id() const override { return ArchiveCodec::Store; }
+    const char *name() const override { return "store"; }
+
+    size_t max_compressed_size(size_t raw_size) const override {
+        return raw_size;
+    }
+
+    size_t compress(const u8 *src, size_t src_size, u8 *dst,
+                    size_t dst_capacity) const override {
+        if (src_size > dst_capacity) {
+            return 0;
+        }
+        std::memcpy(dst, src, src_size);
+        return src_size;
+    }
+
+    bool decompress(const u8 *src, size_t src_size, u8 *dst,
+                    size_t dst_size) const override {
+        if (src_size != dst_size) {
+            return false;
+        }
+        std::memcpy(dst, src, src_size);
+        return true;
+    }
+};
+
+// LZ77 with a single-entry hash table, in the spirit of LZ4
+// A sequence is a token byte (literal count in the high nibble, match length
+// minus MIN_MATCH in the low nibble, 15 meaning "more length bytes follow"),
+// the literals, a 16-bit little endian match offset and the extra match length
+// bytes. The last sequence of a block only carries literals.
+class LzCodec final : public Codec {
+  public:
+    ArchiveCodec id() const override { return ArchiveCodec::Lz; }
+    const char *name() const override { return "lz"; }
+
+    size_t max_compressed_size(size_t raw_size) const override {
+        return raw_size + raw_size / 255 + 16;
+    }
+
+    size_t compress(const u8 *src, size_t src_size, u8 *dst,
+                    size_t dst_capacity) const override {
+        // Reused across blocks, every block starts from a clean table though
+        thread_local std::vector<u32> table;
+        table.assign(size_t(1) << HASH_BITS, 0);
+
+        const u8 *ip = src;
+        const u8 *anchor = src;
+        const u8 *const iend = src + src_size;
+        u8 *op = dst;
+        u8 *const oend = dst + dst_capacity;
+
+        if (src_size >= MIN_MATCH) {
+            const u8 *const match_limit = iend - MIN_MATCH;
+            size_t misses = 0;
+
+            while (ip <= match_limit) {
+                const u32 sequence = read32(ip);
+                const u32 h = hash(sequence);
+                const u8 *ref = src + table[h];
+                table[h] = static_cast<u32>(ip - src);
+
+                if (ref < ip && static_cast<size_t>(ip - ref) <= MAX_OFFSET &&
+                    read32(ref) == sequence) {
+                    const u8 *match_end = ip + MIN_MATCH;
+                    const u8 *ref_end = ref + MIN_MATCH;
+                    while (match_end < iend && *match_end == *ref_end) {
+                        ++match_end;
+                        ++ref_end;
+                    }
+
+                    if (!emit(op, oend, anchor,
+                              static_cast<size_t>(ip - anchor),
+                              static_cast<size_t>(ip - ref),
+                              static_cast<size_t>(match_end - ip) - MIN_MATCH,
+                              false)) {
+                        return 0;
+                    }
+
+                    ip = match_end;
+                    anchor = ip;
+                    misses = 0;
+                } else {
+                    // Skip faster through data that doesn't match anything
+                    ip += 1 + (misses++ >> 6);
+                }
+            }
+        }
+
+        if (!emit(op, oend, anchor, static_cast<size_t>(iend - anchor), 0, 0,
+                  true)) {
+            return 0;
+        }
+        return static_cast<size_t>(op - dst);
+    }
+
+    bool decompress(const u8 *src, size_t src_size, u8 *dst,
+                    size_t dst_size) const override {
+        const u8 *ip = src;
+        const u8 *const iend = src + src_size;
+        u8 *op = dst;
+        u8 *const oend = dst + dst_size;
+
+        while (ip < iend) {
+            const u8 token = *ip++;
+
+            size_t literals = token >> 4;
+            if (literals == 15 && !read_length(ip, iend, literals)) {
+                return false;
+            }
+            if (literals > static_cast<size_t>(iend - ip) ||
+                literals > static_cast<size_t>(oend - op)) {
+                return false;
+            }
+            std::memcpy(op, ip, literals);
+            ip += literals;
+            op += literals;
+
+            if (ip == iend) {
+                break; // last sequence
+            }
+
+            if (iend - ip < 2) {
+                return false;
+            }
+            const size_t offset =
+                static_cast<size_t>(ip[0]) | (static_cast<size_t>(ip[1]) << 8);
+            ip += 2;
+            if (offset == 0 || offset > static_cast<size_t>(op - dst)) {
+                return false;
+            }
+
+            size_t match_length = token & 15;
+            if (match_length == 15 && !read_length(ip, iend, match_length)) {
+                return false;
+            }
+            match_length += MIN_MATCH;
+            if (match_length > static_cast<size_t>(oend - op)) {
+                return false;
+            }
+
+            const u8 *ref = op - offset;
+            if (offset >= match_length) {
+                std::memcpy(op, ref, match_length);
+                op += match_length;
+            } else {
+                // Overlapping match, this is how runs get encoded
+                while (match_length-- > 0) {
+                    *op++ = *ref++;
+                }
+            }
+        }
+
+        return op == oend;
+    }
+
+  private:
+    static constexpr size_t MIN_MATCH = 4;
+    static constexpr size_t MAX_OFFSET = 65535;
+    static constexpr u32 HASH_BITS = 14;
+
+    static u32 read32(const u8 *p) {
+        u32 value;
+        std::memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    static u32 hash(u32 value) {
+        return (value * 2654435761U) >> (32 - HASH_BITS);
+    }
+
+    static u8 *write_length(u8 *op, size_t length) {
+        while (length >= 255) {
+            *op++ = 255;
+            length -= 255;
+        }
+        *op++ = static_cast<u8>(length);
+        return op;
+    }
+
+    static bool read_length(const u8 *&ip, const u8 *iend, size_t &length) {
+        u8 byte = 0;
+        do {
+            if (ip >= iend) {
+                return false;
+            }
+            byte = *ip++;
+            length += byte;
+        } while (byte == 255);
+        return true;
+    }
+
+    static bool emit(u8 *&op, u8 *oend, const u8 *literals,
+                     size_t literal_count, size_t offset, size_t match_length,
+                     bool last) {
+        size_t needed = 1 + literal_count + literal_count / 255 + 1;
+        if (!last) {
+            needed += 2 + match_length / 255 + 1;
+        }
+        if (static_cast<size_t>(oend - op) < needed) {
+            return false;
+        }
+
+        u8 *token = op++;
+        u8 token_value = static_cast<u8>(std::min<size_t>(literal_count, 15)
+                                         << 4);
+        if (literal_count >= 15) {
+            op = write_length(op, literal_count - 15);
+        }
+        std::memcpy(op, literals, literal_count);
+        op += literal_count;
+
+        if (!last) {
+            *op++ = static_cast<u8>(offset & 0xFF);
+            *op++ = static_cast<u8>(offset >> 8);
+            token_value |= static_cast<u8>(std::min<size_t>(match_length, 15));
+            if (match_length >= 15) {
+                op = write_length(op, match_length - 15);
+            }
+        }
+
+        *token = token_value;
+        return true;
+    }
+};
+
+#ifdef KUNDLI_HAVE_LZMA
+// Raw LZMA2 without the .xz container, the block index already records
+// everything the container would
+class LzmaCodec final : public Codec {
+  public:
+    ArchiveCodec id() const override { return ArchiveCodec::Lzma; }
+    const char *name() const override { return "lzma"; }
+
+    size_t max_compressed_size(size_t raw_size) const override {
+        return lzma_block_buffer_bound(raw_size);
+    }
+
+    size_t compress(const u8 *src, size_t src_size, u8 *dst,
+                    size_t dst_capacity) const override {
+        lzma_options_lzma options{};
+        if (lzma_lzma_preset(&options, PRESET)) {
+            return 0;
+        }
+        // No point in a dictionary bigger than the block itself, and it keeps
+        // the encoder's memory use per worker sane
+        options.dict_size = dictionary_size(src_size, options.dict_size);
+
+        const lzma_filter filters[] = {
+            {LZMA_FILTER_LZMA2, &options},
+            {LZMA_VLI_UNKNOWN, nullptr},
+        };
+
+        size_t out_pos = 0;
+        if (lzma_raw_buffer_encode(filters, nullptr, src, src_size, dst,
+                                   &out_pos, dst_capacity) != LZMA_OK) {
+            return 0;
+        }
+        return out_pos;
+    }
+
+    bool decompress(const u8 *src, size_t src_size, u8 *dst,
+                    size_t dst_size) const override {
+        lzma_options_lzma options{};
+        if (lzma_lzma_preset(&options, PRESET)) {
+            return false;
+        }
+        // Never smaller than what the encoder used for a block this size
+        options.dict_size = dictionary_size(dst_size, dst_size);
+
+        const lzma_filter filters[] = {
+            {LZMA_FILTER_LZMA2, &options},
+            {LZMA_VLI_UNKNOWN, nullptr},
+        };
+
+        size_t in_pos = 0;
+        size_t out_pos = 0;
+        return lzma_raw_buffer_decode(filters, nullptr, src, &in_pos, src_size,
+                                      dst, &out_pos, dst_size) == LZMA_OK &&
+               out_pos == dst_size;
+    }
+
+  private:
+    static constexpr u32 PRESET = 6;
+
+    static u32 dictionary_size(size_t raw_size, size_t limit) {
+        size_t size = std::min(raw_size, limit);
+        return static_cast<u32>(
+            std::max<size_t>(size, LZMA_DICT_SIZE_MIN));
+    }
+};
+#endif
+
+} // namespace
+
+const Codec *find_codec(ArchiveCodec id) {
+    static const StoreCodec store;
+    static const LzCodec lz;
+#ifdef KUNDLI_HAVE_LZMA
+    static const LzmaCodec lzma;
+#endif
+
+    switch (id) {
+    case ArchiveCodec::Store:
+        return &store;
+    case ArchiveCodec::Lz:
+        return &lz;
+    case ArchiveCodec::Lzma:
+#ifdef KUNDLI_HAVE_LZMA
+        return &lzma;
+#else
+        return nullptr;
+#endif
+    }
+    return nullptr;
+}
+
+const Codec *find_codec(const std::string &name) {
+    for (auto id :
+         {ArchiveCodec::Store, ArchiveCodec::Lz, ArchiveCodec::Lzma}) {
+        const Codec *codec = find_codec(id);
+        if (codec != nullptr && name == codec->name()) {
+            return codec;
+        }
+    }
+    return nullptr;
+}
+
+bool looks_incompressible(const u8 *data, size_t size) {
+    // 16 windows of 256 bytes spread over the block. Random bytes come out
+    // at about 7.95 bits a byte over all of them and never below 7 in one
+    // window, compressed formats just under that. Text and code stay under
+    // 6, so a block that's partly those still goes to the codec.
+    constexpr size_t WINDOWS = 16;
+    constexpr size_t WINDOW = 256;
+    constexpr size_t SAMPLED = WINDOWS * WINDOW;
+    constexpr double MIN_BITS = 7.8;
+    constexpr double MIN_WINDOW_BITS = 6.5;
+    if (size < SAMPLED * 2) {
+        return false; // cheap enough to just try
+    }
+
+    // Shannon entropy is log2(n) - sum(c * log2(c)) / n
+    static const auto weights = [] {
+        std::array<double, SAMPLED + 1> table{};
+        for (size_t count = 2; count <= SAMPLED; ++count) {
+            table[count] =
+                static_cast<double>(count) * std::log2(count * 1.0);
+        }
+        return table;
+    }();
+    auto bits = [](double weighted, size_t length) {
+        return std::log2(length * 1.0) - weighted / static_cast<double>(length);
+    };
+
+    u32 totals[256]{};
+    const size_t step = (size - WINDOW) / (WINDOWS - 1);
+    for (size_t w = 0; w < WINDOWS; ++w) {
+        const u8 *window = data + w * step;
+        u32 counts[256]{};
+        for (size_t i = 0; i < WINDOW; ++i) {
+            ++counts[window[i]];
+        }
+        double weighted = 0;
+        for (size_t b = 0; b < 256; ++b) {
+            weighted += weights[counts[b]];
+            totals[b] += counts[b];
+        }
+        if (bits(weighted, WINDOW) < MIN_WINDOW_BITS) {
+            return false;
+        }
+    }
+
+    double weighted = 0;
+    for (const u32 count : totals) {
+        weighted += weights[count];
+    }
+    return bits(weighted, SAMPLED) >= MIN_BITS;
+}
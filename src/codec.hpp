@@ -0,0 +1,37 @@
+#pragma once
+
+#include "kundli.hpp"
+#include <cstddef>
+#include <string>
+
+// Block codec interface
+// Every block in a compressed archive is encoded independently so blocks can
+// be compressed and decoded in parallel, and a reader only has to decode the
+// blocks that overlap the member it wants.
+class Codec {
+  public:
+    virtual ~Codec() = default;
+
+    virtual ArchiveCodec id() const = 0;
+    virtual const char *name() const = 0;
+
+    // Worst case encoded size for raw_size input bytes
+    virtual size_t max_compressed_size(size_t raw_size) const = 0;
+
+    // Returns the encoded size, or 0 if the output didn't fit in dst_capacity
+    virtual size_t compress(const u8 *src, size_t src_size, u8 *dst,
+                            size_t dst_capacity) const = 0;
+
+    // dst_size is the exact decoded size recorded in the block index
+    virtual bool decompress(const u8 *src, size_t src_size, u8 *dst,
+                            size_t dst_size) const = 0;
+};
+
+// nullptr if the codec is unknown or wasn't compiled into this build
+const Codec *find_codec(ArchiveCodec id);
+const Codec *find_codec(const std::string &name);
+
+// Whether a block looks like it won't shrink: media, archives, anything
+// compressed or encrypted already. Judged from the byte entropy of a few KB
+// sampled across it, for a fraction of what trying a codec costs.
+bool looks_incompressible(const u8 *data, size_t size);
@@ -0,0 +1,67 @@
+#include "cpu.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
+namespace {
+
+CpuFeatures probe() {
+    CpuFeatures features;
+#if defined(__x86_64__) || defined(__i386__)
+    // Also checks that the OS saves the wider registers
+    __builtin_cpu_init();
+    features.sse4_2 = __builtin_cpu_supports("sse4.2");
+    features.pclmul = __builtin_cpu_supports("pclmul");
+    features.avx2 = __builtin_cpu_supports("avx2");
+    features.avx512 = __builtin_cpu_supports("avx512f") &&
+                      __builtin_cpu_supports("avx512bw") &&
+                      __builtin_cpu_supports("avx512vl");
+    // Older compilers don't know "sha" for __builtin_cpu_supports
+    unsigned eax = 0;
+    unsigned ebx = 0;
+    unsigned ecx = 0;
+    unsigned edx = 0;
+    features.sha = __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) != 0 &&
+                   (ebx & bit_SHA) != 0;
+#elif defined(__aarch64__)
+    features.neon = true; // part of ARMv8
+#if defined(__ARM_FEATURE_CRC32)
+    features.crc32 = true;
+#elif defined(__linux__)
+    features.crc32 = (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#endif
+#endif
+    return features;
+}
+
+} // namespace
+
+const CpuFeatures &cpu_features() {
+    static const CpuFeatures features = probe();
+    return features;
+}
+
+const char *cpu_simd_level() {
+    const CpuFeatures &features = cpu_features();
+    if (features.avx512) {
+        return "avx512";
+    }
+    if (features.avx2) {
+        return "avx2";
+    }
+    if (features.sse4_2) {
+        return "sse4.2";
+    }
+    if (features.neon) {
+        return "neon";
+    }
+    return "baseline";
+}
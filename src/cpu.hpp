@@ -0,0 +1,23 @@
+#pragma once
+
+#include "kundli.hpp"
+
+// What the CPU we're running on supports, probed once
+// Builds target the baseline ISA unless KUNDLI_NATIVE is set, so one binary
+// runs on every machine of an architecture. Kernels that need more than the
+// baseline are compiled for their ISA with target attributes and picked at
+// runtime from these.
+struct CpuFeatures {
+    bool sse4_2{false};
+    bool pclmul{false};
+    bool avx2{false};
+    bool avx512{false}; // F, BW and VL
+    bool sha{false};    // x86 SHA extensions
+    bool neon{false};
+    bool crc32{false}; // ARMv8 CRC extension
+};
+
+const CpuFeatures &cpu_features();
+
+// The widest vector ISA found, e.g. "avx512" or "neon"
+const char *cpu_simd_level();
@@ -0,0 +1,213 @@
+#include "crc32c.hpp"
+#include "cpu.hpp"
+#include "metrics.hpp"
+#include <array>
+#include <cstring>
+
+// The hardware kernels are built for their ISA whatever the build targets,
+// and only run if the CPU has it
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define KUNDLI_CRC32C_HW
+#define CRC_TARGET __attribute__((target("sse4.2")))
+#define CLMUL_TARGET __attribute__((target("sse4.2,pclmul")))
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#define KUNDLI_CRC32C_HW
+#define CRC_TARGET __attribute__((target("+crc")))
+#define CLMUL_TARGET CRC_TARGET
+#endif
+
+namespace {
+
+constexpr u32 POLYNOMIAL = 0x82F63B78;
+
+constexpr std::array<u32, 256> create_table() {
+    std::array<u32, 256> table{};
+
+    for (u32 i = 0; i < 256; ++i) {
+        u32 crc = i;
+        for (int j = 0; j < 8; ++j) {
+            crc = (crc >> 1) ^ (POLYNOMIAL & (-(crc & 1)));
+        }
+        table[i] = crc;
+    }
+    return table;
+}
+constexpr std::array<u32, 256> table = create_table();
+
+// All the helpers below work on the raw register, without the inversion
+// before and after that crc32c() applies
+u32 update_table(const u8 *data, size_t length, u32 state) {
+    for (size_t i = 0; i < length; ++i) {
+        state = table[(state ^ data[i]) & 0xFF] ^ (state >> 8);
+    }
+    return state;
+}
+
+// a * b modulo the polynomial. Bits are reflected, x^0 is the top bit.
+constexpr u32 multiply(u32 a, u32 b) {
+    u32 product = 0;
+    for (u32 bit = 1U << 31; bit != 0; bit >>= 1) {
+        if (a & bit) {
+            product ^= b;
+        }
+        b = (b & 1) ? (b >> 1) ^ POLYNOMIAL : b >> 1;
+    }
+    return product;
+}
+
+// x^n modulo the polynomial
+constexpr u32 x_pow(u64 n) {
+    u32 result = 1U << 31; // x^0
+    u32 square = 1U << 30; // x^1
+    while (n > 0) {
+        if (n & 1) {
+            result = multiply(result, square);
+        }
+        square = multiply(square, square);
+        n >>= 1;
+    }
+    return result;
+}
+
+#ifdef KUNDLI_CRC32C_HW
+
+u64 load64(const u8 *p) {
+    u64 value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// States stay 64 bits wide in the loops, narrowing them each step puts a
+// zero-extending mov on the dependency chain
+#if defined(__x86_64__)
+CRC_TARGET inline u64 step64(u64 state, u64 value) {
+    return _mm_crc32_u64(state, value);
+}
+CRC_TARGET inline u32 step8(u32 state, u8 value) {
+    return _mm_crc32_u8(state, value);
+}
+#else
+CRC_TARGET inline u64 step64(u64 state, u64 value) {
+    return __crc32cd(static_cast<u32>(state), value);
+}
+CRC_TARGET inline u32 step8(u32 state, u8 value) {
+    return __crc32cb(state, value);
+}
+#endif
+
+// Advances a state over `Length` bytes that come after it. With PCLMUL the
+// product is a carry-less multiply reduced by the crc32 instruction, which
+// multiplies by x^33 on the way, hence the smaller constant. Without it the
+// multiply is done bit by bit, which still beats a table for big strides.
+template <size_t Length, bool Clmul> struct Shift {
+    static constexpr u32 constant = x_pow(8 * Length);
+
+    static u32 apply(u32 state) { return multiply(state, constant); }
+};
+
+#if defined(__x86_64__)
+template <size_t Length> struct Shift<Length, true> {
+    static constexpr u32 constant = x_pow(8 * Length - 33);
+
+    CLMUL_TARGET static u32 apply(u32 state) {
+        const __m128i product = _mm_clmulepi64_si128(
+            _mm_cvtsi32_si128(static_cast<int>(state)),
+            _mm_cvtsi32_si128(static_cast<int>(constant)), 0);
+        return static_cast<u32>(
+            step64(0, static_cast<u64>(_mm_cvtsi128_si64(product))));
+    }
+};
+#endif
+
+// The crc32 instruction takes 3 cycles but can start one every cycle, so
+// three independent streams over consecutive thirds keep it busy. The
+// streams are stitched together with two shifts per round.
+template <size_t Stride, bool Clmul>
+CLMUL_TARGET u32 update_interleaved(const u8 *&data, size_t &length,
+                                    u32 state) {
+    using Shifter = Shift<Stride, Clmul>;
+    while (length >= 3 * Stride) {
+        u64 a = state;
+        u64 b = 0;
+        u64 c = 0;
+        for (size_t i = 0; i < Stride; i += 8) {
+            a = step64(a, load64(data + i));
+            b = step64(b, load64(data + Stride + i));
+            c = step64(c, load64(data + 2 * Stride + i));
+        }
+        state = Shifter::apply(Shifter::apply(static_cast<u32>(a)) ^
+                               static_cast<u32>(b)) ^
+                static_cast<u32>(c);
+        data += 3 * Stride;
+        length -= 3 * Stride;
+    }
+    return state;
+}
+
+template <bool Clmul>
+CLMUL_TARGET u32 update_hardware(const u8 *data, size_t length, u32 state) {
+    state = update_interleaved<4096, Clmul>(data, length, state);
+    state = update_interleaved<256, Clmul>(data, length, state);
+
+    while (length >= 8) {
+        state = static_cast<u32>(step64(state, load64(data)));
+        data += 8;
+        length -= 8;
+    }
+    while (length > 0) {
+        state = step8(state, *data++);
+        --length;
+    }
+    return state;
+}
+
+#endif
+
+using Kernel = u32 (*)(const u8 *, size_t, u32);
+
+Kernel select_kernel() {
+#if defined(__x86_64__)
+    const CpuFeatures &features = cpu_features();
+    if (features.sse4_2) {
+        return features.pclmul ? update_hardware<true>
+                               : update_hardware<false>;
+    }
+#elif defined(__aarch64__)
+    if (cpu_features().crc32) {
+        return update_hardware<false>;
+    }
+#endif
+    return update_table;
+}
+
+// Picked once, the first time anything is checksummed
+Kernel active_kernel() {
+    static const Kernel kernel = select_kernel();
+    return kernel;
+}
+
+} // namespace
+
+u32 crc32c(const u8 *data, size_t length, u32 crc) {
+    metrics::Scope timing(metrics::Timer::Crc);
+    return ~active_kernel()(data, length, ~crc);
+}
+
+const char *crc32c_kernel() {
+    const Kernel kernel = active_kernel();
+    if (kernel == update_table) {
+        return "table";
+    }
+#if defined(__x86_64__)
+    return kernel == update_hardware<true> ? "sse4.2+pclmul" : "sse4.2";
+#else
+    return "armv8 crc";
+#endif
+}
+
+u32 crc32c_combine(u32 crc_a, u32 crc_b, u64 length_b) {
+    // The inversions cancel out, shifting A past B's length is all it takes
+    return multiply(x_pow(8 * length_b), crc_a) ^ crc_b;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "kundli.hpp"
+#include <cstddef>
+
+// CRC32C (Castagnoli, reflected polynomial 0x82F63B78)
+// Every checksum in the format uses it: the header CRC, member and block
+// checksums. It's what the SSE4.2 and ARMv8 CRC instructions compute, builds
+// without them use a table and get the same values.
+
+// Pass the previous result as `crc` to continue a checksum across buffers
+u32 crc32c(const u8 *data, size_t length, u32 crc = 0);
+
+// CRC of A followed by B, from the CRCs of A and B and the length of B.
+// This is what lets chunks be checksummed independently.
+u32 crc32c_combine(u32 crc_a, u32 crc_b, u64 length_b);
+
+// The implementation picked for this CPU, e.g. "sse4.2+pclmul" or "table"
+const char *crc32c_kernel();
@@ -0,0 +1,125 @@
+#include "dedup.hpp"
+#include "metrics.hpp"
+#include <algorithm>
+#include <array>
+#include <utility>
+
+namespace {
+
+constexpr u64 splitmix64(u64 &state) {
+    u64 z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// One random value per byte, the rolling hash shifts and adds these
+constexpr std::array<u64, 256> create_gear() {
+    std::array<u64, 256> gear{};
+    u64 state = 0x6B756E646C69ULL;
+    for (auto &value : gear) {
+        value = splitmix64(state);
+    }
+    return gear;
+}
+
+constexpr std::array<u64, 256> GEAR = create_gear();
+
+// The top bits depend on the last 64 bytes. Below the average size cuts are
+// harder to hit and above it easier, which keeps sizes close to the average.
+constexpr u64 MASK_SMALL = ~0ULL << (64 - 15);
+constexpr u64 MASK_LARGE = ~0ULL << (64 - 11);
+
+} // namespace
+
+Deduplicator::Deduplicator(std::vector<u64> starts, u64 from, Store store)
+    : starts(std::move(starts)), position(from), store(std::move(store)) {
+    std::sort(this->starts.begin(), this->starts.end());
+    pending.reserve(MAX_CHUNK);
+}
+
+void Deduplicator::update(const u8 *data, size_t length) {
+    while (length > 0) {
+        // Chunks never run across a member start
+        const u64 at = position + pending.size();
+        while (next_start < starts.size() && starts[next_start] <= at) {
+            if (starts[next_start] == at && !pending.empty()) {
+                cut();
+            }
+            ++next_start;
+        }
+        size_t take = length;
+        if (next_start < starts.size()) {
+            take = static_cast<size_t>(
+                std::min<u64>(take, starts[next_start] - at));
+        }
+        scan(data, take);
+        data += take;
+        length -= take;
+    }
+}
+
+void Deduplicator::finish() {
+    if (!pending.empty()) {
+        cut();
+    }
+}
+
+void Deduplicator::scan(const u8 *data, size_t length) {
+    metrics::Scope timing(metrics::Timer::Dedup);
+    size_t begin = 0;
+    for (size_t i = 0; i < length; ++i) {
+        rolling = (rolling << 1) + GEAR[data[i]];
+        const size_t size = pending.size() + (i - begin) + 1;
+        if (size < MIN_CHUNK) {
+            continue;
+        }
+        const u64 mask = size < AVERAGE_CHUNK ? MASK_SMALL : MASK_LARGE;
+        if ((rolling & mask) == 0 || size >= MAX_CHUNK) {
+            pending.insert(pending.end(), data + begin, data + i + 1);
+            cut();
+            begin = i + 1;
+        }
+    }
+    pending.insert(pending.end(), data + begin, data + length);
+}
+
+void Deduplicator::cut() {
+    const u64 size = pending.size();
+    bool inserted = false;
+    u64 stored_offset = stored;
+    {
+        metrics::Scope timing(metrics::Timer::Dedup);
+        auto [it, added] =
+            seen.try_emplace(sha256(pending.data(), pending.size()), stored);
+        inserted = added;
+        stored_offset = it->second;
+    }
+
+    if (inserted) {
+        store(pending.data(), pending.size());
+        stored += size;
+    } else {
+        duplicates += size;
+    }
+    add_extent(position, stored_offset, size);
+    position += size;
+    pending.clear();
+    rolling = 0;
+}
+
+void Deduplicator::add_extent(u64 offset, u64 stored_offset, u64 length) {
+    if (!map.empty()) {
+        ArchiveExtent &last = map.back();
+        if (last.offset + last.length == offset &&
+            last.stored_offset + last.length == stored_offset) {
+            last.length += length;
+            return;
+        }
+    }
+    ArchiveExtent extent;
+    extent.offset = offset;
+    extent.stored_offset = stored_offset;
+    extent.length = length;
+    map.push_back(extent);
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "kundli.hpp"
+#include "sha256.hpp"
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+// Content-defined chunking for deduplicated archives
+// The data section streams through in offset order and gets cut wherever a
+// rolling (gear) hash of the last bytes hits a pattern, so an insert early in
+// a file only changes the chunks around it. Every chunk seen for the first
+// time goes to `store`, repeats just point at the first copy. Cuts are also
+// forced at every member start, which makes identical files come out as
+// identical chunk lists.
+//
+// Chunks are told apart by their SHA-256. Archives get built from files
+// anyone could have put there, a weaker hash would let them craft two chunks
+// that collide and have the second one dropped.
+class Deduplicator {
+  public:
+    static constexpr size_t MIN_CHUNK = 2UL * 1024UL;
+    static constexpr size_t AVERAGE_CHUNK = 8UL * 1024UL;
+    static constexpr size_t MAX_CHUNK = 64UL * 1024UL;
+
+    using Store = std::function<void(const u8 *, size_t)>;
+
+    // `starts` are the offsets members begin at, `from` is where the stream
+    // starts
+    Deduplicator(std::vector<u64> starts, u64 from, Store store);
+
+    void update(const u8 *data, size_t length);
+    // Cuts whatever is pending, call once the stream ended
+    void finish();
+
+    // Logical to stored offsets, in logical order with adjacent runs merged
+    const std::vector<ArchiveExtent> &extents() const { return map; }
+    u64 stored_size() const { return stored; }
+    u64 duplicate_bytes() const { return duplicates; }
+    size_t unique_chunks() const { return seen.size(); }
+
+  private:
+    struct DigestHasher {
+        size_t operator()(const Sha256Digest &digest) const {
+            size_t value;
+            std::memcpy(&value, digest.data(), sizeof(value));
+            return value;
+        }
+    };
+
+    void scan(const u8 *data, size_t length);
+    void cut();
+    void add_extent(u64 offset, u64 stored_offset, u64 length);
+
+    std::vector<u64> starts;
+    size_t next_start{0};
+    u64 position{0}; // logical offset of pending's first byte
+    Store store;
+
+    std::vector<u8> pending;
+    u64 rolling{0};
+    std::unordered_map<Sha256Digest, u64, DigestHasher>
+        seen; // -> stored offset
+    std::vector<ArchiveExtent> map;
+    u64 stored{0};
+    u64 duplicates{0};
+};
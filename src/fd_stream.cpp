@@ -0,0 +1,112 @@
+#include "fd_stream.hpp"
+#include "metrics.hpp"
+#include <cerrno>
+
+#ifdef __unix__
+#include <unistd.h>
+#endif
+
+FdOutputBuffer::FdOutputBuffer(int fd, size_t size) : fd(fd), buffer(size) {
+    setp(buffer.data(), buffer.data() + buffer.size());
+}
+
+FdOutputBuffer::~FdOutputBuffer() { drain(); }
+
+FdOutputBuffer::int_type FdOutputBuffer::overflow(int_type ch) {
+    if (!drain()) {
+        return traits_type::eof();
+    }
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+    }
+    return traits_type::not_eof(ch);
+}
+
+std::streamsize FdOutputBuffer::xsputn(const char *s, std::streamsize n) {
+    const size_t length = static_cast<size_t>(n);
+    const size_t room = static_cast<size_t>(epptr() - pptr());
+    if (length <= room) {
+        traits_type::copy(pptr(), s, length);
+        pbump(static_cast<int>(length));
+        return n;
+    }
+
+    // Big writes, data blocks mostly, skip the buffer
+    if (!drain() || !write_all(s, length)) {
+        return 0;
+    }
+    return n;
+}
+
+int FdOutputBuffer::sync() { return drain() ? 0 : -1; }
+
+FdOutputBuffer::pos_type
+FdOutputBuffer::seekoff(off_type off, std::ios_base::seekdir dir,
+                        std::ios_base::openmode which) {
+    // Only telling where we are, nothing can be moved
+    if (off != 0 || dir != std::ios_base::cur ||
+        (which & std::ios_base::out) == 0) {
+        return pos_type(off_type(-1));
+    }
+    return pos_type(static_cast<off_type>(written) + (pptr() - pbase()));
+}
+
+bool FdOutputBuffer::drain() {
+    const size_t pending = static_cast<size_t>(pptr() - pbase());
+    setp(buffer.data(), buffer.data() + buffer.size());
+    return pending == 0 || write_all(buffer.data(), pending);
+}
+
+bool FdOutputBuffer::write_all(const char *s, size_t length) {
+    if (failure != 0) {
+        return false;
+    }
+#ifdef __unix__
+    while (length > 0) {
+        const ssize_t result = ::write(fd, s, length);
+        metrics::count(metrics::Counter::Syscalls);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            failure = errno;
+            return false;
+        }
+        s += result;
+        length -= static_cast<size_t>(result);
+        written += static_cast<u64>(result);
+    }
+    return true;
+#else
+    (void)s;
+    (void)length;
+    failure = ENOSYS;
+    return false;
+#endif
+}
+
+size_t read_full(int fd, u8 *out, size_t length) {
+    size_t got = 0;
+#ifdef __unix__
+    metrics::Scope timing(metrics::Timer::Read);
+    errno = 0;
+    while (got < length) {
+        const ssize_t result = ::read(fd, out + got, length - got);
+        metrics::count(metrics::Counter::Syscalls);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            break;
+        }
+        got += static_cast<size_t>(result);
+    }
+    metrics::count(metrics::Counter::BytesRead, got);
+#else
+    (void)fd;
+    (void)out;
+    (void)length;
+#endif
+    return got;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "kundli.hpp"
+#include <cstddef>
+#include <streambuf>
+#include <vector>
+
+// Archives written to pipes and sockets, see Archive::compress_stream
+// An output streambuf over a file descriptor that never seeks. tellp() still
+// works and returns how many bytes went through, which is all the writer
+// needs for the footer. Writes that fail stay failed, the stream goes bad.
+class FdOutputBuffer : public std::streambuf {
+  public:
+    static constexpr size_t DEFAULT_SIZE = 1024UL * 1024UL; // 1MB
+
+    explicit FdOutputBuffer(int fd, size_t size = DEFAULT_SIZE);
+    ~FdOutputBuffer() override;
+    FdOutputBuffer(const FdOutputBuffer &) = delete;
+    FdOutputBuffer &operator=(const FdOutputBuffer &) = delete;
+
+    // errno of the write that failed, 0 if none did
+    int error() const { return failure; }
+
+  protected:
+    int_type overflow(int_type ch) override;
+    std::streamsize xsputn(const char *s, std::streamsize n) override;
+    int sync() override;
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                     std::ios_base::openmode which) override;
+
+  private:
+    bool drain();
+    bool write_all(const char *s, size_t length);
+
+    int fd;
+    std::vector<char> buffer;
+    u64 written{0}; // bytes that made it to the descriptor
+    int failure{0};
+};
+
+// Reads until `length` bytes are in or the input ends, returns how many came
+// in. Fewer than asked for means the end or an error, errno is 0 at the end.
+size_t read_full(int fd, u8 *out, size_t length);
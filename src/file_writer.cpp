@@ -0,0 +1,523 @@
+#include "file_writer.hpp"
+#include "metrics.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#ifdef __unix__
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#ifdef KUNDLI_HAVE_IO_URING
+#include "io_ring.hpp"
+#endif
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// The plain path, also what the ring falls back to when a chain fails
+int write_file_sync(const std::string &path, const u8 *data, size_t size,
+                    u32 mode, std::span<const ArchiveHole> holes = {}) {
+    metrics::Scope timing(metrics::Timer::Write);
+#ifdef __unix__
+    // open, fchmod and close, the writes are counted as they go
+    metrics::count(metrics::Counter::Syscalls, 3);
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    static_cast<mode_t>(mode));
+    if (fd == -1) {
+        return errno;
+    }
+
+    int error = 0;
+    off_t position = 0;
+    size_t hole = 0;
+    while (size > 0) {
+        if (hole < holes.size() &&
+            static_cast<u64>(position) == holes[hole].offset) {
+            position += static_cast<off_t>(holes[hole].length);
+            ++hole;
+            continue;
+        }
+        // Up to the next hole
+        size_t run = size;
+        if (hole < holes.size()) {
+            run = static_cast<size_t>(std::min<u64>(
+                run, holes[hole].offset - static_cast<u64>(position)));
+        }
+        ssize_t written = ::pwrite(fd, data, run, position);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            error = written < 0 ? errno : EIO;
+            break;
+        }
+        metrics::count_io(metrics::Counter::BytesWritten,
+                          static_cast<u64>(written));
+        data += written;
+        size -= static_cast<size_t>(written);
+        position += written;
+    }
+    // Trailing holes only show up in the size
+    if (error == 0 && !holes.empty()) {
+        const ArchiveHole &last = holes.back();
+        const off_t end = std::max(
+            position, static_cast<off_t>(last.offset + last.length));
+        metrics::count(metrics::Counter::Syscalls);
+        if (::ftruncate(fd, end) != 0) {
+            error = errno;
+        }
+    }
+    // The creation mode only applies to new files and goes through the umask
+    if (error == 0 && ::fchmod(fd, static_cast<mode_t>(mode)) != 0) {
+        error = errno;
+    }
+    if (::close(fd) != 0 && error == 0) {
+        error = errno;
+    }
+    return error;
+#else
+    {
+        // Holes get written out as zeros here
+        std::ofstream out(fs::path(path), std::ios::binary);
+        const size_t total = size;
+        u64 position = 0;
+        const std::vector<char> zeros(64 * 1024);
+        auto fill = [&](u64 until) {
+            for (; position < until; position += zeros.size()) {
+                out.write(zeros.data(),
+                          static_cast<std::streamsize>(std::min<u64>(
+                              zeros.size(), until - position)));
+            }
+            position = until;
+        };
+        for (const auto &hole : holes) {
+            const u64 run = hole.offset - position;
+            out.write(reinterpret_cast<const char *>(data),
+                      static_cast<std::streamsize>(run));
+            data += run;
+            size -= static_cast<size_t>(run);
+            position = hole.offset;
+            fill(hole.offset + hole.length);
+        }
+        out.write(reinterpret_cast<const char *>(data),
+                  static_cast<std::streamsize>(size));
+        if (!out) {
+            return EIO;
+        }
+        metrics::count(metrics::Counter::BytesWritten, total);
+    }
+    std::error_code ec;
+    fs::permissions(path, static_cast<fs::perms>(mode), ec);
+    return ec.value();
+#endif
+}
+
+int copy_file_sync(const std::string &path, int source, u64 offset,
+                   size_t size, u32 mode) {
+#ifdef __unix__
+    metrics::Scope timing(metrics::Timer::Write);
+    metrics::count(metrics::Counter::Syscalls, 3);
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    static_cast<mode_t>(mode));
+    if (fd == -1) {
+        return errno;
+    }
+
+    int error = 0;
+    u64 copied = copy_range(source, offset, fd, 0, size);
+    // Whatever the kernel didn't take goes through a buffer
+    std::vector<u8> buffer;
+    while (copied < size && error == 0) {
+        buffer.resize(static_cast<size_t>(
+            std::min<u64>(size - copied, 1024UL * 1024UL)));
+        const ssize_t got =
+            ::pread(source, buffer.data(), buffer.size(),
+                    static_cast<off_t>(offset + copied));
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0 ||
+            ::pwrite(fd, buffer.data(), static_cast<size_t>(got),
+                     static_cast<off_t>(copied)) != got) {
+            error = got < 0 ? errno : EIO;
+            break;
+        }
+        metrics::count_io(metrics::Counter::BytesRead,
+                          static_cast<u64>(got));
+        metrics::count_io(metrics::Counter::BytesWritten,
+                          static_cast<u64>(got));
+        copied += static_cast<u64>(got);
+    }
+    if (error == 0 && ::fchmod(fd, static_cast<mode_t>(mode)) != 0) {
+        error = errno;
+    }
+    if (::close(fd) != 0 && error == 0) {
+        error = errno;
+    }
+    return error;
+#else
+    (void)path;
+    (void)source;
+    (void)offset;
+    (void)size;
+    (void)mode;
+    return ENOTSUP;
+#endif
+}
+
+int create_symlink_sync(const std::string &target, const std::string &path) {
+    metrics::Scope timing(metrics::Timer::Write);
+    metrics::count(metrics::Counter::Syscalls);
+    std::error_code ec;
+    fs::create_symlink(target, path, ec);
+    return ec.value();
+}
+
+} // namespace
+
+#ifdef KUNDLI_HAVE_IO_URING
+
+class FileWriter::Ring {
+  public:
+    // nullptr if the kernel doesn't have io_uring or the ops we need
+    static std::unique_ptr<Ring> create();
+    ~Ring();
+
+    void write_file(std::string_view path, const u8 *data, size_t size,
+                    u32 mode, Done done);
+    void create_symlink(std::string_view target, std::string_view path,
+                        Done done);
+    void flush();
+
+  private:
+    // A file in flight, it owns one slot of the registered file table too
+    struct Slot {
+        bool symlink{};
+        std::string path;
+        std::string target;
+        const u8 *data{};
+        size_t size{};
+        u32 mode{};
+        Done done;
+        s32 results[3]{};
+        unsigned pending{};
+    };
+
+    enum Op : u64 { Open, Write, Close };
+
+    static constexpr unsigned SLOTS = 64;
+    // Three requests per file, the ring never fills up
+    static constexpr unsigned ENTRIES = 256;
+
+    Ring() = default;
+    bool setup();
+
+    unsigned acquire_slot();
+    io_uring_sqe *next_sqe(unsigned slot, Op op);
+    void enter(unsigned min_complete);
+    void reap();
+    void finish(unsigned slot);
+
+    IoRing ring;
+    std::vector<Slot> slots;
+    std::vector<unsigned> free_slots;
+    u32 umask_bits{};
+};
+
+namespace {
+
+u32 process_umask() {
+    // Reading the umask means setting it, do that once
+    static const u32 bits = [] {
+        mode_t mask = ::umask(0);
+        ::umask(mask);
+        return static_cast<u32>(mask);
+    }();
+    return bits;
+}
+
+} // namespace
+
+std::unique_ptr<FileWriter::Ring> FileWriter::Ring::create() {
+    std::unique_ptr<Ring> ring(new Ring());
+    if (!ring->setup()) {
+        return nullptr;
+    }
+    return ring;
+}
+
+bool FileWriter::Ring::setup() {
+    // Direct opens and symlinkat both arrived in 5.15, close with a file
+    // index too
+    if (!ring.setup(ENTRIES) || !ring.supports(IORING_OP_SYMLINKAT)) {
+        return false;
+    }
+
+    // Sparse table, the opens fill the slots in
+    std::vector<int> fds(SLOTS, -1);
+    if (ring.register_resource(IORING_REGISTER_FILES, fds.data(), SLOTS) <
+        0) {
+        return false;
+    }
+
+    slots.resize(SLOTS);
+    for (unsigned i = SLOTS; i > 0; --i) {
+        free_slots.push_back(i - 1);
+    }
+    umask_bits = process_umask();
+    return true;
+}
+
+FileWriter::Ring::~Ring() {
+    if (!slots.empty()) {
+        flush();
+    }
+}
+
+unsigned FileWriter::Ring::acquire_slot() {
+    // Once every slot is taken, let half of them finish before queueing
+    // more so each enter still carries a decent batch
+    if (free_slots.empty()) {
+        while (free_slots.size() < SLOTS / 2) {
+            enter(1);
+            reap();
+        }
+    }
+    const unsigned slot = free_slots.back();
+    free_slots.pop_back();
+    return slot;
+}
+
+io_uring_sqe *FileWriter::Ring::next_sqe(unsigned slot, Op op) {
+    ++slots[slot].pending;
+    return ring.next_sqe((static_cast<u64>(slot) << 2) | op);
+}
+
+void FileWriter::Ring::enter(unsigned min_complete) {
+    metrics::Scope timing(metrics::Timer::Write);
+    metrics::count(metrics::Counter::Syscalls);
+    ring.enter(min_complete);
+}
+
+void FileWriter::Ring::reap() {
+    std::vector<unsigned> finished;
+    ring.reap([&](const io_uring_cqe &cqe) {
+        Slot &slot = slots[cqe.user_data >> 2];
+        slot.results[cqe.user_data & 3] = cqe.res;
+        if (--slot.pending == 0) {
+            finished.push_back(static_cast<unsigned>(cqe.user_data >> 2));
+        }
+    });
+
+    // Callbacks may queue more work, so they run once the ring is consistent
+    for (unsigned slot : finished) {
+        finish(slot);
+    }
+}
+
+void FileWriter::Ring::finish(unsigned index) {
+    Slot &slot = slots[index];
+    int error = 0;
+    if (slot.symlink) {
+        error = slot.results[Open] < 0 ? -slot.results[Open] : 0;
+    } else if (slot.results[Open] < 0 ||
+               slot.results[Write] != static_cast<s32>(slot.size) ||
+               slot.results[Close] < 0) {
+        // Existing files, short writes and anything else unusual go the plain
+        // way, which truncates and retries the whole file
+        error = write_file_sync(slot.path, slot.data, slot.size, slot.mode);
+    } else {
+        metrics::count(metrics::Counter::BytesWritten, slot.size);
+        if ((slot.mode & umask_bits) != 0) {
+            metrics::count(metrics::Counter::Syscalls);
+            if (::chmod(slot.path.c_str(), static_cast<mode_t>(slot.mode)) !=
+                0) {
+                error = errno;
+            }
+        }
+    }
+
+    Done done = std::move(slot.done);
+    slot.done = nullptr;
+    free_slots.push_back(index);
+    done(error);
+}
+
+void FileWriter::Ring::write_file(std::string_view path, const u8 *data,
+                                  size_t size, u32 mode, Done done) {
+    const unsigned index = acquire_slot();
+    Slot &slot = slots[index];
+    slot.symlink = false;
+    slot.path.assign(path);
+    slot.data = data;
+    slot.size = size;
+    slot.mode = mode;
+    slot.done = std::move(done);
+
+    // O_EXCL makes an existing file fail the chain instead of keeping its
+    // old mode, the fallback then deals with it
+    io_uring_sqe *open = next_sqe(index, Open);
+    open->opcode = IORING_OP_OPENAT;
+    open->fd = AT_FDCWD;
+    open->addr = reinterpret_cast<u64>(slot.path.c_str());
+    open->len = mode;
+    open->open_flags = O_WRONLY | O_CREAT | O_EXCL;
+    open->file_index = index + 1;
+    open->flags = IOSQE_IO_LINK;
+
+    io_uring_sqe *write = next_sqe(index, Write);
+    write->opcode = IORING_OP_WRITE;
+    write->fd = static_cast<s32>(index);
+    write->addr = reinterpret_cast<u64>(data);
+    write->len = static_cast<u32>(size);
+    write->off = 0;
+    write->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+
+    io_uring_sqe *close = next_sqe(index, Close);
+    close->opcode = IORING_OP_CLOSE;
+    close->file_index = index + 1;
+}
+
+void FileWriter::Ring::create_symlink(std::string_view target,
+                                      std::string_view path, Done done) {
+    const unsigned index = acquire_slot();
+    Slot &slot = slots[index];
+    slot.symlink = true;
+    slot.path.assign(path);
+    slot.target.assign(target);
+    slot.done = std::move(done);
+
+    io_uring_sqe *symlink = next_sqe(index, Open);
+    symlink->opcode = IORING_OP_SYMLINKAT;
+    symlink->fd = AT_FDCWD;
+    symlink->addr = reinterpret_cast<u64>(slot.target.c_str());
+    symlink->addr2 = reinterpret_cast<u64>(slot.path.c_str());
+}
+
+void FileWriter::Ring::flush() {
+    while (free_slots.size() < SLOTS) {
+        enter(1);
+        reap();
+    }
+}
+
+#else
+
+// Never instantiated, the writer always takes the plain path
+class FileWriter::Ring {
+  public:
+    static std::unique_ptr<Ring> create() { return nullptr; }
+
+    void write_file(std::string_view, const u8 *, size_t, u32, Done) {}
+    void create_symlink(std::string_view, std::string_view, Done) {}
+    void flush() {}
+};
+
+#endif
+
+namespace {
+// A write is a u32 on the ring, and big files are bandwidth bound anyway
+constexpr size_t MAX_BATCHED_SIZE = 1024 * 1024;
+} // namespace
+
+FileWriter::FileWriter() : ring(Ring::create()) {}
+
+FileWriter::~FileWriter() = default;
+
+void FileWriter::write_file(std::string_view path, const u8 *data,
+                            size_t size, u32 mode, Done done) {
+    if (ring != nullptr && size <= MAX_BATCHED_SIZE) {
+        ring->write_file(path, data, size, mode, std::move(done));
+        return;
+    }
+    done(write_file_sync(std::string(path), data, size, mode));
+}
+
+void FileWriter::write_sparse_file(std::string_view path, const u8 *data,
+                                   size_t size,
+                                   std::span<const ArchiveHole> holes,
+                                   u32 mode, Done done) {
+    done(write_file_sync(std::string(path), data, size, mode, holes));
+}
+
+void FileWriter::copy_file(std::string_view path, int source, u64 offset,
+                           size_t size, u32 mode, Done done) {
+    done(copy_file_sync(std::string(path), source, offset, size, mode));
+}
+
+void FileWriter::create_symlink(std::string_view target,
+                                std::string_view path, Done done) {
+    if (ring != nullptr) {
+        ring->create_symlink(target, path, std::move(done));
+        return;
+    }
+    done(create_symlink_sync(std::string(target), std::string(path)));
+}
+
+void FileWriter::flush() {
+    if (ring != nullptr) {
+        ring->flush();
+    }
+}
+
+u64 copy_range(int in, u64 in_offset, int out, u64 out_offset, u64 length) {
+    u64 copied = 0;
+#ifdef __linux__
+    loff_t from = static_cast<loff_t>(in_offset);
+    loff_t to = static_cast<loff_t>(out_offset);
+    while (copied < length) {
+        metrics::count(metrics::Counter::Syscalls);
+        const ssize_t moved =
+            ::copy_file_range(in, &from, out, &to,
+                              static_cast<size_t>(length - copied), 0);
+        if (moved < 0 && errno == EINTR) {
+            continue;
+        }
+        if (moved <= 0) {
+            break; // the input ended, or unsupported (EXDEV, EINVAL, ...)
+        }
+        metrics::count(metrics::Counter::BytesWritten,
+                       static_cast<u64>(moved));
+        copied += static_cast<u64>(moved);
+    }
+
+    // sendfile writes at the file position and takes files since 2.6.33
+    if (copied == 0 && length > 0 &&
+        ::lseek(out, static_cast<off_t>(out_offset), SEEK_SET) != -1) {
+        off_t position = static_cast<off_t>(in_offset);
+        while (copied < length) {
+            metrics::count(metrics::Counter::Syscalls);
+            const ssize_t moved = ::sendfile(
+                out, in, &position, static_cast<size_t>(length - copied));
+            if (moved < 0 && errno == EINTR) {
+                continue;
+            }
+            if (moved <= 0) {
+                break;
+            }
+            metrics::count(metrics::Counter::BytesWritten,
+                           static_cast<u64>(moved));
+            copied += static_cast<u64>(moved);
+        }
+    }
+#else
+    (void)in;
+    (void)in_offset;
+    (void)out;
+    (void)out_offset;
+    (void)length;
+#endif
+    return copied;
+}
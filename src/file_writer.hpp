@@ -0,0 +1,60 @@
+#pragma once
+
+#include "kundli.hpp"
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <span>
+#include <string_view>
+
+// Creates extracted files with as few syscalls as possible
+// With io_uring the open, write and close of each file are linked requests
+// and a whole batch of files goes to the kernel in one io_uring_enter. The
+// permissions ride along as the creation mode. Everywhere else it's open,
+// pwrite and fchmod. Completion callbacks run on the thread that owns the
+// writer, from inside one of its calls.
+class FileWriter {
+  public:
+    // errno of whatever failed, 0 on success
+    using Done = std::function<void(int error)>;
+
+    FileWriter();
+    ~FileWriter(); // Finishes everything still queued
+    FileWriter(const FileWriter &) = delete;
+    FileWriter &operator=(const FileWriter &) = delete;
+
+    // Creates or truncates `path` with `data` and the given permission bits.
+    // `data` has to stay valid until `done` runs, capturing its owner in
+    // `done` takes care of that.
+    void write_file(std::string_view path, const u8 *data, size_t size,
+                    u32 mode, Done done);
+    // Same for a sparse file, `data` is what it stores between the holes.
+    // Holes are skipped and the file is sized at the end, so they stay holes.
+    // Always written directly, `holes` only has to last for the call.
+    void write_sparse_file(std::string_view path, const u8 *data, size_t size,
+                           std::span<const ArchiveHole> holes, u32 mode,
+                           Done done);
+    // Creates `path` from `size` bytes of `source` at `offset` copied by the
+    // kernel, see copy_range. Always done directly, big files are what this
+    // is for.
+    void copy_file(std::string_view path, int source, u64 offset, size_t size,
+                   u32 mode, Done done);
+    void create_symlink(std::string_view target, std::string_view path,
+                        Done done);
+
+    // Waits until every queued file is finished
+    void flush();
+
+    bool batched() const { return ring != nullptr; }
+
+  private:
+    class Ring;
+    std::unique_ptr<Ring> ring;
+};
+
+// Copies `length` bytes between two files without them passing through user
+// space: copy_file_range, which shares the extents on filesystems with
+// reflinks, and sendfile if that's not supported. Returns how much got
+// copied, less if the input ended or the kernel can't do it, the caller
+// moves the rest itself. 0 everywhere but Linux.
+u64 copy_range(int in, u64 in_offset, int out, u64 out_offset, u64 length);
@@ -0,0 +1,122 @@
+#include "io_ring.hpp"
+
+#ifdef KUNDLI_HAVE_IO_URING
+#include <cerrno>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+int io_uring_setup(unsigned entries, io_uring_params *params) {
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                   unsigned flags) {
+    return static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit,
+                                      min_complete, flags, nullptr, 0));
+}
+
+void *map_ring(int fd, size_t size, off_t offset) {
+    void *ring = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, offset);
+    return ring == MAP_FAILED ? nullptr : ring;
+}
+
+} // namespace
+
+bool IoRing::setup(unsigned entries) {
+    io_uring_params params{};
+    ring_fd = io_uring_setup(entries, &params);
+    if (ring_fd < 0) {
+        return false;
+    }
+
+    std::vector<u8> probe_buffer(sizeof(io_uring_probe) +
+                                 256 * sizeof(io_uring_probe_op));
+    auto *probe = reinterpret_cast<io_uring_probe *>(probe_buffer.data());
+    if (register_resource(IORING_REGISTER_PROBE, probe, 256) < 0) {
+        return false;
+    }
+    for (unsigned op = 0; op <= probe->last_op && op < 256; ++op) {
+        supported[op] = (probe->ops[op].flags & IO_URING_OP_SUPPORTED) != 0;
+    }
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+    cq_ring_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+
+    sq_ring = map_ring(ring_fd, sq_ring_size, IORING_OFF_SQ_RING);
+    cq_ring = map_ring(ring_fd, cq_ring_size, IORING_OFF_CQ_RING);
+    sqes = static_cast<io_uring_sqe *>(
+        map_ring(ring_fd, sqes_size, IORING_OFF_SQES));
+    if (sq_ring == nullptr || cq_ring == nullptr || sqes == nullptr) {
+        return false;
+    }
+
+    auto *sq = static_cast<u8 *>(sq_ring);
+    auto *cq = static_cast<u8 *>(cq_ring);
+    sq_tail = reinterpret_cast<u32 *>(sq + params.sq_off.tail);
+    sq_mask = *reinterpret_cast<u32 *>(sq + params.sq_off.ring_mask);
+    cq_head = reinterpret_cast<u32 *>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<u32 *>(cq + params.cq_off.tail);
+    cq_mask = *reinterpret_cast<u32 *>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+    auto *array = reinterpret_cast<u32 *>(sq + params.sq_off.array);
+    for (u32 i = 0; i < params.sq_entries; ++i) {
+        array[i] = i;
+    }
+    return true;
+}
+
+IoRing::~IoRing() {
+    if (sqes != nullptr) {
+        ::munmap(sqes, sqes_size);
+    }
+    if (cq_ring != nullptr) {
+        ::munmap(cq_ring, cq_ring_size);
+    }
+    if (sq_ring != nullptr) {
+        ::munmap(sq_ring, sq_ring_size);
+    }
+    if (ring_fd >= 0) {
+        ::close(ring_fd); // also closes whatever is left in the file table
+    }
+}
+
+int IoRing::register_resource(unsigned opcode, const void *arg,
+                              unsigned count) const {
+    return static_cast<int>(
+        ::syscall(__NR_io_uring_register, ring_fd, opcode, arg, count));
+}
+
+io_uring_sqe *IoRing::next_sqe(u64 user_data) {
+    const u32 tail = *sq_tail;
+    io_uring_sqe *sqe = &sqes[tail & sq_mask];
+    *sqe = {};
+    sqe->user_data = user_data;
+    store_release(sq_tail, tail + 1);
+    ++pending;
+    return sqe;
+}
+
+bool IoRing::enter(unsigned min_complete) {
+    for (;;) {
+        const int result =
+            io_uring_enter(ring_fd, pending, min_complete,
+                           min_complete > 0 ? IORING_ENTER_GETEVENTS : 0);
+        if (result >= 0) {
+            pending -= static_cast<unsigned>(result);
+            return true;
+        }
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+}
+
+#endif
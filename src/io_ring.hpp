@@ -0,0 +1,76 @@
+#pragma once
+
+#include "kundli.hpp"
+
+#ifdef KUNDLI_HAVE_IO_URING
+#include <atomic>
+#include <bitset>
+#include <linux/io_uring.h>
+
+// A bare io_uring, set up with the raw syscalls so there's no liburing to
+// depend on. Entries are submitted in the order they're taken, so the
+// indirection array never has to change. One thread at a time, see
+// FileWriter and ReadRing for what goes on top.
+class IoRing {
+  public:
+    IoRing() = default;
+    ~IoRing();
+    IoRing(const IoRing &) = delete;
+    IoRing &operator=(const IoRing &) = delete;
+
+    // False if the kernel doesn't have io_uring or won't give us one
+    bool setup(unsigned entries);
+    // Whether the kernel knows the opcode, from the probe done by setup
+    bool supports(u8 op) const { return supported[op]; }
+    // io_uring_register, negative on failure
+    int register_resource(unsigned opcode, const void *arg,
+                          unsigned count) const;
+
+    // The next submission entry, zeroed, goes in with the next enter. The
+    // caller keeps count so the ring never fills up.
+    io_uring_sqe *next_sqe(u64 user_data);
+    unsigned unsubmitted() const { return pending; }
+
+    // Submits what's queued and waits for `min_complete` completions.
+    // Retries on EINTR, false on anything else.
+    bool enter(unsigned min_complete);
+
+    // Hands every completion that's in to `handle`, which mustn't queue
+    // anything, then releases them
+    template <class F> void reap(F &&handle) {
+        u32 head = *cq_head;
+        const u32 tail = load_acquire(cq_tail);
+        for (; head != tail; ++head) {
+            handle(cqes[head & cq_mask]);
+        }
+        store_release(cq_head, head);
+    }
+
+  private:
+    static u32 load_acquire(u32 *p) {
+        return std::atomic_ref<u32>(*p).load(std::memory_order_acquire);
+    }
+    static void store_release(u32 *p, u32 value) {
+        std::atomic_ref<u32>(*p).store(value, std::memory_order_release);
+    }
+
+    int ring_fd{-1};
+    void *sq_ring{};
+    size_t sq_ring_size{};
+    void *cq_ring{};
+    size_t cq_ring_size{};
+    io_uring_sqe *sqes{};
+    size_t sqes_size{};
+
+    u32 *sq_tail{};
+    u32 sq_mask{};
+    u32 *cq_head{};
+    u32 *cq_tail{};
+    u32 cq_mask{};
+    io_uring_cqe *cqes{};
+
+    unsigned pending{};
+    std::bitset<256> supported;
+};
+
+#endif
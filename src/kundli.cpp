@@ -1,24 +1,33 @@
 #include "kundli.hpp"
+#include "block_cache.hpp"
+#include "buffer_pool.hpp"
+#include "codec.hpp"
+#include "cpu.hpp"
+#include "crc32c.hpp"
+#include "dedup.hpp"
+#include "fd_stream.hpp"
+#include "file_writer.hpp"
+#include "metrics.hpp"
+#include "volume.hpp"
 #include <algorithm>
-#include <array>
 #include <atomic>
+#include <cerrno>
 #include <cstddef>
+#include <cstdio>
 #include <cstring>
 #include <ctime>
+#include <deque>
 #include <filesystem>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <mutex>
+#include <spanstream>
+#include <sstream>
+#include <system_error>
 #include <thread>
 #include <vector>
 
-// SIMD support
-#ifdef __x86_64__
-#include <cpuid.h>
-#include <immintrin.h>
-#endif
-
 // Memory mapping support
 #ifdef __unix__
 #include <fcntl.h>
@@ -30,112 +39,83 @@
 using namespace std;
 namespace fs = std::filesystem;
 
-constexpr std::array<u32, 256> create_crc32_table() {
-    std::array<u32, 256> table{};
-
-    for (u32 i = 0; i < 256; ++i) {
-        u32 crc = i;
-        for (int j = 0; j < 8; ++j) {
-            crc = (crc >> 1) ^ (0xEDB88320 & (-(crc & 1)));
+// File table record of archives up to version 9, the paths follow all
+// records
+struct FileRecord {
+    u64 offset{};
+    u64 size{};
+    u8 permissions[3]{};
+    ArchiveFile::FileType type{};
+    u64 path_length{};
+    u64 data_length{};
+    u32 crc32c{};
+} __attribute__((packed));
+
+// Streamed archives follow the header with this and a copy of the file
+// table, the logical data size tells a reader where the data ends
+struct StreamPrologue {
+    u64 data_length{}; // Decoded size of the data section
+    u64 table_size{};
+} __attribute__((packed));
+
+// Since version 10 the table is stored in columns, this starts it. The CRCs
+// and the modes of all files follow, then the packed columns.
+struct TableColumns {
+    u64 file_count{};
+    u64 pool_size{};   // Total length of all paths once they're put together
+    u64 packed_size{}; // Offsets, data lengths and paths, see write_file_table
+} __attribute__((packed));
+
+struct ModeRecord {
+    u8 permissions[3]{};
+    ArchiveFile::FileType type{};
+} __attribute__((packed));
+
+// Holes of sparse files, these follow the paths
+struct HoleRecord {
+    u64 file{}; // index into the records
+    u64 offset{};
+    u64 length{};
+} __attribute__((packed));
+
+// What incremental archives compare, one per record after the holes
+struct StatRecord {
+    s64 mtime{};
+    u64 inode{};
+} __attribute__((packed));
+
+// Calls `run(offset, stored, length)` for each run of data between the holes
+// that falls into [begin, end) of the file. `offset` is into the file,
+// `stored` into the data it stores.
+template <class Run>
+void for_each_data_run(span<const ArchiveHole> holes, u64 data_length,
+                       u64 begin, u64 end, Run run) {
+    u64 offset = 0;
+    u64 stored = 0;
+    auto clip = [&](u64 length) {
+        const u64 from = std::max(offset, begin);
+        const u64 to = std::min(offset + length, end);
+        if (from < to) {
+            run(from, stored + (from - offset), to - from);
         }
-        table[i] = crc;
-    }
-    return table;
-}
-constexpr std::array<u32, 256> crc32_table = create_crc32_table();
-
-u32 crc32(const u8 *data, size_t length) {
-    u32 crc = 0xFFFFFFFF;
-    for (size_t i = 0; i < length; ++i) {
-        crc = crc32_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
-    }
-
-    return ~crc;
-}
-
-#ifdef __SSE4_2__
-bool has_sse4_2() {
-    static bool checked = false;
-    static bool supported = false;
-
-    if (!checked) {
-        unsigned int eax, ebx, ecx, edx;
-        if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
-            supported = (ecx & bit_SSE4_2) != 0;
+        stored += length;
+    };
+    for (const auto &hole : holes) {
+        if (hole.offset >= end) {
+            break;
         }
-        checked = true;
-    }
-    return supported;
-}
-
-u32 crc32_simd(const u8 *data, size_t length) {
-    if (!has_sse4_2()) {
-        return crc32(data, length); // Fallback to table-based version
+        clip(hole.offset - offset);
+        offset = hole.offset + hole.length;
     }
-
-    u32 crc = 0xFFFFFFFF;
-    const u8 *end = data + length;
-
-    // Process 8-byte chunks using hardware CRC32
-    while (data + 8 <= end) {
-        crc = _mm_crc32_u64(crc, *reinterpret_cast<const u64 *>(data));
-        data += 8;
-    }
-
-    // Process 4-byte chunk if available
-    if (data + 4 <= end) {
-        crc = _mm_crc32_u32(crc, *reinterpret_cast<const u32 *>(data));
-        data += 4;
-    }
-
-    // Process remaining bytes
-    while (data < end) {
-        crc = _mm_crc32_u8(crc, *data);
-        data++;
-    }
-
-    return ~crc;
-}
-#endif
-
-void *fast_memcpy(void *dest, const void *src, size_t n) {
-#ifdef __x86_64__
-    if (n >= 32) {
-        // Use AVX for large copies if available
-        const char *s = static_cast<const char *>(src);
-        char *d = static_cast<char *>(dest);
-
-        // Align to 32-byte boundary
-        while (((uintptr_t)d & 31) && n > 0) {
-            *d++ = *s++;
-            n--;
-        }
-
-        // Copy 32-byte chunks with AVX
-        while (n >= 32) {
-            __m256i data =
-                _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s));
-            _mm256_store_si256(reinterpret_cast<__m256i *>(d), data);
-            s += 32;
-            d += 32;
-            n -= 32;
-        }
-
-        // Copy remaining bytes
-        while (n > 0) {
-            *d++ = *s++;
-            n--;
-        }
-
-        return dest;
+    if (stored < data_length) {
+        clip(data_length - stored);
     }
-#endif
-    return std::memcpy(dest, src, n);
 }
 
 Archive::MappedFile::~MappedFile() { unmap(); }
 
 bool Archive::MappedFile::map_file(const std::string &path) {
+    unmap();
 #ifdef __unix__
     fd = open(path.c_str(), O_RDONLY);
     if (fd == -1) {
@@ -160,10 +140,8 @@ bool Archive::MappedFile::map_file(const std::string &path) {
         return false;
     }
 
-    // We're gonna do sequential access,
-    // so advise the kernel to optimize for that
-    madvise(mapped_data, file_size, MADV_SEQUENTIAL);
-
+    // Readers advise the access pattern they're about to use, extraction
+    // walks it sequentially while single member reads jump around
     return true;
 #else
     // Memory mapping not supported on this platform ( Windows :/ )
@@ -171,6 +149,115 @@ bool Archive::MappedFile::map_file(const std::string &path) {
 #endif
 }
 
+bool Archive::MappedFile::map_volumes(const std::vector<std::string> &paths) {
+    unmap();
+#ifdef __unix__
+    vector<int> fds;
+    vector<u64> sizes;
+    auto close_all = [&fds] {
+        for (int volume_fd : fds) {
+            close(volume_fd);
+        }
+    };
+    for (const auto &path : paths) {
+        const int volume_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (volume_fd == -1) {
+            close_all();
+            return false;
+        }
+        fds.push_back(volume_fd);
+        if (fstat(volume_fd, &st) == -1) {
+            close_all();
+            return false;
+        }
+        sizes.push_back(static_cast<u64>(st.st_size));
+    }
+
+    // The last one can be short, anything else would leave a gap
+    const u64 page_size = static_cast<u64>(sysconf(_SC_PAGESIZE));
+    const u64 volume_size = sizes.empty() ? 0 : sizes.front();
+    bool aligned = !sizes.empty() &&
+                   (sizes.size() == 1 || volume_size % page_size == 0);
+    for (size_t i = 0; aligned && i + 1 < sizes.size(); ++i) {
+        aligned = sizes[i] == volume_size;
+    }
+    const u64 total =
+        aligned ? volume_size * (sizes.size() - 1) + sizes.back() : 0;
+    if (total == 0) {
+        close_all();
+        return false;
+    }
+
+    // Reserve the whole range, then put every volume in its place
+    void *base = mmap(nullptr, total, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    bool mapped = base != MAP_FAILED;
+    for (size_t i = 0; mapped && i < fds.size(); ++i) {
+        if (sizes[i] == 0) {
+            continue;
+        }
+        u8 *at = static_cast<u8 *>(base) + volume_size * i;
+        mapped = mmap(at, sizes[i], PROT_READ, MAP_PRIVATE | MAP_FIXED,
+                      fds[i], 0) != MAP_FAILED;
+    }
+    // The mappings hold on to the files
+    close_all();
+    if (!mapped) {
+        if (base != MAP_FAILED) {
+            munmap(base, total);
+        }
+        return false;
+    }
+    mapped_data = static_cast<u8 *>(base);
+    file_size = static_cast<size_t>(total);
+    return true;
+#else
+    (void)paths;
+    return false;
+#endif
+}
+
+void Archive::MappedFile::advise(Access access) const {
+    advise(0, file_size, access);
+}
+
+void Archive::MappedFile::advise(size_t offset, size_t length,
+                                 Access access) const {
+#ifdef __unix__
+    if (mapped_data == nullptr || offset >= file_size) {
+        return;
+    }
+    length = std::min(length, file_size - offset);
+
+    // madvise wants a page aligned start
+    const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const size_t aligned = offset - (offset % page_size);
+    length += offset - aligned;
+
+    int advice = MADV_NORMAL;
+    switch (access) {
+    case Access::Normal:
+        advice = MADV_NORMAL;
+        break;
+    case Access::Sequential:
+        advice = MADV_SEQUENTIAL;
+        break;
+    case Access::Random:
+        advice = MADV_RANDOM;
+        break;
+    case Access::WillNeed:
+        advice = MADV_WILLNEED;
+        break;
+    }
+    madvise(mapped_data + aligned, length, advice);
+#else
+    (void)offset;
+    (void)length;
+    (void)access;
+#endif
+}
+
 void Archive::MappedFile::unmap() {
 #ifdef __unix__
     if (mapped_data != nullptr) {
@@ -185,7 +272,6 @@ void Archive::MappedFile::unmap() {
     file_size = 0;
 }
 
-Archive::MemoryPool Archive::memory_pool;
 Archive::ThreadPool Archive::thread_pool;
 
 // Thread pool
@@ -197,23 +283,39 @@ Archive::ThreadPool Archive::thread_pool;
 Archive::ThreadPool::ThreadPool(size_t threads) : stop(false) {
     if (threads == 0)
         threads = std::thread::hardware_concurrency();
+    active = threads;
     for (size_t i = 0; i < threads; ++i) {
-        workers.emplace_back([this] {
-            for (;;) {
-                std::function<void()> task;
-                {
-                    std::unique_lock<std::mutex> lock(this->queue_mutex);
-                    this->condition.wait(lock, [this] {
-                        return this->stop || !this->tasks.empty();
-                    });
-                    if (this->stop && this->tasks.empty())
-                        return;
-                    task = std::move(this->tasks.front());
-                    this->tasks.pop();
-                }
-                task();
-            }
-        });
+        workers.emplace_back([this, i] { work(i); });
+    }
+    worker_count = threads;
+}
+
+u64 Archive::ThreadPool::queue_stamp() {
+    return metrics::on() ? metrics::now() : 0;
+}
+
+void Archive::ThreadPool::work(size_t worker) {
+    for (;;) {
+        Task task;
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            condition.wait(lock, [this, worker] {
+                return stop || worker >= active || !tasks.empty();
+            });
+            if (worker >= active || (stop && tasks.empty()))
+                return;
+            task = std::move(tasks.front());
+            tasks.pop();
+        }
+        if (task.queued_at == 0 || !metrics::on()) {
+            task.run();
+            continue;
+        }
+        const u64 started = metrics::now();
+        metrics::add(metrics::Timer::QueueWait, started - task.queued_at);
+        task.run();
+        metrics::add_busy(worker, metrics::now() - started);
+        metrics::add(metrics::Counter::Tasks, 1);
     }
 }
 
@@ -229,41 +331,28 @@ Archive::ThreadPool::~ThreadPool() {
 }
 
 void Archive::ThreadPool::resize(size_t new_size) {
-    if (new_size == workers.size())
+    std::lock_guard<std::mutex> resizing(resize_mutex);
+    const size_t old_size = workers.size();
+    if (new_size == old_size)
         return;
 
-    // Stop current workers
     {
         std::unique_lock<std::mutex> lock(queue_mutex);
-        stop = true;
-    }
-    condition.notify_all();
-    for (std::thread &worker : workers) {
-        worker.join();
+        active = new_size;
     }
-
-    // Clear and restart
-    workers.clear();
-    stop = false;
-
-    for (size_t i = 0; i < new_size; ++i) {
-        workers.emplace_back([this] {
-            for (;;) {
-                std::function<void()> task;
-                {
-                    std::unique_lock<std::mutex> lock(this->queue_mutex);
-                    this->condition.wait(lock, [this] {
-                        return this->stop || !this->tasks.empty();
-                    });
-                    if (this->stop && this->tasks.empty())
-                        return;
-                    task = std::move(this->tasks.front());
-                    this->tasks.pop();
-                }
-                task();
-            }
-        });
+    if (new_size < old_size) {
+        // Whoever is left keeps working through the queue meanwhile
+        condition.notify_all();
+        for (size_t i = new_size; i < old_size; ++i) {
+            workers[i].join();
+        }
+        workers.resize(new_size);
+    } else {
+        for (size_t i = old_size; i < new_size; ++i) {
+            workers.emplace_back([this, i] { work(i); });
+        }
     }
+    worker_count = new_size;
 }
 
 unique_ptr<Archive> Archive::create() {
@@ -279,232 +368,286 @@ unique_ptr<Archive> Archive::create() {
     return archive;
 }
 
-unique_ptr<Archive> Archive::load(const string &path) {
-    ifstream file(path, ios::binary);
-    if (!file) {
-        cerr << "Failed to open archive: " << path << '\n';
-        return nullptr;
+// Whole-archive CRCs are split over the pool and the pieces combined, the
+// result is the same as one pass
+u32 Archive::checksum_parallel(const u8 *data, size_t length) {
+    constexpr size_t MIN_CHUNK = 4UL * 1024UL * 1024UL; // 4MB
+
+    const size_t chunks =
+        std::min(thread_pool.size(), std::max<size_t>(length / MIN_CHUNK, 1));
+    if (chunks <= 1) {
+        return crc32c(data, length);
     }
 
-    auto archive = create();
-    archive->archive_file_path = path;
-    archive->lazy_loaded = true;
+    vector<future<u32>> futures;
+    futures.reserve(chunks);
+    for (size_t c = 0; c < chunks; ++c) {
+        const size_t begin = length * c / chunks;
+        const size_t end = length * (c + 1) / chunks;
+        futures.push_back(thread_pool.enqueue([data, begin, end]() {
+            return crc32c(data + begin, end - begin);
+        }));
+    }
 
-    file.read(reinterpret_cast<char *>(&archive->header),
-              sizeof(ArchiveHeader));
+    u32 crc = 0;
+    for (size_t c = 0; c < chunks; ++c) {
+        const size_t begin = length * c / chunks;
+        const size_t end = length * (c + 1) / chunks;
+        crc = crc32c_combine(crc, futures[c].get(), end - begin);
+    }
+    return crc;
+}
 
-    if (strncmp(reinterpret_cast<char *>(archive->header.magic), ARCHIVE_MAGIC,
-                4) != 0 ||
-        archive->header.version != ARCHIVE_VERSION) {
-        cerr << "Invalid archive format or version mismatch.\n";
+BufferPoolStats Archive::buffer_stats() { return buffer_pool_stats(); }
+
+const char *Archive::simd_level() { return cpu_simd_level(); }
+
+const char *Archive::checksum_kernel() { return crc32c_kernel(); }
+
+void Archive::set_stats_enabled(bool enabled) {
+    metrics::enabled.store(enabled, std::memory_order_relaxed);
+}
+
+ArchiveStats Archive::stats() { return metrics::snapshot(); }
+
+void Archive::reset_stats() { metrics::reset(); }
+
+// The archive file, or its volumes through the mapping
+unique_ptr<istream> Archive::open_archive(const string &path,
+                                          span<const string> directories,
+                                          u64 &archive_size) {
+    archive_file_path = path;
+    std::error_code ec;
+    if (directories.empty() && fs::is_regular_file(path, ec)) {
+        auto file = make_unique<ifstream>(path, ios::binary);
+        archive_size = fs::file_size(path, ec);
+        if (!*file || ec) {
+            cerr << "Failed to open archive: " << path << '\n';
+            return nullptr;
+        }
+        return file;
+    }
+
+    const vector<string> volumes = find_volumes(path, directories);
+    if (volumes.empty()) {
+        cerr << "Failed to open archive: " << path << '\n';
+        return nullptr;
+    }
+    if (!mapped_archive->map_volumes(volumes)) {
+        cerr << "Volumes of " << path << " are missing or don't line up\n";
         return nullptr;
     }
+    // Writing it again keeps the layout
+    const u64 first = fs::file_size(volumes.front(), ec);
+    volume_size = (first + MIN_VOLUME_SIZE - 1) / MIN_VOLUME_SIZE *
+                  MIN_VOLUME_SIZE;
+    volume_dirs.assign(directories.begin(), directories.end());
+    loaded_volumes = volumes.size();
+    archive_size = mapped_archive->size();
+    return reopen_archive();
+}
 
-    u64 file_count = 0;
-    file.read(reinterpret_cast<char *>(&file_count), sizeof(file_count));
+// Header, trailer and everything the trailer points to
+bool Archive::read_head(istream &in, u64 archive_size,
+                        const string &path) {
+    in.read(reinterpret_cast<char *>(&header), sizeof(ArchiveHeader));
 
-    archive->files.reserve(file_count);
-    for (u64 i = 0; i < file_count; ++i) {
-        ArchiveFile file_entry;
-        file.read(reinterpret_cast<char *>(&file_entry.offset),
-                  sizeof(file_entry.offset));
-        file.read(reinterpret_cast<char *>(&file_entry.size),
-                  sizeof(file_entry.size));
-        file.read(reinterpret_cast<char *>(file_entry.permissions), 3);
-        file.read(reinterpret_cast<char *>(&file_entry.type),
-                  sizeof(file_entry.type));
-        file.read(reinterpret_cast<char *>(&file_entry.path_length),
-                  sizeof(file_entry.path_length));
-        file.read(reinterpret_cast<char *>(&file_entry.data_length),
-                  sizeof(file_entry.data_length));
+    if (strncmp(reinterpret_cast<char *>(header.magic), ARCHIVE_MAGIC, 4) !=
+            0 ||
+        header.version < MIN_ARCHIVE_VERSION ||
+        header.version > ARCHIVE_VERSION) {
+        cerr << "Invalid archive format or version mismatch.\n";
+        return false;
+    }
+    dedup = is_deduplicated();
 
-        file_entry.path.resize(file_entry.path_length);
-        file.read(file_entry.path.data(), (long)file_entry.path_length);
+    if (!read_trailer(in, archive_size)) {
+        cerr << "Invalid file table in archive: " << path << '\n';
+        return false;
+    }
+    return true;
+}
 
-        archive->files.push_back(std::move(file_entry));
+unique_ptr<Archive> Archive::load(const string &path,
+                                  span<const string> volume_dirs) {
+    auto archive = create();
+    u64 archive_size = 0;
+    auto file = archive->open_archive(path, volume_dirs, archive_size);
+    if (file == nullptr) {
+        return nullptr;
+    }
+    archive->lazy_loaded = true;
+    if (!archive->read_head(*file, archive_size, path)) {
+        return nullptr;
     }
 
-    u64 data_size = 0;
-    file.read(reinterpret_cast<char *>(&data_size), sizeof(data_size));
-    archive->data_section_offset = file.tellg();
+    // Nothing is read yet, all of the data is still in the file
+    archive->base_size = archive->loaded_size;
+
+    // Big archives get mapped once and every read is served from the mapping,
+    // if that doesn't work out reads fall back to the file. Volumes are
+    // mapped already.
+    if (archive_size >= MMAP_THRESHOLD &&
+        !archive->mapped_archive->is_mapped()) {
+        archive->mapped_archive->map_file(path);
+    }
 
     return archive;
 }
 
-unique_ptr<Archive> Archive::load_full(const string &path) {
-    ifstream file(path, ios::binary);
-    if (!file) {
-        cerr << "Failed to open archive: " << path << '\n';
+unique_ptr<Archive> Archive::load_full(const string &path,
+                                       span<const string> volume_dirs) {
+    auto archive = create();
+    u64 archive_size = 0;
+    auto stream = archive->open_archive(path, volume_dirs, archive_size);
+    if (stream == nullptr) {
         return nullptr;
     }
-
-    auto archive = create();
+    istream &file = *stream;
     archive->lazy_loaded = false;
-
-    file.read(reinterpret_cast<char *>(&archive->header),
-              sizeof(ArchiveHeader));
-
-    if (strncmp(reinterpret_cast<char *>(archive->header.magic), ARCHIVE_MAGIC,
-                4) != 0 ||
-        archive->header.version != ARCHIVE_VERSION) {
-        cerr << "Invalid archive format or version mismatch.\n";
+    if (!archive->read_head(file, archive_size, path)) {
         return nullptr;
     }
 
-    u64 file_count = 0;
-    file.read(reinterpret_cast<char *>(&file_count), sizeof(file_count));
-
-    archive->files.reserve(file_count);
-    for (u64 i = 0; i < file_count; ++i) {
-        ArchiveFile file_entry;
-        file.read(reinterpret_cast<char *>(&file_entry.offset),
-                  sizeof(file_entry.offset));
-        file.read(reinterpret_cast<char *>(&file_entry.size),
-                  sizeof(file_entry.size));
-        file.read(reinterpret_cast<char *>(file_entry.permissions), 3);
-        file.read(reinterpret_cast<char *>(&file_entry.type),
-                  sizeof(file_entry.type));
-        file.read(reinterpret_cast<char *>(&file_entry.path_length),
-                  sizeof(file_entry.path_length));
-        file.read(reinterpret_cast<char *>(&file_entry.data_length),
-                  sizeof(file_entry.data_length));
-
-        file_entry.path.resize(file_entry.path_length);
-        file.read(file_entry.path.data(),
-                  static_cast<streamsize>(file_entry.path_length));
-
-        archive->files.push_back(std::move(file_entry));
-    }
-
-    u64 data_size = 0;
-    file.read(reinterpret_cast<char *>(&data_size), sizeof(data_size));
+    const u64 data_size = archive->stored_data_size;
     archive->data.resize(static_cast<size_t>(data_size));
-    file.read(reinterpret_cast<char *>(archive->data.data()),
-              static_cast<streamsize>(data_size));
+    {
+        metrics::Scope timing(metrics::Timer::Read);
+        file.seekg(static_cast<streamoff>(archive->data_section_offset));
+        file.read(reinterpret_cast<char *>(archive->data.data()),
+                  static_cast<streamsize>(data_size));
+        metrics::count_io(metrics::Counter::BytesRead, data_size);
+    }
+
+    if (archive->is_compressed()) {
+        vector<u8> decoded;
+        if (!file || !archive->decode_blocks(archive->data, decoded)) {
+            cerr << "Failed to decode archive data: " << path << '\n';
+            return nullptr;
+        }
+        archive->data = std::move(decoded);
+    }
 
     // Validate CRC32 for full loading
-#ifdef __x86_64__
-    u32 actual_crc = crc32_simd(archive->data.data(),
-                                static_cast<size_t>(archive->data.size()));
-#else
     u32 actual_crc =
-        crc32(archive->data.data(), static_cast<size_t>(archive->data.size()));
-#endif
+        checksum_parallel(archive->data.data(), archive->data.size());
     if (archive->header.crc32 != actual_crc) {
         cerr << "Archive CRC32 mismatch! The archive may be corrupted.\n";
         return nullptr;
     }
+    if (!archive->expand_extents(archive->data)) {
+        cerr << "Invalid extent map in archive: " << path << '\n';
+        return nullptr;
+    }
+    // Volumes were only mapped to be read
+    archive->mapped_archive->unmap();
     return archive;
 }
 
-Archive::~Archive() = default;
-
-ArchiveFile *Archive::add_file(const string &path) {
-    if (!fs::exists(path)) {
-        cerr << "File does not exist: " << path << '\n';
-        return nullptr;
+Archive::~Archive() {
+#ifdef __unix__
+    if (ring_source_fd >= 0) {
+        ::close(ring_source_fd);
     }
+#endif
+}
 
-    // Normalize the path
-    string normalized_path = normalize_path(path);
-
-    if (fs::is_directory(normalized_path)) {
-        return add_directory(normalized_path);
+bool Archive::set_codec(ArchiveCodec new_codec) {
+    if (find_codec(new_codec) == nullptr) {
+        return false;
     }
+    codec = new_codec;
+    return true;
+}
 
-    // Check if this file is already in the archive
-    // Todo!: implement a way to update files
-    // i can just add the offset difference to every file entry after it 💀
-    auto existing =
-        std::find_if(files.begin(), files.end(), [&](const ArchiveFile &f) {
-            return f.path == normalized_path &&
-                   f.type != ArchiveFile::FileType::Directory;
-        });
-
-    if (existing != files.end()) {
-        if (verbose) {
-            cerr << "File already exists in archive, skipping: "
-                 << normalized_path << '\n';
-        }
-        return &(*existing);
+bool Archive::set_codec(const string &name) {
+    const Codec *found = find_codec(name);
+    if (found == nullptr) {
+        return false;
     }
+    codec = found->id();
+    return true;
+}
 
-    // Ensure all parent directories are added to the archive
-    add_parent_directories(normalized_path);
-
-    ArchiveFile file_entry;
-    file_entry.path = normalized_path;
-    file_entry.path_length = normalized_path.size();
-    file_entry.offset = data.size();
-
-    auto perms = fs::status(normalized_path).permissions();
-    file_entry.permissions[0] =
-        static_cast<u8>((static_cast<u32>(perms) >> 6) & 0b111); // owner
-    file_entry.permissions[1] =
-        static_cast<u8>((static_cast<u32>(perms) >> 3) & 0b111); // group
-    file_entry.permissions[2] =
-        static_cast<u8>((static_cast<u32>(perms)) & 0b111); // others
+void Archive::set_volumes(u64 size, vector<string> directories) {
+    volume_size =
+        (size + MIN_VOLUME_SIZE - 1) / MIN_VOLUME_SIZE * MIN_VOLUME_SIZE;
+    volume_dirs = std::move(directories);
+}
 
-    if (fs::is_symlink(normalized_path)) {
-        // https://en.wikipedia.org/wiki/Symbolic_link
-        // symlink store the link target as data
-        // i thought they would be something on the filesystem but ok?
-        file_entry.type = ArchiveFile::FileType::Symlink;
-        string target = fs::read_symlink(normalized_path).string();
-        file_entry.data_length = target.size();
-        file_entry.size = file_entry.data_length + file_entry.path_length;
+namespace {
 
-        data.insert(data.end(), target.begin(), target.end());
-    } else {
-        file_entry.type = ArchiveFile::FileType::Regular;
-        file_entry.data_length = fs::file_size(normalized_path);
-        file_entry.size = file_entry.data_length + file_entry.path_length;
+// Where a sparse file has holes, nothing for files that have all their
+// blocks (most of them, that costs one stat) or filesystems that can't tell
+void find_holes(const string &path, u64 size, vector<ArchiveHole> &holes) {
+#if defined(__unix__) && defined(SEEK_HOLE)
+    struct stat info;
+    metrics::count(metrics::Counter::Syscalls);
+    if (::stat(path.c_str(), &info) != 0 ||
+        static_cast<u64>(info.st_blocks) * 512 >= size) {
+        return;
+    }
 
-        ifstream file(normalized_path, ios::binary);
-        if (!file) {
-            cerr << "Failed to open: " << normalized_path << '\n';
-            return nullptr;
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    metrics::count(metrics::Counter::Syscalls, 2); // open, close
+    if (fd == -1) {
+        return;
+    }
+    const off_t end = static_cast<off_t>(size);
+    off_t data = 0;
+    while (data < end) {
+        const off_t hole = ::lseek(fd, data, SEEK_HOLE);
+        if (hole < 0 || hole >= end) {
+            break;
         }
+        // No more data means the hole runs to the end
+        off_t next = ::lseek(fd, hole, SEEK_DATA);
+        if (next < 0 || next > end) {
+            next = end;
+        }
+        metrics::count(metrics::Counter::Syscalls, 2);
+        holes.push_back(
+            {static_cast<u64>(hole), static_cast<u64>(next - hole)});
+        data = next;
+    }
+    ::close(fd);
+#else
+    (void)path;
+    (void)size;
+    (void)holes;
+#endif
+}
 
-        // Buffer read files in chunks to avoid larger allocations
-        // Note: i should make the size a build option
-        constexpr size_t BUFFER_SIZE = 1024UL * 1024UL;
-        const size_t file_size = file_entry.data_length;
-
-        // Reserve space for the data section
-        // "Might as well use an Arena" - 🤓
-        data.reserve(data.size() + file_size);
+} // namespace
 
-        if (file_size <= BUFFER_SIZE) {
-            // smaller files, just read in one go
-            vector<u8> buffer(file_size);
-            file.read(reinterpret_cast<char *>(buffer.data()),
-                      static_cast<streamsize>(file_size));
-            data.insert(data.end(), buffer.begin(), buffer.end());
-        } else {
+// Adding files
+// Input paths are scanned first (stat, symlink target, directory listing and
+// for buffered archives the contents) and added afterwards. The scan is where
+// all the filesystem latency is, so add_file_parallel runs it on the thread
+// pool one directory level at a time, while adding stays serial and in listing
+// order. Offsets come out exactly as they would from add_file.
 
-            vector<u8> buffer(BUFFER_SIZE);
-            size_t remaining = file_size;
+ArchiveFile *Archive::add_file(const string &path) {
+    ScannedPath scanned;
+    scanned.path = path;
+    scan_tree(scanned, 1);
+    return add_scanned(scanned);
+}
 
-            while (remaining > 0) {
-                size_t to_read = std::min(remaining, BUFFER_SIZE);
-                file.read(reinterpret_cast<char *>(buffer.data()),
-                          static_cast<streamsize>(to_read));
-
-                auto bytes_read = file.gcount();
-                if (bytes_read > 0) {
-                    data.insert(data.end(), buffer.begin(),
-                                buffer.begin() + bytes_read);
-                    remaining -= static_cast<size_t>(bytes_read);
-                } else {
-                    break;
-                }
-            }
-        }
+ArchiveFile *Archive::add_file_parallel(const string &path,
+                                        size_t num_threads) {
+    if (num_threads == 0) {
+        num_threads = thread_count > 0 ? thread_count
+                                       : std::thread::hardware_concurrency();
+    }
+    if (num_threads > 1 && thread_pool.size() != num_threads) {
+        thread_pool.resize(num_threads);
     }
 
-    files.push_back(std::move(file_entry));
-    return &files.back();
+    ScannedPath scanned;
+    scanned.path = path;
+    scan_tree(scanned, num_threads);
+    return add_scanned(scanned);
 }
 
 ArchiveFile *Archive::add_directory(const string &path) {
@@ -518,62 +661,324 @@ ArchiveFile *Archive::add_directory(const string &path) {
         return nullptr;
     }
 
-    string normalized_path = normalize_path(path);
-    add_parent_directories(normalized_path);
-
-    auto existing =
-        std::find_if(files.begin(), files.end(), [&](const ArchiveFile &f) {
-            return f.path == normalized_path &&
-                   f.type == ArchiveFile::FileType::Directory;
-        });
+    ScannedPath scanned;
+    scanned.path = path;
+    scan_tree(scanned, 1);
+    if (!scanned.is_directory) {
+        cerr << "Path is not a directory: " << path << '\n';
+        return nullptr;
+    }
+    return add_scanned_directory(scanned);
+}
 
-    if (existing != files.end()) {
-        if (verbose) {
-            cerr << "Directory already exists in archive, skipping: "
-                 << normalized_path << '\n';
-        }
-        return &(*existing);
+void Archive::scan_path(ScannedPath &scanned, bool read_contents,
+                        const Archive *previous) {
+    metrics::Scope timing(metrics::Timer::Scan);
+    metrics::count(metrics::Counter::Syscalls, 3); // stat, lstat, lstat
+    std::error_code ec;
+    scanned.exists = fs::exists(scanned.path, ec);
+    if (!scanned.exists) {
+        return;
     }
+    scanned.path = normalize_path(scanned.path);
 
-    // create directory first
-    // Archive blows up if its not there :/
-    ArchiveFile dir_entry;
-    dir_entry.path = normalized_path;
-    dir_entry.path_length = normalized_path.size();
-    dir_entry.type = ArchiveFile::FileType::Directory;
-    dir_entry.data_length = 0;
-    dir_entry.offset = data.size();
-    dir_entry.size = dir_entry.path_length;
+#ifdef __unix__
+    struct stat info {};
+    if (::lstat(scanned.path.c_str(), &info) == 0) {
+        scanned.mtime = static_cast<s64>(info.st_mtim.tv_sec) * 1000000000 +
+                        info.st_mtim.tv_nsec;
+        scanned.inode = static_cast<u64>(info.st_ino);
+    }
+#endif
 
-    auto perms = fs::status(normalized_path).permissions();
-    dir_entry.permissions[0] =
+    auto status = fs::status(scanned.path, ec);
+    auto perms = status.permissions();
+    scanned.permissions[0] =
         static_cast<u8>((static_cast<u32>(perms) >> 6) & 0b111); // owner
-    dir_entry.permissions[1] =
+    scanned.permissions[1] =
         static_cast<u8>((static_cast<u32>(perms) >> 3) & 0b111); // group
-    dir_entry.permissions[2] =
+    scanned.permissions[2] =
         static_cast<u8>((static_cast<u32>(perms)) & 0b111); // others
 
-    files.push_back(std::move(dir_entry));
-    ArchiveFile *result = &files.back();
+    scanned.is_directory = fs::is_directory(status);
+    if (scanned.is_directory) {
+        return;
+    }
 
-    // Recursively add children
-    // "put them in the juvenile detention center" - 🤓
-    try {
-        for (const auto &entry : fs::directory_iterator(normalized_path)) {
-            const string entry_path = entry.path().string();
+    if (fs::is_symlink(scanned.path, ec)) {
+        // https://en.wikipedia.org/wiki/Symbolic_link
+        // symlink store the link target as data
+        // i thought they would be something on the filesystem but ok?
+        scanned.type = ArchiveFile::FileType::Symlink;
+        scanned.target = fs::read_symlink(scanned.path, ec).string();
+        scanned.data_length = scanned.target.size();
+        return;
+    }
 
-            if (entry.is_directory()) {
-                add_directory(entry_path);
-            } else {
-                add_file(entry_path);
-            }
+    scanned.type = ArchiveFile::FileType::Regular;
+    const uintmax_t file_size = fs::file_size(scanned.path, ec);
+    const u64 size = ec ? 0 : file_size;
+
+    // Looks like the file the previous archive has, its data gets copied
+    // from there instead of read again. The size, mtime and inode are what
+    // make and rsync go by too.
+    const ArchiveFile *before =
+        previous != nullptr ? previous->find_file(scanned.path) : nullptr;
+    if (before != nullptr && before->type == ArchiveFile::FileType::Regular &&
+        previous->file_size(*before) == size && scanned.mtime != 0 &&
+        before->mtime == scanned.mtime && before->inode == scanned.inode) {
+        scanned.holes.assign(
+            previous->holes.begin() + before->first_hole,
+            previous->holes.begin() + before->first_hole + before->hole_count);
+        scanned.data_length = before->data_length;
+        if (!read_contents) {
+            scanned.unchanged = before;
+            return;
         }
-    } catch (const fs::filesystem_error &e) {
-        cerr << "Error reading directory " << normalized_path << ": "
-             << e.what() << '\n';
+        scanned.contents.reserve(static_cast<size_t>(before->data_length));
+        unique_ptr<MemberReader> reader;
+        previous->stream_member(
+            *before,
+            [&](const u8 *chunk, size_t length) {
+                scanned.contents.insert(scanned.contents.end(), chunk,
+                                        chunk + length);
+            },
+            reader);
+        if (scanned.contents.size() == before->data_length) {
+            scanned.unchanged = before;
+            return;
+        }
+        cerr << "Reading again, previous archive's copy is damaged: "
+             << scanned.path << '\n';
+        scanned.holes.clear();
+        scanned.contents.clear();
     }
 
-    return result;
+    // Holes aren't stored, or read
+    find_holes(scanned.path, size, scanned.holes);
+    scanned.data_length = size;
+    for (const auto &hole : scanned.holes) {
+        scanned.data_length -= hole.length;
+    }
+
+    ifstream file(scanned.path, ios::binary);
+    if (!file) {
+        scanned.readable = false;
+        return;
+    }
+
+    if (read_contents) {
+        // The table says data_length bytes, so a file that shrank since the
+        // stat gets padded with zeros rather than shifting everything after it
+        scanned.contents.resize(static_cast<size_t>(scanned.data_length));
+        for_each_data_run(
+            scanned.holes, scanned.data_length, 0, size,
+            [&](u64 offset, u64 stored, u64 length) {
+                if (!scanned.holes.empty()) {
+                    file.clear();
+                    file.seekg(static_cast<streamoff>(offset));
+                }
+                file.read(
+                    reinterpret_cast<char *>(scanned.contents.data() + stored),
+                    static_cast<streamsize>(length));
+                metrics::count_io(metrics::Counter::BytesRead,
+                                  static_cast<u64>(file.gcount()), 2);
+            });
+    }
+}
+
+void Archive::scan_children(ScannedPath &directory) {
+    metrics::Scope timing(metrics::Timer::Scan);
+    std::error_code ec;
+    for (fs::directory_iterator it(directory.path, ec), end;
+         !ec && it != end; it.increment(ec)) {
+        ScannedPath child;
+        child.path = it->path().string();
+        directory.children.push_back(std::move(child));
+    }
+    metrics::count(metrics::Counter::Syscalls, 3); // open, getdents, close
+    if (ec) {
+        directory.list_error = ec.message();
+    }
+}
+
+void Archive::scan_tree(ScannedPath &root, size_t num_threads) const {
+    // Buffered archives keep the data in memory anyway, so it's read during
+    // the scan. Streamed data is read while writing.
+    const bool read_contents = !streaming && stream_sources.empty();
+
+    // Runs `scan` over every item, a few chunks per worker so one slow
+    // directory doesn't hold up a whole share of the level
+    auto for_each = [&](vector<ScannedPath *> &items, auto scan) {
+        if (num_threads <= 1 || items.size() <= 1) {
+            for (ScannedPath *item : items) {
+                scan(*item);
+            }
+            return;
+        }
+
+        const size_t chunks = std::min(items.size(), num_threads * 4);
+        vector<future<void>> futures;
+        futures.reserve(chunks);
+        for (size_t c = 0; c < chunks; ++c) {
+            futures.push_back(thread_pool.enqueue([&items, &scan, c, chunks]() {
+                const size_t begin = items.size() * c / chunks;
+                const size_t end = items.size() * (c + 1) / chunks;
+                for (size_t i = begin; i < end; ++i) {
+                    scan(*items[i]);
+                }
+            }));
+        }
+        for (auto &future : futures) {
+            future.wait();
+        }
+    };
+
+    scan_path(root, read_contents, previous.get());
+
+    vector<ScannedPath *> level;
+    if (root.exists && root.is_directory) {
+        level.push_back(&root);
+    }
+
+    while (!level.empty()) {
+        for_each(level,
+                 [](ScannedPath &directory) { scan_children(directory); });
+
+        // Children don't move anymore, the pointers stay valid
+        vector<ScannedPath *> children;
+        for (ScannedPath *directory : level) {
+            for (auto &child : directory->children) {
+                children.push_back(&child);
+            }
+        }
+        for_each(children, [this, read_contents](ScannedPath &child) {
+            scan_path(child, read_contents, previous.get());
+        });
+
+        level.clear();
+        for (ScannedPath *child : children) {
+            if (child->exists && child->is_directory) {
+                level.push_back(child);
+            }
+        }
+    }
+}
+
+ArchiveFile *Archive::add_scanned(ScannedPath &scanned) {
+    if (!scanned.exists) {
+        cerr << "File does not exist: " << scanned.path << '\n';
+        return nullptr;
+    }
+
+    if (scanned.is_directory) {
+        return add_scanned_directory(scanned);
+    }
+
+    // A file that's already in the archive is updated: the new contents go
+    // to the end like any other file's and the entry moves there. The old
+    // bytes are left behind unreferenced, so nothing else has to shift and
+    // append() only writes the new data.
+    ArchiveFile *existing = find_file(scanned.path);
+    const bool update = existing != nullptr &&
+                        existing->type != ArchiveFile::FileType::Directory;
+
+    // Ensure all parent directories are added to the archive
+    if (!update) {
+        add_parent_directories(scanned.path);
+    }
+
+    if (!scanned.readable) {
+        cerr << "Failed to open: " << scanned.path << '\n';
+        return nullptr;
+    }
+
+    ArchiveFile file_entry;
+    file_entry.path = update ? existing->path : path_pool.add(scanned.path);
+    file_entry.offset = data_end();
+    std::memcpy(file_entry.permissions, scanned.permissions, 3);
+    file_entry.type = scanned.type;
+    file_entry.data_length = scanned.data_length;
+    file_entry.mtime = scanned.mtime;
+    file_entry.inode = scanned.inode;
+    if (!scanned.holes.empty()) {
+        file_entry.first_hole = static_cast<u32>(holes.size());
+        file_entry.hole_count = static_cast<u32>(scanned.holes.size());
+        holes.insert(holes.end(), scanned.holes.begin(), scanned.holes.end());
+    }
+
+    // Streamed data has to stay behind everything already buffered, so
+    // once something was streamed the rest follows
+    if (streaming || !stream_sources.empty()) {
+        StreamSource source;
+        source.length = file_entry.data_length;
+        if (scanned.type == ArchiveFile::FileType::Symlink) {
+            source.target = std::move(scanned.target);
+        } else {
+            source.path = scanned.path;
+            source.first_hole = file_entry.first_hole;
+            source.hole_count = file_entry.hole_count;
+            source.unchanged = scanned.unchanged;
+        }
+        stream_sources.push_back(std::move(source));
+        stream_size += file_entry.data_length;
+    } else if (scanned.type == ArchiveFile::FileType::Symlink) {
+        data.insert(data.end(), scanned.target.begin(), scanned.target.end());
+    } else {
+        data.insert(data.end(), scanned.contents.begin(),
+                    scanned.contents.end());
+        vector<u8>().swap(scanned.contents);
+    }
+
+    if (verbose && scanned.unchanged != nullptr) {
+        cout << "Unchanged since previous archive: " << scanned.path << '\n';
+    }
+    if (update) {
+        if (verbose) {
+            cout << "Updating file in archive: " << scanned.path << '\n';
+        }
+        *existing = file_entry;
+        return existing;
+    }
+    return push_file(std::move(file_entry));
+}
+
+ArchiveFile *Archive::add_scanned_directory(ScannedPath &scanned) {
+    add_parent_directories(scanned.path);
+
+    ArchiveFile *existing = find_file(scanned.path);
+    if (existing != nullptr &&
+        existing->type == ArchiveFile::FileType::Directory) {
+        if (verbose) {
+            cerr << "Directory already exists in archive, skipping: "
+                 << scanned.path << '\n';
+        }
+        return existing;
+    }
+
+    // create directory first
+    // Archive blows up if its not there :/
+    ArchiveFile dir_entry;
+    dir_entry.path = path_pool.add(scanned.path);
+    dir_entry.type = ArchiveFile::FileType::Directory;
+    dir_entry.data_length = 0;
+    dir_entry.offset = data_end();
+    std::memcpy(dir_entry.permissions, scanned.permissions, 3);
+
+    push_file(std::move(dir_entry));
+
+    // Recursively add children
+    // "put them in the juvenile detention center" - 🤓
+    for (auto &child : scanned.children) {
+        add_scanned(child);
+    }
+    if (!scanned.list_error.empty()) {
+        cerr << "Error reading directory " << scanned.path << ": "
+             << scanned.list_error << '\n';
+    }
+
+    // Adding the children may have moved the table
+    return find_file(scanned.path);
 }
 
 void Archive::add_parent_directories(const string &path) {
@@ -595,23 +1000,18 @@ void Archive::add_parent_directories(const string &path) {
         const string &parent_dir = *it;
 
         // Check if this directory is already in the archive
-        auto existing =
-            std::find_if(files.begin(), files.end(), [&](const ArchiveFile &f) {
-                return f.path == parent_dir &&
-                       f.type == ArchiveFile::FileType::Directory;
-            });
+        const ArchiveFile *existing = find_file(parent_dir);
 
         // If not found
-        if (existing == files.end()) {
+        if (existing == nullptr ||
+            existing->type != ArchiveFile::FileType::Directory) {
             if (fs::exists(parent_dir) && fs::is_directory(parent_dir)) {
                 // Add directory entry without recursively adding its contents
                 ArchiveFile dir_entry;
-                dir_entry.path = parent_dir;
-                dir_entry.path_length = parent_dir.size();
+                dir_entry.path = path_pool.add(parent_dir);
                 dir_entry.type = ArchiveFile::FileType::Directory;
                 dir_entry.data_length = 0;
-                dir_entry.offset = data.size();
-                dir_entry.size = dir_entry.path_length;
+                dir_entry.offset = data_end();
 
                 auto perms = fs::status(parent_dir).permissions();
                 dir_entry.permissions[0] = static_cast<u8>(
@@ -621,7 +1021,7 @@ void Archive::add_parent_directories(const string &path) {
                 dir_entry.permissions[2] = static_cast<u8>(
                     (static_cast<u32>(perms)) & 0b111); // others
 
-                files.push_back(std::move(dir_entry));
+                push_file(std::move(dir_entry));
             }
         }
     }
@@ -640,525 +1040,3891 @@ string Archive::normalize_path(const string &path) {
 }
 
 void Archive::remove_file(const string &path) {
-    auto it =
-        std::find_if(files.begin(), files.end(),
-                     [&](const ArchiveFile &f) { return f.path == path; });
-    if (it != files.end()) {
-        files.erase(it);
-    } else {
+    auto it = path_index.find(path);
+    if (it == path_index.end()) {
         cerr << "File not found: " << path << '\n';
+        return;
     }
-}
 
-void Archive::compress(const string &output_path) const {
-    ArchiveHeader header_copy = header;
-#ifdef __x86_64__
-    header_copy.crc32 = crc32_simd(data.data(), data.size());
-#else
-    header_copy.crc32 = crc32(data.data(), data.size());
-#endif
+    // Only the lookup goes now, the entry stays in the table until the next
+    // call that walks it
+    removed_files.push_back(it->second);
+    path_index.erase(it);
+}
 
-    ofstream out(output_path, ios::binary);
-    if (!out) {
-        cerr << "Failed to open output: " << output_path << '\n';
+// Drops the removed entries in one pass. The table keeps its order,
+// extraction relies on parents coming first, and the index only has its
+// positions shifted, no paths are hashed again.
+void Archive::compact_files() const {
+    if (removed_files.empty()) {
         return;
     }
+    vector<bool> removed(files.size(), false);
+    for (const size_t index : removed_files) {
+        removed[index] = true;
+    }
+    removed_files.clear();
+
+    vector<size_t> moved_to(files.size());
+    size_t kept = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+        moved_to[i] = kept;
+        if (!removed[i]) {
+            files[kept++] = files[i];
+        }
+    }
+    files.resize(kept);
+    for (auto &entry : path_index) {
+        entry.second = moved_to[entry.second];
+    }
+}
 
-    out.write(reinterpret_cast<const char *>(&header_copy),
-              sizeof(header_copy));
-    u64 file_count = files.size();
-    out.write(reinterpret_cast<const char *>(&file_count), sizeof(file_count));
+// Path index
+// Keeps lookups by path O(1) instead of scanning the file table, adding N
+// files used to be quadratic because of the duplicate check alone.
 
-    for (const auto &file_entry : files) {
-        out.write(reinterpret_cast<const char *>(&file_entry.offset),
-                  sizeof(file_entry.offset));
-        out.write(reinterpret_cast<const char *>(&file_entry.size),
-                  sizeof(file_entry.size));
-        out.write(reinterpret_cast<const char *>(file_entry.permissions), 3);
-        out.write(reinterpret_cast<const char *>(&file_entry.type),
-                  sizeof(file_entry.type));
-        out.write(reinterpret_cast<const char *>(&file_entry.path_length),
-                  sizeof(file_entry.path_length));
-        out.write(reinterpret_cast<const char *>(&file_entry.data_length),
-                  sizeof(file_entry.data_length));
-        out.write(file_entry.path.c_str(), (long)file_entry.path_length);
+ArchiveFile *Archive::push_file(ArchiveFile entry) {
+    path_index.emplace(entry.path, files.size());
+    files.push_back(std::move(entry));
+    return &files.back();
+}
+
+void Archive::rebuild_path_index() {
+    path_index.clear();
+    path_index.reserve(files.size());
+    for (size_t i = 0; i < files.size(); ++i) {
+        // First entry wins, same as the linear search it replaces
+        path_index.emplace(files[i].path, i);
     }
+}
 
-    u64 data_size = data.size();
-    out.write(reinterpret_cast<const char *>(&data_size), sizeof(data_size));
-    out.write(reinterpret_cast<const char *>(data.data()), (long)data_size);
+ArchiveFile *Archive::find_file(const string &path) {
+    auto it = path_index.find(path);
+    return it != path_index.end() ? &files[it->second] : nullptr;
 }
 
-void Archive::compress_parallel(const string &output_path,
-                                size_t num_threads) const {
-    // Determine optimal thread count
-    if (num_threads == 0) {
-        num_threads = thread_count > 0 ? thread_count
-                                       : std::thread::hardware_concurrency();
+const ArchiveFile *Archive::find_file(const string &path) const {
+    auto it = path_index.find(path);
+    return it != path_index.end() ? &files[it->second] : nullptr;
+}
+
+string_view Archive::PathPool::add(string_view path) {
+    if (path.size() > remaining) {
+        // Start a new chunk, whatever is left of the old one is wasted
+        const size_t chunk_size = std::max(CHUNK_SIZE, path.size());
+        chunks.push_back(make_unique<char[]>(chunk_size));
+        cursor = chunks.back().get();
+        remaining = chunk_size;
     }
 
-    num_threads = std::min(num_threads, files.size());
+    std::memcpy(cursor, path.data(), path.size());
+    string_view stored(cursor, path.size());
+    cursor += path.size();
+    remaining -= path.size();
+    return stored;
+}
+
+void Archive::PathPool::adopt(unique_ptr<char[]> chunk) {
+    // Goes behind the active chunk, which keeps handing out space
+    chunks.push_back(std::move(chunk));
+}
+
+// Block compression
+// The data section is cut into block_size pieces that are encoded on their own,
+// so they can be encoded and decoded in parallel and a lazy read only has to
+// decode the blocks overlapping the requested range.
+
+bool Archive::decode_block(const ArchiveBlock &block, const u8 *stored,
+                           u8 *out) const {
+    const Codec *block_codec = find_codec(block.codec);
+    if (block_codec == nullptr) {
+        cerr << "Archive block uses a codec not available in this build ("
+             << static_cast<int>(block.codec) << ")\n";
+        return false;
+    }
+    bool decoded = false;
+    {
+        metrics::Scope timing(metrics::Timer::Decode);
+        decoded = block_codec->decompress(stored, block.stored_size, out,
+                                          block.raw_size);
+    }
+    if (!decoded) {
+        return false;
+    }
+    if (crc32c(out, block.raw_size) != block.crc32c) {
+        cerr << "Block CRC32C mismatch! The archive may be corrupted.\n";
+        return false;
+    }
+    return true;
+}
+
+bool Archive::decode_blocks(const vector<u8> &stored, vector<u8> &out) const {
+    size_t raw_size = 0;
+    for (const auto &block : blocks) {
+        raw_size += block.raw_size;
+    }
+    out.resize(raw_size);
+
+    atomic<size_t> next_block{0};
+    atomic<bool> failed{false};
+    auto decode_task = [&]() {
+        while (!failed) {
+            size_t index = next_block.fetch_add(1);
+            if (index >= blocks.size())
+                break;
+
+            const ArchiveBlock &block = blocks[index];
+            if (!decode_block(block, stored.data() + block.offset,
+                              out.data() + index * block_size)) {
+                failed = true;
+            }
+        }
+    };
 
+    const size_t num_threads = std::min(thread_pool.size(), blocks.size());
     if (num_threads <= 1) {
-        // Fallback to single-thread
-        compress(output_path);
-        return;
+        decode_task();
+    } else {
+        vector<future<void>> futures;
+        futures.reserve(num_threads);
+        for (size_t i = 0; i < num_threads; ++i) {
+            futures.push_back(thread_pool.enqueue(decode_task));
+        }
+        for (auto &future : futures) {
+            future.get();
+        }
     }
 
-    ArchiveHeader header_copy = header;
-#ifdef __x86_64__
-    header_copy.crc32 = crc32_simd(data.data(), data.size());
-#else
-    header_copy.crc32 = crc32(data.data(), data.size());
-#endif
+    return !failed;
+}
 
-    // First, write header and file table sequentially
-    ofstream out(output_path, ios::binary);
-    if (!out) {
-        cerr << "Failed to open output: " << output_path << '\n';
-        return;
+bool Archive::read_compressed_range(u64 offset, u64 length, u8 *out) const {
+    if (length == 0) {
+        return true;
     }
 
-    // Header Section
-    out.write(reinterpret_cast<const char *>(&header_copy),
-              sizeof(header_copy));
-    u64 file_count = files.size();
-    out.write(reinterpret_cast<const char *>(&file_count), sizeof(file_count));
+    const u64 first = offset / block_size;
+    const u64 last = (offset + length - 1) / block_size;
+    if (last >= blocks.size()) {
+        return false;
+    }
 
-    // File Table Section
-    for (const auto &file_entry : files) {
-        out.write(reinterpret_cast<const char *>(&file_entry.offset),
-                  sizeof(file_entry.offset));
-        out.write(reinterpret_cast<const char *>(&file_entry.size),
-                  sizeof(file_entry.size));
-        out.write(reinterpret_cast<const char *>(file_entry.permissions), 3);
-        out.write(reinterpret_cast<const char *>(&file_entry.type),
-                  sizeof(file_entry.type));
-        out.write(reinterpret_cast<const char *>(&file_entry.path_length),
-                  sizeof(file_entry.path_length));
-        out.write(reinterpret_cast<const char *>(&file_entry.data_length),
-                  sizeof(file_entry.data_length));
-        out.write(file_entry.path.c_str(),
-                  static_cast<streamsize>(file_entry.path_length));
-    }
-
-    // Write data size placeholder and calculate data section offset
-    u64 data_size = data.size();
-    out.write(reinterpret_cast<const char *>(&data_size), sizeof(data_size));
-    u64 data_start_offset = out.tellp();
+    if (cache != nullptr) {
+        return read_cached_range(offset, length, out);
+    }
 
-    // Pre-allocate space for data section
-    out.seekp((long)data_start_offset + static_cast<std::streamoff>(data_size) -
-              1);
-    out.write("", 1);
-    out.close();
+    const u64 stored_begin = blocks[first].offset;
+    Buffer stored;
+    const u8 *stored_data = read_stored_blocks(first, last, stored);
+    if (stored_data == nullptr) {
+        return false;
+    }
 
-    // Now write data section in parallel using thread pool
-    if (data_size > 0) {
-        // Resize thread pool if needed
-        if (thread_pool.size() != num_threads) {
-            thread_pool.resize(num_threads);
+    Buffer raw;
+    u8 *dst = out;
+    for (u64 b = first; b <= last; ++b) {
+        const ArchiveBlock &block = blocks[b];
+        const u64 block_start = b * block_size;
+        const u64 copy_begin = std::max(offset, block_start) - block_start;
+        const u64 copy_end =
+            std::min(offset + length, block_start + block.raw_size) -
+            block_start;
+        const u8 *src = stored_data + (block.offset - stored_begin);
+
+        if (copy_begin == 0 && copy_end == block.raw_size) {
+            // Whole block belongs to the range, decode in place
+            if (!decode_block(block, src, dst)) {
+                return false;
+            }
+        } else {
+            if (raw.empty()) {
+                raw = Buffer(block_size);
+            }
+            if (!decode_block(block, src, raw.data())) {
+                return false;
+            }
+            std::memcpy(dst, raw.data() + copy_begin,
+                        static_cast<size_t>(copy_end - copy_begin));
         }
+        dst += copy_end - copy_begin;
+    }
 
-        atomic<size_t> current_chunk{0};
-        mutex error_mutex;
-        bool has_error = false;
-        string error_message;
+    return true;
+}
 
-        // Calculate optimal chunk size for parallel processing
-        const size_t min_chunk_size =
-            256UL * 1024UL; // Increased to 256KB minimum
-        const size_t max_chunk_size = 8UL * 1024UL * 1024UL; // 8MB maximum
+// The stored bytes of blocks `first` to `last`. Blocks are laid out back to
+// back, so one read covers all of them. Points into the mapping or `stored`.
+const u8 *Archive::read_stored_blocks(u64 first, u64 last,
+                                      Buffer &stored) const {
+    const u64 stored_begin = blocks[first].offset;
+    const u64 stored_end = blocks[last].offset + blocks[last].stored_size;
 
-        // Calculate chunk size based on data size and thread count
-        size_t optimal_chunk_size = data_size / (num_threads * 2);
-        optimal_chunk_size = std::max(
-            min_chunk_size, std::min(max_chunk_size, optimal_chunk_size));
+    if (mapped_archive->is_mapped()) {
+        if (data_section_offset + stored_end > mapped_archive->size()) {
+            return nullptr;
+        }
+        return mapped_archive->data() + data_section_offset + stored_begin;
+    }
 
-        const size_t chunk_size = optimal_chunk_size;
-        const size_t total_chunks = (data_size + chunk_size - 1) / chunk_size;
+    metrics::Scope timing(metrics::Timer::Read);
+    ifstream archive_file(archive_file_path, ios::binary);
+    if (!archive_file) {
+        return nullptr;
+    }
 
-        // Pre-open file descriptors for each thread to reduce overhead
-        vector<ofstream> thread_files(num_threads);
-        for (size_t i = 0; i < num_threads; ++i) {
-            thread_files[i].open(output_path, ios::binary | ios::in | ios::out);
-            if (!thread_files[i]) {
-                cerr << "Failed to open file for thread " << i << ": "
-                     << output_path << '\n';
-                return;
+    stored = Buffer(static_cast<size_t>(stored_end - stored_begin));
+    archive_file.seekg(
+        static_cast<streamoff>(data_section_offset + stored_begin));
+    archive_file.read(reinterpret_cast<char *>(stored.data()),
+                      static_cast<streamsize>(stored.size()));
+    metrics::count_io(metrics::Counter::BytesRead, stored.size(), 2);
+    if (static_cast<size_t>(archive_file.gcount()) != stored.size()) {
+        return nullptr;
+    }
+    return stored.data();
+}
+
+// read_compressed_range through the cache. Only the blocks that missed are
+// read and decoded, in one read from the first to the last of them.
+bool Archive::read_cached_range(u64 offset, u64 length, u8 *out) const {
+    const u64 first = offset / block_size;
+    const u64 last = (offset + length - 1) / block_size;
+
+    std::vector<std::shared_ptr<const Buffer>> decoded(
+        static_cast<size_t>(last - first + 1));
+    u64 first_missing = UINT64_MAX;
+    u64 last_missing = 0;
+    for (u64 b = first; b <= last; ++b) {
+        decoded[b - first] = cache->find(BlockCache::block_key(b));
+        if (decoded[b - first] == nullptr) {
+            first_missing = std::min(first_missing, b);
+            last_missing = b;
+        }
+    }
+
+    if (first_missing != UINT64_MAX) {
+        Buffer stored;
+        const u8 *stored_data =
+            read_stored_blocks(first_missing, last_missing, stored);
+        if (stored_data == nullptr) {
+            return false;
+        }
+        for (u64 b = first_missing; b <= last_missing; ++b) {
+            auto &block = decoded[b - first];
+            if (block == nullptr) {
+                block = decode_shared(
+                    b, stored_data +
+                           (blocks[b].offset - blocks[first_missing].offset));
+                if (block == nullptr) {
+                    return false;
+                }
             }
         }
+    }
 
-        // Task function for thread pool
-        auto write_chunk_task = [&](size_t thread_id) {
-            ofstream &thread_file = thread_files[thread_id];
+    u8 *dst = out;
+    for (u64 b = first; b <= last; ++b) {
+        const Buffer &block = *decoded[b - first];
+        const u64 block_start = b * block_size;
+        const u64 copy_begin = std::max(offset, block_start) - block_start;
+        const u64 copy_end =
+            std::min(offset + length, block_start + block.size()) -
+            block_start;
+        std::memcpy(dst, block.data() + copy_begin,
+                    static_cast<size_t>(copy_end - copy_begin));
+        dst += copy_end - copy_begin;
+    }
+    return true;
+}
 
-            while (true) {
-                size_t chunk_idx = current_chunk.fetch_add(1);
-                if (chunk_idx >= total_chunks)
-                    break;
+// Block `index` decoded into a buffer readers can share, handed to the cache
+// as well if there is one
+std::shared_ptr<const Buffer> Archive::decode_shared(u64 index,
+                                                     const u8 *stored) const {
+    const ArchiveBlock &block = blocks[index];
+    auto decoded = make_shared<Buffer>(size_t{block.raw_size});
+    if (!decode_block(block, stored, decoded->data())) {
+        return nullptr;
+    }
+    if (cache != nullptr) {
+        cache->insert(BlockCache::block_key(index), decoded);
+    }
+    return decoded;
+}
 
-                size_t chunk_start = chunk_idx * chunk_size;
-                size_t chunk_end =
-                    std::min(chunk_start + chunk_size, data_size);
-                size_t actual_chunk_size = chunk_end - chunk_start;
+void Archive::set_cache_size(size_t bytes) {
+    cache = bytes > 0 ? make_shared<BlockCache>(bytes) : nullptr;
+}
 
-                try {
-                    // Seek to the correct position in the data section
-                    thread_file.seekp(static_cast<streamsize>(
-                        data_start_offset + chunk_start));
+CacheStats Archive::cache_stats() const {
+    return cache != nullptr ? cache->stats() : CacheStats{};
+}
 
-                    // Write this chunk of data
-                    thread_file.write(
-                        reinterpret_cast<const char *>(data.data() +
-                                                       chunk_start),
-                        static_cast<streamsize>(actual_chunk_size));
+// Stored members the cache keeps whole, the ones that would otherwise be
+// read from the file and checked every time
+bool Archive::member_cacheable(const ArchiveFile &file) const {
+    return cache != nullptr && !is_compressed() && file.offset < base_size &&
+           !mapped_archive->is_mapped() && file.data_length > 0 &&
+           file.data_length <= MAX_CACHED_MEMBER &&
+           file.type != ArchiveFile::FileType::Directory;
+}
 
-                    thread_file.flush(); // Ensure data is written
+// A cacheable member's stored bytes, read and checked on a miss. nullptr if
+// they can't be read intact.
+std::shared_ptr<const Buffer>
+Archive::cached_member(const ArchiveFile &file) const {
+    const u64 key = BlockCache::member_key(file.offset);
+    if (auto hit = cache->find(key)) {
+        return hit;
+    }
+    auto bytes = make_shared<Buffer>(static_cast<size_t>(file.data_length));
+    if (!read_range(file.offset, file.data_length, bytes->data()) ||
+        !verify_member(file, bytes->data())) {
+        return nullptr;
+    }
+    cache->insert(key, bytes);
+    return bytes;
+}
 
-                    if (!thread_file.good()) {
-                        lock_guard<mutex> lock(error_mutex);
-                        has_error = true;
-                        error_message = "Failed to write data chunk";
-                        return;
-                    }
+void Archive::write_block_index(ostream &out,
+                                const vector<ArchiveBlock> &index) const {
+    metrics::Scope timing(metrics::Timer::Table);
+    u64 block_count = index.size();
+    out.write(reinterpret_cast<const char *>(&block_size), sizeof(block_size));
+    // Every block may have been stored as-is, so the blocks can't tell
+    out.write(reinterpret_cast<const char *>(&codec), sizeof(codec));
+    out.write(reinterpret_cast<const char *>(&block_count),
+              sizeof(block_count));
+    out.write(reinterpret_cast<const char *>(index.data()),
+              static_cast<streamsize>(block_count * sizeof(ArchiveBlock)));
+}
 
-                    if (verbose) {
-                        lock_guard<mutex> lock(error_mutex);
-                        cout << "Thread " << thread_id << " wrote chunk "
-                             << chunk_idx + 1 << "/" << total_chunks << " ("
-                             << actual_chunk_size << " bytes)" << '\n';
-                    }
-                } catch (const exception &e) {
-                    lock_guard<mutex> lock(error_mutex);
-                    has_error = true;
-                    error_message = string("Error writing chunk: ") + e.what();
-                    return;
-                }
-            }
-        };
+bool Archive::read_block_index(istream &in, u64 data_size) {
+    metrics::Scope timing(metrics::Timer::Table);
+    u64 block_count = 0;
+    in.read(reinterpret_cast<char *>(&block_size), sizeof(block_size));
+    const bool has_codec = header.version >= 11;
+    if (has_codec) {
+        in.read(reinterpret_cast<char *>(&codec), sizeof(codec));
+    }
+    in.read(reinterpret_cast<char *>(&block_count), sizeof(block_count));
+    if (!in || block_size == 0 || block_count > data_size ||
+        (has_codec && (codec == ArchiveCodec::Store ||
+                       static_cast<u8>(codec) >
+                           static_cast<u8>(ArchiveCodec::Lzma)))) {
+        return false;
+    }
 
-        // Submit tasks to thread pool
-        vector<future<void>> futures;
-        futures.reserve(num_threads);
+    blocks.resize(static_cast<size_t>(block_count));
+    in.read(reinterpret_cast<char *>(blocks.data()),
+            static_cast<streamsize>(block_count * sizeof(ArchiveBlock)));
+    if (!in) {
+        return false;
+    }
 
-        for (size_t i = 0; i < num_threads; ++i) {
-            futures.push_back(thread_pool.enqueue(write_chunk_task, i));
+    // Readers index blocks by offset / block_size, so the layout has to be
+    // exactly what encode_blocks produces. Streamed archives have each
+    // block's record in front of it.
+    const u64 frame = is_streamed() ? sizeof(ArchiveBlock) : 0;
+    u64 expected_offset = 0;
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        const ArchiveBlock &block = blocks[i];
+        const bool is_last = i + 1 == blocks.size();
+        expected_offset += frame;
+        if (block.offset != expected_offset ||
+            (is_last ? block.raw_size > block_size
+                     : block.raw_size != block_size)) {
+            return false;
         }
+        expected_offset += block.stored_size;
 
-        // Wait for all tasks to complete
-        for (auto &future : futures) {
-            future.wait();
+        // Older archives don't say, the first block that isn't stored does
+        if (!has_codec && codec == ArchiveCodec::Store &&
+            block.codec != ArchiveCodec::Store &&
+            find_codec(block.codec) != nullptr) {
+            codec = block.codec;
         }
+    }
+    // And if none is, the archive still gets a codec for what's added later
+    if (!has_codec && codec == ArchiveCodec::Store) {
+        codec = ArchiveCodec::Lz;
+    }
+    return expected_offset == data_size;
+}
 
-        // Close all thread files
-        for (auto &file : thread_files) {
-            file.close();
+// Writing
+// The data section is produced as one logical stream, the buffered `data`
+// followed by the streamed sources, and goes through the CRC and the block
+// encoder in bounded pieces. Nothing here holds more than a few blocks.
+
+namespace {
+
+// Uncompressed files from here on are copied by the kernel, when writing and
+// when extracting. Smaller ones don't gain much and batch better as they are.
+constexpr u64 KERNEL_COPY_MIN = 1024UL * 1024UL; // 1MB
+
+// Runs `fn` over `length` bytes of `fd` at `offset` from a mapping, or a
+// buffer if it can't be mapped
+template <class Fn>
+void for_each_mapped(int fd, u64 offset, u64 length, Fn fn) {
+#ifdef __unix__
+    constexpr u64 WINDOW = 64UL * 1024UL * 1024UL;
+    const u64 page = static_cast<u64>(::sysconf(_SC_PAGESIZE));
+    while (length > 0) {
+        const u64 aligned = offset & ~(page - 1);
+        const u64 take = std::min(length, WINDOW);
+        const size_t mapped_length =
+            static_cast<size_t>(offset - aligned + take);
+        void *mapped = ::mmap(nullptr, mapped_length, PROT_READ,
+                              MAP_PRIVATE | MAP_POPULATE, fd,
+                              static_cast<off_t>(aligned));
+        metrics::count(metrics::Counter::Syscalls, 2); // mmap, munmap
+        if (mapped == MAP_FAILED) {
+            break;
+        }
+        fn(static_cast<const u8 *>(mapped) + (offset - aligned),
+           static_cast<size_t>(take));
+        ::munmap(mapped, mapped_length);
+        offset += take;
+        length -= take;
+    }
+
+    Buffer buffer(static_cast<size_t>(std::min<u64>(length, 1024UL * 1024UL)));
+    while (length > 0) {
+        const size_t take =
+            static_cast<size_t>(std::min<u64>(length, buffer.size()));
+        const ssize_t got =
+            ::pread(fd, buffer.data(), take, static_cast<off_t>(offset));
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        const size_t valid = got > 0 ? static_cast<size_t>(got) : 0;
+        std::memset(buffer.data() + valid, 0, take - valid);
+        fn(buffer.data(), take);
+        offset += take;
+        length -= take;
+    }
+#else
+    (void)fd;
+    (void)offset;
+    (void)length;
+    (void)fn;
+#endif
+}
+
+struct PrefetchedFile {
+    Buffer bytes; // always the recorded length, padded if the file shrank
+    bool opened{false};
+    bool changed{false};
+};
+
+// Per-file CRC32C of a data section streaming past in offset order, works
+// for any layout, holes included. Files below `first_new` came from the
+// loaded archive and keep the checksum they have.
+class MemberChecksums {
+  public:
+    MemberChecksums(const vector<ArchiveFile> &files, u64 first_new, u64 from)
+        : files(files), crcs(files.size(), 0), position(from) {
+        for (size_t i = 0; i < files.size(); ++i) {
+            if (files[i].offset < first_new) {
+                crcs[i] = files[i].crc32c;
+            } else if (files[i].data_length > 0) {
+                ordered.push_back(i);
+            }
+        }
+        std::stable_sort(ordered.begin(), ordered.end(),
+                         [&files](size_t a, size_t b) {
+                             return files[a].offset < files[b].offset;
+                         });
+    }
+
+    void update(const u8 *chunk, size_t length) {
+        const u64 chunk_begin = position;
+        const u64 chunk_end = position + length;
+        position = chunk_end;
+
+        // Files that ended before this chunk are done
+        while (next < ordered.size() && end_of(ordered[next]) <= chunk_begin) {
+            ++next;
+        }
+        for (size_t k = next; k < ordered.size(); ++k) {
+            const ArchiveFile &file = files[ordered[k]];
+            if (file.offset >= chunk_end) {
+                break;
+            }
+            const u64 begin = std::max(file.offset, chunk_begin);
+            const u64 end = std::min(end_of(ordered[k]), chunk_end);
+            if (begin < end) {
+                crcs[ordered[k]] =
+                    crc32c(chunk + (begin - chunk_begin),
+                           static_cast<size_t>(end - begin), crcs[ordered[k]]);
+            }
+        }
+    }
+
+    const vector<u32> &result() const { return crcs; }
+
+  private:
+    u64 end_of(size_t index) const {
+        return files[index].offset + files[index].data_length;
+    }
+
+    const vector<ArchiveFile> &files;
+    vector<u32> crcs;
+    vector<size_t> ordered; // files with data, by offset
+    size_t next{0};
+    u64 position{0};
+};
+
+PrefetchedFile prefetch_file(const string &path, u64 length) {
+    PrefetchedFile prefetched;
+    prefetched.bytes = Buffer(static_cast<size_t>(length));
+
+    metrics::Scope timing(metrics::Timer::Read);
+    ifstream file(path, ios::binary);
+    prefetched.opened = static_cast<bool>(file);
+    size_t bytes_read = 0;
+    if (file) {
+        file.read(reinterpret_cast<char *>(prefetched.bytes.data()),
+                  static_cast<streamsize>(length));
+        bytes_read = static_cast<size_t>(file.gcount());
+        prefetched.changed = bytes_read < length;
+        metrics::count_io(metrics::Counter::BytesRead, bytes_read, 3);
+    }
+    std::memset(prefetched.bytes.data() + bytes_read, 0,
+                prefetched.bytes.size() - bytes_read);
+    return prefetched;
+}
+
+} // namespace
+
+void Archive::stream_data(const function<void(const u8 *, size_t)> &sink,
+                          size_t num_threads, u64 from,
+                          const CopySink &copy) const {
+    constexpr size_t CHUNK_SIZE = 1024UL * 1024UL; // 1MB
+
+    // Data of a lazily loaded archive that's still only in the archive file
+    Buffer buffer(CHUNK_SIZE);
+    for (u64 offset = from; offset < base_size; offset += CHUNK_SIZE) {
+        const size_t length =
+            static_cast<size_t>(std::min<u64>(CHUNK_SIZE, base_size - offset));
+        if (!read_range(offset, length, buffer.data())) {
+            cerr << "Failed to read archive data at offset " << offset << '\n';
+            std::memset(buffer.data(), 0, length);
+        }
+        sink(buffer.data(), length);
+    }
+
+    const size_t data_from =
+        static_cast<size_t>(from > base_size ? from - base_size : 0);
+    for (size_t offset = data_from; offset < data.size();
+         offset += CHUNK_SIZE) {
+        sink(data.data() + offset, std::min(CHUNK_SIZE, data.size() - offset));
+    }
+
+    // Small files are all open and read latency, so with threads to spare
+    // the next few get read ahead on the pool. Big ones are bandwidth bound
+    // and keep being read here in chunks. At most max_ahead * CHUNK_SIZE
+    // bytes are buffered.
+    const size_t max_ahead = num_threads > 1 ? num_threads * 4 : 0;
+    vector<future<PrefetchedFile>> ahead(max_ahead > 0 ? stream_sources.size()
+                                                       : 0);
+    size_t next_ahead = 0;
+    size_t in_flight = 0;
+    unique_ptr<MemberReader> previous_reader; // see set_previous
+    auto read_ahead = [&]() {
+        while (next_ahead < ahead.size() && in_flight < max_ahead) {
+            const StreamSource &source = stream_sources[next_ahead];
+            if (!source.path.empty() && source.unchanged == nullptr &&
+                source.length <= CHUNK_SIZE && source.hole_count == 0) {
+                ahead[next_ahead] = thread_pool.enqueue(
+                    prefetch_file, std::cref(source.path), source.length);
+                ++in_flight;
+            }
+            ++next_ahead;
+        }
+    };
+
+    for (size_t i = 0; i < stream_sources.size(); ++i) {
+        const StreamSource &source = stream_sources[i];
+        read_ahead();
+
+        if (source.path.empty()) {
+            sink(reinterpret_cast<const u8 *>(source.target.data()),
+                 source.target.size());
+            continue;
+        }
+
+        if (i < ahead.size() && ahead[i].valid()) {
+            PrefetchedFile prefetched = ahead[i].get();
+            --in_flight;
+            if (!prefetched.opened) {
+                cerr << "Failed to open: " << source.path << '\n';
+            } else if (prefetched.changed) {
+                cerr << "File changed while archiving: " << source.path
+                     << '\n';
+            }
+            sink(prefetched.bytes.data(), prefetched.bytes.size());
+            continue;
+        }
+
+        // Sparse files skip over their holes
+        const span<const ArchiveHole> source_holes(
+            holes.data() + source.first_hole, source.hole_count);
+        bool changed = false;
+
+        // Unchanged files come out of the previous archive, from the file
+        // only what that couldn't provide
+        u64 skip = 0;
+        if (source.unchanged != nullptr) {
+            skip = previous->stream_member(*source.unchanged, sink,
+                                           previous_reader);
+            if (skip == source.length) {
+                continue;
+            }
+            cerr << "Reading again, previous archive's copy is damaged: "
+                 << source.path << '\n';
+        }
+
+#ifdef __unix__
+        // Big files can go to a writer that copies them itself
+        if (copy && skip == 0 && source.length >= KERNEL_COPY_MIN) {
+            int fd = ::open(source.path.c_str(), O_RDONLY | O_CLOEXEC);
+            metrics::count(metrics::Counter::Syscalls, 2); // open, close
+            if (fd != -1) {
+                for_each_data_run(source_holes, source.length, 0, UINT64_MAX,
+                                  [&](u64 offset, u64, u64 length) {
+                    if (copy(fd, offset, length) < length && !changed) {
+                        cerr << "File changed while archiving: "
+                             << source.path << '\n';
+                        changed = true;
+                    }
+                });
+                ::close(fd);
+                continue;
+            }
+        }
+#endif
+
+        ifstream file(source.path, ios::binary);
+        if (!file) {
+            cerr << "Failed to open: " << source.path << '\n';
+        }
+
+        for_each_data_run(source_holes, source.length, 0, UINT64_MAX,
+                          [&](u64 offset, u64 stored, u64 length) {
+            if (stored + length <= skip) {
+                return;
+            }
+            if (stored < skip) {
+                offset += skip - stored;
+                length -= skip - stored;
+            }
+            if ((!source_holes.empty() || skip > 0) && file) {
+                file.seekg(static_cast<streamoff>(offset));
+            }
+
+            u64 remaining = length;
+            while (remaining > 0) {
+                const size_t to_read =
+                    static_cast<size_t>(std::min<u64>(remaining, CHUNK_SIZE));
+                size_t bytes_read = 0;
+                if (file) {
+                    metrics::Scope timing(metrics::Timer::Read);
+                    file.read(reinterpret_cast<char *>(buffer.data()),
+                              static_cast<streamsize>(to_read));
+                    bytes_read = static_cast<size_t>(file.gcount());
+                    metrics::count_io(metrics::Counter::BytesRead, bytes_read);
+                }
+
+                // Offsets of everything after this file are already in the
+                // table, so a file that shrank since add_file gets padded
+                // with zeros
+                if (bytes_read < to_read) {
+                    std::memset(buffer.data() + bytes_read, 0,
+                                to_read - bytes_read);
+                    if (file && !changed) {
+                        cerr << "File changed while archiving: "
+                             << source.path << '\n';
+                    }
+                    changed = true;
+                }
+
+                sink(buffer.data(), to_read);
+                remaining -= to_read;
+            }
+        });
+    }
+}
+
+// Writes the data from logical offset `from` on, which has to be block
+// aligned for compressed archives, with `stored_from` bytes of the section
+// already in place. `crc` comes in as the CRC of everything before `from`.
+// Deduplicated archives fill `extent_map`, they're always written whole.
+// `framed` puts every block's record in front of it, for streamed archives.
+// Returns the stored size of the whole section.
+u64 Archive::write_data_section(ostream &out, size_t num_threads, u32 &crc,
+                                vector<ArchiveBlock> &index,
+                                vector<ArchiveExtent> &extent_map,
+                                vector<u32> &file_crcs, u64 from,
+                                u64 stored_from, int out_fd,
+                                bool framed) const {
+    u64 stored_size = stored_from;
+    MemberChecksums members(files, loaded_size, from);
+
+    // The data goes to `store` as is, or just the chunks that weren't seen
+    // before if deduplicating
+    auto stream_stored = [&](const Deduplicator::Store &store) {
+        if (!dedup) {
+            stream_data(
+                [&](const u8 *chunk, size_t length) {
+                    members.update(chunk, length);
+                    store(chunk, length);
+                },
+                num_threads, from);
+            return;
+        }
+
+        vector<u64> starts;
+        for (const auto &file_entry : files) {
+            if (file_entry.data_length > 0 && file_entry.offset >= from) {
+                starts.push_back(file_entry.offset);
+            }
+        }
+        Deduplicator chunks(std::move(starts), from, store);
+        stream_data(
+            [&](const u8 *chunk, size_t length) {
+                members.update(chunk, length);
+                chunks.update(chunk, length);
+            },
+            num_threads, from);
+        chunks.finish();
+        extent_map = chunks.extents();
+        if (verbose) {
+            cout << "Deduplicated " << chunks.duplicate_bytes() << " of "
+                 << data_end() - from << " bytes, "
+                 << chunks.unique_chunks() << " unique chunks\n";
+        }
+    };
+
+    if (codec == ArchiveCodec::Store) {
+        auto store = [&](const u8 *chunk, size_t length) {
+            crc = crc32c(chunk, length, crc);
+            metrics::Scope timing(metrics::Timer::Write);
+            out.write(reinterpret_cast<const char *>(chunk),
+                      static_cast<streamsize>(length));
+            metrics::count(metrics::Counter::BytesWritten, length);
+            stored_size += length;
+        };
+
+        // Big input files are copied into the archive by the kernel through
+        // `out_fd`, a second descriptor of the same file. The CRCs are then
+        // taken from the copy, which is in the page cache by now and which
+        // nobody else writes.
+        auto copy = [&](int fd, u64 offset, u64 length) {
+            out.flush();
+            const u64 at = static_cast<u64>(out.tellp());
+            u64 copied = 0;
+            {
+                metrics::Scope timing(metrics::Timer::Write);
+                copied = copy_range(fd, offset, out_fd, at, length);
+            }
+            u64 got_total = copied;
+            out.seekp(static_cast<streamoff>(at + copied));
+
+            // Whatever the kernel didn't copy goes through a buffer, and
+            // whatever the file doesn't have anymore is padded with zeros
+            const size_t chunk_size = 1024UL * 1024UL;
+            Buffer buffer(static_cast<size_t>(
+                std::min<u64>(length - copied, chunk_size)));
+            bool ended = false;
+            while (copied < length) {
+                const size_t take = static_cast<size_t>(
+                    std::min<u64>(length - copied, buffer.size()));
+                ssize_t got = 0;
+                if (!ended) {
+                    metrics::Scope timing(metrics::Timer::Read);
+                    got = ::pread(fd, buffer.data(), take,
+                                  static_cast<off_t>(offset + copied));
+                    metrics::count_io(metrics::Counter::BytesRead,
+                                      got > 0 ? static_cast<u64>(got) : 0);
+                }
+                const size_t valid = got > 0 ? static_cast<size_t>(got) : 0;
+                ended = ended || valid < take;
+                std::memset(buffer.data() + valid, 0, take - valid);
+                metrics::Scope timing(metrics::Timer::Write);
+                out.write(reinterpret_cast<const char *>(buffer.data()),
+                          static_cast<streamsize>(take));
+                metrics::count(metrics::Counter::BytesWritten, take);
+                copied += take;
+                got_total += valid;
+            }
+            out.flush();
+
+            for_each_mapped(out_fd, at, length,
+                            [&](const u8 *bytes, size_t piece) {
+                                members.update(bytes, piece);
+                                crc = crc32c(bytes, piece, crc);
+                            });
+            stored_size += length;
+            return got_total;
+        };
+
+        if (out_fd != -1 && !dedup) {
+            stream_data(
+                [&](const u8 *chunk, size_t length) {
+                    members.update(chunk, length);
+                    store(chunk, length);
+                },
+                num_threads, from, copy);
+        } else {
+            stream_stored(store);
+        }
+        file_crcs = members.result();
+        return stored_size;
+    }
+
+    struct EncodedBlock {
+        Buffer bytes;
+        ArchiveBlock block;
+    };
+
+    const Codec *block_codec = find_codec(codec);
+    const ArchiveCodec block_codec_id = codec;
+    auto encode = [block_codec, block_codec_id](Buffer raw) {
+        EncodedBlock encoded;
+        size_t encoded_size = 0;
+        {
+            // Media and archives that get added don't shrink, only blocks
+            // that might are worth the codec's time
+            metrics::Scope timing(metrics::Timer::Encode);
+            if (!looks_incompressible(raw.data(), raw.size())) {
+                encoded.bytes =
+                    Buffer(block_codec->max_compressed_size(raw.size()));
+                encoded_size = block_codec->compress(raw.data(), raw.size(),
+                                                     encoded.bytes.data(),
+                                                     encoded.bytes.size());
+            }
+        }
+
+        encoded.block.raw_size = static_cast<u32>(raw.size());
+        encoded.block.crc32c = crc32c(raw.data(), raw.size());
+        if (encoded_size == 0 || encoded_size >= raw.size()) {
+            // Didn't shrink or wouldn't have, not worth decoding later
+            encoded.bytes = std::move(raw);
+            encoded.block.codec = ArchiveCodec::Store;
+        } else {
+            encoded.bytes.resize(encoded_size);
+            encoded.block.codec = block_codec_id;
+        }
+        encoded.block.stored_size = static_cast<u32>(encoded.bytes.size());
+        return encoded;
+    };
+
+    // Framed blocks have their record in front, for readers that only get to
+    // see the index once they're past the data
+    const u64 frame = framed ? sizeof(ArchiveBlock) : 0;
+    size_t raw_blocks = 0;
+    auto write_block = [&](EncodedBlock encoded) {
+        encoded.block.offset = stored_size + frame;
+        metrics::Scope timing(metrics::Timer::Write);
+        if (framed) {
+            out.write(reinterpret_cast<const char *>(&encoded.block),
+                      sizeof(encoded.block));
+        }
+        out.write(reinterpret_cast<const char *>(encoded.bytes.data()),
+                  static_cast<streamsize>(encoded.bytes.size()));
+        metrics::count(metrics::Counter::BytesWritten,
+                       frame + encoded.bytes.size());
+        stored_size += frame + encoded.bytes.size();
+        raw_blocks += encoded.block.codec == ArchiveCodec::Store ? 1 : 0;
+        index.push_back(encoded.block);
+    };
+
+    // A couple of blocks per worker in flight is enough to keep them busy, and
+    // it's all the memory the writer needs. Blocks are written in order.
+    const size_t max_in_flight = num_threads > 1 ? num_threads * 2 : 0;
+    std::deque<future<EncodedBlock>> in_flight;
+    auto empty_block = [this]() {
+        Buffer block(block_size);
+        block.resize(0);
+        return block;
+    };
+    Buffer pending = empty_block();
+
+    auto submit = [&]() {
+        if (max_in_flight == 0) {
+            write_block(encode(std::move(pending)));
+            pending = empty_block();
+            return;
+        }
+
+        if (in_flight.size() >= max_in_flight) {
+            write_block(in_flight.front().get());
+            in_flight.pop_front();
+        }
+        in_flight.push_back(thread_pool.enqueue(
+            [encode, raw = std::move(pending)]() mutable {
+                return encode(std::move(raw));
+            }));
+        pending = empty_block();
+    };
+
+    stream_stored([&](const u8 *chunk, size_t length) {
+        crc = crc32c(chunk, length, crc);
+        while (length > 0) {
+            const size_t filled = pending.size();
+            const size_t take = std::min<size_t>(length, block_size - filled);
+            pending.resize(filled + take);
+            std::memcpy(pending.data() + filled, chunk, take);
+            chunk += take;
+            length -= take;
+            if (pending.size() == block_size) {
+                submit();
+            }
+        }
+    });
+    if (!pending.empty()) {
+        submit();
+    }
+    while (!in_flight.empty()) {
+        write_block(in_flight.front().get());
+        in_flight.pop_front();
+    }
+    file_crcs = members.result();
+
+    if (verbose) {
+        cout << "Encoded " << data_end() << " bytes into " << index.size()
+             << " blocks (" << stored_size << " bytes, " << block_codec->name()
+             << ", " << raw_blocks << " stored as they were)\n";
+    }
+
+    return stored_size;
+}
+
+namespace {
+
+// Paths share at most this much with the one before them. It's what keeps a
+// bogus table from claiming paths much longer than the table itself.
+constexpr size_t MAX_SHARED_PREFIX = 255;
+
+void put_varint(string &out, u64 value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+bool get_varint(const u8 *&cursor, const u8 *end, u64 &value) {
+    value = 0;
+    for (unsigned shift = 0; shift < 64 && cursor < end; shift += 7) {
+        const u8 byte = *cursor++;
+        value |= static_cast<u64>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+} // namespace
+
+void Archive::write_file_table(ostream &out, span<const u32> crcs) const {
+    metrics::Scope timing(metrics::Timer::Table);
+
+    // One column per field, so like values end up next to each other.
+    // Offsets are stored as the step from the one before, which is the
+    // previous file's size most of the time, and paths as what they add to
+    // the previous path.
+    TableColumns columns;
+    columns.file_count = files.size();
+    vector<u32> crc_column;
+    vector<ModeRecord> modes;
+    string offsets;
+    string lengths;
+    string paths;
+    vector<HoleRecord> hole_records;
+    vector<StatRecord> stat_records;
+    crc_column.reserve(files.size());
+    modes.reserve(files.size());
+    stat_records.reserve(files.size());
+    u64 previous_offset = 0;
+    string_view previous_path;
+    for (size_t i = 0; i < files.size(); ++i) {
+        const ArchiveFile &file_entry = files[i];
+        crc_column.push_back(i < crcs.size() ? crcs[i] : file_entry.crc32c);
+        ModeRecord mode;
+        std::memcpy(mode.permissions, file_entry.permissions, 3);
+        mode.type = file_entry.type;
+        modes.push_back(mode);
+
+        // Zigzag, directories and replaced files can step backwards
+        const u64 step = file_entry.offset - previous_offset;
+        put_varint(offsets, (step << 1) ^ (0 - (step >> 63)));
+        previous_offset = file_entry.offset;
+        put_varint(lengths, file_entry.data_length);
+
+        const string_view path = file_entry.path;
+        const size_t limit =
+            std::min({previous_path.size(), path.size(), MAX_SHARED_PREFIX});
+        size_t shared = 0;
+        while (shared < limit && previous_path[shared] == path[shared]) {
+            ++shared;
+        }
+        paths.push_back(static_cast<char>(shared));
+        put_varint(paths, path.size() - shared);
+        paths.append(path.substr(shared));
+        previous_path = path;
+        columns.pool_size += path.size();
+
+        stat_records.push_back({file_entry.mtime, file_entry.inode});
+        for (const auto &hole : file_holes(file_entry)) {
+            hole_records.push_back({i, hole.offset, hole.length});
+        }
+    }
+    columns.packed_size = offsets.size() + lengths.size() + paths.size();
+
+    out.write(reinterpret_cast<const char *>(&columns), sizeof(columns));
+    out.write(reinterpret_cast<const char *>(crc_column.data()),
+              static_cast<streamsize>(crc_column.size() * sizeof(u32)));
+    out.write(reinterpret_cast<const char *>(modes.data()),
+              static_cast<streamsize>(modes.size() * sizeof(ModeRecord)));
+    for (const string *column : {&offsets, &lengths, &paths}) {
+        out.write(column->data(), static_cast<streamsize>(column->size()));
+    }
+
+    const u64 hole_count = hole_records.size();
+    out.write(reinterpret_cast<const char *>(&hole_count), sizeof(hole_count));
+    out.write(reinterpret_cast<const char *>(hole_records.data()),
+              static_cast<streamsize>(hole_count * sizeof(HoleRecord)));
+
+    const u64 stat_count = stat_records.size();
+    out.write(reinterpret_cast<const char *>(&stat_count), sizeof(stat_count));
+    out.write(reinterpret_cast<const char *>(stat_records.data()),
+              static_cast<streamsize>(stat_count * sizeof(StatRecord)));
+}
+
+bool Archive::read_file_table(istream &in, u64 archive_size) {
+    metrics::Scope timing(metrics::Timer::Table);
+    files.clear();
+    holes.clear();
+    const bool read = header.version < 10 ? read_file_records(in, archive_size)
+                                          : read_file_columns(in, archive_size);
+    if (!read) {
+        return false;
+    }
+    rebuild_path_index();
+    return (header.version < 7 || read_holes(in, archive_size)) &&
+           (header.version < 9 || read_file_stats(in, archive_size));
+}
+
+bool Archive::read_file_columns(istream &in, u64 archive_size) {
+    TableColumns columns;
+    in.read(reinterpret_cast<char *>(&columns), sizeof(columns));
+    const u64 position = static_cast<u64>(in.tellg());
+    if (!in || position > archive_size) {
+        return false;
+    }
+
+    // Every file takes a CRC, a mode and at least four packed bytes, and
+    // its path can only be so much longer than what the table stores of it
+    constexpr u64 FIXED_SIZE = sizeof(u32) + sizeof(ModeRecord);
+    const u64 remaining = archive_size - position;
+    if (columns.file_count > remaining / (FIXED_SIZE + 4) ||
+        columns.packed_size > remaining - columns.file_count * FIXED_SIZE ||
+        columns.pool_size > columns.packed_size +
+                                columns.file_count * MAX_SHARED_PREFIX) {
+        return false;
+    }
+
+    // A read per column
+    const size_t count = static_cast<size_t>(columns.file_count);
+    vector<u32> crc_column(count);
+    vector<ModeRecord> modes(count);
+    vector<u8> packed(static_cast<size_t>(columns.packed_size));
+    in.read(reinterpret_cast<char *>(crc_column.data()),
+            static_cast<streamsize>(count * sizeof(u32)));
+    in.read(reinterpret_cast<char *>(modes.data()),
+            static_cast<streamsize>(count * sizeof(ModeRecord)));
+    in.read(reinterpret_cast<char *>(packed.data()),
+            static_cast<streamsize>(packed.size()));
+    if (!in) {
+        return false;
+    }
+
+    files.resize(count);
+    const u8 *cursor = packed.data();
+    const u8 *const end = cursor + packed.size();
+    u64 offset = 0;
+    for (auto &file_entry : files) {
+        u64 step = 0;
+        if (!get_varint(cursor, end, step)) {
+            return false;
+        }
+        offset += (step >> 1) ^ (0 - (step & 1));
+        file_entry.offset = offset;
+    }
+    for (auto &file_entry : files) {
+        if (!get_varint(cursor, end, file_entry.data_length)) {
+            return false;
+        }
+    }
+
+    // Paths are put back together in one chunk of the path pool
+    auto pool = make_unique<char[]>(static_cast<size_t>(columns.pool_size));
+    char *const pool_data = pool.get();
+    path_pool.adopt(std::move(pool));
+    u64 pool_offset = 0;
+    string_view previous_path;
+    for (size_t i = 0; i < count; ++i) {
+        u64 added = 0;
+        if (cursor == end) {
+            return false;
+        }
+        const size_t shared = *cursor++;
+        if (shared > previous_path.size() ||
+            !get_varint(cursor, end, added) ||
+            added > static_cast<u64>(end - cursor) ||
+            shared + added > columns.pool_size - pool_offset) {
+            return false;
+        }
+        char *const path = pool_data + pool_offset;
+        std::copy_n(previous_path.data(), shared, path);
+        std::copy_n(cursor, static_cast<size_t>(added), path + shared);
+        cursor += added;
+        pool_offset += shared + added;
+
+        ArchiveFile &file_entry = files[i];
+        file_entry.path =
+            string_view(path, shared + static_cast<size_t>(added));
+        file_entry.crc32c = crc_column[i];
+        std::memcpy(file_entry.permissions, modes[i].permissions, 3);
+        file_entry.type = modes[i].type;
+        previous_path = file_entry.path;
+    }
+    return cursor == end && pool_offset == columns.pool_size;
+}
+
+bool Archive::read_file_records(istream &in, u64 archive_size) {
+    u64 file_count = 0;
+    u64 pool_size = 0;
+    in.read(reinterpret_cast<char *>(&file_count), sizeof(file_count));
+    in.read(reinterpret_cast<char *>(&pool_size), sizeof(pool_size));
+    if (!in) {
+        return false;
+    }
+
+    // Don't trust the counts with an allocation bigger than the archive
+    const u64 position = static_cast<u64>(in.tellg());
+    if (position > archive_size) {
+        return false;
+    }
+    const u64 remaining = archive_size - position;
+    if (file_count > remaining / sizeof(FileRecord) ||
+        pool_size > remaining - file_count * sizeof(FileRecord)) {
+        return false;
+    }
+
+    // Two reads for the whole table: the fixed size records, then the pool
+    // with every path back to back that the entries point into
+    vector<FileRecord> records(static_cast<size_t>(file_count));
+    in.read(reinterpret_cast<char *>(records.data()),
+            static_cast<streamsize>(file_count * sizeof(FileRecord)));
+
+    auto pool = make_unique<char[]>(static_cast<size_t>(pool_size));
+    in.read(pool.get(), static_cast<streamsize>(pool_size));
+    if (!in) {
+        return false;
+    }
+
+    files.resize(records.size());
+    u64 pool_offset = 0;
+    for (size_t i = 0; i < records.size(); ++i) {
+        const FileRecord &record = records[i];
+        if (record.path_length > pool_size - pool_offset) {
+            return false;
+        }
+
+        ArchiveFile &file_entry = files[i];
+        file_entry.offset = record.offset;
+        std::memcpy(file_entry.permissions, record.permissions, 3);
+        file_entry.type = record.type;
+        file_entry.data_length = record.data_length;
+        file_entry.crc32c = record.crc32c;
+        file_entry.path = string_view(pool.get() + pool_offset,
+                                      static_cast<size_t>(record.path_length));
+        pool_offset += record.path_length;
+    }
+
+    path_pool.adopt(std::move(pool));
+    return pool_offset == pool_size;
+}
+
+bool Archive::read_holes(istream &in, u64 archive_size) {
+    u64 hole_count = 0;
+    in.read(reinterpret_cast<char *>(&hole_count), sizeof(hole_count));
+    const u64 position = static_cast<u64>(in.tellg());
+    if (!in || position > archive_size ||
+        hole_count > (archive_size - position) / sizeof(HoleRecord)) {
+        return false;
+    }
+    vector<HoleRecord> records(static_cast<size_t>(hole_count));
+    in.read(reinterpret_cast<char *>(records.data()),
+            static_cast<streamsize>(hole_count * sizeof(HoleRecord)));
+    if (!in) {
+        return false;
+    }
+
+    // Grouped by file in table order, each file's sorted and apart, and
+    // never more data between them than the file stores
+    holes.reserve(records.size());
+    u64 end = 0;
+    u64 data_before = 0;
+    for (size_t h = 0; h < records.size(); ++h) {
+        const HoleRecord &record = records[h];
+        if (record.file >= files.size() || record.length == 0 ||
+            files[record.file].type != ArchiveFile::FileType::Regular) {
+            return false;
+        }
+        ArchiveFile &file_entry = files[record.file];
+        if (file_entry.hole_count == 0) {
+            if (h > 0 && record.file <= records[h - 1].file) {
+                return false;
+            }
+            file_entry.first_hole = static_cast<u32>(h);
+            end = 0;
+            data_before = 0;
+        } else if (record.file != records[h - 1].file ||
+                   record.offset <= end) {
+            return false;
+        }
+        data_before += record.offset - end;
+        if (data_before > file_entry.data_length ||
+            record.length > UINT64_MAX - record.offset) {
+            return false;
+        }
+        end = record.offset + record.length;
+        ++file_entry.hole_count;
+        holes.push_back({record.offset, record.length});
+    }
+    return true;
+}
+
+bool Archive::read_file_stats(istream &in, u64 archive_size) {
+    u64 stat_count = 0;
+    in.read(reinterpret_cast<char *>(&stat_count), sizeof(stat_count));
+    const u64 position = static_cast<u64>(in.tellg());
+    if (!in || stat_count != files.size() || position > archive_size ||
+        stat_count > (archive_size - position) / sizeof(StatRecord)) {
+        return false;
+    }
+    vector<StatRecord> records(static_cast<size_t>(stat_count));
+    in.read(reinterpret_cast<char *>(records.data()),
+            static_cast<streamsize>(stat_count * sizeof(StatRecord)));
+    if (!in) {
+        return false;
+    }
+    for (size_t i = 0; i < records.size(); ++i) {
+        files[i].mtime = records[i].mtime;
+        files[i].inode = records[i].inode;
+    }
+    return true;
+}
+
+void Archive::write_trailer(ostream &out, u64 data_size,
+                            span<const u32> crcs) const {
+    ArchiveFooter footer;
+    footer.data_size = data_size;
+    footer.table_offset = static_cast<u64>(out.tellp());
+    std::memcpy(footer.magic, FOOTER_MAGIC, sizeof(footer.magic));
+
+    write_file_table(out, crcs);
+    out.write(reinterpret_cast<const char *>(&footer), sizeof(footer));
+}
+
+bool Archive::read_trailer(istream &in, u64 archive_size) {
+    // Streamed archives have a copy of the table in front of the data, the
+    // one at the end is the one with the CRCs
+    if (is_streamed()) {
+        StreamPrologue prologue;
+        in.read(reinterpret_cast<char *>(&prologue), sizeof(prologue));
+        if (!in || prologue.table_size > archive_size) {
+            return false;
+        }
+        data_section_offset =
+            sizeof(ArchiveHeader) + sizeof(prologue) + prologue.table_size;
+    }
+    if (archive_size < data_section_offset + sizeof(ArchiveFooter)) {
+        return false;
+    }
+
+    ArchiveFooter footer;
+    const u64 footer_offset = archive_size - sizeof(ArchiveFooter);
+    in.seekg(static_cast<streamoff>(footer_offset));
+    in.read(reinterpret_cast<char *>(&footer), sizeof(footer));
+    if (!in ||
+        std::memcmp(footer.magic, FOOTER_MAGIC, sizeof(footer.magic)) != 0 ||
+        footer.data_size > footer_offset - data_section_offset ||
+        footer.table_offset < data_section_offset + footer.data_size ||
+        footer.table_offset > footer_offset) {
+        return false;
+    }
+    stored_data_size = footer.data_size;
+    loaded_size = footer.data_size;
+
+    // The block index sits between the data and the table
+    if (is_compressed()) {
+        in.seekg(static_cast<streamoff>(data_section_offset +
+                                        footer.data_size));
+        if (!read_block_index(in, footer.data_size) ||
+            static_cast<u64>(in.tellg()) > footer.table_offset) {
+            return false;
+        }
+        loaded_size = 0;
+        for (const auto &block : blocks) {
+            loaded_size += block.raw_size;
+        }
+    }
+
+    // Then the extent map, file offsets go up to its logical size
+    if (is_deduplicated()) {
+        if (!is_compressed()) {
+            in.seekg(static_cast<streamoff>(data_section_offset +
+                                            footer.data_size));
+        }
+        if (!read_extent_map(in, loaded_size, footer.table_offset)) {
+            return false;
+        }
+        loaded_size = extents.empty()
+                          ? 0
+                          : extents.back().offset + extents.back().length;
+    }
+
+    // Nor could they go back to the header for the CRC, it's right in front
+    // of the table
+    if (is_streamed()) {
+        if (footer.table_offset <
+            data_section_offset + footer.data_size + sizeof(header.crc32)) {
+            return false;
+        }
+        in.seekg(static_cast<streamoff>(footer.table_offset -
+                                        sizeof(header.crc32)));
+        in.read(reinterpret_cast<char *>(&header.crc32),
+                sizeof(header.crc32));
+    }
+
+    in.seekg(static_cast<streamoff>(footer.table_offset));
+    return read_file_table(in, footer_offset);
+}
+
+void Archive::write_extent_map(ostream &out,
+                               const vector<ArchiveExtent> &map) const {
+    metrics::Scope timing(metrics::Timer::Table);
+    const u64 extent_count = map.size();
+    out.write(reinterpret_cast<const char *>(&extent_count),
+              sizeof(extent_count));
+    out.write(reinterpret_cast<const char *>(map.data()),
+              static_cast<streamsize>(extent_count * sizeof(ArchiveExtent)));
+}
+
+bool Archive::read_extent_map(istream &in, u64 stored_size, u64 end) {
+    metrics::Scope timing(metrics::Timer::Table);
+    u64 extent_count = 0;
+    in.read(reinterpret_cast<char *>(&extent_count), sizeof(extent_count));
+    const u64 position = static_cast<u64>(in.tellg());
+    if (!in || position > end ||
+        extent_count > (end - position) / sizeof(ArchiveExtent)) {
+        return false;
+    }
+
+    extents.resize(static_cast<size_t>(extent_count));
+    in.read(reinterpret_cast<char *>(extents.data()),
+            static_cast<streamsize>(extent_count * sizeof(ArchiveExtent)));
+    if (!in) {
+        return false;
+    }
+
+    // Lookups binary search the map, so it has to cover the logical data
+    // front to back without gaps
+    u64 expected_offset = 0;
+    for (const auto &extent : extents) {
+        if (extent.offset != expected_offset || extent.length == 0 ||
+            extent.stored_offset > stored_size ||
+            extent.length > stored_size - extent.stored_offset) {
+            return false;
+        }
+        expected_offset += extent.length;
+    }
+    return true;
+}
+
+const ArchiveExtent *Archive::find_extent(u64 offset) const {
+    auto it = std::upper_bound(
+        extents.begin(), extents.end(), offset,
+        [](u64 value, const ArchiveExtent &extent) {
+            return value < extent.offset;
+        });
+    if (it == extents.begin()) {
+        return nullptr;
+    }
+    --it;
+    return offset < it->offset + it->length ? &*it : nullptr;
+}
+
+// The loaded volume data at `offset` is stored in, as far as extraction
+// needs to know to keep every volume busy. 0 for a single file.
+size_t Archive::volume_of(u64 offset) const {
+    if (loaded_volumes <= 1 || offset >= base_size) {
+        return 0;
+    }
+    if (!extents.empty()) {
+        const ArchiveExtent *extent = find_extent(offset);
+        offset = extent != nullptr
+                     ? extent->stored_offset + (offset - extent->offset)
+                     : 0;
+    }
+    if (is_compressed()) {
+        const u64 block = offset / block_size;
+        offset = block < blocks.size() ? blocks[block].offset : 0;
+    }
+    return std::min(
+        static_cast<size_t>((data_section_offset + offset) / volume_size),
+        loaded_volumes - 1);
+}
+
+// Turns decoded stored data into the logical data files refer to
+bool Archive::expand_extents(vector<u8> &stored) const {
+    if (extents.empty()) {
+        return true;
+    }
+    const ArchiveExtent &last = extents.back();
+    vector<u8> logical(static_cast<size_t>(last.offset + last.length));
+    for (const auto &extent : extents) {
+        if (extent.stored_offset + extent.length > stored.size()) {
+            return false;
+        }
+        std::memcpy(logical.data() + extent.offset,
+                    stored.data() + extent.stored_offset,
+                    static_cast<size_t>(extent.length));
+    }
+    stored = std::move(logical);
+    return true;
+}
+
+// Streamed files are copied into uncompressed archives by the kernel, which
+// needs a descriptor of the archive next to the stream writing it
+int Archive::open_copy_target(const string &path) const {
+#ifdef __unix__
+    if (codec == ArchiveCodec::Store && !dedup && !stream_sources.empty()) {
+        metrics::count(metrics::Counter::Syscalls);
+        return ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+    }
+#else
+    (void)path;
+#endif
+    return -1;
+}
+
+void Archive::close_copy_fd(int fd) {
+#ifdef __unix__
+    if (fd != -1) {
+        metrics::count(metrics::Counter::Syscalls);
+        ::close(fd);
+    }
+#else
+    (void)fd;
+#endif
+}
+
+// Archives are written next to the target and renamed over it, so the old
+// archive stays readable while its data is copied
+static string temporary_path(const string &output_path) {
+    return output_path + ".tmp";
+}
+
+// An archive loaded from elsewhere can name a codec this build doesn't have
+static bool check_codec(ArchiveCodec codec) {
+    if (find_codec(codec) == nullptr) {
+        cerr << "The archive's codec isn't available in this build\n";
+        return false;
+    }
+    return true;
+}
+
+static bool replace_with(const string &temp_path, const string &output_path) {
+    std::error_code ec;
+    fs::rename(temp_path, output_path, ec);
+    if (ec) {
+        cerr << "Failed to write archive: " << output_path << ": "
+             << ec.message() << '\n';
+        fs::remove(temp_path, ec);
+        return false;
+    }
+    return true;
+}
+
+// Everything from the header to the footer, the header last once the CRC
+// is known. `out` starts out empty.
+bool Archive::write_sections(ostream &out, size_t num_threads,
+                             int out_fd) const {
+    ArchiveHeader header_copy = header;
+    header_copy.version = ARCHIVE_VERSION;
+    auto set_flag = [&header_copy](ArchiveFlag flag, bool set) {
+        if (set) {
+            header_copy.flags |= static_cast<u8>(flag);
+        } else {
+            header_copy.flags &= static_cast<u8>(~static_cast<u8>(flag));
+        }
+    };
+    set_flag(ArchiveFlag::Compressed, codec != ArchiveCodec::Store);
+    set_flag(ArchiveFlag::Deduplicated, dedup);
+    set_flag(ArchiveFlag::Streamed, false);
+
+    // The CRC is only known once the data went through, it gets patched in
+    // at the end
+    out.write(reinterpret_cast<const char *>(&header_copy),
+              sizeof(header_copy));
+
+    // The CRC always covers the decoded data, the codec is a storage detail
+    vector<ArchiveBlock> index;
+    vector<ArchiveExtent> extent_map;
+    vector<u32> file_crcs;
+    u32 crc = 0;
+    const u64 data_size = write_data_section(
+        out, num_threads, crc, index, extent_map, file_crcs, 0, 0, out_fd);
+    if (codec != ArchiveCodec::Store) {
+        write_block_index(out, index);
+    }
+    if (dedup) {
+        write_extent_map(out, extent_map);
+    }
+    write_trailer(out, data_size, file_crcs);
+
+    header_copy.crc32 = crc;
+    out.seekp(0);
+    out.write(reinterpret_cast<const char *>(&header_copy),
+              sizeof(header_copy));
+    out.flush();
+    return out.good();
+}
+
+bool Archive::write_archive(const string &output_path,
+                            size_t num_threads) const {
+    if (!check_codec(codec)) {
+        return false;
+    }
+    // Volumes are written in place of the file, the kernel can't copy into
+    // them since a member may straddle two
+    if (volume_size > 0) {
+        VolumeWriter volumes(output_path, volume_dirs, volume_size);
+        bool written = false;
+        {
+            VolumeOutputBuffer buffer(volumes);
+            ostream out(&buffer);
+            written = write_sections(out, num_threads, -1);
+        }
+        if (!written || !volumes.commit()) {
+            cerr << "Failed to write archive: " << output_path;
+            if (volumes.error() != 0) {
+                cerr << ": "
+                     << std::error_code(volumes.error(), std::system_category())
+                            .message();
+            }
+            cerr << '\n';
+            return false;
+        }
+        return true;
+    }
+
+    const string temp_path = temporary_path(output_path);
+    ofstream out(temp_path, ios::binary);
+    if (!out) {
+        cerr << "Failed to open output: " << output_path << '\n';
+        return false;
+    }
+
+    const int out_fd = open_copy_target(temp_path);
+    const bool written = write_sections(out, num_threads, out_fd);
+    close_copy_fd(out_fd);
+    out.close();
+
+    if (!written || !out) {
+        cerr << "Failed to write archive: " << output_path << '\n';
+        std::error_code ec;
+        fs::remove(temp_path, ec);
+        return false;
+    }
+    return replace_with(temp_path, output_path);
+}
+
+bool Archive::append(size_t num_threads) {
+    compact_files();
+    if (archive_file_path.empty()) {
+        cerr << "Archive wasn't loaded from a file, nothing to append to\n";
+        return false;
+    }
+    if (!check_codec(codec)) {
+        return false;
+    }
+    // The last block and the members' places in the file may change
+    if (cache != nullptr) {
+        cache->clear();
+    }
+
+    if (num_threads == 0) {
+        num_threads = thread_count > 0 ? thread_count
+                                       : std::thread::hardware_concurrency();
+    }
+    if (num_threads > 1 && thread_pool.size() != num_threads) {
+        thread_pool.resize(num_threads);
+    }
+
+    // Appending keeps every existing block, so the storage settings have to
+    // match what the archive was written with
+    const bool compressed = is_compressed();
+    bool same_layout = codec == ArchiveCodec::Store;
+    if (compressed) {
+        same_layout = codec != ArchiveCodec::Store &&
+                      (blocks.size() <= 1 || blocks[0].raw_size == block_size);
+    }
+    // The stored data of a deduplicated archive doesn't line up with file
+    // offsets, so it's rewritten instead. So are streamed ones, their copy of
+    // the table up front would be out of date.
+    if (dedup || is_deduplicated() || is_streamed()) {
+        same_layout = false;
+    }
+    // Volumes are always written whole, and so is an archive that moves into
+    // or out of them
+    if (volume_size > 0 || loaded_volumes > 0) {
+        same_layout = false;
+    }
+    if (!same_layout) {
+        if (verbose) {
+            cout << "Storage settings changed, rewriting " << archive_file_path
+                 << '\n';
+        }
+        return write_archive(archive_file_path, num_threads);
+    }
+
+    // New data goes where the old block index and table were. A partial last
+    // block gets decoded and encoded again together with the new data, it's
+    // read in full before anything is written since it's under block_size.
+    u64 from = loaded_size;
+    u64 stored_from = stored_data_size;
+    u32 crc = header.crc32;
+    size_t kept_blocks = blocks.size();
+    if (compressed && !blocks.empty() && blocks.back().raw_size < block_size) {
+        --kept_blocks;
+        from = static_cast<u64>(kept_blocks) * block_size;
+        stored_from = blocks.back().offset;
+        crc = 0;
+        for (size_t b = 0; b < kept_blocks; ++b) {
+            crc = crc32c_combine(crc, blocks[b].crc32c, blocks[b].raw_size);
+        }
+    }
+
+    fstream out(archive_file_path, ios::binary | ios::in | ios::out);
+    if (!out) {
+        cerr << "Failed to open archive for appending: " << archive_file_path
+             << '\n';
+        return false;
+    }
+    out.seekp(static_cast<streamoff>(data_section_offset + stored_from));
+
+    vector<ArchiveBlock> index(blocks.begin(),
+                               blocks.begin() +
+                                   static_cast<ptrdiff_t>(kept_blocks));
+    vector<ArchiveExtent> extent_map;
+    vector<u32> file_crcs;
+    const int out_fd = open_copy_target(archive_file_path);
+    const u64 data_size =
+        write_data_section(out, num_threads, crc, index, extent_map,
+                           file_crcs, from, stored_from, out_fd);
+    close_copy_fd(out_fd);
+    if (compressed) {
+        write_block_index(out, index);
+    }
+    write_trailer(out, data_size, file_crcs);
+    const u64 archive_size = static_cast<u64>(out.tellp());
+
+    // The table was written in the current format
+    ArchiveHeader header_copy = header;
+    header_copy.version = ARCHIVE_VERSION;
+    header_copy.crc32 = crc;
+    out.seekp(0);
+    out.write(reinterpret_cast<const char *>(&header_copy),
+              sizeof(header_copy));
+    out.close();
+
+    if (!out) {
+        cerr << "Failed to append to archive: " << archive_file_path << '\n';
+        return false;
+    }
+
+    // The new table can be shorter than the old one if files were removed
+    std::error_code ec;
+    fs::resize_file(archive_file_path, archive_size, ec);
+    if (ec) {
+        cerr << "Failed to append to archive: " << archive_file_path << ": "
+             << ec.message() << '\n';
+        return false;
+    }
+
+    if (verbose) {
+        cout << "Appended " << data_end() - from << " bytes to "
+             << archive_file_path << '\n';
+    }
+    return true;
+}
+
+void Archive::compress(const string &output_path) const {
+    compact_files();
+    write_archive(output_path, 1);
+}
+
+void Archive::compress_parallel(const string &output_path,
+                                size_t num_threads) const {
+    compact_files();
+    // Determine optimal thread count
+    if (num_threads == 0) {
+        num_threads = thread_count > 0 ? thread_count
+                                       : std::thread::hardware_concurrency();
+    }
+
+    num_threads = std::min(num_threads, files.size());
+
+    if (num_threads <= 1) {
+        // Fallback to single-thread
+        compress(output_path);
+        return;
+    }
+
+    // Resize thread pool if needed
+    if (thread_pool.size() != num_threads) {
+        thread_pool.resize(num_threads);
+    }
+
+    // Encoded and streamed data sections are produced in order, the workers
+    // encode blocks ahead of the writer
+    if (codec != ArchiveCodec::Store || dedup || !stream_sources.empty() ||
+        base_size > 0) {
+        write_archive(output_path, num_threads);
+        if (verbose) {
+            cout << "Parallel compression completed successfully using thread "
+                    "pool with "
+                 << num_threads << " threads" << '\n';
+        }
+        return;
+    }
+
+    ArchiveHeader header_copy = header;
+    header_copy.version = ARCHIVE_VERSION;
+    header_copy.crc32 = checksum_parallel(data.data(), data.size());
+    header_copy.flags &= static_cast<u8>(
+        ~(static_cast<u8>(ArchiveFlag::Compressed) |
+          static_cast<u8>(ArchiveFlag::Streamed)));
+
+    // First, write header and trailer sequentially
+    const string temp_path = temporary_path(output_path);
+    std::unique_ptr<VolumeWriter> volumes;
+    ofstream file_out;
+    std::unique_ptr<VolumeOutputBuffer> volume_buffer;
+    std::unique_ptr<ostream> volume_out;
+    if (volume_size > 0) {
+        volumes =
+            make_unique<VolumeWriter>(output_path, volume_dirs, volume_size);
+        volume_buffer = make_unique<VolumeOutputBuffer>(*volumes);
+        volume_out = make_unique<ostream>(volume_buffer.get());
+    } else {
+        file_out.open(temp_path, ios::binary);
+        if (!file_out) {
+            cerr << "Failed to open output: " << output_path << '\n';
+            return;
+        }
+    }
+    ostream &out = volumes != nullptr ? *volume_out : file_out;
+
+    // Header Section
+    out.write(reinterpret_cast<const char *>(&header_copy),
+              sizeof(header_copy));
+    u64 data_start_offset = out.tellp();
+    u64 data_size = data.size();
+
+    // The trailer goes right behind where the data will be, which also
+    // pre-allocates the data section
+    MemberChecksums members(files, loaded_size, 0);
+    members.update(data.data(), data.size());
+    out.seekp(static_cast<streamoff>(data_start_offset + data_size));
+    write_trailer(out, data_size, members.result());
+    out.flush();
+    const bool trailer_written = out.good();
+    if (volumes != nullptr) {
+        volume_out.reset();
+        volume_buffer.reset();
+    } else {
+        file_out.close();
+    }
+    auto discard = [&] {
+        std::error_code ec;
+        if (volumes == nullptr) {
+            fs::remove(temp_path, ec);
+        }
+    };
+    if (!trailer_written || (volumes == nullptr && !file_out)) {
+        cerr << "Failed to write archive: " << output_path << '\n';
+        discard();
+        return;
+    }
+
+    // Now write data section in parallel using thread pool
+    if (data_size > 0) {
+        mutex error_mutex;
+        bool has_error = false;
+        string error_message;
+
+        // Calculate optimal chunk size for parallel processing
+        const size_t min_chunk_size =
+            256UL * 1024UL; // Increased to 256KB minimum
+        const size_t max_chunk_size = 8UL * 1024UL * 1024UL; // 8MB maximum
+
+        // Calculate chunk size based on data size and thread count
+        size_t optimal_chunk_size = data_size / (num_threads * 2);
+        optimal_chunk_size = std::max(
+            min_chunk_size, std::min(max_chunk_size, optimal_chunk_size));
+
+        const size_t chunk_size = optimal_chunk_size;
+
+        // Chunks never cross into the next volume, each volume has its own
+        // list. A single file is one volume.
+        struct Chunk {
+            u64 start;
+            u64 end;
+        };
+        const u64 span_size =
+            volumes != nullptr ? volume_size
+                               : data_start_offset + data_size;
+        const size_t volume_count = static_cast<size_t>(
+            (data_start_offset + data_size + span_size - 1) / span_size);
+        vector<vector<Chunk>> volume_chunks(volume_count);
+        size_t total_chunks = 0;
+        for (size_t v = 0; v < volume_count; ++v) {
+            const u64 begin =
+                std::max<u64>(v * span_size, data_start_offset) -
+                data_start_offset;
+            const u64 end =
+                std::min<u64>((v + 1) * span_size,
+                              data_start_offset + data_size) -
+                data_start_offset;
+            for (u64 chunk = begin; chunk < end; chunk += chunk_size) {
+                volume_chunks[v].push_back(
+                    {chunk, std::min<u64>(chunk + chunk_size, end)});
+            }
+            total_chunks += volume_chunks[v].size();
+        }
+        vector<atomic<size_t>> next_chunk(volume_count);
+        atomic<size_t> chunks_done{0};
+
+        // Pre-open file descriptors for each thread to reduce overhead,
+        // volumes are shared by all threads
+        vector<ofstream> thread_files;
+        if (volumes == nullptr) {
+            thread_files.resize(num_threads);
+            for (size_t i = 0; i < num_threads; ++i) {
+                thread_files[i].open(temp_path,
+                                     ios::binary | ios::in | ios::out);
+                if (!thread_files[i]) {
+                    cerr << "Failed to open file for thread " << i << ": "
+                         << output_path << '\n';
+                    discard();
+                    return;
+                }
+            }
+        } else if (!volumes->open_through(data_start_offset + data_size)) {
+            cerr << "Failed to open volumes of " << output_path << '\n';
+            return;
+        }
+
+        auto write_at = [&](size_t thread_id, u64 position, const u8 *bytes,
+                            size_t length) {
+            if (volumes != nullptr) {
+                return volumes->write(position, bytes, length);
+            }
+            ofstream &thread_file = thread_files[thread_id];
+            // Seek to the correct position in the data section
+            thread_file.seekp(static_cast<streamsize>(position));
+            // Write this chunk of data
+            thread_file.write(reinterpret_cast<const char *>(bytes),
+                              static_cast<streamsize>(length));
+            thread_file.flush(); // Ensure data is written
+            return thread_file.good();
+        };
+
+        // Task function for thread pool. Thread t starts on volume
+        // t % volume_count, so with enough threads every volume has its own
+        // writers, and helps with the others once its own is done.
+        auto write_chunk_task = [&](size_t thread_id) {
+            for (size_t k = 0; k < volume_count; ++k) {
+                const size_t volume = (thread_id + k) % volume_count;
+                const vector<Chunk> &chunks = volume_chunks[volume];
+                while (true) {
+                    size_t chunk_idx = next_chunk[volume].fetch_add(1);
+                    if (chunk_idx >= chunks.size())
+                        break;
+
+                    const Chunk &chunk = chunks[chunk_idx];
+                    size_t actual_chunk_size =
+                        static_cast<size_t>(chunk.end - chunk.start);
+
+                    try {
+                        metrics::Scope timing(metrics::Timer::Write);
+                        if (!write_at(thread_id,
+                                      data_start_offset + chunk.start,
+                                      data.data() + chunk.start,
+                                      actual_chunk_size)) {
+                            lock_guard<mutex> lock(error_mutex);
+                            has_error = true;
+                            error_message = "Failed to write data chunk";
+                            return;
+                        }
+                        metrics::count_io(metrics::Counter::BytesWritten,
+                                          actual_chunk_size);
+
+                        if (verbose) {
+                            lock_guard<mutex> lock(error_mutex);
+                            cout << "Thread " << thread_id << " wrote chunk "
+                                 << chunks_done.fetch_add(1) + 1 << "/"
+                                 << total_chunks << " (" << actual_chunk_size
+                                 << " bytes)" << '\n';
+                        }
+                    } catch (const exception &e) {
+                        lock_guard<mutex> lock(error_mutex);
+                        has_error = true;
+                        error_message =
+                            string("Error writing chunk: ") + e.what();
+                        return;
+                    }
+                }
+            }
+        };
+
+        // Submit tasks to thread pool
+        vector<future<void>> futures;
+        futures.reserve(num_threads);
+
+        for (size_t i = 0; i < num_threads; ++i) {
+            futures.push_back(thread_pool.enqueue(write_chunk_task, i));
+        }
+
+        // Wait for all tasks to complete
+        for (auto &future : futures) {
+            future.wait();
+        }
+
+        // Close all thread files
+        for (auto &file : thread_files) {
+            file.close();
+        }
+
+        // Check for errors
+        if (has_error) {
+            cerr << "Parallel compression failed: " << error_message << '\n';
+            discard();
+            return;
+        }
+
+        if (verbose) {
+            cout << "Parallel compression completed successfully using thread "
+                    "pool with "
+                 << num_threads << " threads" << '\n';
+        }
+    }
+
+    if (volumes != nullptr) {
+        if (!volumes->commit()) {
+            cerr << "Failed to write archive: " << output_path << '\n';
+        }
+        return;
+    }
+    replace_with(temp_path, output_path);
+}
+
+bool Archive::compress_stream(int fd, size_t num_threads) const {
+    compact_files();
+    if (dedup) {
+        cerr << "Deduplicated archives can't be streamed\n";
+        return false;
+    }
+    if (!check_codec(codec)) {
+        return false;
+    }
+    if (num_threads == 0) {
+        num_threads = thread_count > 0 ? thread_count
+                                       : std::thread::hardware_concurrency();
+    }
+    if (num_threads > 1 && thread_pool.size() != num_threads) {
+        thread_pool.resize(num_threads);
+    }
+
+    ArchiveHeader header_copy = header;
+    header_copy.version = ARCHIVE_VERSION;
+    header_copy.flags = static_cast<u8>(ArchiveFlag::Streamed);
+    if (codec != ArchiveCodec::Store) {
+        header_copy.flags |= static_cast<u8>(ArchiveFlag::Compressed);
+    }
+    header_copy.crc32 = 0; // comes after the data
+
+    FdOutputBuffer buffer(fd);
+    ostream out(&buffer);
+    out.write(reinterpret_cast<const char *>(&header_copy),
+              sizeof(header_copy));
+
+    // Offsets and sizes are all known up front, only the CRCs aren't
+    ostringstream table;
+    write_file_table(table, vector<u32>(files.size(), 0));
+    const string table_bytes = table.str();
+    StreamPrologue prologue;
+    prologue.data_length = data_end();
+    prologue.table_size = table_bytes.size();
+    out.write(reinterpret_cast<const char *>(&prologue), sizeof(prologue));
+    out.write(table_bytes.data(),
+              static_cast<streamsize>(table_bytes.size()));
+
+    // Files are read and blocks encoded on the pool ahead of the writer, the
+    // same as for a file
+    vector<ArchiveBlock> index;
+    vector<ArchiveExtent> extent_map;
+    vector<u32> file_crcs;
+    u32 crc = 0;
+    const u64 data_size = write_data_section(
+        out, num_threads, crc, index, extent_map, file_crcs, 0, 0, -1, true);
+    if (codec != ArchiveCodec::Store) {
+        write_block_index(out, index);
+    }
+    out.write(reinterpret_cast<const char *>(&crc), sizeof(crc));
+    write_trailer(out, data_size, file_crcs);
+    out.flush();
+
+    if (!out || buffer.error() != 0) {
+        cerr << "Failed to write archive stream";
+        if (buffer.error() != 0) {
+            cerr << ": "
+                 << std::error_code(buffer.error(), std::system_category())
+                        .message();
+        }
+        cerr << '\n';
+        return false;
+    }
+    if (verbose) {
+        cout << "Streamed " << data_end() << " bytes of data, "
+             << static_cast<u64>(out.tellp()) << " bytes in all\n";
+    }
+    return true;
+}
+
+namespace {
+
+u32 file_mode(const ArchiveFile &file_entry) {
+    return static_cast<u32>((file_entry.permissions[0] << 6) | // owner
+                            (file_entry.permissions[1] << 3) | // group
+                            (file_entry.permissions[2]));      // others
+}
+
+string_view parent_of(string_view path) {
+    const size_t slash = path.find_last_of('/');
+    return slash == string_view::npos ? string_view() : path.substr(0, slash);
+}
+
+string error_message(int error) {
+    return std::error_code(error, std::system_category()).message();
+}
+
+void make_directories(const fs::path &path) {
+    metrics::Scope timing(metrics::Timer::Write);
+    metrics::count(metrics::Counter::Syscalls);
+    fs::create_directories(path);
+}
+
+} // namespace
+
+// Where a member's stored bytes start in the archive file, or UINT64_MAX
+u64 Archive::file_offset(const ArchiveFile &file) const {
+    if (is_compressed() || file.offset >= base_size) {
+        return UINT64_MAX;
+    }
+    u64 stored_offset = file.offset;
+    if (!extents.empty()) {
+        const ArchiveExtent *extent = find_extent(file.offset);
+        if (extent == nullptr ||
+            file.offset + file.data_length > extent->offset + extent->length) {
+            return UINT64_MAX;
+        }
+        stored_offset = extent->stored_offset + (file.offset - extent->offset);
+    }
+    return data_section_offset + stored_offset;
+}
+
+// Where the kernel can copy a member's data from in the archive file,
+// UINT64_MAX if it has to be read. That's big uncompressed members stored in
+// one piece.
+u64 Archive::copy_offset(const ArchiveFile &file) const {
+    if (file.type != ArchiveFile::FileType::Regular || file.hole_count > 0 ||
+        file.data_length < KERNEL_COPY_MIN) {
+        return UINT64_MAX;
+    }
+    return file_offset(file);
+}
+
+// A descriptor to copy members from, -1 if nothing can be copied. Members
+// are still checked against their CRC, on the mapping, so the archive gets
+// mapped whatever its size.
+int Archive::open_copy_source() {
+#ifdef __unix__
+    if (is_compressed() || base_size == 0 || archive_file_path.empty() ||
+        loaded_volumes > 0 ||
+        std::none_of(files.begin(), files.end(), [this](const auto &file) {
+            return copy_offset(file) != UINT64_MAX;
+        })) {
+        return -1;
+    }
+    if (!mapped_archive->is_mapped() &&
+        !mapped_archive->map_file(archive_file_path)) {
+        return -1;
+    }
+    metrics::count(metrics::Counter::Syscalls);
+    return ::open(archive_file_path.c_str(), O_RDONLY | O_CLOEXEC);
+#else
+    return -1;
+#endif
+}
+
+namespace {
+
+// Members next to each other in the data section, read in one go. Gaps up
+// to MERGE_GAP are read along rather than costing another read, a run stops
+// growing at MAX_RUN.
+constexpr u64 MERGE_GAP = 256ULL * 1024;
+constexpr u64 MAX_RUN = 16ULL * 1024 * 1024;
+
+struct ExtractRun {
+    size_t first{}; // into the members, see plan_runs
+    size_t count{};
+    u64 begin{}; // logical range the run covers
+    u64 end{};
+};
+
+// Members are only merged with the one before them, so `members` (indices
+// into `files`) should be in data order for runs to get long. Compressed
+// runs may as well span a block's worth of gap, the block gets decoded
+// anyway.
+vector<ExtractRun> plan_runs(span<const ArchiveFile> files,
+                             span<const size_t> members, u64 gap) {
+    vector<ExtractRun> runs;
+    for (size_t m = 0; m < members.size(); ++m) {
+        const ArchiveFile &file_entry = files[members[m]];
+        const u64 end = file_entry.offset + file_entry.data_length;
+        if (!runs.empty()) {
+            ExtractRun &run = runs.back();
+            if (file_entry.offset >= run.end &&
+                file_entry.offset - run.end <= gap &&
+                end - run.begin <= MAX_RUN) {
+                run.end = end;
+                ++run.count;
+                continue;
+            }
+        }
+        runs.push_back({m, 1, file_entry.offset, end});
+    }
+    return runs;
+}
+
+// A member read for extraction, the view is empty if reading it failed
+struct MemberData {
+    size_t index{};
+    Archive::FileView view;
+};
+
+// Extraction's read stage. The reader start() puts on the pool takes tasks
+// from `next`, `read` turns each into items, and the writing thread gets
+// them from pop() in that order. Reading stays up to `depth` items and
+// MAX_READAHEAD bytes ahead, so the archive and the destination are both
+// kept busy without the archive ending up in memory. A depth of 0 runs
+// nothing on its own, pop() reads the next task itself. The reader is
+// stopped and waited for however the writer leaves, see stop().
+constexpr u64 MAX_READAHEAD = 64ULL * 1024 * 1024;
+
+template <class Task, class Item> class ReadAhead {
+  public:
+    using Emit = std::function<void(Item item, u64 bytes)>;
+    using Next = std::function<bool(Task &task)>;
+    using Read = std::function<void(const Task &task, const Emit &emit)>;
+
+    ReadAhead(size_t depth, Next next, Read read)
+        : depth(depth), next(std::move(next)), read(std::move(read)) {}
+    ~ReadAhead() { stop(); }
+    ReadAhead(const ReadAhead &) = delete;
+    ReadAhead &operator=(const ReadAhead &) = delete;
+
+    template <class Pool> void start(Pool &pool) {
+        if (depth > 0) {
+            reading = pool.enqueue([this] { run(); });
+        }
+    }
+
+    // Has the reader give up on what's left and waits for it. Called by the
+    // destructor too, so a writer that throws can't leave it reading into
+    // a gone queue.
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopped = true;
+        }
+        writable.notify_one();
+        if (reading.valid()) {
+            reading.wait();
+        }
+    }
+
+    bool pop(Item &item) {
+        if (depth == 0) {
+            Task task;
+            while (ready.empty() && next(task)) {
+                read(task, [this](Item read_item, u64) {
+                    ready.emplace_back(std::move(read_item), 0);
+                });
+            }
+            if (ready.empty()) {
+                return false;
+            }
+            item = std::move(ready.front().first);
+            ready.pop_front();
+            return true;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        readable.wait(lock, [this] { return !ready.empty() || done; });
+        if (ready.empty()) {
+            return false;
+        }
+        item = std::move(ready.front().first);
+        queued_bytes -= ready.front().second;
+        ready.pop_front();
+        writable.notify_one();
+        return true;
+    }
+
+  private:
+    void run() {
+        Task task;
+        const Emit emit = [this](Item item, u64 bytes) {
+            push(std::move(item), bytes);
+        };
+        try {
+            while (!stopping() && next(task)) {
+                read(task, emit);
+            }
+        } catch (...) {
+            finish();
+            throw;
+        }
+        finish();
+    }
+
+    bool stopping() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stopped;
+    }
+
+    // pop() runs dry from here on
+    void finish() {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+        readable.notify_one();
+    }
+
+    void push(Item item, u64 bytes) {
+        std::unique_lock<std::mutex> lock(mutex);
+        // Something always fits, a member bigger than the limit included
+        writable.wait(lock, [&] {
+            return stopped || ready.empty() ||
+                   (ready.size() < depth &&
+                    queued_bytes + bytes <= MAX_READAHEAD);
+        });
+        if (stopped) {
+            return; // nobody's going to take it
+        }
+        ready.emplace_back(std::move(item), bytes);
+        queued_bytes += bytes;
+        readable.notify_one();
+    }
+
+    const size_t depth;
+    Next next;
+    Read read;
+    std::mutex mutex;
+    std::condition_variable readable;
+    std::condition_variable writable;
+    std::deque<std::pair<Item, u64>> ready;
+    u64 queued_bytes{0};
+    bool done{false};
+    bool stopped{false};
+    std::future<void> reading;
+};
+
+} // namespace
+
+// Reads the members `run` names in one go, they have to make up a run as
+// plan_runs puts them together. `member` gets each one checked against its
+// CRC, or an empty view if it couldn't be read.
+void Archive::read_run(span<const size_t> run,
+                       const function<void(size_t, FileView)> &member) const {
+    const ArchiveFile &first = files[run.front()];
+    const ArchiveFile &last = files[run.back()];
+    FileView range;
+    if (run.size() == 1 ||
+        !view_range(first.offset,
+                    last.offset + last.data_length - first.offset, range)) {
+        // One damaged block shouldn't take the whole run down
+        for (size_t index : run) {
+            member(index, member_view(files[index]));
+        }
+        return;
+    }
+
+    for (size_t index : run) {
+        const ArchiveFile &file_entry = files[index];
+        FileView file_data(
+            range.bytes().subspan(
+                static_cast<size_t>(file_entry.offset - first.offset),
+                static_cast<size_t>(file_entry.data_length)),
+            range.owner);
+        if (file_entry.offset < base_size &&
+            !verify_member(file_entry, file_data.data())) {
+            file_data = {};
+        }
+        member(index, std::move(file_data));
+    }
+}
+
+u64 Archive::run_gap() const {
+    return is_compressed() ? std::max<u64>(MERGE_GAP, block_size) : MERGE_GAP;
+}
+
+size_t Archive::readahead_depth(size_t readers) const {
+    // The readers need threads of their own, without any they'd never run
+    return thread_pool.size() >= readers ? extract_readahead : 0;
+}
+
+void Archive::decompress() {
+    compact_files();
+    const int copy_source = open_copy_source();
+    // Extraction walks the data section front to back
+    mapped_archive->advise(MappedFile::Access::Sequential);
+
+    auto restore_permissions = [](const ArchiveFile &file_entry) {
+        metrics::Scope timing(metrics::Timer::Permissions);
+        metrics::count(metrics::Counter::Syscalls);
+        try {
+            fs::permissions(file_entry.path,
+                            static_cast<fs::perms>(file_mode(file_entry)));
+        } catch (const fs::filesystem_error &e) {
+            cerr << "Failed to set permissions for: " << file_entry.path << ": "
+                 << e.what() << '\n';
+        }
+    };
+
+    // Members with data get read ahead of the loop below, neighbours in one
+    // go, and come out of `ahead` in table order
+    vector<size_t> members;
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (files[i].type != ArchiveFile::FileType::Directory &&
+            files[i].data_length > 0) {
+            members.push_back(i);
+        }
+    }
+    const vector<ExtractRun> runs = plan_runs(files, members, run_gap());
+    size_t next_run = 0;
+    ReadAhead<ExtractRun, MemberData> ahead(
+        readahead_depth(1),
+        [&](ExtractRun &run) {
+            if (next_run == runs.size()) {
+                return false;
+            }
+            run = runs[next_run++];
+            return true;
+        },
+        [&](const ExtractRun &run, const auto &emit) {
+            read_run(span(members).subspan(run.first, run.count),
+                     [&](size_t index, FileView view) {
+                         const u64 bytes = view.size();
+                         emit({index, std::move(view)}, bytes);
+                     });
+        });
+    ahead.start(thread_pool);
+    auto next_member = [&]() {
+        MemberData member;
+        ahead.pop(member);
+        return std::move(member.view);
+    };
+
+    // Files and symlinks are queued and finish whenever the writer gets to
+    // them, the callbacks report errors
+    FileWriter writer;
+    string_view last_parent;
+
+    for (const auto &file_entry : files) {
+        if (verbose) {
+            cout << "Extracting: " << file_entry.path << '\n';
+        }
+
+        // Create parent directories if they don't exist. Siblings are next
+        // to each other in the table, so checking once per run of them is
+        // enough.
+        const string_view parent = parent_of(file_entry.path);
+        if (!parent.empty() && parent != last_parent) {
+            make_directories(fs::path(parent));
+            last_parent = parent;
+        }
+
+        switch (file_entry.type) {
+        case ArchiveFile::FileType::Directory: {
+            make_directories(file_entry.path);
+            restore_permissions(file_entry);
+            break;
+        }
+
+        case ArchiveFile::FileType::Regular: {
+            FileView file_data;
+            if (file_entry.data_length > 0) {
+                file_data = next_member();
+                if (file_data.empty()) {
+                    cerr << "Failed to read file data for: " << file_entry.path
+                         << '\n';
+                    continue;
+                }
+            }
+
+            // Written straight from the view, the callback keeps it alive.
+            // Big members only needed the view for their CRC and get copied
+            // from the archive by the kernel.
+            const u8 *bytes = file_data.data();
+            const size_t size = file_data.size();
+            const u64 source_offset =
+                copy_source != -1 ? copy_offset(file_entry) : UINT64_MAX;
+            auto done = [&file_entry,
+                         file_data = std::move(file_data)](int error) {
+                if (error != 0) {
+                    cerr << "Failed to create file: " << file_entry.path
+                         << ": " << error_message(error) << '\n';
+                }
+            };
+            if (source_offset != UINT64_MAX) {
+                writer.copy_file(file_entry.path, copy_source, source_offset,
+                                 size, file_mode(file_entry), std::move(done));
+            } else if (file_entry.hole_count > 0) {
+                writer.write_sparse_file(file_entry.path, bytes, size,
+                                         file_holes(file_entry),
+                                         file_mode(file_entry),
+                                         std::move(done));
+            } else {
+                writer.write_file(file_entry.path, bytes, size,
+                                  file_mode(file_entry), std::move(done));
+            }
+            break;
+        }
+
+        case ArchiveFile::FileType::Symlink: {
+            // For symlinks, the target path is stored in the data
+            if (file_entry.data_length == 0) {
+                restore_permissions(file_entry);
+                break;
+            }
+
+            auto target_data = next_member();
+            if (target_data.empty()) {
+                cerr << "Failed to read symlink target for: " << file_entry.path
+                     << '\n';
+                continue;
+            }
+
+            string_view target(
+                reinterpret_cast<const char *>(target_data.data()),
+                target_data.size());
+            writer.create_symlink(
+                target, file_entry.path,
+                [&file_entry, target_data = std::move(target_data),
+                 target, &restore_permissions](int error) {
+                    if (error != 0) {
+                        cerr << "Failed to create symlink: " << file_entry.path
+                             << " -> " << target << ": "
+                             << error_message(error) << '\n';
+                    }
+                    restore_permissions(file_entry);
+                });
+            break;
+        }
+        }
+    }
+
+    writer.flush();
+    ahead.stop();
+    close_copy_fd(copy_source);
+    mapped_archive->advise(MappedFile::Access::Normal);
+}
+
+namespace {
+
+// Regular files bigger than this get extracted in ranges by several workers
+constexpr u64 SPLIT_THRESHOLD = 64ULL * 1024 * 1024;
+constexpr u64 SPLIT_RANGE = 16ULL * 1024 * 1024;
+// What creating, writing and chmod-ing a file costs on top of its bytes,
+// without it ten thousand empty files would look like no work at all
+constexpr u64 FILE_COST = 64 * 1024;
+constexpr size_t NOT_SPLIT = static_cast<size_t>(-1);
+
+struct ExtractTask {
+    size_t file_index{};
+    u64 begin{}; // range of the member's data this task writes
+    u64 end{};
+    size_t split_index = NOT_SPLIT;
+    // Whole members read in one go, see plan_runs. file_index is the first
+    // and the range is all of theirs.
+    span<const size_t> run;
+
+    u64 cost() const {
+        return end - begin + FILE_COST * std::max<size_t>(run.size(), 1);
+    }
+};
+
+// `[...]` at the start of `pattern`: its length, or 0 if it's never closed
+// and so just a `[`. `matches` says whether it takes `c`.
+size_t char_class(string_view pattern, char c, bool &matches) {
+    size_t i = 1;
+    const bool negated =
+        i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^');
+    if (negated) {
+        ++i;
+    }
+    bool found = false;
+    for (const size_t first = i; i < pattern.size(); ++i) {
+        if (pattern[i] == ']' && i > first) {
+            matches = found != negated && c != '/';
+            return i + 1;
+        }
+        if (i + 2 < pattern.size() && pattern[i + 1] == '-' &&
+            pattern[i + 2] != ']') {
+            found = found || (c >= pattern[i] && c <= pattern[i + 2]);
+            i += 2;
+        } else {
+            found = found || c == pattern[i];
+        }
+    }
+    return 0;
+}
+
+// Whole path glob match. `*`, `?` and `[...]` stop at a `/`, `**` doesn't,
+// and a backslash takes the next character as it is.
+bool glob_match(string_view pattern, string_view path) {
+    while (!pattern.empty()) {
+        if (pattern[0] == '*') {
+            const bool across = pattern.size() > 1 && pattern[1] == '*';
+            pattern.remove_prefix(across ? 2 : 1);
+            // a/**/b takes a/b too
+            if (across && !pattern.empty() && pattern[0] == '/' &&
+                glob_match(pattern.substr(1), path)) {
+                return true;
+            }
+            for (size_t i = 0;; ++i) {
+                if (glob_match(pattern, path.substr(i))) {
+                    return true;
+                }
+                if (i == path.size() || (!across && path[i] == '/')) {
+                    return false;
+                }
+            }
+        }
+        if (path.empty()) {
+            return false;
+        }
+
+        size_t used = 1;
+        bool matches = false;
+        if (pattern[0] == '?') {
+            matches = path[0] != '/';
+        } else if (pattern[0] == '[' &&
+                   (used = char_class(pattern, path[0], matches)) > 0) {
+            // matches is set
+        } else {
+            used = pattern[0] == '\\' && pattern.size() > 1 ? 2 : 1;
+            matches = pattern[used - 1] == path[0];
+        }
+        if (!matches) {
+            return false;
+        }
+        pattern.remove_prefix(used);
+        path.remove_prefix(1);
+    }
+    return path.empty();
+}
+
+// A pattern that matches a directory takes everything under it along
+bool selects(string_view pattern, string_view path) {
+    size_t end = path.size();
+    while (end != string_view::npos && end > 0) {
+        if (glob_match(pattern, path.substr(0, end))) {
+            return true;
+        }
+        end = path.rfind('/', end - 1);
+    }
+    return false;
+}
+
+// One deque per worker, the owner pops from the front and an idle worker
+// steals from the back of the others. Everything is pushed before the workers
+// start, so finding all deques empty means the work is done.
+template <class Task> class WorkStealingQueue {
+  public:
+    explicit WorkStealingQueue(size_t workers) : queues(workers) {}
+
+    void push(size_t worker, Task task) {
+        queues[worker].tasks.push_back(std::move(task));
+    }
+
+    bool pop(size_t worker, Task &task) {
+        {
+            auto &own = queues[worker];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.front());
+                own.tasks.pop_front();
+                return true;
+            }
+        }
+
+        for (size_t i = 1; i < queues.size(); ++i) {
+            auto &victim = queues[(worker + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.back());
+                victim.tasks.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+  private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+    std::vector<Queue> queues;
+};
+
+} // namespace
+
+void Archive::decompress_parallel(size_t num_threads) {
+    compact_files();
+    // Determine optimal thread count
+    if (num_threads == 0) {
+        num_threads = thread_count > 0 ? thread_count
+                                       : std::thread::hardware_concurrency();
+        if (num_threads == 0)
+            num_threads = 4; // fallback
+    }
+
+    // Everything but directories becomes a task, big files become one task
+    // per range so a single huge member can't keep one worker busy alone.
+    // The rest are read in runs of neighbours.
+    std::vector<ExtractTask> tasks;
+    std::vector<size_t> split_files;
+    std::vector<size_t> members;
+    for (size_t i = 0; i < files.size(); ++i) {
+        const auto &file_entry = files[i];
+        if (file_entry.type == ArchiveFile::FileType::Directory) {
+            continue;
+        }
+
+#ifdef __unix__
+        if (file_entry.type == ArchiveFile::FileType::Regular &&
+            file_entry.data_length > SPLIT_THRESHOLD) {
+            for (u64 begin = 0; begin < file_entry.data_length;
+                 begin += SPLIT_RANGE) {
+                tasks.push_back(
+                    {i, begin,
+                     std::min(begin + SPLIT_RANGE, file_entry.data_length),
+                     split_files.size(),
+                     {}});
+            }
+            split_files.push_back(i);
+            continue;
+        }
+#endif
+        members.push_back(i);
+    }
+    for (const auto &run : plan_runs(files, members, run_gap())) {
+        tasks.push_back({members[run.first], 0, run.end - run.begin,
+                         NOT_SPLIT,
+                         span(members).subspan(run.first, run.count)});
+    }
+
+    // Limit threads for small workloads
+    num_threads = std::min(num_threads, std::max(tasks.size(), size_t(1)));
+    if (num_threads <= 1) {
+        // Fall back to single-threaded for small workloads
+        decompress();
+        return;
+    }
+
+    if (verbose) {
+        cout << "Using " << num_threads << " threads for extraction\n";
+    }
+
+    // Workers pick files in table order, which is roughly data order too
+    const int copy_source = open_copy_source();
+    mapped_archive->advise(MappedFile::Access::Sequential);
+
+    std::mutex cout_mutex;
+    std::mutex fs_mutex; // For directory creation and permission setting
+
+    // Create all directories first (single-threaded to avoid race conditions)
+    for (const auto &file_entry : files) {
+        if (file_entry.type == ArchiveFile::FileType::Directory) {
+            if (verbose) {
+                std::lock_guard<std::mutex> lock(cout_mutex);
+                cout << "Creating directory: " << file_entry.path << '\n';
+            }
+            make_directories(file_entry.path);
+
+            // Set directory permissions
+            metrics::Scope timing(metrics::Timer::Permissions);
+            metrics::count(metrics::Counter::Syscalls);
+            try {
+                fs::permissions(file_entry.path,
+                                static_cast<fs::perms>(file_mode(file_entry)));
+            } catch (const fs::filesystem_error &e) {
+                std::lock_guard<std::mutex> lock(cout_mutex);
+                cerr << "Failed to set permissions for directory: "
+                     << file_entry.path << ": " << e.what() << '\n';
+            }
+        }
+    }
+
+    // Create parent directories for all files first
+    string_view last_parent;
+    for (const auto &file_entry : files) {
+        if (file_entry.type != ArchiveFile::FileType::Directory) {
+            const string_view parent = parent_of(file_entry.path);
+            if (!parent.empty() && parent != last_parent) {
+                make_directories(fs::path(parent));
+                last_parent = parent;
+            }
+        }
+    }
+
+    // Split files are created at full size up front, their ranges then get
+    // written with pwrite in whatever order the workers reach them. Holes of
+    // sparse ones are just never written.
+    std::vector<std::atomic<size_t>> ranges_left(split_files.size());
+    std::vector<std::atomic<bool>> split_failed(split_files.size());
+    // Each range checksums what it wrote, the last one combines them in order
+    std::vector<std::vector<u32>> range_crcs(split_files.size());
+#ifdef __unix__
+    for (size_t s = 0; s < split_files.size(); ++s) {
+        const auto &file_entry = files[split_files[s]];
+        range_crcs[s].resize(
+            (file_entry.data_length + SPLIT_RANGE - 1) / SPLIT_RANGE);
+        int fd = ::open(fs::path(file_entry.path).c_str(),
+                        O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1 ||
+            ::ftruncate(fd, static_cast<off_t>(file_size(file_entry))) != 0) {
+            cerr << "Failed to create file: " << file_entry.path << '\n';
+            split_failed[s].store(true);
+        }
+        if (fd != -1) {
+            ::close(fd);
+        }
+        ranges_left[s].store(
+            (file_entry.data_length + SPLIT_RANGE - 1) / SPLIT_RANGE);
+    }
+#endif
+
+    auto set_permissions = [&](const ArchiveFile &file_entry) {
+        // Protect with mutex for thread safety
+        std::lock_guard<std::mutex> lock(fs_mutex);
+        metrics::Scope timing(metrics::Timer::Permissions);
+        metrics::count(metrics::Counter::Syscalls);
+        try {
+            fs::permissions(file_entry.path,
+                            static_cast<fs::perms>(file_mode(file_entry)));
+        } catch (const fs::filesystem_error &e) {
+            std::lock_guard<std::mutex> cout_lock(cout_mutex);
+            cerr << "Failed to set permissions for: " << file_entry.path
+                 << ": " << e.what() << '\n';
+        }
+    };
+
+    // What a task read, handed from the worker's read stage to its writes
+    struct TaskData {
+        ExtractTask task;
+        FileView view;
+        bool read{};
+    };
+
+    auto read_task = [&](const ExtractTask &task, const auto &emit) {
+        if (task.split_index == NOT_SPLIT) {
+            read_run(task.run, [&](size_t index, FileView view) {
+                ExtractTask member = task;
+                member.file_index = index;
+                const u64 bytes = view.size();
+                const bool read =
+                    !view.empty() || files[index].data_length == 0;
+                emit({member, std::move(view), read}, bytes);
+            });
+            return;
+        }
+
+        const ArchiveFile &file_entry = files[task.file_index];
+        TaskData item{task, {}, true};
+        if (!split_failed[task.split_index]) {
+            item.read = view_range(file_entry.offset + task.begin,
+                                   task.end - task.begin, item.view);
+            if (item.read) {
+                range_crcs[task.split_index][task.begin / SPLIT_RANGE] =
+                    crc32c(item.view.data(), item.view.size());
+            }
+        }
+        const u64 bytes = item.view.size();
+        emit(std::move(item), bytes);
+    };
+
+    // Regular files get their permissions as part of the write
+    auto extract_file = [&](const ArchiveFile &file_entry, FileView file_data,
+                            bool read, FileWriter &writer) {
+        if (verbose) {
+            std::lock_guard<std::mutex> lock(cout_mutex);
+            cout << "Extracting: " << file_entry.path << '\n';
+        }
+
+        switch (file_entry.type) {
+        case ArchiveFile::FileType::Regular: {
+            if (!read) {
+                std::lock_guard<std::mutex> lock(cout_mutex);
+                cerr << "Failed to read file data for: " << file_entry.path
+                     << '\n';
+                return;
+            }
+
+            const u8 *bytes = file_data.data();
+            const size_t size = file_data.size();
+            const u64 source_offset =
+                copy_source != -1 ? copy_offset(file_entry) : UINT64_MAX;
+            auto done = [&, file_data = std::move(file_data)](int error) {
+                if (error != 0) {
+                    std::lock_guard<std::mutex> lock(cout_mutex);
+                    cerr << "Failed to create file: " << file_entry.path
+                         << ": " << error_message(error) << '\n';
+                }
+            };
+            if (source_offset != UINT64_MAX) {
+                writer.copy_file(file_entry.path, copy_source, source_offset,
+                                 size, file_mode(file_entry), std::move(done));
+            } else if (file_entry.hole_count > 0) {
+                writer.write_sparse_file(file_entry.path, bytes, size,
+                                         file_holes(file_entry),
+                                         file_mode(file_entry),
+                                         std::move(done));
+            } else {
+                writer.write_file(file_entry.path, bytes, size,
+                                  file_mode(file_entry), std::move(done));
+            }
+            break;
+        }
+
+        case ArchiveFile::FileType::Symlink: {
+            if (file_entry.data_length == 0) {
+                set_permissions(file_entry);
+                break;
+            }
+
+            if (!read) {
+                std::lock_guard<std::mutex> lock(cout_mutex);
+                cerr << "Failed to read symlink target for: " << file_entry.path
+                     << '\n';
+                return;
+            }
+
+            string_view target(
+                reinterpret_cast<const char *>(file_data.data()),
+                file_data.size());
+            writer.create_symlink(
+                target, file_entry.path,
+                [&, target_data = std::move(file_data), target](int error) {
+                    if (error != 0) {
+                        std::lock_guard<std::mutex> lock(cout_mutex);
+                        cerr << "Failed to create symlink: " << file_entry.path
+                             << " -> " << target << ": "
+                             << error_message(error) << '\n';
+                    }
+                    set_permissions(file_entry);
+                });
+            break;
+        }
+
+        case ArchiveFile::FileType::Directory:
+            // Already handled above
+            return;
+        }
+    };
+
+    // Returns false if the range couldn't be written
+    auto extract_range = [&](const ExtractTask &task, const FileView &range,
+                             bool read) {
+        const auto &file_entry = files[task.file_index];
+#ifdef __unix__
+        if (split_failed[task.split_index]) {
+            return false;
+        }
+        if (verbose && task.begin == 0) {
+            std::lock_guard<std::mutex> lock(cout_mutex);
+            cout << "Extracting: " << file_entry.path << '\n';
+        }
+
+        if (!read) {
+            std::lock_guard<std::mutex> lock(cout_mutex);
+            cerr << "Failed to read file data for: " << file_entry.path << '\n';
+            return false;
+        }
+
+        metrics::Scope timing(metrics::Timer::Write);
+        int fd = ::open(fs::path(file_entry.path).c_str(), O_WRONLY);
+        metrics::count(metrics::Counter::Syscalls);
+        if (fd == -1) {
+            std::lock_guard<std::mutex> lock(cout_mutex);
+            cerr << "Failed to open file: " << file_entry.path << '\n';
+            return false;
+        }
+
+        // The kernel copies what it can, the rest is written from the view
+        u64 copied = 0;
+        const u64 source_offset =
+            copy_source != -1 ? copy_offset(file_entry) : UINT64_MAX;
+        if (source_offset != UINT64_MAX) {
+            copied = copy_range(copy_source, source_offset + task.begin, fd,
+                                task.begin, range.size());
+        }
+
+        // The range is of the stored data, each run of it goes where it is
+        // in the file
+        size_t remaining = range.size() - static_cast<size_t>(copied);
+        for_each_data_run(
+            file_holes(file_entry), file_entry.data_length, 0, UINT64_MAX,
+            [&](u64 offset, u64 stored, u64 length) {
+                const u64 from = std::max(stored, task.begin + copied);
+                const u64 to = std::min(stored + length, task.end);
+                if (from >= to) {
+                    return;
+                }
+                const u8 *bytes = range.data() + (from - task.begin);
+                off_t position = static_cast<off_t>(offset + (from - stored));
+                for (u64 left = to - from; left > 0;) {
+                    ssize_t written = ::pwrite(fd, bytes, left, position);
+                    if (written <= 0) {
+                        return;
+                    }
+                    metrics::count_io(metrics::Counter::BytesWritten,
+                                      static_cast<u64>(written));
+                    bytes += written;
+                    left -= static_cast<u64>(written);
+                    remaining -= static_cast<size_t>(written);
+                    position += written;
+                }
+            });
+        ::close(fd);
+        metrics::count(metrics::Counter::Syscalls);
+
+        if (remaining > 0) {
+            std::lock_guard<std::mutex> lock(cout_mutex);
+            cerr << "Failed to write file: " << file_entry.path << '\n';
+            return false;
+        }
+        return true;
+#else
+        (void)task;
+        (void)file_entry;
+        (void)range;
+        (void)read;
+        return false;
+#endif
+    };
+
+    auto verify_split = [](const ArchiveFile &file_entry,
+                           const std::vector<u32> &crcs) {
+        u32 crc = 0;
+        for (size_t r = 0; r < crcs.size(); ++r) {
+            const u64 begin = r * SPLIT_RANGE;
+            crc = crc32c_combine(
+                crc, crcs[r],
+                std::min(SPLIT_RANGE, file_entry.data_length - begin));
+        }
+        return crc == file_entry.crc32c;
+    };
+
+    // Deal the biggest tasks first, each to whichever worker has the fewest
+    // bytes so far, then let stealing even out whatever the estimate got wrong
+    std::sort(tasks.begin(), tasks.end(),
+              [](const ExtractTask &a, const ExtractTask &b) {
+                  return a.cost() > b.cost();
+              });
+
+    // Volumes get workers of their own, worker w reads from volume
+    // w % volumes (or the other way round if there are more volumes), so
+    // no device sits idle while the workers are all on one of the others
+    const size_t volumes = std::max<size_t>(loaded_volumes, 1);
+    WorkStealingQueue<ExtractTask> queue(num_threads);
+    std::vector<u64> worker_load(num_threads, 0);
+    for (const auto &task : tasks) {
+        const size_t volume =
+            volume_of(files[task.file_index].offset + task.begin);
+        size_t worker = volume % num_threads;
+        for (size_t w = worker; w < num_threads; w += volumes) {
+            if (worker_load[w] < worker_load[worker]) {
+                worker = w;
+            }
+        }
+        worker_load[worker] += task.cost();
+        queue.push(worker, task);
+    }
+
+    // Each worker's reads run ahead of its writes on a thread of their own,
+    // so the pool needs twice the workers
+    const size_t pool_size =
+        extract_readahead > 0 ? num_threads * 2 : num_threads;
+    if (thread_pool.size() != pool_size) {
+        thread_pool.resize(pool_size);
+    }
+    const size_t depth = readahead_depth(pool_size);
+
+    auto worker_task = [&](size_t worker) {
+        ReadAhead<ExtractTask, TaskData> ahead(
+            depth,
+            [&](ExtractTask &task) { return queue.pop(worker, task); },
+            read_task);
+        ahead.start(thread_pool);
+
+        FileWriter writer;
+        TaskData item;
+        while (ahead.pop(item)) {
+            const ExtractTask &task = item.task;
+            if (task.split_index == NOT_SPLIT) {
+                extract_file(files[task.file_index], std::move(item.view),
+                             item.read, writer);
+                continue;
+            }
+
+            if (!extract_range(task, item.view, item.read)) {
+                split_failed[task.split_index].store(true);
+            }
+            // Whoever writes the last range finishes the file off
+            if (ranges_left[task.split_index].fetch_sub(1) == 1 &&
+                !split_failed[task.split_index]) {
+                const ArchiveFile &file_entry = files[task.file_index];
+                const auto &crcs = range_crcs[task.split_index];
+                if (file_entry.offset < base_size &&
+                    !verify_split(file_entry, crcs)) {
+                    std::lock_guard<std::mutex> lock(cout_mutex);
+                    cerr << "CRC32C mismatch for " << file_entry.path
+                         << "! The archive may be corrupted.\n";
+                    std::error_code ec;
+                    fs::remove(fs::path(file_entry.path), ec);
+                    continue;
+                }
+                set_permissions(file_entry);
+            }
+        }
+    };
+
+    std::vector<std::future<void>> futures;
+    futures.reserve(num_threads);
+    for (size_t t = 0; t < num_threads; ++t) {
+        futures.push_back(thread_pool.enqueue(worker_task, t));
+    }
+
+    // Wait for all tasks to complete
+    for (auto &future : futures) {
+        future.wait();
+    }
+
+    close_copy_fd(copy_source);
+    mapped_archive->advise(MappedFile::Access::Normal);
+
+    if (verbose) {
+        cout << "Extracted" << "\n";
+    }
+}
+
+bool Archive::match_members(span<const string> include,
+                            span<const string> exclude,
+                            vector<size_t> &selected) const {
+    vector<string> included;
+    vector<string> excluded;
+    for (const auto &pattern : include) {
+        included.push_back(normalize_path(pattern));
+    }
+    for (const auto &pattern : exclude) {
+        excluded.push_back(normalize_path(pattern));
+    }
+
+    // Plain paths of files come straight from the index, only globs and
+    // directories need a pass over the table
+    vector<char> chosen(files.size(), included.empty() ? 1 : 0);
+    vector<char> matched(included.size(), 0);
+    vector<size_t> scanned;
+    for (size_t i = 0; i < included.size(); ++i) {
+        const string &pattern = included[i];
+        if (pattern.find_first_of("*?[\\") == string::npos) {
+            auto it = path_index.find(pattern);
+            if (it != path_index.end() &&
+                files[it->second].type != ArchiveFile::FileType::Directory) {
+                chosen[it->second] = 1;
+                matched[i] = 1;
+                continue;
+            }
+        }
+        scanned.push_back(i);
+    }
+    if (!scanned.empty()) {
+        for (size_t f = 0; f < files.size(); ++f) {
+            for (size_t i : scanned) {
+                if ((!chosen[f] || !matched[i]) &&
+                    selects(included[i], files[f].path)) {
+                    chosen[f] = 1;
+                    matched[i] = 1;
+                }
+            }
+        }
+    }
+
+    bool complete = true;
+    for (size_t i = 0; i < included.size(); ++i) {
+        if (!matched[i]) {
+            cerr << "Not found in archive: " << include[i] << '\n';
+            complete = false;
+        }
+    }
+
+    selected.clear();
+    for (size_t f = 0; f < files.size(); ++f) {
+        if (chosen[f] &&
+            std::none_of(excluded.begin(), excluded.end(),
+                         [&](const string &pattern) {
+                             return selects(pattern, files[f].path);
+                         })) {
+            selected.push_back(f);
+        }
+    }
+    return complete;
+}
+
+bool Archive::decompress_matching(span<const string> include,
+                                  span<const string> exclude,
+                                  size_t num_threads) {
+    compact_files();
+    vector<size_t> selected;
+    bool ok = match_members(include, exclude, selected);
+    if (num_threads == 0) {
+        num_threads = thread_count > 0 ? thread_count
+                                       : std::thread::hardware_concurrency();
+    }
+
+    std::mutex cout_mutex;
+    std::mutex fs_mutex;
+    auto set_permissions = [&](const ArchiveFile &file_entry) {
+        std::lock_guard<std::mutex> lock(fs_mutex);
+        metrics::Scope timing(metrics::Timer::Permissions);
+        metrics::count(metrics::Counter::Syscalls);
+        try {
+            fs::permissions(file_entry.path,
+                            static_cast<fs::perms>(file_mode(file_entry)));
+        } catch (const fs::filesystem_error &e) {
+            std::lock_guard<std::mutex> cout_lock(cout_mutex);
+            cerr << "Failed to set permissions for: " << file_entry.path
+                 << ": " << e.what() << '\n';
+        }
+    };
+
+    // Directories and the parents of everything else first, in table order.
+    // Symlinks come last, their permissions go to what they point at.
+    vector<size_t> members;
+    vector<size_t> symlinks;
+    string_view last_parent;
+    for (size_t index : selected) {
+        const ArchiveFile &file_entry = files[index];
+        if (file_entry.type == ArchiveFile::FileType::Directory) {
+            if (verbose) {
+                cout << "Creating directory: " << file_entry.path << '\n';
+            }
+            make_directories(file_entry.path);
+            set_permissions(file_entry);
+            continue;
+        }
+        const string_view parent = parent_of(file_entry.path);
+        if (!parent.empty() && parent != last_parent) {
+            make_directories(fs::path(parent));
+            last_parent = parent;
+        }
+        if (file_entry.type == ArchiveFile::FileType::Symlink) {
+            symlinks.push_back(index);
+        } else {
+            members.push_back(index);
+        }
+    }
+
+    // The rest in data order, neighbours merged into runs
+    std::stable_sort(members.begin(), members.end(),
+                     [this](size_t a, size_t b) {
+                         return files[a].offset < files[b].offset;
+                     });
+    const vector<ExtractRun> runs = plan_runs(files, members, run_gap());
+    if (verbose) {
+        cout << "Extracting " << members.size() << " of " << files.size()
+             << " entries in " << runs.size() << " reads\n";
+    }
+
+    const int copy_source = open_copy_source();
+    std::atomic<bool> failed{false};
+
+    auto write_member = [&](const ArchiveFile &file_entry, FileView file_data,
+                            FileWriter &writer) {
+        if (verbose) {
+            std::lock_guard<std::mutex> lock(cout_mutex);
+            cout << "Extracting: " << file_entry.path << '\n';
+        }
+
+        if (file_entry.type == ArchiveFile::FileType::Symlink) {
+            if (file_entry.data_length == 0) {
+                set_permissions(file_entry);
+                return;
+            }
+            string_view target(
+                reinterpret_cast<const char *>(file_data.data()),
+                file_data.size());
+            writer.create_symlink(
+                target, file_entry.path,
+                [&, file_data = std::move(file_data), target](int error) {
+                    if (error != 0) {
+                        std::lock_guard<std::mutex> lock(cout_mutex);
+                        cerr << "Failed to create symlink: " << file_entry.path
+                             << " -> " << target << ": "
+                             << error_message(error) << '\n';
+                        failed.store(true);
+                    }
+                    set_permissions(file_entry);
+                });
+            return;
+        }
+
+        const u8 *bytes = file_data.data();
+        const size_t size = file_data.size();
+        const u64 source_offset =
+            copy_source != -1 ? copy_offset(file_entry) : UINT64_MAX;
+        auto done = [&, file_data = std::move(file_data)](int error) {
+            if (error != 0) {
+                std::lock_guard<std::mutex> lock(cout_mutex);
+                cerr << "Failed to create file: " << file_entry.path << ": "
+                     << error_message(error) << '\n';
+                failed.store(true);
+            }
+        };
+        if (source_offset != UINT64_MAX) {
+            writer.copy_file(file_entry.path, copy_source, source_offset, size,
+                             file_mode(file_entry), std::move(done));
+        } else if (file_entry.hole_count > 0) {
+            writer.write_sparse_file(file_entry.path, bytes, size,
+                                     file_holes(file_entry),
+                                     file_mode(file_entry), std::move(done));
+        } else {
+            writer.write_file(file_entry.path, bytes, size,
+                              file_mode(file_entry), std::move(done));
+        }
+    };
+
+    // Each worker gets a stretch of consecutive runs, read ahead of its
+    // writes on a thread of their own. Stealing evens the stretches out.
+    num_threads =
+        std::clamp<size_t>(num_threads, 1, std::max<size_t>(runs.size(), 1));
+    WorkStealingQueue<size_t> queue(num_threads);
+    for (size_t r = 0; r < runs.size(); ++r) {
+        queue.push(r * num_threads / runs.size(), r);
+    }
+    const size_t readers = extract_readahead > 0 ? num_threads : 0;
+    if (num_threads > 1 && thread_pool.size() != num_threads + readers) {
+        thread_pool.resize(num_threads + readers);
+    }
+    const size_t depth =
+        readahead_depth(num_threads > 1 ? num_threads + readers : readers);
+
+    auto worker_task = [&](size_t worker) {
+        ReadAhead<size_t, MemberData> ahead(
+            depth, [&](size_t &run) { return queue.pop(worker, run); },
+            [&](const size_t &r, const auto &emit) {
+                const ExtractRun &run = runs[r];
+                read_run(span(members).subspan(run.first, run.count),
+                         [&](size_t index, FileView view) {
+                             const u64 bytes = view.size();
+                             emit({index, std::move(view)}, bytes);
+                         });
+            });
+        ahead.start(thread_pool);
+
+        FileWriter writer;
+        MemberData member;
+        while (ahead.pop(member)) {
+            const ArchiveFile &file_entry = files[member.index];
+            if (member.view.empty() && file_entry.data_length > 0) {
+                std::lock_guard<std::mutex> lock(cout_mutex);
+                cerr << "Failed to read file data for: " << file_entry.path
+                     << '\n';
+                failed.store(true);
+                continue;
+            }
+            write_member(file_entry, std::move(member.view), writer);
         }
+        writer.flush();
+    };
 
-        // Check for errors
-        if (has_error) {
-            cerr << "Parallel compression failed: " << error_message << '\n';
-            return;
+    if (num_threads == 1) {
+        worker_task(0);
+    } else {
+        vector<future<void>> futures;
+        futures.reserve(num_threads);
+        for (size_t t = 0; t < num_threads; ++t) {
+            futures.push_back(thread_pool.enqueue(worker_task, t));
+        }
+        for (auto &future : futures) {
+            future.wait();
         }
+    }
 
-        if (verbose) {
-            cout << "Parallel compression completed successfully using thread "
-                    "pool with "
-                 << num_threads << " threads" << '\n';
+    FileWriter writer;
+    for (size_t index : symlinks) {
+        const ArchiveFile &file_entry = files[index];
+        FileView target = member_view(file_entry);
+        if (target.empty() && file_entry.data_length > 0) {
+            cerr << "Failed to read symlink target for: " << file_entry.path
+                 << '\n';
+            failed.store(true);
+            continue;
         }
+        write_member(file_entry, std::move(target), writer);
     }
+    writer.flush();
+
+    close_copy_fd(copy_source);
+    return ok && !failed.load();
 }
 
-void Archive::decompress() {
-    for (const auto &file_entry : files) {
-        if (verbose) {
-            cout << "Extracting: " << file_entry.path << '\n';
-        }
+namespace {
 
-        // Create parent directories if they don't exist
-        fs::path file_path(file_entry.path);
-        if (file_path.has_parent_path()) {
-            fs::create_directories(file_path.parent_path());
-        }
+// A member of a streamed archive that comes in over several pieces, written
+// as they arrive. The holes of a sparse one are never written, the file gets
+// its size at the end.
+class PieceWriter {
+  public:
+    PieceWriter() = default;
+    ~PieceWriter() { finish(0, false, 0); }
+    PieceWriter(const PieceWriter &) = delete;
+    PieceWriter &operator=(const PieceWriter &) = delete;
 
-        switch (file_entry.type) {
-        case ArchiveFile::FileType::Directory: {
-            fs::create_directories(file_entry.path);
-            break;
+    void open(const string &path, u32 mode) {
+        failure = 0;
+#ifdef __unix__
+        metrics::Scope timing(metrics::Timer::Write);
+        metrics::count(metrics::Counter::Syscalls);
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    static_cast<mode_t>(mode));
+        if (fd == -1) {
+            failure = errno;
         }
+#else
+        (void)path;
+        (void)mode;
+        failure = ENOTSUP;
+#endif
+    }
 
-        case ArchiveFile::FileType::Regular: {
-            if (file_entry.data_length > 0) {
-                auto file_data = get_file_data(file_entry);
-                if (file_data.empty()) {
-                    cerr << "Failed to read file data for: " << file_entry.path
-                         << '\n';
-                    continue;
-                }
-
-                ofstream output_file(file_entry.path, ios::binary);
-                if (!output_file) {
-                    cerr << "Failed to create file: " << file_entry.path
-                         << '\n';
-                    continue;
-                }
+    void write(u64 offset, const u8 *bytes, size_t length) {
+#ifdef __unix__
+        metrics::Scope timing(metrics::Timer::Write);
+        while (failure == 0 && length > 0) {
+            const ssize_t written =
+                ::pwrite(fd, bytes, length, static_cast<off_t>(offset));
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                failure = written < 0 ? errno : EIO;
+                break;
+            }
+            metrics::count_io(metrics::Counter::BytesWritten,
+                              static_cast<u64>(written));
+            bytes += written;
+            offset += static_cast<u64>(written);
+            length -= static_cast<size_t>(written);
+        }
+#else
+        (void)offset;
+        (void)bytes;
+        (void)length;
+#endif
+    }
 
-                output_file.write(
-                    reinterpret_cast<const char *>(file_data.data()),
-                    (long)file_data.size());
-            } else {
-                // Create empty file
-                ofstream output_file(file_entry.path);
+    // Sizes the file if asked to and sets its permissions, returns the errno
+    // of whatever failed since open
+    int finish(u64 size, bool sized, u32 mode) {
+#ifdef __unix__
+        if (fd != -1) {
+            metrics::Scope timing(metrics::Timer::Write);
+            metrics::count(metrics::Counter::Syscalls, sized ? 3 : 2);
+            if (failure == 0 && sized &&
+                ::ftruncate(fd, static_cast<off_t>(size)) != 0) {
+                failure = errno;
             }
-            break;
+            if (failure == 0 && mode != 0 &&
+                ::fchmod(fd, static_cast<mode_t>(mode)) != 0) {
+                failure = errno;
+            }
+            if (::close(fd) != 0 && failure == 0) {
+                failure = errno;
+            }
+            fd = -1;
         }
+#else
+        (void)size;
+        (void)sized;
+        (void)mode;
+#endif
+        return failure;
+    }
 
-        case ArchiveFile::FileType::Symlink: {
-            // For symlinks, the target path is stored in the data
-            if (file_entry.data_length > 0) {
-                auto target_data = get_file_data(file_entry);
-                if (target_data.empty()) {
-                    cerr << "Failed to read symlink target for: "
-                         << file_entry.path << '\n';
-                    continue;
-                }
+  private:
+    int fd{-1};
+    int failure{0};
+};
 
-                string target(
-                    reinterpret_cast<const char *>(target_data.data()),
-                    target_data.size());
+} // namespace
 
-                try {
-                    fs::create_symlink(target, file_entry.path);
-                } catch (const fs::filesystem_error &e) {
-                    cerr << "Failed to create symlink: " << file_entry.path
-                         << " -> " << target << ": " << e.what() << '\n';
-                }
-            }
-            break;
-        }
-        }
+unique_ptr<Archive> Archive::load_stream(int fd) {
+    auto archive = create();
+    ArchiveHeader &stream_header = archive->header;
+    if (read_full(fd, reinterpret_cast<u8 *>(&stream_header),
+                  sizeof(stream_header)) != sizeof(stream_header) ||
+        strncmp(reinterpret_cast<char *>(stream_header.magic), ARCHIVE_MAGIC,
+                4) != 0 ||
+        stream_header.version < MIN_ARCHIVE_VERSION ||
+        stream_header.version > ARCHIVE_VERSION) {
+        cerr << "Invalid archive format or version mismatch.\n";
+        return nullptr;
+    }
+    if (!archive->is_streamed()) {
+        cerr << "Archive wasn't written as a stream, it has to be read from "
+                "a file\n";
+        return nullptr;
+    }
 
-        // Restore permissions
-        try {
-            auto perms = static_cast<fs::perms>(
-                (file_entry.permissions[0] << 6) | // owner
-                (file_entry.permissions[1] << 3) | // group
-                (file_entry.permissions[2])        // others
-            );
-            fs::permissions(file_entry.path, perms);
-        } catch (const fs::filesystem_error &e) {
-            cerr << "Failed to set permissions for: " << file_entry.path << ": "
-                 << e.what() << '\n';
-        }
+    // The table grows as it comes in, so a bogus size runs into the end of
+    // the stream long before it could allocate much
+    StreamPrologue prologue;
+    string table;
+    bool complete = read_full(fd, reinterpret_cast<u8 *>(&prologue),
+                              sizeof(prologue)) == sizeof(prologue);
+    while (complete && table.size() < prologue.table_size) {
+        const size_t filled = table.size();
+        const size_t take = static_cast<size_t>(
+            std::min<u64>(prologue.table_size - filled, 1024UL * 1024UL));
+        table.resize(filled + take);
+        complete = read_full(fd, reinterpret_cast<u8 *>(table.data() + filled),
+                             take) == take;
     }
+    istringstream in(std::move(table));
+    if (!complete || !archive->read_file_table(in, prologue.table_size)) {
+        cerr << "Invalid file table in archive stream\n";
+        return nullptr;
+    }
+
+    archive->data_section_offset =
+        sizeof(ArchiveHeader) + sizeof(prologue) + prologue.table_size;
+    archive->input_fd = fd;
+    archive->input_length = prologue.data_length;
+    archive->from_stream = true;
+    return archive;
 }
 
-void Archive::decompress_parallel(size_t num_threads) {
-    // Determine optimal thread count
+bool Archive::decompress_stream(size_t num_threads) {
+    compact_files();
+    if (input_fd == -1) {
+        cerr << "Archive isn't being read from a stream\n";
+        return false;
+    }
+    // A stream can only be read once
+    const int fd = input_fd;
+    input_fd = -1;
+
     if (num_threads == 0) {
         num_threads = thread_count > 0 ? thread_count
                                        : std::thread::hardware_concurrency();
-        if (num_threads == 0)
-            num_threads = 4; // fallback
-    }
-
-    // Limit threads for small workloads
-    size_t regular_files = 0;
-    for (const auto &file_entry : files) {
-        if (file_entry.type == ArchiveFile::FileType::Regular &&
-            file_entry.data_length > 0) {
-            regular_files++;
-        }
     }
-
-    num_threads = std::min(num_threads, std::max(regular_files, size_t(1)));
-    if (num_threads <= 1) {
-        // Fall back to single-threaded for small workloads
-        decompress();
-        return;
+    if (num_threads > 1 && thread_pool.size() != num_threads) {
+        thread_pool.resize(num_threads);
     }
 
-    if (verbose) {
-        cout << "Using " << num_threads << " threads for extraction\n";
-    }
+    auto restore_permissions = [](const ArchiveFile &file_entry) {
+        metrics::Scope timing(metrics::Timer::Permissions);
+        metrics::count(metrics::Counter::Syscalls);
+        try {
+            fs::permissions(file_entry.path,
+                            static_cast<fs::perms>(file_mode(file_entry)));
+        } catch (const fs::filesystem_error &e) {
+            cerr << "Failed to set permissions for: " << file_entry.path << ": "
+                 << e.what() << '\n';
+        }
+    };
+    auto report = [](const ArchiveFile &file_entry, int error) {
+        if (error != 0) {
+            cerr << "Failed to create file: " << file_entry.path << ": "
+                 << error_message(error) << '\n';
+        }
+    };
 
-    std::atomic<size_t> completed_files{0};
-    std::mutex cout_mutex;
-    std::mutex fs_mutex; // For directory creation and permission setting
+    // Directories and everything without data are there before the data
+    // comes in. Directory permissions wait for the end, a read-only one
+    // would keep its files out.
+    FileWriter writer;
+    string_view last_parent;
+    vector<size_t> ordered; // members with data, in data order
+    for (size_t i = 0; i < files.size(); ++i) {
+        const ArchiveFile &file_entry = files[i];
+        const string_view parent = parent_of(file_entry.path);
+        if (!parent.empty() && parent != last_parent) {
+            make_directories(fs::path(parent));
+            last_parent = parent;
+        }
+        if (file_entry.data_length > 0) {
+            ordered.push_back(i);
+            continue;
+        }
 
-    // Create all directories first (single-threaded to avoid race conditions)
-    for (const auto &file_entry : files) {
-        if (file_entry.type == ArchiveFile::FileType::Directory) {
+        switch (file_entry.type) {
+        case ArchiveFile::FileType::Directory:
+            make_directories(file_entry.path);
+            break;
+        case ArchiveFile::FileType::Regular: {
             if (verbose) {
-                std::lock_guard<std::mutex> lock(cout_mutex);
-                cout << "Creating directory: " << file_entry.path << '\n';
+                cout << "Extracting: " << file_entry.path << '\n';
             }
-            fs::create_directories(file_entry.path);
-
-            // Set directory permissions
-            try {
-                auto perms = static_cast<fs::perms>(
-                    (file_entry.permissions[0] << 6) | // owner
-                    (file_entry.permissions[1] << 3) | // group
-                    (file_entry.permissions[2])        // others
-                );
-                fs::permissions(file_entry.path, perms);
-            } catch (const fs::filesystem_error &e) {
-                std::lock_guard<std::mutex> lock(cout_mutex);
-                cerr << "Failed to set permissions for directory: "
-                     << file_entry.path << ": " << e.what() << '\n';
+            auto done = [&report, &file_entry](int error) {
+                report(file_entry, error);
+            };
+            if (file_entry.hole_count > 0) {
+                writer.write_sparse_file(file_entry.path, nullptr, 0,
+                                         file_holes(file_entry),
+                                         file_mode(file_entry),
+                                         std::move(done));
+            } else {
+                writer.write_file(file_entry.path, nullptr, 0,
+                                  file_mode(file_entry), std::move(done));
             }
+            break;
         }
-    }
-
-    // Create parent directories for all files first
-    for (const auto &file_entry : files) {
-        if (file_entry.type != ArchiveFile::FileType::Directory) {
-            fs::path file_path(file_entry.path);
-            if (file_path.has_parent_path()) {
-                fs::create_directories(file_path.parent_path());
-            }
+        case ArchiveFile::FileType::Symlink:
+            restore_permissions(file_entry);
+            break;
         }
     }
+    std::stable_sort(ordered.begin(), ordered.end(),
+                     [this](size_t a, size_t b) {
+                         return files[a].offset < files[b].offset;
+                     });
+
+    // Hands each piece of the data section to the members it belongs to.
+    // Members that fit in one piece are written like any other extracted
+    // file, straight from the piece, bigger ones as their pieces arrive.
+    MemberChecksums members(files, 0, 0);
+    u32 crc = 0;
+    u64 position = 0;
+    size_t next = 0;
+    PieceWriter piece;
+    string target; // of the symlink coming in
+    auto consume = [&](const shared_ptr<Buffer> &chunk) {
+        const u8 *bytes = chunk->data();
+        members.update(bytes, chunk->size());
+        crc = crc32c(bytes, chunk->size(), crc);
+
+        const u64 chunk_begin = position;
+        const u64 chunk_end = position + chunk->size();
+        while (position < chunk_end && next < ordered.size()) {
+            const ArchiveFile &file_entry = files[ordered[next]];
+            if (file_entry.offset >= chunk_end) {
+                break;
+            }
+            const u64 member_end = file_entry.offset + file_entry.data_length;
+            if (member_end <= position) {
+                ++next; // overlaps the one before, can't be extracted
+                continue;
+            }
+            position = std::max(position, file_entry.offset);
+            const u64 begin = position - file_entry.offset;
+            const u64 end = std::min(member_end, chunk_end) - file_entry.offset;
+            const u8 *from = bytes + (position - chunk_begin);
+            const size_t length = static_cast<size_t>(end - begin);
+            const bool whole = begin == 0 && end == file_entry.data_length;
+            position = file_entry.offset + end;
+            if (end == file_entry.data_length) {
+                ++next;
+            }
 
-    // Worker function for extracting files using thread pool
-    auto extract_task = [&](size_t start_idx, size_t end_idx) {
-        for (size_t i = start_idx; i < end_idx; ++i) {
-            const auto &file_entry = files[i];
-
-            // Skip directories (already processed)
-            if (file_entry.type == ArchiveFile::FileType::Directory) {
+            if (file_entry.type == ArchiveFile::FileType::Symlink) {
+                if (begin == 0) {
+                    target.clear();
+                }
+                target.append(reinterpret_cast<const char *>(from), length);
+                if (end < file_entry.data_length) {
+                    continue;
+                }
+                auto link = make_shared<string>(std::move(target));
+                writer.create_symlink(
+                    *link, file_entry.path,
+                    [&file_entry, link, &restore_permissions](int error) {
+                        if (error != 0) {
+                            cerr << "Failed to create symlink: "
+                                 << file_entry.path << " -> " << *link << ": "
+                                 << error_message(error) << '\n';
+                        }
+                        restore_permissions(file_entry);
+                    });
+                continue;
+            }
+            if (file_entry.type != ArchiveFile::FileType::Regular) {
                 continue;
             }
 
-            if (verbose) {
-                std::lock_guard<std::mutex> lock(cout_mutex);
+            if (verbose && begin == 0) {
                 cout << "Extracting: " << file_entry.path << '\n';
             }
+            if (whole && file_entry.hole_count > 0) {
+                writer.write_sparse_file(
+                    file_entry.path, from, length, file_holes(file_entry),
+                    file_mode(file_entry),
+                    [&report, &file_entry](int error) {
+                        report(file_entry, error);
+                    });
+                continue;
+            }
+            if (whole) {
+                // The piece stays alive until the writer is done with it
+                writer.write_file(file_entry.path, from, length,
+                                  file_mode(file_entry),
+                                  [&report, &file_entry, chunk](int error) {
+                                      report(file_entry, error);
+                                  });
+                continue;
+            }
 
-            switch (file_entry.type) {
-            case ArchiveFile::FileType::Regular: {
-                if (file_entry.data_length > 0) {
-                    auto file_data = get_file_data(file_entry);
-                    if (file_data.empty()) {
-                        std::lock_guard<std::mutex> lock(cout_mutex);
-                        cerr << "Failed to read file data for: "
-                             << file_entry.path << '\n';
-                        continue;
-                    }
-
-                    ofstream output_file(file_entry.path, ios::binary);
-                    if (!output_file) {
-                        std::lock_guard<std::mutex> lock(cout_mutex);
-                        cerr << "Failed to create file: " << file_entry.path
-                             << '\n';
-                        continue;
-                    }
-
-                    output_file.write(
-                        reinterpret_cast<const char *>(file_data.data()),
-                        static_cast<streamsize>(file_data.size()));
-                } else {
-                    // Create empty file
-                    ofstream output_file(file_entry.path);
+            if (begin == 0) {
+                piece.open(string(file_entry.path), file_mode(file_entry));
+            }
+            for_each_data_run(file_holes(file_entry), file_entry.data_length,
+                              0, UINT64_MAX,
+                              [&](u64 offset, u64 stored, u64 run_length) {
+                const u64 run_begin = std::max(stored, begin);
+                const u64 run_end = std::min(stored + run_length, end);
+                if (run_begin < run_end) {
+                    piece.write(offset + (run_begin - stored),
+                                from + (run_begin - begin),
+                                static_cast<size_t>(run_end - run_begin));
                 }
-                break;
+            });
+            if (end == file_entry.data_length) {
+                report(file_entry,
+                       piece.finish(file_size(file_entry),
+                                    file_entry.hole_count > 0,
+                                    file_mode(file_entry)));
             }
+        }
+        position = chunk_end;
+    };
 
-            case ArchiveFile::FileType::Symlink: {
-                if (file_entry.data_length > 0) {
-                    auto target_data = get_file_data(file_entry);
-                    if (target_data.empty()) {
-                        std::lock_guard<std::mutex> lock(cout_mutex);
-                        cerr << "Failed to read symlink target for: "
-                             << file_entry.path << '\n';
-                        continue;
-                    }
-
-                    string target(
-                        reinterpret_cast<const char *>(target_data.data()),
-                        target_data.size());
+    // Stored data comes in chunks. Blocks are read here and decoded on the
+    // pool, a couple per worker ahead of the members being written.
+    constexpr size_t CHUNK_SIZE = 1024UL * 1024UL; // 1MB
+    bool intact = true;
+    u64 stored_size = 0;
+    if (!is_compressed()) {
+        while (intact && stored_size < input_length) {
+            auto chunk = make_shared<Buffer>(static_cast<size_t>(
+                std::min<u64>(CHUNK_SIZE, input_length - stored_size)));
+            intact = read_full(fd, chunk->data(), chunk->size()) ==
+                     chunk->size();
+            if (intact) {
+                stored_size += chunk->size();
+                consume(chunk);
+            }
+        }
+    } else {
+        struct DecodedBlock {
+            shared_ptr<Buffer> bytes;
+            bool decoded{false};
+        };
+        auto decode = [this](ArchiveBlock block, Buffer encoded) {
+            DecodedBlock result;
+            result.bytes = make_shared<Buffer>(size_t{block.raw_size});
+            result.decoded =
+                decode_block(block, encoded.data(), result.bytes->data());
+            return result;
+        };
+        auto take = [&](DecodedBlock result) {
+            intact = intact && result.decoded;
+            if (intact) {
+                consume(result.bytes);
+            }
+        };
 
-                    try {
-                        fs::create_symlink(target, file_entry.path);
-                    } catch (const fs::filesystem_error &e) {
-                        std::lock_guard<std::mutex> lock(cout_mutex);
-                        cerr << "Failed to create symlink: " << file_entry.path
-                             << " -> " << target << ": " << e.what() << '\n';
-                    }
-                }
+        const size_t max_in_flight = num_threads > 1 ? num_threads * 2 : 0;
+        std::deque<future<DecodedBlock>> in_flight;
+        u64 decoded_size = 0; // once everything read so far is decoded
+        while (intact && decoded_size < input_length) {
+            ArchiveBlock block;
+            intact = read_full(fd, reinterpret_cast<u8 *>(&block),
+                               sizeof(block)) == sizeof(block);
+            const Codec *block_codec =
+                intact ? find_codec(block.codec) : nullptr;
+            if (block_codec == nullptr || block.raw_size == 0 ||
+                block.raw_size > input_length - decoded_size ||
+                block.stored_size >
+                    block_codec->max_compressed_size(block.raw_size)) {
+                intact = false;
                 break;
             }
-
-            case ArchiveFile::FileType::Directory:
-                // Already handled above
+            Buffer encoded(block.stored_size);
+            if (read_full(fd, encoded.data(), encoded.size()) !=
+                encoded.size()) {
+                intact = false;
                 break;
             }
+            stored_size += sizeof(block) + block.stored_size;
+            decoded_size += block.raw_size;
 
-            // Set file permissions (protect with mutex for thread safety)
-            {
-                std::lock_guard<std::mutex> lock(fs_mutex);
-                try {
-                    auto perms = static_cast<fs::perms>(
-                        (file_entry.permissions[0] << 6) | // owner
-                        (file_entry.permissions[1] << 3) | // group
-                        (file_entry.permissions[2])        // others
-                    );
-                    fs::permissions(file_entry.path, perms);
-                } catch (const fs::filesystem_error &e) {
-                    std::lock_guard<std::mutex> cout_lock(cout_mutex);
-                    cerr << "Failed to set permissions for: " << file_entry.path
-                         << ": " << e.what() << '\n';
-                }
+            if (max_in_flight == 0) {
+                take(decode(block, std::move(encoded)));
+                continue;
             }
-
-            completed_files.fetch_add(1);
+            if (in_flight.size() >= max_in_flight) {
+                take(in_flight.front().get());
+                in_flight.pop_front();
+            }
+            in_flight.push_back(thread_pool.enqueue(
+                [decode, block, encoded = std::move(encoded)]() mutable {
+                    return decode(block, std::move(encoded));
+                }));
+        }
+        while (!in_flight.empty()) {
+            take(in_flight.front().get());
+            in_flight.pop_front();
         }
-    };
-
-    // Resize thread pool if needed
-    if (thread_pool.size() != num_threads) {
-        thread_pool.resize(num_threads);
     }
-
-    // Divide work among thread pool tasks
-    std::vector<std::future<void>> futures;
-    futures.reserve(num_threads);
-
-    size_t files_per_thread = files.size() / num_threads;
-    size_t remaining_files = files.size() % num_threads;
-
-    for (size_t t = 0; t < num_threads; ++t) {
-        size_t start_idx = t * files_per_thread;
-        size_t end_idx = start_idx + files_per_thread;
-
-        // Distribute remaining files to the first few threads
-        if (t < remaining_files) {
-            end_idx++;
-            start_idx += t;
-        } else {
-            start_idx += remaining_files;
-            end_idx += remaining_files;
+    piece.finish(0, false, 0);
+
+    // What's left is the block index, the CRC, the table with the members'
+    // CRCs and the footer, smaller than the data by far
+    vector<u8> tail;
+    while (intact) {
+        const size_t filled = tail.size();
+        tail.resize(filled + CHUNK_SIZE);
+        const size_t got = read_full(fd, tail.data() + filled, CHUNK_SIZE);
+        tail.resize(filled + got);
+        if (got < CHUNK_SIZE) {
+            break;
         }
+    }
+    if (!intact) {
+        writer.flush();
+        cerr << "Archive stream ended early or is corrupted\n";
+        return false;
+    }
 
-        if (start_idx < files.size()) {
-            futures.push_back(thread_pool.enqueue(
-                extract_task, start_idx, std::min(end_idx, files.size())));
+    ArchiveFooter footer;
+    const u64 tail_offset = data_section_offset + stored_size;
+    bool valid = tail.size() >= sizeof(footer);
+    if (valid) {
+        std::memcpy(&footer, tail.data() + tail.size() - sizeof(footer),
+                    sizeof(footer));
+    }
+    const u64 footer_offset = tail_offset + tail.size() - sizeof(footer);
+    u32 stored_crc = 0;
+    u64 file_count = 0;
+    valid = valid &&
+            std::memcmp(footer.magic, FOOTER_MAGIC, sizeof(footer.magic)) ==
+                0 &&
+            footer.data_size == stored_size &&
+            footer.table_offset >= tail_offset + sizeof(stored_crc) &&
+            footer.table_offset <= footer_offset &&
+            footer_offset - footer.table_offset >= sizeof(file_count) * 2;
+
+    // Where the table keeps each file's CRC, in a column of their own or
+    // in the records of older archives. Only pointed at once the footer
+    // says the table is inside the tail.
+    const bool columns = header.version >= 10;
+    const size_t lead =
+        columns ? sizeof(TableColumns) : sizeof(file_count) * 2;
+    const size_t stride = columns ? sizeof(u32) : sizeof(FileRecord);
+    const u8 *crcs = nullptr;
+    if (valid) {
+        const u8 *table = tail.data() + (footer.table_offset - tail_offset);
+        std::memcpy(&stored_crc, table - sizeof(stored_crc),
+                    sizeof(stored_crc));
+        std::memcpy(&file_count, table, sizeof(file_count));
+        const u64 table_size = footer_offset - footer.table_offset;
+        valid = file_count == files.size() && lead <= table_size &&
+                files.size() <= (table_size - lead) / stride;
+        if (valid) {
+            crcs = table + lead + (columns ? 0 : offsetof(FileRecord, crc32c));
         }
     }
+    writer.flush();
+    if (!valid) {
+        cerr << "Invalid trailer in archive stream\n";
+        return false;
+    }
 
-    // Wait for all tasks to complete
-    for (auto &future : futures) {
-        future.wait();
+    // Everything's written by now, members that don't match their CRC are
+    // taken out again
+    if (stored_crc != crc) {
+        cerr << "Archive CRC32 mismatch! The archive may be corrupted.\n";
+        intact = false;
+    }
+    for (const size_t i : ordered) {
+        u32 stored_member_crc = 0;
+        std::memcpy(&stored_member_crc, crcs + i * stride,
+                    sizeof(stored_member_crc));
+        if (stored_member_crc != members.result()[i]) {
+            cerr << "CRC32C mismatch for " << files[i].path
+                 << "! The archive may be corrupted.\n";
+            std::error_code ec;
+            fs::remove(fs::path(files[i].path), ec);
+            intact = false;
+        }
     }
 
-    if (verbose) {
-        cout << "Extracted" << "\n";
+    for (const auto &file_entry : files) {
+        if (file_entry.type == ArchiveFile::FileType::Directory) {
+            restore_permissions(file_entry);
+        }
     }
+    return intact;
 }
 
 void Archive::list_files() const {
+    compact_files();
     if (files.empty()) {
         cout << "Archive is empty\n";
         return;
@@ -1166,7 +4932,14 @@ void Archive::list_files() const {
 
     cout << "total " << files.size() << "\n";
 
+    // One line buffer for the whole listing instead of a handful of strings
+    // per entry, this is most of the time spent on big archives
+    string line;
+    char size_field[24];
+
     for (const ArchiveFile &f : files) {
+        line.clear();
+
         // File type and permissions (like ls -l)
         char type_char = '-';
         switch (f.type) {
@@ -1180,52 +4953,83 @@ void Archive::list_files() const {
             type_char = '.';
             break;
         }
+        line += type_char;
 
         // Format permissions as rwxrwxrwx
-        auto format_perms = [](u8 perm) -> string {
-            string result;
-            result += (perm & 0b100) ? 'r' : '-';
-            result += (perm & 0b010) ? 'w' : '-';
-            result += (perm & 0b001) ? 'x' : '-';
-            return result;
-        };
-
-        string owner_perms = format_perms(f.permissions[0]);
-        string group_perms = format_perms(f.permissions[1]);
-        string other_perms = format_perms(f.permissions[2]);
-
-        // Format size with right alignment (similar to ls)
-        string size_str = to_string(f.data_length);
+        for (u8 perm : f.permissions) {
+            line += (perm & 0b100) ? 'r' : '-';
+            line += (perm & 0b010) ? 'w' : '-';
+            line += (perm & 0b001) ? 'x' : '-';
+        }
 
         // Print in ls -l format: type+permissions size path
-        cout << type_char << owner_perms << group_perms << other_perms;
-        cout << " " << setw(8) << right << size_str;
-        cout << " " << f.path;
-
-        // For symlinks, show target if available
-        if (f.type == ArchiveFile::FileType::Symlink && f.data_length > 0) {
-
-            std::vector<u8> target_data = get_file_data(f);
+        // Size is right aligned (similar to ls)
+        snprintf(size_field, sizeof(size_field), " %8llu ",
+                 static_cast<unsigned long long>(file_size(f)));
+        line += size_field;
+        line += f.path;
+
+        // For symlinks, show target if available. A stream only has its
+        // table in hand, targets are somewhere in the data still to come.
+        if (f.type == ArchiveFile::FileType::Symlink && f.data_length > 0 &&
+            !from_stream) {
+            auto target_data = get_file_view(f);
             if (!target_data.empty()) {
-                string target(
-                    reinterpret_cast<const char *>(target_data.data()),
-                    target_data.size());
-                cout << " -> " << target;
+                line += " -> ";
+                line.append(reinterpret_cast<const char *>(target_data.data()),
+                            target_data.size());
             } else {
-                cout << " -> <unavailable>";
+                line += " -> <unavailable>";
             }
         }
 
-        cout << "\n";
+        line += '\n';
+        cout.write(line.data(), static_cast<streamsize>(line.size()));
     }
 }
 
 void Archive::print_info() const {
+    compact_files();
     cout << "Version: " << static_cast<int>(header.version) << '\n';
     cout << "Flags: " << static_cast<int>(header.flags) << '\n';
     cout << "CRC32: " << hex << setfill('0') << setw(8) << header.crc32 << dec
          << '\n';
     cout << "Files: " << files.size() << '\n';
+    if (is_compressed()) {
+        const Codec *block_codec = find_codec(codec);
+        cout << "Codec: "
+             << (block_codec != nullptr ? block_codec->name() : "unavailable")
+             << '\n';
+        cout << "Blocks: " << blocks.size() << " (" << block_size
+             << " bytes each)\n";
+    }
+    if (is_deduplicated()) {
+        u64 stored = stored_data_size;
+        if (is_compressed()) {
+            stored = 0;
+            for (const auto &block : blocks) {
+                stored += block.raw_size;
+            }
+        }
+        cout << "Deduplicated: " << stored << " of " << loaded_size
+             << " bytes stored (" << extents.size() << " extents)\n";
+    }
+    if (!holes.empty()) {
+        size_t sparse_files = 0;
+        u64 hole_bytes = 0;
+        for (const auto &file : files) {
+            sparse_files += file.hole_count > 0 ? 1 : 0;
+            for (const auto &hole : file_holes(file)) {
+                hole_bytes += hole.length;
+            }
+        }
+        cout << "Sparse: " << sparse_files << " files, " << hole_bytes
+             << " bytes of holes not stored\n";
+    }
+    if (loaded_volumes > 0) {
+        cout << "Volumes: " << loaded_volumes << " (" << volume_size
+             << " bytes each)\n";
+    }
     if (lazy_loaded && data.empty()) {
         cout << "Data: Not loaded (lazy loading enabled)\n";
     } else {
@@ -1233,27 +5037,34 @@ void Archive::print_info() const {
     }
 }
 
+// The loaded archive's file again, volumes are served from the mapping
+unique_ptr<istream> Archive::reopen_archive() const {
+    if (loaded_volumes > 0) {
+        auto *bytes = const_cast<char *>(
+            reinterpret_cast<const char *>(mapped_archive->data()));
+        return make_unique<ispanstream>(span<char>(bytes,
+                                                   mapped_archive->size()));
+    }
+    return make_unique<ifstream>(archive_file_path, ios::binary);
+}
+
 void Archive::load_file_data_if_needed() {
-    if (!lazy_loaded || !data.empty()) {
+    if (base_size == 0) {
         return; // Already loaded or not using lazy loading
     }
 
-    ifstream file(archive_file_path, ios::binary);
-    if (!file) {
+    auto stream = reopen_archive();
+    if (stream == nullptr || !*stream) {
         cerr << "Failed to reopen archive for lazy loading: "
              << archive_file_path << '\n';
         return;
     }
+    istream &file = *stream;
 
-    // Read data size first
-    u64 data_size = 0;
-    file.seekg(static_cast<streamoff>(data_section_offset - sizeof(u64)));
-    file.read(reinterpret_cast<char *>(&data_size), sizeof(data_size));
+    const u64 data_size = stored_data_size;
 
-    // Optimize memory allocation with reserve
-    data.clear();
-    data.reserve(static_cast<size_t>(data_size));
-    data.resize(static_cast<size_t>(data_size));
+    // Files added since loading already sit in `data`, they go after it
+    vector<u8> loaded(static_cast<size_t>(data_size));
 
     // Seek to data section and read with larger buffer for better I/O
     // performance
@@ -1262,7 +5073,7 @@ void Archive::load_file_data_if_needed() {
     constexpr size_t READ_BUFFER_SIZE = 2UL * 1024UL * 1024UL; // 2MB buffer
     if (data_size <= READ_BUFFER_SIZE) {
         // Small data: read in one go
-        file.read(reinterpret_cast<char *>(data.data()),
+        file.read(reinterpret_cast<char *>(loaded.data()),
                   static_cast<streamsize>(data_size));
     } else {
         // Large data: read in chunks
@@ -1271,7 +5082,7 @@ void Archive::load_file_data_if_needed() {
 
         while (remaining > 0) {
             size_t to_read = std::min(remaining, READ_BUFFER_SIZE);
-            file.read(reinterpret_cast<char *>(data.data() + offset),
+            file.read(reinterpret_cast<char *>(loaded.data() + offset),
                       static_cast<streamsize>(to_read));
 
             auto bytes_read = file.gcount();
@@ -1283,76 +5094,133 @@ void Archive::load_file_data_if_needed() {
         }
     }
 
+    if (is_compressed()) {
+        vector<u8> decoded;
+        if (!decode_blocks(loaded, decoded)) {
+            cerr << "Failed to decode archive data: " << archive_file_path
+                 << '\n';
+            return;
+        }
+        loaded = std::move(decoded);
+    }
+
     // Validate CRC32 now that we have the data
-#ifdef __x86_64__
-    u32 actual_crc = crc32_simd(data.data(), static_cast<size_t>(data.size()));
-#else
-    u32 actual_crc = crc32(data.data(), static_cast<size_t>(data.size()));
-#endif
+    u32 actual_crc = checksum_parallel(loaded.data(), loaded.size());
     if (header.crc32 != actual_crc) {
         cerr << "Archive CRC32 mismatch! The archive may be corrupted.\n";
-        data.clear(); // Clear potentially corrupted data
+        return;
+    }
+    if (!expand_extents(loaded)) {
+        cerr << "Invalid extent map in archive: " << archive_file_path << '\n';
         return;
     }
 
+    loaded.insert(loaded.end(), data.begin(), data.end());
+    data = std::move(loaded);
+    base_size = 0;
+
     if (verbose) {
         cout << "Loaded " << data_size << " bytes of archive data\n";
     }
 }
 
-const std::vector<u8> Archive::get_file_data(const ArchiveFile &file) const {
-    if (file.type == ArchiveFile::FileType::Directory) {
-        return {}; // Directories have no data
+bool Archive::read_range(u64 offset, u64 length, u8 *out) const {
+    if (extents.empty()) {
+        return read_stored_range(offset, length, out);
     }
 
-    if (lazy_loaded) {
-        // For lazy loading, read the specific file data directly from disk
-        ifstream archive_file(archive_file_path, ios::binary);
-        if (!archive_file) {
-            cerr << "Failed to open archive for reading file data: "
-                 << archive_file_path << '\n';
-            return {};
+    // Deduplicated, the range can be made of chunks stored anywhere
+    while (length > 0) {
+        const ArchiveExtent *extent = find_extent(offset);
+        if (extent == nullptr) {
+            return false;
+        }
+        const u64 skip = offset - extent->offset;
+        const u64 piece = std::min(length, extent->length - skip);
+        if (!read_stored_range(extent->stored_offset + skip, piece, out)) {
+            return false;
         }
+        offset += piece;
+        out += piece;
+        length -= piece;
+    }
+    return true;
+}
 
-        // Optimize buffer allocation using memory pool for large files
-        const size_t file_size = static_cast<size_t>(file.data_length);
-        std::vector<u8> file_data;
+bool Archive::read_stored_range(u64 offset, u64 length, u8 *out) const {
+    if (is_compressed()) {
+        return read_compressed_range(offset, length, out);
+    }
 
-        if (file_size > 1024UL * 1024UL) { // Use memory pool for files > 1MB
-            file_data = memory_pool.get_buffer(file_size);
-            file_data.resize(file_size);
-        } else {
-            file_data.resize(file_size);
+    const u64 absolute_offset = data_section_offset + offset;
+
+    metrics::Scope timing(metrics::Timer::Read);
+    if (mapped_archive->is_mapped()) {
+        if (absolute_offset + length > mapped_archive->size()) {
+            return false;
+        }
+        metrics::count(metrics::Counter::BytesRead, length);
+        if (length > 1024UL * 1024UL) {
+            mapped_archive->advise(absolute_offset, length,
+                                   MappedFile::Access::WillNeed);
         }
+        std::memcpy(out, mapped_archive->data() + absolute_offset,
+                    static_cast<size_t>(length));
+        return true;
+    }
 
-        // Seek to the file's data position
-        u64 absolute_offset = data_section_offset + file.offset;
-        archive_file.seekg(static_cast<streamoff>(absolute_offset));
+    // For lazy loading, read the specific file data directly from disk
+    ifstream archive_file(archive_file_path, ios::binary);
+    if (!archive_file) {
+        cerr << "Failed to open archive for reading file data: "
+             << archive_file_path << '\n';
+        return false;
+    }
 
-        // Read with optimized I/O for large files
-        if (file_size <= 64UL * 1024UL) { // 64KB threshold
-            // Small files: single read
-            archive_file.read(reinterpret_cast<char *>(file_data.data()),
-                              static_cast<streamsize>(file_size));
-        } else {
-            // Large files: chunked read for better I/O performance
-            constexpr size_t CHUNK_SIZE = 64UL * 1024UL; // 64KB chunks
-            size_t remaining = file_size;
-            size_t offset = 0;
+    archive_file.seekg(static_cast<streamoff>(absolute_offset));
+    archive_file.read(reinterpret_cast<char *>(out),
+                      static_cast<streamsize>(length));
+    metrics::count_io(metrics::Counter::BytesRead,
+                      static_cast<u64>(archive_file.gcount()), 2);
+    return static_cast<u64>(archive_file.gcount()) == length;
+}
 
-            while (remaining > 0) {
-                size_t to_read = std::min(remaining, CHUNK_SIZE);
-                archive_file.read(
-                    reinterpret_cast<char *>(file_data.data() + offset),
-                    static_cast<streamsize>(to_read));
+u64 Archive::file_size(const ArchiveFile &file) const {
+    u64 size = file.data_length;
+    for (const auto &hole : file_holes(file)) {
+        size += hole.length;
+    }
+    return size;
+}
 
-                auto bytes_read = archive_file.gcount();
-                if (bytes_read <= 0)
-                    break;
+const std::vector<u8> Archive::get_file_data(const ArchiveFile &file) const {
+    if (file.type == ArchiveFile::FileType::Directory) {
+        return {}; // Directories have no data
+    }
 
-                offset += static_cast<size_t>(bytes_read);
-                remaining -= static_cast<size_t>(bytes_read);
-            }
+    if (file.hole_count > 0) {
+        FileView stored = member_view(file);
+        if (stored.empty() && file.data_length > 0) {
+            return {};
+        }
+        return expand_member(file, stored.data());
+    }
+
+    if (file.offset < base_size) {
+        if (member_cacheable(file)) {
+            const FileView cached = member_view(file);
+            return std::vector<u8>(cached.data(),
+                                   cached.data() + cached.size());
+        }
+
+        // The caller owns the vector, so there's nothing to pool here
+        const size_t file_size = static_cast<size_t>(file.data_length);
+        std::vector<u8> file_data(file_size);
+
+        if (!read_range(file.offset, file_size, file_data.data()) ||
+            !verify_member(file, file_data.data())) {
+            cerr << "Failed to read file data: " << file.path << '\n';
+            return {};
         }
 
         if (verbose) {
@@ -1363,58 +5231,595 @@ const std::vector<u8> Archive::get_file_data(const ArchiveFile &file) const {
         return file_data;
     } else {
         // Traditional loading: data is already in memory
-        if (file.offset + file.data_length > data.size()) {
+        const u64 offset = file.offset - base_size;
+        if (offset + file.data_length > data.size()) {
             cerr << "File data extends beyond archive data: " << file.path
                  << '\n';
             return {};
         }
 
-        // Use more efficient memory copy for large files
         const size_t file_size = static_cast<size_t>(file.data_length);
-        std::vector<u8> file_data;
-
-        if (file_size > 1024UL * 1024UL) {
-            file_data = memory_pool.get_buffer(file_size);
-            file_data.resize(file_size);
-        } else {
-            file_data.resize(file_size);
-        }
+        std::vector<u8> file_data(file_size);
 
         // Use optimized memory copy for better performance on large files
         if (file_size > 0) {
-            fast_memcpy(file_data.data(), data.data() + file.offset, file_size);
+            std::memcpy(file_data.data(), data.data() + offset, file_size);
         }
 
         return file_data;
     }
 }
 
+bool Archive::view_range(u64 offset, u64 length, FileView &view) const {
+    const size_t size = static_cast<size_t>(length);
+
+    if (offset >= base_size) {
+        // Valid for as long as the archive isn't modified
+        offset -= base_size;
+        if (offset + length > data.size()) {
+            return false;
+        }
+        view = FileView({data.data() + offset, size}, nullptr);
+        return true;
+    }
+
+    // A range within one extent is stored in one piece and can be viewed
+    // in place like any other
+    u64 stored_offset = offset;
+    bool contiguous = true;
+    if (!extents.empty()) {
+        const ArchiveExtent *extent = find_extent(offset);
+        contiguous = extent != nullptr &&
+                     offset + length <= extent->offset + extent->length;
+        if (contiguous) {
+            stored_offset = extent->stored_offset + (offset - extent->offset);
+        }
+    }
+
+    if (!is_compressed() && mapped_archive->is_mapped() && contiguous) {
+        const u64 absolute_offset = data_section_offset + stored_offset;
+        if (absolute_offset + length > mapped_archive->size()) {
+            return false;
+        }
+        if (size > 1024UL * 1024UL) {
+            mapped_archive->advise(absolute_offset, size,
+                                   MappedFile::Access::WillNeed);
+        }
+        // Shares the mapping, so the view may even outlive the archive
+        view = FileView({mapped_archive->data() + absolute_offset, size},
+                        mapped_archive);
+        return true;
+    }
+
+    // Encoded or unmapped data has to be materialized somewhere
+    // Goes back to the pool once the last view of it is gone
+    auto buffer = make_shared<Buffer>(size);
+    if (!read_range(offset, length, buffer->data())) {
+        return false;
+    }
+    const u8 *bytes = buffer->data();
+    view = FileView({bytes, size}, std::move(buffer));
+    return true;
+}
+
+Archive::FileView Archive::get_file_view(const ArchiveFile &file) const {
+    if (file.hole_count == 0) {
+        return member_view(file);
+    }
+
+    // Sparse files have to be put back together, the view owns the result
+    auto expanded = make_shared<vector<u8>>(get_file_data(file));
+    if (expanded->empty()) {
+        return {};
+    }
+    const std::span<const u8> bytes(*expanded);
+    return FileView(bytes, std::move(expanded));
+}
+
+// Just the data a file stores, holes left out
+Archive::FileView Archive::member_view(const ArchiveFile &file) const {
+    if (file.type == ArchiveFile::FileType::Directory) {
+        return {}; // Directories have no data
+    }
+
+    if (member_cacheable(file)) {
+        auto cached = cached_member(file);
+        if (cached == nullptr) {
+            cerr << "Failed to read file data: " << file.path << '\n';
+            return {};
+        }
+        const std::span<const u8> bytes(cached->data(), cached->size());
+        return FileView(bytes, std::move(cached));
+    }
+
+    // In memory data was checked as a whole when it was loaded, lazy reads
+    // check just the member
+    FileView view;
+    if (!view_range(file.offset, file.data_length, view) ||
+        (file.offset < base_size && !verify_member(file, view.data()))) {
+        cerr << "Failed to read file data: " << file.path << '\n';
+        return {};
+    }
+    return view;
+}
+
+int Archive::ring_source() const {
+#ifdef __unix__
+    // Volumes are read from the mapping, on the pool
+    std::call_once(ring_source_once, [this] {
+        if (!archive_file_path.empty() && loaded_volumes == 0) {
+            metrics::count(metrics::Counter::Syscalls);
+            ring_source_fd =
+                ::open(archive_file_path.c_str(), O_RDONLY | O_CLOEXEC);
+        }
+    });
+#endif
+    return ring_source_fd;
+}
+
+std::optional<std::vector<u8>>
+Archive::read_member_data(const ArchiveFile &file) const {
+    std::vector<u8> bytes = get_file_data(file);
+    if (bytes.empty() && file_size(file) > 0) {
+        return std::nullopt;
+    }
+    return bytes;
+}
+
+// `bytes` came straight from the archive file, as stored
+bool Archive::finish_ring_read(const ArchiveFile &file,
+                               std::vector<u8> &bytes) const {
+    if (!verify_member(file, bytes.data())) {
+        cerr << "Failed to read file data: " << file.path << '\n';
+        return false;
+    }
+    if (member_cacheable(file)) {
+        auto cached = make_shared<Buffer>(bytes.size());
+        std::memcpy(cached->data(), bytes.data(), bytes.size());
+        cache->insert(BlockCache::member_key(file.offset), std::move(cached));
+    }
+    if (file.hole_count > 0) {
+        bytes = expand_member(file, bytes.data());
+    }
+    return true;
+}
+
+// A member as it reads, holes filled in, from the bytes it stores
+std::vector<u8> Archive::expand_member(const ArchiveFile &file,
+                                       const u8 *stored) const {
+    std::vector<u8> bytes(static_cast<size_t>(file_size(file)));
+    for_each_data_run(file_holes(file), file.data_length, 0, bytes.size(),
+                      [&](u64 offset, u64 from, u64 length) {
+                          std::memcpy(bytes.data() + offset, stored + from,
+                                      static_cast<size_t>(length));
+                      });
+    return bytes;
+}
+
+bool Archive::verify_member(const ArchiveFile &file, const u8 *bytes) const {
+    if (crc32c(bytes, static_cast<size_t>(file.data_length)) != file.crc32c) {
+        cerr << "CRC32C mismatch for " << file.path
+             << "! The archive may be corrupted.\n";
+        return false;
+    }
+    return true;
+}
+
+bool Archive::verify(size_t num_threads) const {
+    compact_files();
+    if (num_threads == 0) {
+        num_threads = thread_count > 0 ? thread_count
+                                       : std::thread::hardware_concurrency();
+    }
+
+    // Big members are checked a range at a time so memory stays bounded
+    constexpr u64 RANGE_SIZE = 16ULL * 1024 * 1024;
+
+    atomic<size_t> next_file{0};
+    atomic<size_t> corrupted{0};
+    std::mutex cerr_mutex;
+    auto verify_task = [&]() {
+        for (size_t i = next_file.fetch_add(1); i < files.size();
+             i = next_file.fetch_add(1)) {
+            const ArchiveFile &file = files[i];
+            if (file.type == ArchiveFile::FileType::Directory) {
+                continue;
+            }
+
+            u32 crc = 0;
+            bool readable = true;
+            for (u64 begin = 0; begin < file.data_length && readable;
+                 begin += RANGE_SIZE) {
+                FileView range;
+                readable = view_range(
+                    file.offset + begin,
+                    std::min(RANGE_SIZE, file.data_length - begin), range);
+                crc = crc32c(range.data(), range.size(), crc);
+            }
+
+            if (!readable || crc != file.crc32c) {
+                corrupted.fetch_add(1);
+                std::lock_guard<std::mutex> lock(cerr_mutex);
+                cerr << (readable ? "CRC32C mismatch: " : "Failed to read: ")
+                     << file.path << '\n';
+            }
+        }
+    };
+
+    num_threads = std::min(num_threads, std::max(files.size(), size_t(1)));
+    if (num_threads <= 1) {
+        verify_task();
+    } else {
+        // Exactly num_threads tasks, so a bigger pool is fine. Not shrinking
+        // it keeps concurrent readers from waiting on each other's workers.
+        if (thread_pool.size() < num_threads) {
+            thread_pool.resize(num_threads);
+        }
+        vector<future<void>> futures;
+        futures.reserve(num_threads);
+        for (size_t t = 0; t < num_threads; ++t) {
+            futures.push_back(thread_pool.enqueue(verify_task));
+        }
+        for (auto &future : futures) {
+            future.wait();
+        }
+    }
+
+    if (verbose) {
+        cout << "Verified " << files.size() << " entries, " << corrupted
+             << " corrupted\n";
+    }
+    return corrupted == 0;
+}
+
+Archive::FileView Archive::get_file_view(const std::string &file_path) const {
+    const ArchiveFile *file = find_file(file_path);
+    if (file == nullptr) {
+        cerr << "File not found in archive: " << file_path << '\n';
+        return {};
+    }
+
+    return get_file_view(*file);
+}
+
+// Member readers
+
+unique_ptr<Archive::MemberReader>
+Archive::open_member(const std::string &path) const {
+    const ArchiveFile *file = find_file(path);
+    if (file == nullptr) {
+        cerr << "File not found in archive: " << path << '\n';
+        return nullptr;
+    }
+    if (file->type == ArchiveFile::FileType::Directory) {
+        cerr << "Not a file: " << path << '\n';
+        return nullptr;
+    }
+
+    auto reader = unique_ptr<MemberReader>(new MemberReader(*this, *file));
+#ifdef __unix__
+    if (reader->mapping == nullptr && file->offset < base_size) {
+        reader->fd = ::open(archive_file_path.c_str(), O_RDONLY | O_CLOEXEC);
+        metrics::count(metrics::Counter::Syscalls);
+        if (reader->fd == -1) {
+            cerr << "Failed to open archive for reading file data: "
+                 << archive_file_path << '\n';
+            return nullptr;
+        }
+    }
+#endif
+    return reader;
+}
+
+// Hands the stored data of `file` (no holes) to `sink` a chunk at a time,
+// for the archives set_previous points at this one. Blocks get checked as
+// they're decoded, uncompressed members get their CRC checked in a first
+// pass. Returns how many bytes went to `sink`, all of them unless something
+// in here is damaged. `reader` is opened on first use, passing the same one
+// for members in archive order decodes blocks they share just once.
+u64 Archive::stream_member(const ArchiveFile &file,
+                           const function<void(const u8 *, size_t)> &sink,
+                           unique_ptr<MemberReader> &reader) const {
+    constexpr size_t CHUNK_SIZE = 1024UL * 1024UL; // 1MB
+
+    if (reader == nullptr) {
+        reader = open_member(string(file.path));
+        if (reader == nullptr) {
+            return 0;
+        }
+    }
+    Buffer buffer(
+        static_cast<size_t>(std::min<u64>(CHUNK_SIZE, file.data_length)));
+    auto for_each_chunk = [&](auto chunk_sink) {
+        u64 done = 0;
+        while (done < file.data_length) {
+            const size_t length = static_cast<size_t>(
+                std::min<u64>(CHUNK_SIZE, file.data_length - done));
+            if (!reader->read_at(file.offset + done, length, buffer.data())) {
+                break;
+            }
+            chunk_sink(buffer.data(), length);
+            done += length;
+        }
+        return done;
+    };
+
+    if (!is_compressed()) {
+        u32 crc = 0;
+        if (for_each_chunk([&](const u8 *chunk, size_t length) {
+                crc = crc32c(chunk, length, crc);
+            }) < file.data_length ||
+            crc != file.crc32c) {
+            cerr << "CRC32C mismatch for " << file.path
+                 << "! The archive may be corrupted.\n";
+            return 0;
+        }
+    }
+    return for_each_chunk(sink);
+}
+
+Archive::MemberReader::MemberReader(const Archive &archive,
+                                    const ArchiveFile &entry)
+    : archive(archive), entry(entry), length(archive.file_size(entry)) {
+    if (archive.mapped_archive->is_mapped()) {
+        mapping = archive.mapped_archive;
+    }
+}
+
+Archive::MemberReader::~MemberReader() {
+#ifdef __unix__
+    if (fd != -1) {
+        ::close(fd);
+    }
+#endif
+}
+
+bool Archive::MemberReader::pread(u64 offset, size_t length, u8 *out) {
+    if (offset > size() || length > size() - offset) {
+        return false;
+    }
+    return length == 0 || read_member(offset, length, out);
+}
+
+size_t Archive::MemberReader::read(u8 *out, size_t length) {
+    if (error || position >= size()) {
+        return 0;
+    }
+    length = static_cast<size_t>(std::min<u64>(length, size() - position));
+    const u64 offset = entry.offset + position;
+
+    bool ok = true;
+    if (offset >= archive.base_size || archive.is_compressed() ||
+        length >= readahead) {
+        // In memory data needs no window, blocks are their own
+        if (mapping != nullptr && !archive.is_compressed() &&
+            archive.extents.empty() && entry.hole_count == 0 &&
+            offset < archive.base_size) {
+            const u64 ahead = std::min<u64>(readahead, size() - position);
+            mapping->advise(
+                static_cast<size_t>(archive.data_section_offset + offset),
+                static_cast<size_t>(ahead), MappedFile::Access::WillNeed);
+        }
+        ok = read_member(position, length, out);
+    } else {
+        if (position < window_offset ||
+            position + length > window_offset + window.size()) {
+            // Refill from here on, never past the member
+            window.resize(static_cast<size_t>(
+                std::min<u64>(readahead, size() - position)));
+            window_offset = position;
+            ok = read_member(position, window.size(), window.data());
+            if (!ok) {
+                window.clear();
+            }
+        }
+        if (ok) {
+            std::memcpy(out, window.data() + (position - window_offset),
+                        length);
+        }
+    }
+    if (!ok) {
+        error = true;
+        cerr << "Failed to read file data: " << entry.path << '\n';
+        return 0;
+    }
+
+    // Reading front to back covers the whole member, so it can be checked.
+    // The CRC is of the stored data, holes don't count.
+    if (position == checked) {
+        for_each_data_run(archive.file_holes(entry), entry.data_length,
+                          position, position + length,
+                          [&](u64 run_offset, u64, u64 run_length) {
+                              crc = crc32c(out + (run_offset - position),
+                                           static_cast<size_t>(run_length),
+                                           crc);
+                          });
+        checked += length;
+        if (checked == size() && crc != entry.crc32c) {
+            error = true;
+            cerr << "CRC32C mismatch for " << entry.path
+                 << "! The archive may be corrupted.\n";
+            return 0;
+        }
+    }
+    position += length;
+    return length;
+}
+
+// `offset` is into the member as extracted
+bool Archive::MemberReader::read_member(u64 offset, size_t length, u8 *out) {
+    if (entry.hole_count == 0) {
+        return read_at(entry.offset + offset, length, out);
+    }
+
+    std::memset(out, 0, length);
+    bool ok = true;
+    for_each_data_run(archive.file_holes(entry), entry.data_length, offset,
+                      offset + length,
+                      [&](u64 run_offset, u64 stored, u64 run_length) {
+                          ok = ok && read_at(entry.offset + stored,
+                                             static_cast<size_t>(run_length),
+                                             out + (run_offset - offset));
+                      });
+    return ok;
+}
+
+// `offset` is logical, into the data section
+bool Archive::MemberReader::read_at(u64 offset, size_t length, u8 *out) {
+    if (offset >= archive.base_size) {
+        offset -= archive.base_size;
+        if (offset + length > archive.data.size()) {
+            return false;
+        }
+        std::memcpy(out, archive.data.data() + offset, length);
+        return true;
+    }
+    if (archive.extents.empty()) {
+        return read_piece(offset, length, out);
+    }
+
+    // Deduplicated data is pieced together from its extents
+    while (length > 0) {
+        const ArchiveExtent *extent = archive.find_extent(offset);
+        if (extent == nullptr) {
+            return false;
+        }
+        const u64 skip = offset - extent->offset;
+        const size_t piece =
+            static_cast<size_t>(std::min<u64>(length, extent->length - skip));
+        if (!read_piece(extent->stored_offset + skip, piece, out)) {
+            return false;
+        }
+        offset += piece;
+        out += piece;
+        length -= piece;
+    }
+    return true;
+}
+
+// `offset` is into the decoded data section
+bool Archive::MemberReader::read_piece(u64 offset, size_t length, u8 *out) {
+    if (!archive.is_compressed()) {
+        return read_stored(offset, length, out);
+    }
+
+    const u64 block_size = archive.block_size;
+    while (length > 0) {
+        if (!load_block(offset / block_size)) {
+            return false;
+        }
+        const u64 begin = offset - block_index * block_size;
+        if (begin >= block->size()) {
+            return false;
+        }
+        const size_t take =
+            static_cast<size_t>(std::min<u64>(length, block->size() - begin));
+        std::memcpy(out, block->data() + begin, take);
+        out += take;
+        offset += take;
+        length -= take;
+    }
+    return true;
+}
+
+// `offset` is into the stored data section
+bool Archive::MemberReader::read_stored(u64 offset, size_t length, u8 *out) {
+    const u64 absolute_offset = archive.data_section_offset + offset;
+    metrics::Scope timing(metrics::Timer::Read);
+    if (mapping != nullptr) {
+        if (absolute_offset + length > mapping->size()) {
+            return false;
+        }
+        metrics::count(metrics::Counter::BytesRead, length);
+        std::memcpy(out, mapping->data() + absolute_offset, length);
+        return true;
+    }
+#ifdef __unix__
+    off_t file_offset = static_cast<off_t>(absolute_offset);
+    while (length > 0) {
+        const ssize_t got = ::pread(fd, out, length, file_offset);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        metrics::count_io(metrics::Counter::BytesRead, static_cast<u64>(got));
+        out += got;
+        length -= static_cast<size_t>(got);
+        file_offset += got;
+    }
+    return true;
+#else
+    ifstream archive_file(archive.archive_file_path, ios::binary);
+    archive_file.seekg(static_cast<streamoff>(absolute_offset));
+    archive_file.read(reinterpret_cast<char *>(out),
+                      static_cast<streamsize>(length));
+    return static_cast<size_t>(archive_file.gcount()) == length;
+#endif
+}
+
+bool Archive::MemberReader::load_block(u64 index) {
+    if (index == block_index) {
+        return true;
+    }
+    if (index >= archive.blocks.size()) {
+        return false;
+    }
+    const ArchiveBlock &info = archive.blocks[index];
+
+    block_index = UINT64_MAX;
+    if (archive.cache != nullptr) {
+        block = archive.cache->find(BlockCache::block_key(index));
+        if (block != nullptr) {
+            block_index = index;
+            return true;
+        }
+    }
+
+    const u8 *source = nullptr;
+    const u64 absolute_offset = archive.data_section_offset + info.offset;
+    if (mapping != nullptr) {
+        if (absolute_offset + info.stored_size > mapping->size()) {
+            return false;
+        }
+        source = mapping->data() + absolute_offset;
+    } else {
+        stored.resize(info.stored_size);
+        if (!read_stored(info.offset, stored.size(), stored.data())) {
+            return false;
+        }
+        source = stored.data();
+    }
+
+    block = archive.decode_shared(index, source);
+    if (block == nullptr) {
+        return false;
+    }
+    block_index = index;
+    return true;
+}
+
 const std::vector<u8>
 Archive::get_file_data(const std::string &file_path) const {
-    auto it =
-        std::find_if(files.begin(), files.end(),
-                     [&](const ArchiveFile &f) { return f.path == file_path; });
-
-    if (it == files.end()) {
+    const ArchiveFile *file = find_file(file_path);
+    if (file == nullptr) {
         cerr << "File not found in archive: " << file_path << '\n';
         return {};
     }
 
-    return get_file_data(*it);
+    return get_file_data(*file);
 }
 
 void Archive::decompress_file(const std::string &file_path,
                               const std::string &output_path) {
-    auto it =
-        std::find_if(files.begin(), files.end(),
-                     [&](const ArchiveFile &f) { return f.path == file_path; });
-
-    if (it == files.end()) {
+    const ArchiveFile *found = find_file(file_path);
+    if (found == nullptr) {
         cerr << "File not found in archive: " << file_path << '\n';
         return;
     }
 
-    const ArchiveFile &file_entry = *it;
+    const ArchiveFile &file_entry = *found;
 
     if (verbose) {
         cout << "Extracting: " << file_entry.path << " to " << output_path
@@ -1424,24 +5829,64 @@ void Archive::decompress_file(const std::string &file_path,
     // Create parent directories if they don't exist
     fs::path out_path(output_path);
     if (out_path.has_parent_path()) {
-        fs::create_directories(out_path.parent_path());
+        make_directories(out_path.parent_path());
     }
 
     switch (file_entry.type) {
     case ArchiveFile::FileType::Directory: {
-        fs::create_directories(output_path);
+        make_directories(output_path);
         break;
     }
 
     case ArchiveFile::FileType::Regular: {
-        if (file_entry.data_length > 0) {
-            auto file_data = get_file_data(file_entry);
+        if (file_entry.hole_count > 0) {
+            // Keeps the holes, permissions are set below
+            auto file_data = member_view(file_entry);
+            if (file_data.empty() && file_entry.data_length > 0) {
+                cerr << "Failed to read file data for: " << file_entry.path
+                     << '\n';
+                return;
+            }
+            FileWriter writer;
+            writer.write_sparse_file(
+                output_path, file_data.data(), file_data.size(),
+                file_holes(file_entry), file_mode(file_entry),
+                [&output_path](int error) {
+                    if (error != 0) {
+                        cerr << "Failed to create file: " << output_path
+                             << ": " << error_message(error) << '\n';
+                    }
+                });
+        } else if (file_entry.data_length > 0) {
+            // Mapping first means checking the CRC doesn't copy anything,
+            // then the kernel can copy the bytes
+            const int copy_source = copy_offset(file_entry) != UINT64_MAX
+                                        ? open_copy_source()
+                                        : -1;
+            auto file_data = get_file_view(file_entry);
             if (file_data.empty()) {
                 cerr << "Failed to read file data for: " << file_entry.path
                      << '\n';
+                close_copy_fd(copy_source);
                 return;
             }
 
+            if (copy_source != -1) {
+                FileWriter writer;
+                writer.copy_file(output_path, copy_source,
+                                 copy_offset(file_entry), file_data.size(),
+                                 file_mode(file_entry), [&](int error) {
+                                     if (error != 0) {
+                                         cerr << "Failed to create file: "
+                                              << output_path << ": "
+                                              << error_message(error) << '\n';
+                                     }
+                                 });
+                close_copy_fd(copy_source);
+                break;
+            }
+
+            metrics::Scope timing(metrics::Timer::Write);
             ofstream output_file(output_path, ios::binary);
             if (!output_file) {
                 cerr << "Failed to create file: " << output_path << '\n';
@@ -1450,6 +5895,8 @@ void Archive::decompress_file(const std::string &file_path,
 
             output_file.write(reinterpret_cast<const char *>(file_data.data()),
                               (long)file_data.size());
+            metrics::count_io(metrics::Counter::BytesWritten, file_data.size(),
+                              3);
         } else {
             // Create empty file
             ofstream output_file(output_path);
@@ -1459,7 +5906,7 @@ void Archive::decompress_file(const std::string &file_path,
 
     case ArchiveFile::FileType::Symlink: {
         if (file_entry.data_length > 0) {
-            auto target_data = get_file_data(file_entry);
+            auto target_data = get_file_view(file_entry);
             if (target_data.empty()) {
                 cerr << "Failed to read symlink target for: " << file_entry.path
                      << '\n';
@@ -1481,6 +5928,8 @@ void Archive::decompress_file(const std::string &file_path,
     }
 
     // Restore permissions
+    metrics::Scope timing(metrics::Timer::Permissions);
+    metrics::count(metrics::Counter::Syscalls);
     try {
         auto perms =
             static_cast<fs::perms>((file_entry.permissions[0] << 6) | // owner
@@ -0,0 +1,621 @@
+#include "kundli.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <coroutine>
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef __unix__
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+// Benchmarks the archive hot paths on synthetic corpora
+// Every corpus is generated from a fixed seed, so two runs with the same
+// options archive the exact same bytes. Each phase runs a few times and the
+// percentiles are over those runs, reads are also timed one by one.
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+// splitmix64, deterministic across platforms and standard libraries
+class Random {
+  public:
+    explicit Random(u64 seed) : state(seed) {}
+
+    u64 next() {
+        u64 z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    u64 below(u64 bound) { return bound == 0 ? 0 : next() % bound; }
+
+  private:
+    u64 state;
+};
+
+// Half noise, half repeated text, so codecs have something to do without
+// the data being trivially compressible
+void fill(Random &random, std::vector<u8> &bytes) {
+    static constexpr char TEXT[] =
+        "the quick brown fox jumps over the lazy archive ";
+    constexpr size_t RUN = 4096;
+    for (size_t offset = 0; offset < bytes.size(); offset += RUN) {
+        const size_t end = std::min(offset + RUN, bytes.size());
+        const bool noise = (offset / RUN) % 2 == 0;
+        for (size_t i = offset; i < end; ++i) {
+            bytes[i] = noise ? static_cast<u8>(random.next())
+                             : static_cast<u8>(TEXT[i % (sizeof(TEXT) - 1)]);
+        }
+    }
+}
+
+struct Corpus {
+    explicit Corpus(std::string name = {}) : name(std::move(name)) {}
+
+    std::string name;
+    u64 bytes{0};
+    u64 files{0};                   // entries the archive ends up with
+    std::vector<std::string> reads; // regular files to read back
+};
+
+void write_file(Random &random, const fs::path &path, size_t size,
+                Corpus &corpus) {
+    std::vector<u8> bytes(size);
+    fill(random, bytes);
+    std::ofstream out(path, std::ios::binary);
+    out.write(reinterpret_cast<const char *>(bytes.data()),
+              static_cast<std::streamsize>(bytes.size()));
+    corpus.bytes += size;
+    ++corpus.files;
+    corpus.reads.push_back(path.generic_string());
+}
+
+void make_directory(const fs::path &path, Corpus &corpus) {
+    fs::create_directories(path);
+    ++corpus.files;
+}
+
+size_t scaled(double scale, size_t count) {
+    return std::max<size_t>(1, static_cast<size_t>(count * scale));
+}
+
+// Paths are relative, the generator runs inside the work directory
+Corpus make_tiny(double scale) {
+    Corpus corpus{"tiny"};
+    Random random(1);
+    make_directory("tiny", corpus);
+    const size_t count = scaled(scale, 20000);
+    for (size_t i = 0; i < count; ++i) {
+        const fs::path dir = fs::path("tiny") / ("d" + std::to_string(i / 200));
+        if (i % 200 == 0) {
+            make_directory(dir, corpus);
+        }
+        write_file(random, dir / ("f" + std::to_string(i)),
+                   static_cast<size_t>(random.below(4096)), corpus);
+    }
+    return corpus;
+}
+
+Corpus make_huge(double scale) {
+    Corpus corpus{"huge"};
+    Random random(2);
+    make_directory("huge", corpus);
+    const size_t size = scaled(scale, 96UL * 1024UL * 1024UL);
+    for (size_t i = 0; i < 3; ++i) {
+        write_file(random, fs::path("huge") / ("f" + std::to_string(i)), size,
+                   corpus);
+    }
+    return corpus;
+}
+
+Corpus make_deep(double scale) {
+    Corpus corpus{"deep"};
+    Random random(3);
+    fs::path dir = "deep";
+    const size_t depth = scaled(scale, 64);
+    for (size_t level = 0; level < depth; ++level) {
+        make_directory(dir, corpus);
+        for (size_t i = 0; i < 16; ++i) {
+            write_file(random, dir / ("f" + std::to_string(i)),
+                       static_cast<size_t>(random.below(64 * 1024)), corpus);
+        }
+        dir /= "l" + std::to_string(level);
+    }
+    return corpus;
+}
+
+Corpus make_symlinks(double scale) {
+    Corpus corpus{"symlinks"};
+    Random random(4);
+    make_directory("symlinks", corpus);
+    make_directory("symlinks/targets", corpus);
+    make_directory("symlinks/links", corpus);
+    const size_t count = scaled(scale, 5000);
+    for (size_t i = 0; i < count; ++i) {
+        const std::string name = "f" + std::to_string(i);
+        write_file(random, fs::path("symlinks/targets") / name,
+                   static_cast<size_t>(random.below(1024)), corpus);
+        fs::create_symlink(fs::path("../targets") / name,
+                           fs::path("symlinks/links") / name);
+        ++corpus.files;
+    }
+    return corpus;
+}
+
+// Peak RSS of the phase where the kernel lets us reset it (Linux), the peak
+// of the whole process otherwise
+void reset_peak_rss() {
+#ifdef __linux__
+    std::ofstream("/proc/self/clear_refs") << "5";
+#endif
+}
+
+u64 peak_rss_kb() {
+#ifdef __linux__
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.rfind("VmHWM:", 0) == 0) {
+            return std::strtoull(line.c_str() + 6, nullptr, 10);
+        }
+    }
+#endif
+#ifdef __unix__
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return static_cast<u64>(usage.ru_maxrss);
+#else
+    return 0;
+#endif
+}
+
+double percentile(std::vector<double> values, double p) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    std::sort(values.begin(), values.end());
+    // Nearest rank
+    const double rank = std::ceil(p * static_cast<double>(values.size()));
+    const size_t index = rank < 1.0 ? 0 : static_cast<size_t>(rank) - 1;
+    return values[std::min(index, values.size() - 1)];
+}
+
+// Fire and forget, runs up to its first co_await and frees itself when done
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+Detached timed_read(const Archive &archive, const std::string &path,
+                    ReadRing &ring, std::vector<double> &seconds) {
+    const auto start = Clock::now();
+    auto bytes = co_await archive.read_member(path, &ring);
+    seconds.push_back(
+        std::chrono::duration<double>(Clock::now() - start).count());
+}
+
+struct Result {
+    std::string corpus;
+    std::string phase;
+    u64 bytes{0};
+    u64 files{0};
+    std::vector<double> seconds; // one per run
+    std::vector<double> op_seconds; // per operation, reads only
+    u64 peak_rss_kb{0};
+};
+
+struct Options {
+    double scale{1.0};
+    size_t runs{3};
+    size_t threads{std::max(1U, std::thread::hardware_concurrency())};
+    std::string codec{"store"};
+    std::string json_path;
+    std::string work_dir;
+    std::vector<std::string> corpora{"tiny", "huge", "deep", "symlinks"};
+    bool keep{false};
+};
+
+class Bench {
+  public:
+    explicit Bench(const Options &options) : options(options) {}
+
+    void run_corpus(const Corpus &corpus) {
+        const std::string archive = corpus.name + ".kl";
+        const std::string parallel_archive = corpus.name + ".par.kl";
+        const u64 bytes = corpus.bytes;
+        const u64 files = corpus.files;
+
+        run(corpus.name, "create", bytes, files, {}, [&] {
+            auto created = Archive::create();
+            created->set_codec(options.codec);
+            created->set_streaming(true);
+            created->add_file(corpus.name);
+            created->compress(archive);
+        });
+        run(corpus.name, "create-par", bytes, files, {}, [&] {
+            auto created = Archive::create();
+            created->set_codec(options.codec);
+            created->set_streaming(true);
+            created->add_file_parallel(corpus.name, options.threads);
+            created->compress_parallel(parallel_archive, options.threads);
+        });
+        fs::remove(parallel_archive);
+
+        run(corpus.name, "list", 0, files, {}, [&] {
+            // Only the table is read, its printing isn't what's measured
+            std::ostringstream sink;
+            auto *previous = std::cout.rdbuf(sink.rdbuf());
+            auto loaded = Archive::load(archive);
+            if (loaded) {
+                loaded->list_files();
+            }
+            std::cout.rdbuf(previous);
+        });
+
+        const fs::path out_dir = "extract";
+        auto clean = [&] {
+            fs::remove_all(out_dir);
+            fs::create_directories(out_dir);
+        };
+        auto extract = [&](bool parallel) {
+            auto loaded = Archive::load(fs::absolute(archive).string());
+            const fs::path previous = fs::current_path();
+            fs::current_path(out_dir);
+            if (loaded) {
+                parallel ? loaded->decompress_parallel(options.threads)
+                         : loaded->decompress();
+            }
+            fs::current_path(previous);
+        };
+        run(corpus.name, "extract", bytes, files, clean,
+            [&] { extract(false); });
+        run(corpus.name, "extract-par", bytes, files, clean,
+            [&] { extract(true); });
+        fs::remove_all(out_dir);
+
+        // Reads in a fixed shuffled order, each one timed
+        std::vector<std::string> order = corpus.reads;
+        Random random(5);
+        for (size_t i = order.size(); i > 1; --i) {
+            std::swap(order[i - 1], order[random.below(i)]);
+        }
+        std::vector<double> read_seconds;
+        run(corpus.name, "read", bytes, corpus.reads.size(), {}, [&] {
+            auto loaded = Archive::load(archive);
+            if (!loaded) {
+                return;
+            }
+            for (const auto &path : order) {
+                const auto start = Clock::now();
+                auto view = loaded->get_file_view(path);
+                read_seconds.push_back(seconds_since(start));
+            }
+        });
+        results.back().op_seconds = std::move(read_seconds);
+
+        // The same reads spread over threads sharing one loaded archive
+        std::vector<std::vector<double>> thread_seconds(options.threads);
+        run(corpus.name, "read-par", bytes, corpus.reads.size(), {}, [&] {
+            auto loaded = Archive::load(archive);
+            if (!loaded) {
+                return;
+            }
+            const Archive &shared = *loaded;
+            std::vector<std::thread> readers;
+            for (size_t t = 0; t < options.threads; ++t) {
+                readers.emplace_back([&, t] {
+                    for (size_t i = t; i < order.size();
+                         i += options.threads) {
+                        const auto start = Clock::now();
+                        auto view = shared.get_file_view(order[i]);
+                        thread_seconds[t].push_back(seconds_since(start));
+                    }
+                });
+            }
+            for (auto &reader : readers) {
+                reader.join();
+            }
+        });
+        for (const auto &seconds : thread_seconds) {
+            results.back().op_seconds.insert(results.back().op_seconds.end(),
+                                             seconds.begin(), seconds.end());
+        }
+
+        // And all of them in flight at once from a single thread
+        std::vector<double> async_seconds;
+        run(corpus.name, "read-async", bytes, corpus.reads.size(), {}, [&] {
+            auto loaded = Archive::load(archive);
+            if (!loaded) {
+                return;
+            }
+            ReadRing ring;
+            for (const auto &path : order) {
+                timed_read(*loaded, path, ring, async_seconds);
+            }
+            while (ring.pending() > 0) {
+                ring.wait();
+            }
+        });
+        results.back().op_seconds = std::move(async_seconds);
+
+        // Hot members read again and again from one archive with a cache,
+        // every run after the first is served from it
+        if (auto cached = Archive::load(archive)) {
+            cached->set_cache_size(64UL * 1024UL * 1024UL);
+            std::vector<double> cached_seconds;
+            run(corpus.name, "read-cached", bytes, corpus.reads.size(), {},
+                [&] {
+                    for (const auto &path : order) {
+                        const auto start = Clock::now();
+                        auto view = cached->get_file_view(path);
+                        cached_seconds.push_back(seconds_since(start));
+                    }
+                });
+            results.back().op_seconds = std::move(cached_seconds);
+        }
+
+        run(corpus.name, "verify", bytes, files, {}, [&] {
+            auto loaded = Archive::load(archive);
+            if (loaded) {
+                loaded->verify(options.threads);
+            }
+        });
+        fs::remove(archive);
+    }
+
+    void run_checksum() {
+        // The checksum engine on its own, over one big in-memory buffer
+        std::vector<u8> bytes(scaled(options.scale, 256UL * 1024UL * 1024UL));
+        Random random(6);
+        fill(random, bytes);
+        u32 crc = 0;
+        run("memory", "crc32c", bytes.size(), 0, {}, [&] {
+            crc ^= Archive::checksum_parallel(bytes.data(), bytes.size());
+        });
+        if (crc == 1) {
+            std::printf(" "); // keeps the checksum from being optimized away
+        }
+    }
+
+    void print_table(FILE *out) const {
+        std::fprintf(out, "%-9s %-12s %9s %9s %9s %10s %11s %9s\n", "corpus",
+                    "phase", "p50 ms", "p90 ms", "p99 ms", "MiB/s", "files/s",
+                    "RSS MiB");
+        for (const auto &result : results) {
+            const double p50 = percentile(result.seconds, 0.5);
+            std::fprintf(
+                out, "%-9s %-12s %9.2f %9.2f %9.2f %10.1f %11.0f %9.1f\n",
+                result.corpus.c_str(), result.phase.c_str(), p50 * 1e3,
+                percentile(result.seconds, 0.9) * 1e3,
+                percentile(result.seconds, 0.99) * 1e3,
+                rate(result.bytes, p50) / MIB,
+                rate(result.files, p50),
+                static_cast<double>(result.peak_rss_kb) / 1024.0);
+            if (!result.op_seconds.empty()) {
+                std::fprintf(out,
+                             "%-9s %-12s %9.2f %9.2f %9.2f   (us per read)\n",
+                             "", "", percentile(result.op_seconds, 0.5) * 1e6,
+                             percentile(result.op_seconds, 0.9) * 1e6,
+                             percentile(result.op_seconds, 0.99) * 1e6);
+            }
+        }
+
+        const BufferPoolStats pool = Archive::buffer_stats();
+        std::fprintf(out, "buffer pool hit rate: %.1f%%\n",
+                     pool.hit_rate() * 100.0);
+    }
+
+    // One JSON document, results in run order
+    void write_json(std::ostream &out) const {
+        out << "{\n  \"format_version\": " << static_cast<int>(ARCHIVE_VERSION)
+            << ",\n  \"codec\": \"" << options.codec
+            << "\",\n  \"threads\": " << options.threads
+            << ",\n  \"scale\": " << options.scale
+            << ",\n  \"runs\": " << options.runs << ",\n  \"results\": [";
+        for (size_t i = 0; i < results.size(); ++i) {
+            const Result &result = results[i];
+            const double p50 = percentile(result.seconds, 0.5);
+            out << (i == 0 ? "\n" : ",\n") << "    {\"corpus\": \""
+                << result.corpus << "\", \"phase\": \"" << result.phase
+                << "\", \"bytes\": " << result.bytes
+                << ", \"files\": " << result.files << ", \"seconds\": "
+                << json_percentiles(result.seconds)
+                << ", \"mib_per_s\": " << rate(result.bytes, p50) / MIB
+                << ", \"files_per_s\": " << rate(result.files, p50);
+            if (!result.op_seconds.empty()) {
+                out << ", \"op_seconds\": "
+                    << json_percentiles(result.op_seconds);
+            }
+            out << ", \"peak_rss_kb\": " << result.peak_rss_kb << "}";
+        }
+
+        const BufferPoolStats pool = Archive::buffer_stats();
+        out << "\n  ],\n  \"buffer_pool\": {\"hits\": " << pool.hits
+            << ", \"depot_hits\": " << pool.depot_hits
+            << ", \"misses\": " << pool.misses
+            << ", \"unpooled\": " << pool.unpooled
+            << ", \"dropped\": " << pool.dropped << "}\n}\n";
+    }
+
+  private:
+    // Both outputs report throughput in the same unit
+    static constexpr double MIB = 1024.0 * 1024.0;
+
+    static double seconds_since(Clock::time_point start) {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    static double rate(u64 amount, double seconds) {
+        return seconds > 0.0 ? static_cast<double>(amount) / seconds : 0.0;
+    }
+
+    static std::string json_percentiles(const std::vector<double> &values) {
+        std::ostringstream out;
+        out << "{\"min\": " << percentile(values, 0.0)
+            << ", \"p50\": " << percentile(values, 0.5)
+            << ", \"p90\": " << percentile(values, 0.9)
+            << ", \"p99\": " << percentile(values, 0.99)
+            << ", \"max\": " << percentile(values, 1.0) << "}";
+        return out.str();
+    }
+
+    // `prepare` runs before every run and isn't timed
+    void run(const std::string &corpus, const std::string &phase, u64 bytes,
+             u64 files, const std::function<void()> &prepare,
+             const std::function<void()> &body) {
+        Result result;
+        result.corpus = corpus;
+        result.phase = phase;
+        result.bytes = bytes;
+        result.files = files;
+        reset_peak_rss();
+        for (size_t i = 0; i < options.runs; ++i) {
+            if (prepare) {
+                prepare();
+            }
+            const auto start = Clock::now();
+            body();
+            result.seconds.push_back(seconds_since(start));
+        }
+        result.peak_rss_kb = peak_rss_kb();
+        std::fprintf(stderr, "%s/%s done\n", corpus.c_str(), phase.c_str());
+        results.push_back(std::move(result));
+    }
+
+    const Options &options;
+    std::vector<Result> results;
+};
+
+void print_help() {
+    std::printf("Usage: kundli_bench [options]\n");
+    std::printf("Options:\n");
+    std::printf("  --scale F         Scale corpus sizes by F (default 1)\n");
+    std::printf("  --runs N          Runs per phase (default 3)\n");
+    std::printf("  --threads N       Threads for the parallel phases\n");
+    std::printf("  --codec NAME      Block codec (store, lz, lzma)\n");
+    std::printf("  --corpus LIST     Comma separated subset of tiny, huge, "
+                "deep, symlinks\n");
+    std::printf("  --json PATH       Also write the results as JSON, - for "
+                "stdout\n");
+    std::printf("  --dir PATH        Work directory (default: a temporary "
+                "one)\n");
+    std::printf("  --keep            Keep the work directory\n");
+}
+
+bool parse_arguments(int argc, char **argv, Options &options) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg(argv[i]);
+        const bool has_value = i + 1 < argc;
+        if (arg == "--scale" && has_value) {
+            options.scale = std::strtod(argv[++i], nullptr);
+        } else if (arg == "--runs" && has_value) {
+            options.runs = std::max<size_t>(1, std::stoul(argv[++i]));
+        } else if (arg == "--threads" && has_value) {
+            options.threads = std::max<size_t>(1, std::stoul(argv[++i]));
+        } else if (arg == "--codec" && has_value) {
+            options.codec = argv[++i];
+        } else if (arg == "--corpus" && has_value) {
+            options.corpora.clear();
+            std::stringstream list(argv[++i]);
+            std::string name;
+            while (std::getline(list, name, ',')) {
+                options.corpora.push_back(name);
+            }
+        } else if (arg == "--json" && has_value) {
+            options.json_path = argv[++i];
+        } else if (arg == "--dir" && has_value) {
+            options.work_dir = argv[++i];
+        } else if (arg == "--keep") {
+            options.keep = true;
+        } else {
+            print_help();
+            return false;
+        }
+    }
+    return options.scale > 0.0;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!parse_arguments(argc, argv, options)) {
+        return EXIT_FAILURE;
+    }
+    if (!Archive::create()->set_codec(options.codec)) {
+        std::fprintf(stderr, "Error: Unknown or unavailable codec '%s'.\n",
+                     options.codec.c_str());
+        return EXIT_FAILURE;
+    }
+
+    fs::path work_dir = options.work_dir;
+    if (work_dir.empty()) {
+#ifdef __unix__
+        const auto id = std::to_string(::getpid());
+#else
+        const auto id = std::to_string(Clock::now().time_since_epoch().count());
+#endif
+        work_dir = fs::temp_directory_path() / ("kundli_bench_" + id);
+    }
+    fs::create_directories(work_dir);
+    const fs::path previous = fs::current_path();
+    fs::current_path(work_dir);
+
+    Bench bench(options);
+    for (const auto &name : options.corpora) {
+        Corpus corpus;
+        if (name == "tiny") {
+            corpus = make_tiny(options.scale);
+        } else if (name == "huge") {
+            corpus = make_huge(options.scale);
+        } else if (name == "deep") {
+            corpus = make_deep(options.scale);
+        } else if (name == "symlinks") {
+            corpus = make_symlinks(options.scale);
+        } else {
+            std::fprintf(stderr, "Error: Unknown corpus '%s'.\n", name.c_str());
+            continue;
+        }
+        bench.run_corpus(corpus);
+        fs::remove_all(corpus.name);
+    }
+    bench.run_checksum();
+
+    fs::current_path(previous);
+    if (!options.keep) {
+        fs::remove_all(work_dir);
+    }
+
+    // The table moves out of the way when the JSON goes to stdout
+    bench.print_table(options.json_path == "-" ? stderr : stdout);
+    if (options.json_path == "-") {
+        bench.write_json(std::cout);
+    } else if (!options.json_path.empty()) {
+        std::ofstream out(options.json_path);
+        bench.write_json(out);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,94 @@
+#include "metrics.hpp"
+#include <algorithm>
+#include <array>
+#include <chrono>
+
+namespace metrics {
+
+std::atomic<bool> enabled{false};
+
+namespace {
+
+// Workers past this share the last slot
+constexpr size_t MAX_WORKERS = 256;
+
+std::array<std::atomic<u64>, static_cast<size_t>(Timer::Count)> timers{};
+std::array<std::atomic<u64>, static_cast<size_t>(Counter::Count)> counters{};
+std::array<std::atomic<u64>, MAX_WORKERS> busy{};
+std::atomic<size_t> workers_seen{0};
+
+u64 load(const std::atomic<u64> &value) {
+    return value.load(std::memory_order_relaxed);
+}
+
+u64 load(Timer timer) { return load(timers[static_cast<size_t>(timer)]); }
+
+u64 load(Counter counter) {
+    return load(counters[static_cast<size_t>(counter)]);
+}
+
+} // namespace
+
+u64 now() {
+    return static_cast<u64>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+}
+
+void add(Timer timer, u64 ns) {
+    timers[static_cast<size_t>(timer)].fetch_add(ns,
+                                                 std::memory_order_relaxed);
+}
+
+void add(Counter counter, u64 amount) {
+    counters[static_cast<size_t>(counter)].fetch_add(
+        amount, std::memory_order_relaxed);
+}
+
+void add_busy(size_t worker, u64 ns) {
+    worker = std::min(worker, MAX_WORKERS - 1);
+    busy[worker].fetch_add(ns, std::memory_order_relaxed);
+    size_t seen = workers_seen.load(std::memory_order_relaxed);
+    while (seen <= worker && !workers_seen.compare_exchange_weak(
+                                 seen, worker + 1, std::memory_order_relaxed)) {
+    }
+}
+
+ArchiveStats snapshot() {
+    ArchiveStats stats;
+    stats.scan_ns = load(Timer::Scan);
+    stats.read_ns = load(Timer::Read);
+    stats.crc_ns = load(Timer::Crc);
+    stats.encode_ns = load(Timer::Encode);
+    stats.decode_ns = load(Timer::Decode);
+    stats.table_ns = load(Timer::Table);
+    stats.write_ns = load(Timer::Write);
+    stats.permissions_ns = load(Timer::Permissions);
+    stats.queue_wait_ns = load(Timer::QueueWait);
+    stats.dedup_ns = load(Timer::Dedup);
+    stats.bytes_read = load(Counter::BytesRead);
+    stats.bytes_written = load(Counter::BytesWritten);
+    stats.syscalls = load(Counter::Syscalls);
+    stats.tasks = load(Counter::Tasks);
+    const size_t workers = workers_seen.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < workers; ++i) {
+        stats.worker_busy_ns.push_back(load(busy[i]));
+    }
+    return stats;
+}
+
+void reset() {
+    for (auto &timer : timers) {
+        timer.store(0, std::memory_order_relaxed);
+    }
+    for (auto &counter : counters) {
+        counter.store(0, std::memory_order_relaxed);
+    }
+    for (auto &worker : busy) {
+        worker.store(0, std::memory_order_relaxed);
+    }
+    workers_seen.store(0, std::memory_order_relaxed);
+}
+
+} // namespace metrics
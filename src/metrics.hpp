@@ -0,0 +1,73 @@
+#pragma once
+
+#include "kundli.hpp"
+#include <atomic>
+#include <cstddef>
+
+// Timers and counters behind Archive::stats()
+// Off by default. A probe is then one relaxed load and a branch, so they can
+// sit on the hot paths. Timers are meant for leaf work (a read, a CRC, one
+// block's compression) so they don't count the same time twice.
+namespace metrics {
+
+enum class Timer : u8 {
+    Scan,
+    Read,
+    Crc,
+    Encode,
+    Decode,
+    Table,
+    Write,
+    Permissions,
+    QueueWait,
+    Dedup,
+    Count
+};
+
+enum class Counter : u8 { BytesRead, BytesWritten, Syscalls, Tasks, Count };
+
+extern std::atomic<bool> enabled;
+
+inline bool on() { return enabled.load(std::memory_order_relaxed); }
+
+u64 now(); // steady clock, ns
+
+void add(Timer timer, u64 ns);
+void add(Counter counter, u64 amount);
+void add_busy(size_t worker, u64 ns);
+
+inline void count(Counter counter, u64 amount = 1) {
+    if (on()) {
+        add(counter, amount);
+    }
+}
+
+// Bytes moved by `calls` syscalls
+inline void count_io(Counter bytes, u64 amount, u64 calls = 1) {
+    if (on()) {
+        add(bytes, amount);
+        add(Counter::Syscalls, calls);
+    }
+}
+
+// Times the enclosing scope
+class Scope {
+  public:
+    explicit Scope(Timer timer) : timer(timer), start(on() ? now() : 0) {}
+    ~Scope() {
+        if (start != 0) {
+            add(timer, now() - start);
+        }
+    }
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+  private:
+    Timer timer;
+    u64 start;
+};
+
+ArchiveStats snapshot();
+void reset();
+
+} // namespace metrics
@@ -1,10 +1,13 @@
 #include "kundli.hpp"
+#include <chrono>
 #include <cstddef>
 #include <cstdio>
 #include <cstdlib>
+#include <exception>
 #include <iostream>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 constexpr const size_t DEFAULT_THREAD_COUNT = 4;
@@ -20,10 +23,23 @@ class Config {
     std::unique_ptr<Archive> archive{Archive::create()};
     std::string archive_path{"comp.kl"};
     std::vector<std::string> files;
+    std::string codec_name;
     bool verbose{false};
     bool force_full_load{false};
     bool use_parallel{false};
+    bool dedup{false};
     size_t thread_count{DEFAULT_THREAD_COUNT};
+    u64 volume_size{0};
+    std::vector<std::string> volume_dirs;
+    std::string since_path;
+    std::vector<std::string> excludes;
+    size_t readahead{Archive::DEFAULT_EXTRACT_READAHEAD};
+
+    enum class StatsFormat : uint8_t {
+        None,
+        Text,
+        Json
+    } stats{StatsFormat::None};
 
     enum class Operation : uint8_t {
         None,
@@ -33,7 +49,8 @@ class Config {
         Compress,
         Decompress,
         List,
-        Extend
+        Extend,
+        Verify
     } operation{Operation::None};
 
     void parseArguments(int argc, char **argv) {
@@ -50,6 +67,12 @@ class Config {
                 operation = Operation::Extend;
             } else if (arg == "-v" || arg == "--verbose") {
                 verbose = true;
+            } else if (arg == "--stats") {
+                stats = StatsFormat::Text;
+            } else if (arg == "--stats-json") {
+                stats = StatsFormat::Json;
+            } else if (arg == "-D" || arg == "--dedup") {
+                dedup = true;
             } else if (arg == "--full-load") {
                 force_full_load = true;
             } else if (arg == "-j" || arg == "--parallel") {
@@ -64,6 +87,51 @@ class Config {
                         << "Error: --threads requires a number argument.\n";
                     std::exit(EXIT_FAILURE);
                 }
+            } else if (arg == "-z" || arg == "--codec") {
+                if (i + 1 < argc) {
+                    codec_name = argv[++i];
+                } else {
+                    std::cerr << "Error: --codec requires a codec name.\n";
+                    std::exit(EXIT_FAILURE);
+                }
+            } else if (arg == "--volume-size") {
+                if (i + 1 < argc) {
+                    volume_size = parseSize(argv[++i]);
+                } else {
+                    std::cerr << "Error: --volume-size requires a size.\n";
+                    std::exit(EXIT_FAILURE);
+                }
+            } else if (arg == "--volume-dir") {
+                if (i + 1 < argc) {
+                    volume_dirs.push_back(argv[++i]);
+                } else {
+                    std::cerr
+                        << "Error: --volume-dir requires a directory.\n";
+                    std::exit(EXIT_FAILURE);
+                }
+            } else if (arg == "--since") {
+                if (i + 1 < argc) {
+                    since_path = argv[++i];
+                } else {
+                    std::cerr << "Error: --since requires an archive path.\n";
+                    std::exit(EXIT_FAILURE);
+                }
+            } else if (arg == "--readahead") {
+                if (i + 1 < argc) {
+                    readahead = std::stoul(argv[++i]);
+                } else {
+                    std::cerr << "Error: --readahead requires a number.\n";
+                    std::exit(EXIT_FAILURE);
+                }
+            } else if (arg == "--exclude") {
+                if (i + 1 < argc) {
+                    excludes.push_back(argv[++i]);
+                } else {
+                    std::cerr << "Error: --exclude requires a pattern.\n";
+                    std::exit(EXIT_FAILURE);
+                }
+            } else if (arg == "--verify") {
+                operation = Operation::Verify;
             } else if (arg == "-i" || arg == "--info") {
                 operation = Operation::Info;
             } else if (arg == "-h" || arg == "--help") {
@@ -84,32 +152,134 @@ class Config {
         }
     }
 
+    // Bytes, or with a K, M, G or T suffix
+    static u64 parseSize(const std::string &text) {
+        size_t used = 0;
+        u64 size = 0;
+        try {
+            size = std::stoull(text, &used);
+        } catch (const std::exception &) {
+            used = 0;
+        }
+        const std::string suffix = text.substr(used);
+        u64 unit = 1;
+        if (suffix == "K" || suffix == "k") {
+            unit = 1ULL << 10;
+        } else if (suffix == "M" || suffix == "m") {
+            unit = 1ULL << 20;
+        } else if (suffix == "G" || suffix == "g") {
+            unit = 1ULL << 30;
+        } else if (suffix == "T" || suffix == "t") {
+            unit = 1ULL << 40;
+        } else if (!suffix.empty()) {
+            used = 0;
+        }
+        if (used == 0 || size == 0) {
+            std::cerr << "Error: Invalid size '" << text << "'.\n";
+            std::exit(EXIT_FAILURE);
+        }
+        return size * unit;
+    }
+
     void printHelp() const {
         printf("Usage: pandit [options] [files...]\n");
         printf("Options:\n");
         printf("  -c, --compress        Compress files into an archive\n");
-        printf("  -x, --extract         Extract files from an archive\n");
+        printf("  -x, --extract         Extract files from an archive, just "
+               "those matching the\n"
+               "                        files given as globs if there are "
+               "any\n");
         printf("  -l, --list            List files in an archive\n");
         printf("  -e, --extend          Extend the archive with new files\n");
         printf("  -i, --info            Show archive information\n");
+        printf("      --verify          Check every file against its "
+               "checksum\n");
         printf("  -v, --verbose         Enable verbose output\n");
+        printf("      --stats           Print where the time went to stderr\n");
+        printf("      --stats-json      Same as --stats, as JSON\n");
         printf("  -j, --parallel        Enable parallel processing\n");
         printf(
             "  -t, --threads N       Use N threads for parallel operations\n");
+        printf("  -z, --codec NAME      Compress blocks with NAME (store, lz, "
+               "lzma)\n");
+        printf("  -D, --dedup           Store repeated content only once\n");
+        printf("      --volume-size N   Split the archive into volumes of N "
+               "bytes (K, M, G, T)\n");
+        printf("      --volume-dir DIR  Put volumes in DIR, repeat to deal "
+               "them over several\n");
+        printf("      --since <path>    Copy files unchanged since the "
+               "archive at path from it\n");
+        printf("      --exclude GLOB    Leave out what matches GLOB when "
+               "extracting\n");
+        printf("      --readahead N     Read up to N files ahead of writing "
+               "them when extracting\n");
         printf("      --full-load       Force full loading (disable lazy "
                "loading)\n");
         printf("  -h, --help            Show this help message\n");
         printf("  -V, --version         Show version information\n");
         printf("  -a, --archive <path>  Specify the archive path (default: "
-               "comp.kl)\n");
+               "comp.kl),\n"
+               "                        - streams it through stdout (-c) or "
+               "stdin (-x, -l)\n");
+    }
+
+    // `-a -` pipes the archive through stdin or stdout
+    bool isStream() const { return archive_path == "-"; }
+
+    // The archive goes to a copy of stdout, everything printed to stdout
+    // from here on goes to stderr instead
+    static int takeStdout() {
+        std::fflush(stdout);
+        const int fd = ::dup(STDOUT_FILENO);
+        if (fd == -1 || ::dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+            fprintf(stderr, "Error: Failed to set up stdout for the "
+                            "archive.\n");
+            std::exit(EXIT_FAILURE);
+        }
+        return fd;
     }
 
     void printVersion() const {
         printf("Pandit Archive Tool\n");
         printf("Built on: %s\n", __DATE__);
+        printf("SIMD: %s (CRC32C: %s)\n", Archive::simd_level(),
+               Archive::checksum_kernel());
+    }
+
+    void applyCodec() {
+        if (!codec_name.empty() && !archive->set_codec(codec_name)) {
+            fprintf(stderr, "Error: Unknown or unavailable codec '%s'.\n",
+                    codec_name.c_str());
+            std::exit(EXIT_FAILURE);
+        }
+        if (dedup) {
+            archive->set_dedup(true);
+        }
+        if (volume_size > 0) {
+            archive->set_volumes(volume_size, volume_dirs);
+        }
     }
 
     void execute() {
+        const auto started = std::chrono::steady_clock::now();
+        if (stats != StatsFormat::None) {
+            Archive::set_stats_enabled(true);
+        }
+
+        if (!volume_dirs.empty() && volume_size == 0 &&
+            operation == Operation::Compress) {
+            fprintf(stderr, "Error: --volume-dir needs a --volume-size.\n");
+            std::exit(EXIT_FAILURE);
+        }
+
+        if (isStream() && (operation == Operation::Extend ||
+                           operation == Operation::Info ||
+                           operation == Operation::Verify)) {
+            fprintf(stderr, "Error: This operation needs an archive file, it "
+                            "can't use a stream.\n");
+            std::exit(EXIT_FAILURE);
+        }
+
         switch (operation) {
         case Operation::Help:
             printHelp();
@@ -136,9 +306,26 @@ class Config {
             if (thread_count > 0) {
                 archive->set_thread_count(thread_count);
             }
+            applyCodec();
+            archive->set_streaming(true);
+            if (!since_path.empty()) {
+                std::shared_ptr<const Archive> previous =
+                    Archive::load(since_path, volume_dirs);
+                if (!previous) {
+                    fprintf(stderr,
+                            "Error: Failed to load previous archive '%s'.\n",
+                            since_path.c_str());
+                    std::exit(EXIT_FAILURE);
+                }
+                archive->set_previous(std::move(previous));
+            }
 
             for (const auto &file : files) {
-                if (!archive->add_file(file)) {
+                ArchiveFile *added =
+                    use_parallel
+                        ? archive->add_file_parallel(file, thread_count)
+                        : archive->add_file(file);
+                if (!added) {
                     fprintf(stderr,
                             "Error: Failed to add file '%s' to archive.\n",
                             file.c_str());
@@ -146,7 +333,13 @@ class Config {
                 }
             }
 
-            if (use_parallel) {
+            if (isStream()) {
+                if (!archive->compress_stream(takeStdout(),
+                                              use_parallel ? thread_count
+                                                           : 1)) {
+                    std::exit(EXIT_FAILURE);
+                }
+            } else if (use_parallel) {
                 archive->compress_parallel(archive_path, thread_count);
             } else {
                 archive->compress(archive_path);
@@ -154,27 +347,54 @@ class Config {
             break;
 
         case Operation::Decompress:
-            archive = force_full_load ? Archive::load_full(archive_path)
-                                      : Archive::load(archive_path);
+            if (isStream() && (!files.empty() || !excludes.empty())) {
+                fprintf(stderr, "Error: Streamed archives are extracted "
+                                "whole, patterns need an archive file.\n");
+                std::exit(EXIT_FAILURE);
+            }
+            if (isStream()) {
+                archive = Archive::load_stream(STDIN_FILENO);
+                if (!archive) {
+                    fprintf(stderr, "Error: Failed to read archive from "
+                                    "stdin.\n");
+                    std::exit(EXIT_FAILURE);
+                }
+                archive->set_verbose(verbose);
+                if (!archive->decompress_stream(use_parallel ? thread_count
+                                                             : 1)) {
+                    std::exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            archive = force_full_load
+                          ? Archive::load_full(archive_path, volume_dirs)
+                          : Archive::load(archive_path, volume_dirs);
             if (!archive) {
                 fprintf(stderr, "Error: Failed to load archive '%s'.\n",
                         archive_path.c_str());
                 std::exit(EXIT_FAILURE);
             }
             archive->set_verbose(verbose);
+            archive->set_extract_readahead(readahead);
             if (thread_count > 0) {
                 archive->set_thread_count(thread_count);
             }
 
-            if (use_parallel) {
+            if (!files.empty() || !excludes.empty()) {
+                if (!archive->decompress_matching(
+                        files, excludes, use_parallel ? thread_count : 1)) {
+                    std::exit(EXIT_FAILURE);
+                }
+            } else if (use_parallel) {
                 archive->decompress_parallel(thread_count);
             } else {
                 archive->decompress();
             }
             break;
         case Operation::Extend:
-            archive = force_full_load ? Archive::load_full(archive_path)
-                                      : Archive::load(archive_path);
+            archive = force_full_load
+                          ? Archive::load_full(archive_path, volume_dirs)
+                          : Archive::load(archive_path, volume_dirs);
             if (!archive) {
                 fprintf(stderr, "Error: Failed to load archive '%s'.\n",
                         archive_path.c_str());
@@ -189,8 +409,14 @@ class Config {
             if (thread_count > 0) {
                 archive->set_thread_count(thread_count);
             }
+            applyCodec();
+            archive->set_streaming(true);
             for (const auto &file : files) {
-                if (!archive->add_file(file)) {
+                ArchiveFile *added =
+                    use_parallel
+                        ? archive->add_file_parallel(file, thread_count)
+                        : archive->add_file(file);
+                if (!added) {
                     fprintf(stderr,
                             "Error: Failed to add file '%s' to archive.\n",
                             file.c_str());
@@ -198,16 +424,29 @@ class Config {
                 }
             }
 
-            if (use_parallel) {
-                archive->compress_parallel(archive_path, thread_count);
-            } else {
-                archive->compress(archive_path);
+            // Only the new data and the trailer get written
+            if (!archive->append(use_parallel ? thread_count : 1)) {
+                fprintf(stderr, "Error: Failed to extend archive '%s'.\n",
+                        archive_path.c_str());
+                std::exit(EXIT_FAILURE);
             }
             break;
 
         case Operation::List:
-            archive = force_full_load ? Archive::load_full(archive_path)
-                                      : Archive::load(archive_path);
+            if (isStream()) {
+                // The table comes first, the data doesn't need to be read
+                archive = Archive::load_stream(STDIN_FILENO);
+                if (!archive) {
+                    fprintf(stderr, "Error: Failed to read archive from "
+                                    "stdin.\n");
+                    std::exit(EXIT_FAILURE);
+                }
+                archive->list_files();
+                break;
+            }
+            archive = force_full_load
+                          ? Archive::load_full(archive_path, volume_dirs)
+                          : Archive::load(archive_path, volume_dirs);
             if (!archive) {
                 fprintf(stderr, "Error: Failed to load archive '%s'.\n",
                         archive_path.c_str());
@@ -216,8 +455,9 @@ class Config {
             archive->list_files();
             break;
         case Operation::Info:
-            archive = force_full_load ? Archive::load_full(archive_path)
-                                      : Archive::load(archive_path);
+            archive = force_full_load
+                          ? Archive::load_full(archive_path, volume_dirs)
+                          : Archive::load(archive_path, volume_dirs);
             if (!archive) {
                 fprintf(stderr, "Error: Failed to load archive '%s'.\n",
                         archive_path.c_str());
@@ -226,6 +466,21 @@ class Config {
             archive->print_info();
             break;
 
+        case Operation::Verify:
+            archive = Archive::load(archive_path, volume_dirs);
+            if (!archive) {
+                fprintf(stderr, "Error: Failed to load archive '%s'.\n",
+                        archive_path.c_str());
+                std::exit(EXIT_FAILURE);
+            }
+            archive->set_verbose(verbose);
+            if (!archive->verify(use_parallel ? thread_count : 1)) {
+                fprintf(stderr, "Error: Archive '%s' is corrupted.\n",
+                        archive_path.c_str());
+                std::exit(EXIT_FAILURE);
+            }
+            break;
+
         case Operation::None:
         default:
             fprintf(stderr, "Error: No operation specified.\n");
@@ -233,8 +488,87 @@ class Config {
             std::exit(EXIT_FAILURE);
         }
 
+        if (verbose) {
+            printBufferStats();
+        }
+        if (stats != StatsFormat::None) {
+            const auto wall = std::chrono::steady_clock::now() - started;
+            printStats(static_cast<unsigned long long>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(wall)
+                    .count()));
+        }
         std::exit(EXIT_SUCCESS);
     }
+
+    void printStats(unsigned long long wall_ns) const {
+        const ArchiveStats stats_now = Archive::stats();
+        const std::pair<const char *, u64> times[] = {
+            {"scan", stats_now.scan_ns},
+            {"read", stats_now.read_ns},
+            {"crc", stats_now.crc_ns},
+            {"encode", stats_now.encode_ns},
+            {"decode", stats_now.decode_ns},
+            {"table", stats_now.table_ns},
+            {"write", stats_now.write_ns},
+            {"permissions", stats_now.permissions_ns},
+            {"queue_wait", stats_now.queue_wait_ns},
+            {"dedup", stats_now.dedup_ns},
+        };
+        const std::pair<const char *, u64> counts[] = {
+            {"bytes_read", stats_now.bytes_read},
+            {"bytes_written", stats_now.bytes_written},
+            {"syscalls", stats_now.syscalls},
+            {"tasks", stats_now.tasks},
+        };
+
+        if (stats == StatsFormat::Json) {
+            fprintf(stderr, "{\"wall_ns\": %llu", wall_ns);
+            for (const auto &[name, ns] : times) {
+                fprintf(stderr, ", \"%s_ns\": %llu", name,
+                        static_cast<unsigned long long>(ns));
+            }
+            for (const auto &[name, count] : counts) {
+                fprintf(stderr, ", \"%s\": %llu", name,
+                        static_cast<unsigned long long>(count));
+            }
+            fprintf(stderr, ", \"worker_busy_ns\": [");
+            for (size_t i = 0; i < stats_now.worker_busy_ns.size(); ++i) {
+                fprintf(stderr, "%s%llu", i == 0 ? "" : ", ",
+                        static_cast<unsigned long long>(
+                            stats_now.worker_busy_ns[i]));
+            }
+            fprintf(stderr, "]}\n");
+            return;
+        }
+
+        // Times are summed over threads, so they can add up past the wall
+        // time
+        auto ms = [](u64 ns) { return static_cast<double>(ns) / 1e6; };
+        fprintf(stderr, "Stats, %.3f ms wall time:\n", ms(wall_ns));
+        for (const auto &[name, ns] : times) {
+            fprintf(stderr, "  %-14s %12.3f ms\n", name, ms(ns));
+        }
+        for (const auto &[name, count] : counts) {
+            fprintf(stderr, "  %-14s %12llu\n", name,
+                    static_cast<unsigned long long>(count));
+        }
+        for (size_t i = 0; i < stats_now.worker_busy_ns.size(); ++i) {
+            fprintf(stderr, "  worker %-7zu %12.3f ms busy\n", i,
+                    ms(stats_now.worker_busy_ns[i]));
+        }
+    }
+
+    static void printBufferStats() {
+        const BufferPoolStats stats = Archive::buffer_stats();
+        printf("Buffer pool: %llu hits, %llu from other threads, %llu misses, "
+               "%llu unpooled, %llu dropped (%.1f%% hit rate)\n",
+               static_cast<unsigned long long>(stats.hits),
+               static_cast<unsigned long long>(stats.depot_hits),
+               static_cast<unsigned long long>(stats.misses),
+               static_cast<unsigned long long>(stats.unpooled),
+               static_cast<unsigned long long>(stats.dropped),
+               stats.hit_rate() * 100.0);
+    }
 };
 
 int main(int argc, char **argv) {
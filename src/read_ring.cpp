@@ -0,0 +1,360 @@
+#include "kundli.hpp"
+#include "block_cache.hpp"
+#include "io_ring.hpp"
+#include "metrics.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <vector>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+class ReadRing::Impl {
+  public:
+    explicit Impl(unsigned depth);
+    ~Impl();
+
+    void submit(Archive::ReadMember &read);
+    size_t poll();
+    // Until poll() might have something to resume
+    void block();
+    size_t pending() const {
+        return slots.size() - free_slots.size() + backlog.size() +
+               on_pool.load();
+    }
+    int event_fd() const { return event; }
+    bool batched() const { return ring_ready; }
+
+  private:
+    // An io_uring read in flight, the member lands in `bytes` as stored
+    struct Slot {
+        Archive::ReadMember *read{};
+        int fd{-1};
+        u64 offset{}; // in the archive file
+        std::vector<u8> bytes;
+        size_t filled{};
+    };
+
+    // Lengths are a u32 on the ring, bigger members are read in pieces
+    static constexpr size_t MAX_READ = 1UL << 30;
+
+    bool on_ring(const Archive::ReadMember &read, int &fd, u64 &offset) const;
+    void start(unsigned slot, Archive::ReadMember &read, int fd, u64 offset);
+    void queue_read(unsigned slot);
+    void finish(unsigned slot, int result,
+                std::vector<Archive::ReadMember *> &done);
+    void run_on_pool(Archive::ReadMember &read);
+    void enter();
+
+#ifdef KUNDLI_HAVE_IO_URING
+    IoRing ring;
+#endif
+    bool ring_ready{false};
+    bool dispatching{false}; // inside poll(), new reads wait for its batch
+    std::vector<Slot> slots;
+    std::vector<unsigned> free_slots;
+    std::deque<Archive::ReadMember *> backlog; // waiting for a free slot
+
+    // Reads done on the pool, waiting for the ring's thread to take them
+    std::mutex posted_mutex;
+    std::condition_variable posted_condition;
+    std::vector<Archive::ReadMember *> posted;
+    std::atomic<size_t> on_pool{0};
+    int event{-1};
+};
+
+ReadRing::Impl::Impl(unsigned depth) {
+#ifdef __linux__
+    event = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+#ifdef KUNDLI_HAVE_IO_URING
+    // Plain reads are from 5.6. Completions bump the eventfd, so the pool's
+    // and the kernel's show up on the same descriptor.
+    depth = std::max(depth, 1U);
+    ring_ready = event >= 0 && ring.setup(depth) &&
+                 ring.supports(IORING_OP_READ) &&
+                 ring.register_resource(IORING_REGISTER_EVENTFD, &event, 1) >=
+                     0;
+    if (ring_ready) {
+        slots.resize(depth);
+        for (unsigned i = depth; i > 0; --i) {
+            free_slots.push_back(i - 1);
+        }
+    }
+#else
+    (void)depth;
+#endif
+}
+
+ReadRing::Impl::~Impl() {
+    // The last pool task may still be signalling
+    std::lock_guard<std::mutex> lock(posted_mutex);
+#ifdef __linux__
+    if (event >= 0) {
+        ::close(event);
+    }
+#endif
+}
+
+// Members stored in one piece in the archive file are read by the kernel,
+// everything else needs the library
+bool ReadRing::Impl::on_ring(const Archive::ReadMember &read, int &fd,
+                             u64 &offset) const {
+    if (!ring_ready || read.file->data_length == 0) {
+        return false;
+    }
+    offset = read.archive.file_offset(*read.file);
+    if (offset == UINT64_MAX) {
+        return false;
+    }
+    fd = read.archive.ring_source();
+    return fd >= 0;
+}
+
+void ReadRing::Impl::submit(Archive::ReadMember &read) {
+    int fd = -1;
+    u64 offset = 0;
+    if (!on_ring(read, fd, offset)) {
+        run_on_pool(read);
+        return;
+    }
+    if (free_slots.empty()) {
+        backlog.push_back(&read);
+        return;
+    }
+    const unsigned slot = free_slots.back();
+    free_slots.pop_back();
+    start(slot, read, fd, offset);
+}
+
+void ReadRing::Impl::start(unsigned index, Archive::ReadMember &read, int fd,
+                           u64 offset) {
+    Slot &slot = slots[index];
+    slot.read = &read;
+    slot.fd = fd;
+    slot.offset = offset;
+    slot.bytes.resize(static_cast<size_t>(read.file->data_length));
+    slot.filled = 0;
+    queue_read(index);
+}
+
+void ReadRing::Impl::queue_read(unsigned index) {
+#ifdef KUNDLI_HAVE_IO_URING
+    Slot &slot = slots[index];
+    io_uring_sqe *sqe = ring.next_sqe(index);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = slot.fd;
+    sqe->addr = reinterpret_cast<u64>(slot.bytes.data() + slot.filled);
+    sqe->len =
+        static_cast<u32>(std::min(slot.bytes.size() - slot.filled, MAX_READ));
+    sqe->off = slot.offset + slot.filled;
+    if (!dispatching) {
+        enter();
+    }
+#else
+    (void)index;
+#endif
+}
+
+void ReadRing::Impl::enter() {
+#ifdef KUNDLI_HAVE_IO_URING
+    metrics::count(metrics::Counter::Syscalls);
+    if (!ring.enter(0)) {
+        // Still queued, the next poll() tries again
+        std::cerr << "Failed to submit reads: " << std::strerror(errno)
+                  << '\n';
+    }
+#endif
+}
+
+void ReadRing::Impl::finish(unsigned index, int result,
+                            std::vector<Archive::ReadMember *> &done) {
+    Slot &slot = slots[index];
+    Archive::ReadMember &read = *slot.read;
+    if (result > 0) {
+        metrics::count(metrics::Counter::BytesRead, static_cast<u64>(result));
+        slot.filled += static_cast<size_t>(result);
+        if (slot.filled < slot.bytes.size()) {
+            queue_read(index);
+            return;
+        }
+        if (read.archive.finish_ring_read(*read.file, slot.bytes)) {
+            read.result = std::move(slot.bytes);
+        }
+    } else {
+        std::cerr << "Failed to read file data: " << read.file->path;
+        if (result < 0) {
+            std::cerr << ": " << std::strerror(-result);
+        }
+        std::cerr << '\n';
+    }
+    slot.read = nullptr;
+    slot.bytes = {};
+    done.push_back(&read);
+
+    // Hand the slot straight to whoever has been waiting longest
+    while (!backlog.empty()) {
+        Archive::ReadMember &next = *backlog.front();
+        backlog.pop_front();
+        int fd = -1;
+        u64 offset = 0;
+        if (on_ring(next, fd, offset)) {
+            start(index, next, fd, offset);
+            return;
+        }
+        run_on_pool(next);
+    }
+    free_slots.push_back(index);
+}
+
+void ReadRing::Impl::run_on_pool(Archive::ReadMember &read) {
+    on_pool.fetch_add(1);
+    Archive::thread_pool.enqueue([this, &read] {
+        read.result = read.archive.read_member_data(*read.file);
+        // Signalled under the lock, so the ring can't be gone before it's
+        // done with it
+        std::lock_guard<std::mutex> lock(posted_mutex);
+        posted.push_back(&read);
+#ifdef __linux__
+        if (event >= 0) {
+            const u64 one = 1;
+            (void)!::write(event, &one, sizeof(one));
+        }
+#endif
+        posted_condition.notify_one();
+    });
+}
+
+size_t ReadRing::Impl::poll() {
+#ifdef __linux__
+    // Cleared before looking, anything finishing after that sets it again
+    if (event >= 0) {
+        u64 count = 0;
+        (void)!::read(event, &count, sizeof(count));
+    }
+#endif
+
+    dispatching = true;
+    std::vector<Archive::ReadMember *> done;
+#ifdef KUNDLI_HAVE_IO_URING
+    if (ring_ready) {
+        std::vector<std::pair<unsigned, int>> results;
+        ring.reap([&](const io_uring_cqe &cqe) {
+            results.emplace_back(static_cast<unsigned>(cqe.user_data),
+                                 cqe.res);
+        });
+        for (const auto &[slot, result] : results) {
+            finish(slot, result, done);
+        }
+    }
+#endif
+    {
+        std::lock_guard<std::mutex> lock(posted_mutex);
+        done.insert(done.end(), posted.begin(), posted.end());
+        on_pool.fetch_sub(posted.size());
+        posted.clear();
+    }
+
+    // Whatever these start goes to the kernel in one go afterwards
+    for (Archive::ReadMember *read : done) {
+        read->waiter.resume();
+    }
+    dispatching = false;
+#ifdef KUNDLI_HAVE_IO_URING
+    if (ring_ready && ring.unsubmitted() > 0) {
+        enter();
+    }
+#endif
+    return done.size();
+}
+
+void ReadRing::Impl::block() {
+#ifdef __linux__
+    if (event >= 0) {
+        pollfd ready{event, POLLIN, 0};
+        while (::poll(&ready, 1, -1) < 0 && errno == EINTR) {
+        }
+        return;
+    }
+#endif
+    std::unique_lock<std::mutex> lock(posted_mutex);
+    posted_condition.wait(lock, [this] { return !posted.empty(); });
+}
+
+ReadRing::ReadRing(unsigned depth) : impl(std::make_unique<Impl>(depth)) {}
+
+ReadRing::~ReadRing() {
+    while (impl->pending() > 0) {
+        wait();
+    }
+}
+
+int ReadRing::event_fd() const { return impl->event_fd(); }
+
+size_t ReadRing::poll() { return impl->poll(); }
+
+size_t ReadRing::wait() {
+    for (;;) {
+        const size_t resumed = impl->poll();
+        if (resumed > 0 || impl->pending() == 0) {
+            return resumed;
+        }
+        impl->block();
+    }
+}
+
+size_t ReadRing::pending() const { return impl->pending(); }
+
+bool ReadRing::batched() const { return impl->batched(); }
+
+void ReadRing::submit(Archive::ReadMember &read) { impl->submit(read); }
+
+Archive::ReadMember::ReadMember(const Archive &archive,
+                                const ArchiveFile *file, ReadRing *ring)
+    : archive(archive), file(file), ring(ring) {
+    if (file == nullptr || file->type == ArchiveFile::FileType::Directory) {
+        ready = true;
+        return;
+    }
+    // Nothing to wait for, it's a copy out of memory or the cache
+    if (archive.file_size(*file) == 0 || file->offset >= archive.base_size) {
+        result = archive.read_member_data(*file);
+        ready = true;
+    } else if (archive.member_cacheable(*file)) {
+        auto cached = archive.cache->find(BlockCache::member_key(file->offset));
+        if (cached != nullptr) {
+            result = archive.expand_member(*file, cached->data());
+            ready = true;
+        }
+    }
+}
+
+void Archive::ReadMember::await_suspend(std::coroutine_handle<> handle) {
+    waiter = handle;
+    if (ring != nullptr) {
+        ring->submit(*this);
+        return;
+    }
+    // Nothing may touch *this once the worker has it, it can resume and
+    // be gone before enqueue even returns
+    thread_pool.enqueue([this] {
+        result = archive.read_member_data(*file);
+        waiter.resume();
+    });
+}
+
+Archive::ReadMember Archive::read_member(const std::string &path,
+                                         ReadRing *ring) const {
+    return ReadMember(*this, find_file(path), ring);
+}
+
+Archive::ReadMember Archive::read_member(const ArchiveFile &file,
+                                         ReadRing *ring) const {
+    return ReadMember(*this, &file, ring);
+}
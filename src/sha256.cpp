@@ -0,0 +1,187 @@
+#include "sha256.hpp"
+#include "cpu.hpp"
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define KUNDLI_SHA256_HW
+#define SHA_TARGET __attribute__((target("sha,sse4.1,ssse3")))
+#endif
+
+namespace {
+
+constexpr u32 K[64] = {
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1,
+    0x923F82A4, 0xAB1C5ED5, 0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3,
+    0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174, 0xE49B69C1, 0xEFBE4786,
+    0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147,
+    0x06CA6351, 0x14292967, 0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13,
+    0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85, 0xA2BFE8A1, 0xA81A664B,
+    0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A,
+    0x5B9CCA4F, 0x682E6FF3, 0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208,
+    0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2};
+
+constexpr u32 INITIAL[8] = {0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+                            0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19};
+
+constexpr size_t BLOCK = 64;
+
+u32 rotr(u32 value, unsigned bits) {
+    return (value >> bits) | (value << (32 - bits));
+}
+
+u32 load_be32(const u8 *p) {
+    return (static_cast<u32>(p[0]) << 24) | (static_cast<u32>(p[1]) << 16) |
+           (static_cast<u32>(p[2]) << 8) | static_cast<u32>(p[3]);
+}
+
+void compress_portable(u32 state[8], const u8 *data, size_t blocks) {
+    for (; blocks > 0; --blocks, data += BLOCK) {
+        u32 w[64];
+        for (size_t i = 0; i < 16; ++i) {
+            w[i] = load_be32(data + i * 4);
+        }
+        for (size_t i = 16; i < 64; ++i) {
+            const u32 s0 =
+                rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            const u32 s1 =
+                rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        u32 a = state[0], b = state[1], c = state[2], d = state[3];
+        u32 e = state[4], f = state[5], g = state[6], h = state[7];
+        for (size_t i = 0; i < 64; ++i) {
+            const u32 s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+            const u32 choice = (e & f) ^ (~e & g);
+            const u32 t1 = h + s1 + choice + K[i] + w[i];
+            const u32 s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+            const u32 majority = (a & b) ^ (a & c) ^ (b & c);
+            const u32 t2 = s0 + majority;
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#ifdef KUNDLI_SHA256_HW
+
+// The rounds instructions want the state as ABEF and CDGH, and do two
+// rounds each, four message words go through per pair
+SHA_TARGET void compress_hardware(u32 state[8], const u8 *data,
+                                  size_t blocks) {
+    const __m128i byte_swap =
+        _mm_set_epi64x(0x0C0D0E0F08090A0BLL, 0x0405060700010203LL);
+    __m128i dcba = _mm_loadu_si128(reinterpret_cast<const __m128i *>(state));
+    __m128i hgfe =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(state + 4));
+    const __m128i cdab = _mm_shuffle_epi32(dcba, 0xB1);
+    const __m128i efgh = _mm_shuffle_epi32(hgfe, 0x1B);
+    __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+    __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xF0);
+
+    for (; blocks > 0; --blocks, data += BLOCK) {
+        const __m128i abef_before = abef;
+        const __m128i cdgh_before = cdgh;
+        __m128i message[4];
+        for (size_t i = 0; i < 16; ++i) {
+            __m128i &words = message[i % 4];
+            if (i < 4) {
+                words = _mm_shuffle_epi8(
+                    _mm_loadu_si128(
+                        reinterpret_cast<const __m128i *>(data + i * 16)),
+                    byte_swap);
+            } else {
+                // W[t] from W[t - 16], W[t - 15], W[t - 7] and W[t - 2]
+                const __m128i &previous = message[(i + 3) % 4];
+                words = _mm_sha256msg1_epu32(words, message[(i + 1) % 4]);
+                words = _mm_add_epi32(
+                    words, _mm_alignr_epi8(previous, message[(i + 2) % 4], 4));
+                words = _mm_sha256msg2_epu32(words, previous);
+            }
+            const __m128i scheduled = _mm_add_epi32(
+                words,
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(K + i * 4)));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, scheduled);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh,
+                                         _mm_shuffle_epi32(scheduled, 0x0E));
+        }
+        abef = _mm_add_epi32(abef, abef_before);
+        cdgh = _mm_add_epi32(cdgh, cdgh_before);
+    }
+
+    const __m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+    const __m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+    dcba = _mm_blend_epi16(feba, dchg, 0xF0);
+    hgfe = _mm_alignr_epi8(dchg, feba, 8);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state), dcba);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state + 4), hgfe);
+}
+
+#endif
+
+using Kernel = void (*)(u32 *, const u8 *, size_t);
+
+Kernel select_kernel() {
+#ifdef KUNDLI_SHA256_HW
+    if (cpu_features().sha) {
+        return compress_hardware;
+    }
+#endif
+    return compress_portable;
+}
+
+// Picked once, the first time anything is hashed
+Kernel active_kernel() {
+    static const Kernel kernel = select_kernel();
+    return kernel;
+}
+
+} // namespace
+
+Sha256Digest sha256(const u8 *data, size_t length) {
+    const Kernel compress = active_kernel();
+    u32 state[8];
+    std::memcpy(state, INITIAL, sizeof(state));
+    const size_t whole = length / BLOCK;
+    compress(state, data, whole);
+
+    // The rest, the 0x80 marker and the bit length, in one or two blocks
+    u8 tail[BLOCK * 2]{};
+    const size_t left = length - whole * BLOCK;
+    if (left > 0) {
+        std::memcpy(tail, data + whole * BLOCK, left);
+    }
+    tail[left] = 0x80;
+    const size_t tail_size = left + 9 <= BLOCK ? BLOCK : BLOCK * 2;
+    const u64 bits = static_cast<u64>(length) * 8;
+    for (size_t i = 0; i < 8; ++i) {
+        tail[tail_size - 1 - i] = static_cast<u8>(bits >> (i * 8));
+    }
+    compress(state, tail, tail_size / BLOCK);
+
+    Sha256Digest digest;
+    for (size_t i = 0; i < 8; ++i) {
+        digest[i * 4] = static_cast<u8>(state[i] >> 24);
+        digest[i * 4 + 1] = static_cast<u8>(state[i] >> 16);
+        digest[i * 4 + 2] = static_cast<u8>(state[i] >> 8);
+        digest[i * 4 + 3] = static_cast<u8>(state[i]);
+    }
+    return digest;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "kundli.hpp"
+#include <array>
+#include <cstddef>
+
+// SHA-256 (FIPS 180-4)
+// Deduplication takes a matching digest as proof that two chunks are the
+// same, so it needs a hash nobody can find collisions for. x86 CPUs with the
+// SHA extensions get a hardware kernel, everything else the portable one.
+
+using Sha256Digest = std::array<u8, 32>;
+
+Sha256Digest sha256(const u8 *data, size_t length);
@@ -0,0 +1,246 @@
+#include "volume.hpp"
+#include "metrics.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <filesystem>
+#include <system_error>
+
+#ifdef __unix__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+std::string volume_path(const std::string &path,
+                        std::span<const std::string> directories,
+                        size_t index) {
+    std::string number = std::to_string(index);
+    if (number.size() < 3) {
+        number.insert(0, 3 - number.size(), '0');
+    }
+    if (directories.empty()) {
+        return path + "." + number;
+    }
+    const fs::path name = fs::path(path).filename();
+    return (fs::path(directories[index % directories.size()]) / name)
+               .string() +
+           "." + number;
+}
+
+std::vector<std::string>
+find_volumes(const std::string &path,
+             std::span<const std::string> directories) {
+    std::vector<std::string> volumes;
+    for (;;) {
+        std::string volume = volume_path(path, directories, volumes.size());
+        std::error_code ec;
+        if (!fs::is_regular_file(volume, ec)) {
+            return volumes;
+        }
+        volumes.push_back(std::move(volume));
+    }
+}
+
+VolumeWriter::VolumeWriter(std::string path,
+                           std::vector<std::string> directories,
+                           u64 volume_size)
+    : path(std::move(path)), directories(std::move(directories)),
+      size(volume_size) {}
+
+VolumeWriter::~VolumeWriter() {
+#ifdef __unix__
+    for (int fd : fds) {
+        if (fd != -1) {
+            ::close(fd);
+        }
+    }
+#endif
+    if (!committed) {
+        std::error_code ec;
+        for (const auto &temp : temp_paths) {
+            fs::remove(temp, ec);
+        }
+    }
+}
+
+void VolumeWriter::fail(int error) {
+    int none = 0;
+    failure.compare_exchange_strong(none, error != 0 ? error : EIO);
+}
+
+bool VolumeWriter::open_through(u64 end) {
+    const size_t count = end == 0 ? 0 : volume_of(end - 1) + 1;
+#ifdef __unix__
+    while (fds.size() < count) {
+        std::string temp =
+            volume_path(path, directories, fds.size()) + ".tmp";
+        metrics::count(metrics::Counter::Syscalls);
+        const int fd =
+            ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                   0644);
+        if (fd == -1) {
+            fail(errno);
+            return false;
+        }
+        fds.push_back(fd);
+        temp_paths.push_back(std::move(temp));
+    }
+    return true;
+#else
+    (void)count;
+    fail(ENOSYS);
+    return false;
+#endif
+}
+
+bool VolumeWriter::write(u64 position, const u8 *data, size_t length) {
+#ifdef __unix__
+    while (length > 0) {
+        const size_t volume = volume_of(position);
+        if (volume >= fds.size()) {
+            fail(EINVAL);
+            return false;
+        }
+        const u64 in_volume = position - static_cast<u64>(volume) * size;
+        const size_t piece =
+            static_cast<size_t>(std::min<u64>(length, size - in_volume));
+        const ssize_t written = ::pwrite(fds[volume], data, piece,
+                                         static_cast<off_t>(in_volume));
+        metrics::count(metrics::Counter::Syscalls);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            fail(written < 0 ? errno : EIO);
+            return false;
+        }
+        data += written;
+        length -= static_cast<size_t>(written);
+        position += static_cast<u64>(written);
+    }
+    return true;
+#else
+    (void)position;
+    (void)data;
+    (void)length;
+    fail(ENOSYS);
+    return false;
+#endif
+}
+
+bool VolumeWriter::commit() {
+#ifdef __unix__
+    for (int &fd : fds) {
+        metrics::count(metrics::Counter::Syscalls);
+        if (::close(fd) != 0) {
+            fail(errno);
+        }
+        fd = -1;
+    }
+#endif
+    if (failure.load() != 0) {
+        return false;
+    }
+
+    std::error_code ec;
+    for (size_t i = 0; i < temp_paths.size(); ++i) {
+        fs::rename(temp_paths[i], volume_path(path, directories, i), ec);
+        if (ec) {
+            fail(ec.value());
+            return false;
+        }
+    }
+    committed = true;
+
+    // Loading would find these before the new volumes or after them
+    for (size_t i = temp_paths.size();; ++i) {
+        const std::string stale = volume_path(path, directories, i);
+        if (!fs::is_regular_file(stale, ec)) {
+            break;
+        }
+        fs::remove(stale, ec);
+    }
+    if (fs::is_regular_file(path, ec)) {
+        fs::remove(path, ec);
+    }
+    return true;
+}
+
+VolumeOutputBuffer::VolumeOutputBuffer(VolumeWriter &volumes, size_t size)
+    : volumes(volumes), buffer(size) {
+    setp(buffer.data(), buffer.data() + buffer.size());
+}
+
+VolumeOutputBuffer::~VolumeOutputBuffer() { drain(); }
+
+VolumeOutputBuffer::int_type VolumeOutputBuffer::overflow(int_type ch) {
+    if (!drain()) {
+        return traits_type::eof();
+    }
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+    }
+    return traits_type::not_eof(ch);
+}
+
+std::streamsize VolumeOutputBuffer::xsputn(const char *s, std::streamsize n) {
+    const size_t length = static_cast<size_t>(n);
+    const size_t room = static_cast<size_t>(epptr() - pptr());
+    if (length <= room) {
+        traits_type::copy(pptr(), s, length);
+        pbump(static_cast<int>(length));
+        return n;
+    }
+
+    // Big writes, data blocks mostly, skip the buffer
+    if (!drain() || !write_at(s, length)) {
+        return 0;
+    }
+    return n;
+}
+
+int VolumeOutputBuffer::sync() { return drain() ? 0 : -1; }
+
+VolumeOutputBuffer::pos_type
+VolumeOutputBuffer::seekoff(off_type off, std::ios_base::seekdir dir,
+                            std::ios_base::openmode which) {
+    if ((which & std::ios_base::out) == 0 || dir == std::ios_base::end) {
+        return pos_type(off_type(-1));
+    }
+    const u64 here = position + static_cast<u64>(pptr() - pbase());
+    if (dir == std::ios_base::cur && off == 0) {
+        return pos_type(static_cast<off_type>(here));
+    }
+
+    const off_type target =
+        dir == std::ios_base::beg ? off : static_cast<off_type>(here) + off;
+    if (target < 0 || !drain()) {
+        return pos_type(off_type(-1));
+    }
+    position = static_cast<u64>(target);
+    return pos_type(target);
+}
+
+VolumeOutputBuffer::pos_type
+VolumeOutputBuffer::seekpos(pos_type pos, std::ios_base::openmode which) {
+    return seekoff(off_type(pos), std::ios_base::beg, which);
+}
+
+bool VolumeOutputBuffer::drain() {
+    const size_t pending = static_cast<size_t>(pptr() - pbase());
+    setp(buffer.data(), buffer.data() + buffer.size());
+    return pending == 0 || write_at(buffer.data(), pending);
+}
+
+bool VolumeOutputBuffer::write_at(const char *s, size_t length) {
+    if (failed) {
+        return false;
+    }
+    const u8 *bytes = reinterpret_cast<const u8 *>(s);
+    failed = !volumes.open_through(position + length) ||
+             !volumes.write(position, bytes, length);
+    position += length;
+    return !failed;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "kundli.hpp"
+#include <atomic>
+#include <cstddef>
+#include <span>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+// Archives split over several files, see Archive::set_volumes
+// Volume `index` of the archive at `path`: path.000, path.001 and so on next
+// to it, or dealt round-robin over `directories` if there are any.
+std::string volume_path(const std::string &path,
+                        std::span<const std::string> directories,
+                        size_t index);
+
+// The volumes that are there, in order, up to the first one that isn't
+std::vector<std::string> find_volumes(const std::string &path,
+                                      std::span<const std::string> directories);
+
+// Writes bytes [i * volume_size, (i + 1) * volume_size) of an archive to
+// volume i. Volumes are written next to where they go and only replace what
+// was there on commit(), whatever isn't committed gets removed.
+class VolumeWriter {
+  public:
+    VolumeWriter(std::string path, std::vector<std::string> directories,
+                 u64 volume_size);
+    ~VolumeWriter();
+    VolumeWriter(const VolumeWriter &) = delete;
+    VolumeWriter &operator=(const VolumeWriter &) = delete;
+
+    u64 volume_size() const { return size; }
+    size_t volume_of(u64 position) const {
+        return static_cast<size_t>(position / size);
+    }
+
+    // Creates every volume up to the one holding byte `end - 1`
+    bool open_through(u64 end);
+    // `length` bytes at `position` of the archive, split where they cross
+    // into the next volume. Safe from any number of threads as long as the
+    // volumes are open already.
+    bool write(u64 position, const u8 *data, size_t length);
+
+    // Moves the volumes into place and removes what an older archive of the
+    // same name left behind, its extra volumes or the single file
+    bool commit();
+
+    // errno of the first thing that failed, 0 if nothing did
+    int error() const { return failure.load(); }
+
+  private:
+    void fail(int error);
+
+    std::string path;
+    std::vector<std::string> directories;
+    u64 size;
+    std::vector<int> fds;
+    std::vector<std::string> temp_paths;
+    std::atomic<int> failure{0};
+    bool committed{false};
+};
+
+// An output streambuf over a VolumeWriter, for the archive writers that
+// only know about streams. Seeks anywhere but relative to the end. Writes
+// that fail stay failed, the stream goes bad.
+class VolumeOutputBuffer : public std::streambuf {
+  public:
+    static constexpr size_t DEFAULT_SIZE = 1024UL * 1024UL; // 1MB
+
+    explicit VolumeOutputBuffer(VolumeWriter &volumes,
+                                size_t size = DEFAULT_SIZE);
+    ~VolumeOutputBuffer() override;
+    VolumeOutputBuffer(const VolumeOutputBuffer &) = delete;
+    VolumeOutputBuffer &operator=(const VolumeOutputBuffer &) = delete;
+
+  protected:
+    int_type overflow(int_type ch) override;
+    std::streamsize xsputn(const char *s, std::streamsize n) override;
+    int sync() override;
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                     std::ios_base::openmode which) override;
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+
+  private:
+    bool drain();
+    bool write_at(const char *s, size_t length);
+
+    VolumeWriter &volumes;
+    std::vector<char> buffer;
+    u64 position{0}; // in the archive, of what's at the start of the buffer
+    bool failed{false};
+};